@@ -9,12 +9,12 @@
 #include "driver/spi_master.h"
 #include "driver/spi_common.h"
 #include "driver/gpio.h"
-#include "freertos/timers.h"
 #endif
 
 #include "IMU_SPI.h"
 #include "spi_config_data.h"
 #include "MESSAGE_QUEUE.h"
+#include "SENSOR_SCHED.h"
 
 // SPI definitions - TODO: 
 #define PIN_NUM_MISO GPIO_NUM_37
@@ -30,7 +30,12 @@
 // Defines
 
 #define FW_HEADER_LEN 4
-#define IMU_BUF_SIZE 20
+#define IMU_RING_SIZE 16 //power of 2
+#define IMU_POLL_PERIOD_MS 8
+#define IMU_POLL_PHASE_MS 6 //off the tof job's release on multiples of 32 ms, that job only posts a read to the tof queue
+#define IMU_POLL_BUDGET_US 1000
+
+_Static_assert(sizeof(IMU_DATA_RAW_t) <= MSG_INLINE_PAYLOAD_SIZE, "raw imu samples are sent as inline payloads");
 #define POSITION_BUF_SIZE 8
 #define BURST_BYTE_NUMBER 64
 
@@ -66,13 +71,13 @@ static const char *TAG = "SPI_LOG";
 
 // static variables
 static spi_device_handle_t s_spi_handle = NULL;
-static IMU_DATA_RAW_t s_imu_measurement_buffer[IMU_BUF_SIZE] = {0};
-static uint8_t s_imu_buf_iter = 0;
-TimerHandle_t s_imu_timer = NULL;
+static message_info_t s_imu_ring_storage[IMU_RING_SIZE];
+static msg_ring_t s_imu_ring;
+static sensor_job_handle_t s_imu_poll_job = SENSOR_SCHED_INVALID_JOB;
 
 // static functions
 static void imu_configuration_init(void);
-static void imu_check_interrupt_data(TimerHandle_t xTimer);
+static void imu_check_interrupt_data(void* context);
 static void imu_check_interrupt_err(void *arg);
 
 // Externs
@@ -176,8 +181,6 @@ void IMU_INIT(void)
 	gpio_isr_handler_add(IMU_INT1, imu_check_interrupt_data, NULL);
 	gpio_isr_handler_add(IMU_INT2, imu_check_interrupt_err, NULL);
 	*/
-	s_imu_timer = xTimerCreate("imu_timer", 8 / portTICK_PERIOD_MS, pdTRUE, (void*) 0, imu_check_interrupt_data);
-	
 	esp_err_t ret;
 	spi_bus_config_t buscfg={
 		.miso_io_num=PIN_NUM_MISO,
@@ -206,9 +209,15 @@ void IMU_INIT(void)
 
 #endif
 
-	if(check_is_queue_active(1))
+	if(s_imu_poll_job == SENSOR_SCHED_INVALID_JOB)
+	{
+		sensor_sched_register_job("imu_poll", imu_check_interrupt_data, NULL, IMU_POLL_PERIOD_MS, IMU_POLL_PHASE_MS, IMU_POLL_BUDGET_US, &s_imu_poll_job);
+	}
+
+	if(check_is_queue_active(MSG_QUEUE_PRIORITY))
 	{
 		create_handle_for_component(&imu_public_component);
+		msg_ring_init(&s_imu_ring, s_imu_ring_storage, IMU_RING_SIZE, MSG_QUEUE_PRIORITY);
 	}
 
 	// Step 1: Run self test
@@ -350,10 +359,7 @@ uint8_t imu_start(void)
 	// 2. Disable adv power saving, enable fifo_self_wakeup
 	write_data = 0x02;
 	IMU_WRITE(&write_data, BMI2_PWR_CONF_ADDR, 1);
-	if(!xTimerIsTimerActive(s_imu_timer))
-	{
-		xTimerStart(s_imu_timer, 0);
-	}
+	sensor_sched_start_job(s_imu_poll_job);
 	return 0;
 }
 
@@ -371,18 +377,16 @@ uint8_t imu_stop(void)
 	// 2. Enable adv power saving
 	write_data = 0x02;
 	IMU_WRITE(&write_data, BMI2_PWR_CONF_ADDR, 1);
-	if(xTimerIsTimerActive(s_imu_timer))
-	{
-		xTimerStop(s_imu_timer, 0);
-	}
+	sensor_sched_stop_job(s_imu_poll_job);
 	return 0;
 }
 
-static void imu_check_interrupt_data(TimerHandle_t xTimer)
+static void imu_check_interrupt_data(void* context)
 {
+	(void) context;
 	//Read interrupt values and if data is available read imu data
 	uint8_t read_data = 0x00;
-	s_imu_measurement_buffer[s_imu_buf_iter].flags = 0;
+	IMU_DATA_RAW_t imu_sample = {0};
 
 	ESP_LOGI(TAG, "interrupts are GPIO38: %u, GPIO39: %u.", gpio_get_level(IMU_INT1), gpio_get_level(IMU_INT2));
 	
@@ -390,37 +394,32 @@ static void imu_check_interrupt_data(TimerHandle_t xTimer)
 	IMU_READ(&read_data, BMI2_INT_STATUS_1_ADDR, 1);
 	if(read_data & 0x84)
 	{
-		IMU_READ(s_imu_measurement_buffer[s_imu_buf_iter].timestamp, BMI2_SENSORTIME_ADDR, 3);
+		IMU_READ(imu_sample.timestamp, BMI2_SENSORTIME_ADDR, 3);
 	}
 
 	// 2. read accel data if available
 	if(read_data & 0x80)
 	{
-		IMU_READ_LONG(s_imu_measurement_buffer[s_imu_buf_iter].acc_data, BMI2_ACC_X_LSB_ADDR, 6);
-		s_imu_measurement_buffer[s_imu_buf_iter].flags = 1;
+		IMU_READ_LONG(imu_sample.acc_data, BMI2_ACC_X_LSB_ADDR, 6);
+		imu_sample.flags = 1;
 	}
 	// 3. read gyro data if available
 	if(read_data & 0x40)
 	{
-		IMU_READ_LONG(s_imu_measurement_buffer[s_imu_buf_iter].gyr_data, BMI2_GYR_X_LSB_ADDR, 6);
-		s_imu_measurement_buffer[s_imu_buf_iter].flags += 2;
+		IMU_READ_LONG(imu_sample.gyr_data, BMI2_GYR_X_LSB_ADDR, 6);
+		imu_sample.flags += 2;
 	}
 	// 4. send raw imu data to message queue
-	if(check_is_queue_active(1))
+	if(check_is_queue_active(MSG_QUEUE_PRIORITY))
 	{
+		//the sample is copied into the message, so the next read cannot overwrite a queued one
 		message_info_t convert_spi_msg;
-		convert_spi_msg.message_data = (void*) &s_imu_measurement_buffer[s_imu_buf_iter];
-		convert_spi_msg.message_size = sizeof(IMU_DATA_RAW_t);
-		convert_spi_msg.is_pointer = false;
+		set_message_inline_payload(&convert_spi_msg, &imu_sample, sizeof(IMU_DATA_RAW_t));
 		convert_spi_msg.component_handle = imu_public_component;
 		convert_spi_msg.message_type = IMU_MSG_RAW_DATA;
-		send_message_to_priority_queue(convert_spi_msg);
-	}
-
-	s_imu_buf_iter++;
-	if(s_imu_buf_iter >= IMU_BUF_SIZE)
-	{
-		s_imu_buf_iter = 0;
+		convert_spi_msg.request_id = MSG_REQUEST_NONE;
+		start_message_trace(&convert_spi_msg);
+		msg_ring_publish(&s_imu_ring, convert_spi_msg);
 	}
 }
 
@@ -10,93 +10,439 @@
 #include "freertos/queue.h"
 #include "esp_log.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #endif
 
 #include "MESSAGE_QUEUE.h"
+#include "MSG_TRACE.h"
 
-#define MAX_COMPONENT_REGISTRATIONS 10
+#define MAX_HANDLERS_PER_COMPONENT 8
 
-struct callback_node_t
+#define MSG_QUEUE_DEFAULT_STACK_SIZE 2048
+
+//the active table, the one the queue task has pinned and one to build the next version in
+#define CALLBACK_TABLE_COPIES 3
+
+//below the normal queue so deferred handlers only use time the dispatch tasks leave over
+#define MSG_WORKER_PRIORITY 3
+#define MSG_WORKER_STACK_SIZE 4096
+
+//above the dispatch tasks so a due message is never held back by the queue it is going to
+#define MSG_TIMER_PRIORITY 11
+//wheel slot lists and the free list end here, the extra list past the slots holds due messages
+#define MSG_TIMER_NO_ENTRY 0xFF
+#define MSG_TIMER_DUE_LIST MSG_TIMER_WHEEL_SLOTS
+
+typedef struct
 {
     void (*callback_ptr)(component_handle_t, uint8_t, void*, size_t);
-    struct callback_node_t* next_handler;
+    uint32_t type_mask;
     callback_handle_t callback_handle;
-};
+    bool is_deferred;
+} callback_entry_t;
 
-typedef struct callback_node_t callback_handler_t;
+//callbacks are kept packed at the front of the array so dispatch walks contiguous memory
+typedef struct
+{
+    callback_entry_t callbacks[MAX_HANDLERS_PER_COMPONENT];
+    uint8_t callback_count;
+} callback_table_t;
 
+//dispatch walks active_table without a lock. Writers copy it into a spare table, edit the copy and
+//publish it with a single pointer store, so the queue task only ever sees complete tables.
+//handles stay stable across unregistration, handle_callbacks is indexed by handle for deferred jobs.
 typedef struct
 {
-    callback_handler_t* callback_list_start;
+    callback_table_t tables[CALLBACK_TABLE_COPIES];
+    callback_table_t* active_table;
+    void (*handle_callbacks[MAX_HANDLERS_PER_COMPONENT])(component_handle_t, uint8_t, void*, size_t);
+    uint8_t free_handle_mask;
     bool is_component_registered;
 } component_handler_t;
 
+//messages under a policy wait here and the queue only carries one marker per message, each marker
+//dispatches the oldest one. Overflow only ever replaces messages of the same (component, type).
+typedef struct
+{
+    message_info_t pending_messages[MSG_OVERFLOW_BACKLOG]; //coalesce only uses one
+    msg_overflow_policy_t policy;
+    component_handle_t component_handle;
+    uint8_t message_type;
+    uint8_t pending_head;
+    uint8_t pending_count; //same as the number of its markers in the queue
+    bool in_use;
+} overflow_policy_entry_t;
+
+typedef struct
+{
+    component_handler_t handlers[MAX_COMPONENT_REGISTRATIONS];
+    component_handler_t wildcard_handler; //called for every component, after that component's own handlers
+    overflow_policy_entry_t overflow_policies[MAX_OVERFLOW_POLICIES];
+    uint8_t overflow_policy_count;
+    QueueHandle_t message_queue;
+    char task_name[MSG_QUEUE_NAME_MAX];
+    uint8_t batch_size;
+    uint32_t batch_wakeups;
+    uint32_t batch_messages;
+    queue_stats_t stats;
+    uint16_t dispatch_trace_id;
+    uint32_t dispatch_origin_time_us;
+    uint16_t dispatch_request_id;
+    callback_table_t* pinned_table; //table the queue task is walking, writers never reuse it
+    uint8_t queue_id;
+    bool is_active;
+} queue_context_t;
+
+//one deferred handler call, the worker checks the handler is still registered before calling it
+typedef struct
+{
+    queue_context_t* queue;
+    component_handler_t* component_handler;
+    void (*callback_ptr)(component_handle_t, uint8_t, void*, size_t);
+    callback_handle_t callback_handle;
+    message_info_t message_info;
+} deferred_job_t;
+
+//a message waiting on the timer wheel, linked into the list of its slot
+typedef struct
+{
+    message_info_t message_info;
+    uint32_t rounds; //full turns of the wheel left before it is due
+    uint8_t queue_id;
+    uint8_t list;
+    uint8_t next;
+    uint8_t generation; //bumped on every reuse so stale handles cannot cancel the next message
+    bool is_pending;
+} delayed_message_t;
+
+typedef struct
+{
+    msg_response_callback_t callback;
+    void* context;
+    msg_timer_handle_t timeout_handle;
+    uint16_t request_id;
+    uint8_t reply_queue_id;
+    bool is_pending;
+} pending_request_t;
+
+typedef struct
+{
+    uint8_t* arena;
+    uint16_t* free_stack;
+    uint8_t* ref_counts;
+    uint16_t free_top;
+    msg_pool_stats_t stats;
+} payload_pool_t;
+
 //static const char *TAG = "MSG_QUEUE"; //Should use in future
 
-static void normal_queue_loop(void* args);
-static void priority_queue_loop(void* args);
+static void init_queue(uint8_t queue_id, const msg_queue_config_t* config);
+static void queue_task(void* args);
+static void dispatch_message(queue_context_t* queue, message_info_t* message_info);
+static void reset_component_handler(queue_context_t* queue, component_handler_t* component_handler, bool is_registered);
+static callback_table_t* get_spare_callback_table(queue_context_t* queue, component_handler_t* component_handler);
+static callback_table_t* pin_callback_table(queue_context_t* queue, component_handler_t* component_handler);
+static callback_handle_t register_handler(queue_context_t* queue, void (*func_ptr)(component_handle_t, uint8_t, void*, size_t), component_handle_t handle, uint32_t type_mask, bool is_deferred);
+static uint8_t unregister_handler(queue_context_t* queue, component_handle_t handle, callback_handle_t function_handle);
+static callback_handle_t add_callback(queue_context_t* queue, component_handler_t* component_handler, void (*func_ptr)(component_handle_t, uint8_t, void*, size_t), uint32_t type_mask, bool is_deferred);
+static uint8_t remove_callback(queue_context_t* queue, component_handler_t* component_handler, callback_handle_t function_handle);
+static void call_handlers(queue_context_t* queue, component_handler_t* component_handler, message_info_t* message_info);
+static uint8_t send_message(queue_context_t* queue, message_info_t* message_info);
+static uint8_t enqueue_message(queue_context_t* queue, message_info_t* message_info);
+static uint8_t hold_message(queue_context_t* queue, message_info_t* message_info);
+static bool take_held_message(overflow_policy_entry_t* entry, message_info_t* message_info);
+static overflow_policy_entry_t* find_overflow_policy(queue_context_t* queue, component_handle_t handle, uint8_t message_type);
+static void clear_overflow_policies(queue_context_t* queue, component_handle_t handle);
+static void remove_overflow_policy(queue_context_t* queue, overflow_policy_entry_t* entry);
+static void discard_message(message_info_t* message_info);
 static bool is_handle_registered(component_handle_t handle);
-
-static bool normal_queue_active = false;
-static bool priority_queue_active = false;
+static bool is_any_queue_active(void);
+static void release_dispatched_payload(void* payload);
+static bool find_pool_block(void* payload, payload_pool_t** pool_out, uint16_t* block_index);
+static void drain_ring(queue_context_t* queue, msg_ring_t* ring);
+static void record_dispatch_latency(queue_context_t* queue, message_info_t* message_info);
+static void init_worker_pool(void);
+static void worker_task(void* args);
+static bool defer_handler_call(queue_context_t* queue, component_handler_t* component_handler, callback_entry_t* entry, message_info_t* message_info);
+static void drain_worker_queue(void);
+static uint8_t record_trace_stage(component_handle_t handle, uint8_t message_type, uint16_t trace_id, uint32_t origin_time_us);
+static void init_timer_wheel(void);
+static void timer_task(void* args);
+static uint8_t schedule_delayed_message(uint8_t queue_id, message_info_t* message_info, uint64_t due_tick, msg_timer_handle_t* timer_handle);
+static void advance_timer_wheel(void);
+static TickType_t get_timer_wait(void);
+static bool take_delayed_message(uint8_t entry_index, uint8_t* queue_id, message_info_t* message_info);
+static void link_delayed_message(uint8_t list, uint8_t entry_index);
+static void unlink_delayed_message(uint8_t entry_index);
+static void clear_delayed_messages(void);
+static void complete_request(queue_context_t* queue, message_info_t* message_info);
+static bool take_pending_request(uint16_t request_id, pending_request_t* request);
+static void clear_pending_requests(uint8_t reply_queue_id);
 
 static uint8_t queue_handle_cnt = 0;
 static uint8_t lowest_unregistered_queue_handle = 0;
 
-static QueueHandle_t normal_message_queue = NULL;
-static QueueHandle_t priority_message_queue = NULL;
+static queue_context_t s_queues[MAX_MESSAGE_QUEUES] =
+{
+    [0 ... MAX_MESSAGE_QUEUES - 1] = {.message_queue = NULL, .batch_size = 1, .is_active = false},
+};
+
+static const msg_queue_config_t s_normal_queue_config =
+{
+    .name = "normal_queue",
+    .depth = MESSAGE_QUEUE_LENGTH,
+    .task_priority = 5,
+    .stack_size = MSG_QUEUE_DEFAULT_STACK_SIZE,
+    .core_id = MSG_QUEUE_NO_AFFINITY,
+};
+
+static const msg_queue_config_t s_priority_queue_config =
+{
+    .name = "priority_queue",
+    .depth = MESSAGE_QUEUE_LENGTH,
+    .task_priority = 10,
+    .stack_size = MSG_QUEUE_DEFAULT_STACK_SIZE,
+    .core_id = MSG_QUEUE_NO_AFFINITY,
+};
+
+//serializes handler table writers, dispatch never takes it
+static portMUX_TYPE s_handler_lock = portMUX_INITIALIZER_UNLOCKED;
+//senders on any task update the queue counters
+static portMUX_TYPE s_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+//guards the coalesce slots, which senders write and the queue task empties
+static portMUX_TYPE s_policy_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static msg_trace_stage_stats_t s_trace_stages[MAX_TRACE_STAGES];
+static uint8_t s_trace_stage_count = 0;
+static uint16_t s_last_trace_id = MSG_TRACE_NONE;
+static portMUX_TYPE s_trace_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static bool s_worker_pool_started = false; //claimed under s_handler_lock, the worker queue and tasks follow after it
+static QueueHandle_t s_worker_queues[MSG_WORKER_COUNT] = {NULL};
+static char s_worker_names[MSG_WORKER_COUNT][MSG_QUEUE_NAME_MAX];
+
+static delayed_message_t s_delayed_messages[MAX_DELAYED_MESSAGES];
+static uint8_t s_timer_lists[MSG_TIMER_WHEEL_SLOTS + 1];
+static uint8_t s_timer_free_head = MSG_TIMER_NO_ENTRY;
+static uint8_t s_delayed_count = 0;
+static uint64_t s_timer_wheel_tick = 0; //last tick the wheel has handled
+static bool s_timer_wheel_started = false; //claimed under s_timer_lock, the wake queue and task follow after it
+static QueueHandle_t s_timer_wake_queue = NULL;
+static portMUX_TYPE s_timer_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static pending_request_t s_pending_requests[MAX_PENDING_REQUESTS];
+static uint16_t s_last_request_id = MSG_REQUEST_NONE;
+static portMUX_TYPE s_request_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static bool s_pool_initialized = false;
+static portMUX_TYPE s_pool_lock = portMUX_INITIALIZER_UNLOCKED;
+
+//uint64_t so blocks are aligned for any payload type
+static uint64_t s_pool_small_arena[(MSG_POOL_SMALL_BLOCK_SIZE * MSG_POOL_SMALL_BLOCK_COUNT) / sizeof(uint64_t)];
+static uint64_t s_pool_medium_arena[(MSG_POOL_MEDIUM_BLOCK_SIZE * MSG_POOL_MEDIUM_BLOCK_COUNT) / sizeof(uint64_t)];
+static uint64_t s_pool_large_arena[(MSG_POOL_LARGE_BLOCK_SIZE * MSG_POOL_LARGE_BLOCK_COUNT) / sizeof(uint64_t)];
+static uint16_t s_pool_small_free[MSG_POOL_SMALL_BLOCK_COUNT];
+static uint16_t s_pool_medium_free[MSG_POOL_MEDIUM_BLOCK_COUNT];
+static uint16_t s_pool_large_free[MSG_POOL_LARGE_BLOCK_COUNT];
+static uint8_t s_pool_small_refs[MSG_POOL_SMALL_BLOCK_COUNT];
+static uint8_t s_pool_medium_refs[MSG_POOL_MEDIUM_BLOCK_COUNT];
+static uint8_t s_pool_large_refs[MSG_POOL_LARGE_BLOCK_COUNT];
+
+static payload_pool_t s_payload_pools[MSG_POOL_CLASS_MAX] =
+{
+    {(uint8_t*) s_pool_small_arena, s_pool_small_free, s_pool_small_refs, 0, {MSG_POOL_SMALL_BLOCK_SIZE, MSG_POOL_SMALL_BLOCK_COUNT, 0, 0, 0, 0}},
+    {(uint8_t*) s_pool_medium_arena, s_pool_medium_free, s_pool_medium_refs, 0, {MSG_POOL_MEDIUM_BLOCK_SIZE, MSG_POOL_MEDIUM_BLOCK_COUNT, 0, 0, 0, 0}},
+    {(uint8_t*) s_pool_large_arena, s_pool_large_free, s_pool_large_refs, 0, {MSG_POOL_LARGE_BLOCK_SIZE, MSG_POOL_LARGE_BLOCK_COUNT, 0, 0, 0, 0}},
+};
 
-static component_handler_t normal_queue_handlers[MAX_COMPONENT_REGISTRATIONS] = {0};
-static component_handler_t priority_queue_handlers[MAX_COMPONENT_REGISTRATIONS] = {0};
+void MESSAGE_POOL_INIT(void)
+{
+    if(s_pool_initialized) return;
+    portENTER_CRITICAL(&s_pool_lock);
+    for(uint8_t pool_iter = 0; pool_iter < MSG_POOL_CLASS_MAX; pool_iter++)
+    {
+        payload_pool_t* pool = &s_payload_pools[pool_iter];
+        for(uint16_t block = 0; block < pool->stats.block_count; block++)
+        {
+            pool->free_stack[block] = block;
+            pool->ref_counts[block] = 0;
+        }
+        pool->free_top = pool->stats.block_count;
+        pool->stats.blocks_in_use = 0;
+        pool->stats.high_water_mark = 0;
+        pool->stats.acquire_count = 0;
+        pool->stats.exhausted_count = 0;
+    }
+    s_pool_initialized = true;
+    portEXIT_CRITICAL(&s_pool_lock);
+}
 
 void MESSAGE_QUEUE_INIT(void)
 {
-    normal_message_queue = xQueueCreate(MESSAGE_QUEUE_LENGTH, sizeof(message_info_t));
-    normal_queue_active = true;
-    xTaskCreate(normal_queue_loop, "normal_queue", 2048, NULL, 5, NULL);
+    init_queue(MSG_QUEUE_NORMAL, &s_normal_queue_config);
 }
 
 void PRIORITY_MESSAGE_QUEUE_INIT(void)
 {
-    priority_message_queue = xQueueCreate(MESSAGE_QUEUE_LENGTH, sizeof(message_info_t));
-    priority_queue_active = true;
-    xTaskCreate(priority_queue_loop, "priority_queue", 2048, NULL, 10, NULL);
+    init_queue(MSG_QUEUE_PRIORITY, &s_priority_queue_config);
+}
+
+uint8_t create_message_queue(const msg_queue_config_t* config, uint8_t* queue_id)
+{
+    if(config == NULL || queue_id == NULL || config->name == NULL || config->depth == 0) return 1;
+    //the normal and priority slots stay reserved for their init functions
+    for(uint8_t queue_iter = MSG_QUEUE_PRIORITY + 1; queue_iter < MAX_MESSAGE_QUEUES; queue_iter++)
+    {
+        if(!s_queues[queue_iter].is_active)
+        {
+            init_queue(queue_iter, config);
+            *queue_id = queue_iter;
+            return 0;
+        }
+    }
+    *queue_id = MSG_QUEUE_INVALID;
+    return 2;
 }
 
 void uninit_queue(uint8_t queuetype)
 {
-    switch (queuetype)
+    if(queuetype >= MAX_MESSAGE_QUEUES) return;
+    s_queues[queuetype].is_active = false;
+    //nothing is left to run the callbacks of requests answered on this queue
+    clear_pending_requests(queuetype);
+    if(!is_any_queue_active())
     {
-    case 0:
-        normal_queue_active = false;
-#ifdef FUNCTIONAL_TESTS
-        deleteTask("normal_queue");
-        deleteQueue(normal_message_queue);
-#endif
-        break;
-    case 1:
-        priority_queue_active = false;
+        drain_worker_queue();
+        clear_delayed_messages();
+    }
 #ifdef FUNCTIONAL_TESTS
-        deleteTask("priority_queue");
-        deleteQueue(priority_message_queue);
+    deleteTask(s_queues[queuetype].task_name);
+    deleteQueue(s_queues[queuetype].message_queue);
 #endif
-        break;
-    default:
-        break;
-    }
 }
 
 bool check_is_queue_active(uint8_t queuetype)
 {
-    switch (queuetype)
+    if(queuetype >= MAX_MESSAGE_QUEUES) return false;
+    return s_queues[queuetype].is_active;
+}
+
+uint8_t set_queue_batch_size(uint8_t queuetype, uint8_t batch_size)
+{
+    if(queuetype >= MAX_MESSAGE_QUEUES) return 1;
+    if(batch_size == 0 || batch_size > MAX_QUEUE_BATCH_SIZE) return 1;
+    s_queues[queuetype].batch_size = batch_size;
+    return 0;
+}
+
+uint8_t get_queue_batch_stats(uint8_t queuetype, queue_batch_stats_t* stats)
+{
+    if(queuetype >= MAX_MESSAGE_QUEUES || stats == NULL) return 1;
+    stats->batch_size = s_queues[queuetype].batch_size;
+    stats->wakeups = s_queues[queuetype].batch_wakeups;
+    stats->messages_dispatched = s_queues[queuetype].batch_messages;
+    stats->average_batch_x100 = 0;
+    if(stats->wakeups)
     {
-    case 0:
-        return normal_queue_active;
-    case 1:
-        return priority_queue_active;
-    default:
-        return false;
+        stats->average_batch_x100 = (uint16_t) (((uint64_t) stats->messages_dispatched * 100) / stats->wakeups);
+    }
+    return 0;
+}
+
+uint8_t get_queue_stats(uint8_t queuetype, queue_stats_t* stats)
+{
+    if(queuetype >= MAX_MESSAGE_QUEUES || stats == NULL) return 1;
+    portENTER_CRITICAL(&s_stats_lock);
+    *stats = s_queues[queuetype].stats;
+    portEXIT_CRITICAL(&s_stats_lock);
+    return 0;
+}
+
+uint8_t reset_queue_stats(uint8_t queuetype)
+{
+    if(queuetype >= MAX_MESSAGE_QUEUES) return 1;
+    portENTER_CRITICAL(&s_stats_lock);
+    memset(&s_queues[queuetype].stats, 0, sizeof(queue_stats_t));
+    s_queues[queuetype].batch_wakeups = 0;
+    s_queues[queuetype].batch_messages = 0;
+    portEXIT_CRITICAL(&s_stats_lock);
+    return 0;
+}
+
+uint8_t set_message_overflow_policy(uint8_t queuetype, component_handle_t handle, uint8_t message_type, msg_overflow_policy_t policy)
+{
+    if(queuetype >= MAX_MESSAGE_QUEUES || !is_handle_registered(handle)) return 1;
+    queue_context_t* queue = &s_queues[queuetype];
+    message_info_t stale_messages[MSG_OVERFLOW_BACKLOG];
+    uint8_t stale_count = 0;
+    //look up and update in one go, so concurrent callers cannot add the same pair twice or change a removed one
+    portENTER_CRITICAL(&s_policy_lock);
+    overflow_policy_entry_t* entry = find_overflow_policy(queue, handle, message_type);
+    if(entry != NULL)
+    {
+        //the backlog is trimmed to what the new policy holds, dropping the policy gives all of it back
+        uint8_t capacity = MSG_OVERFLOW_BACKLOG;
+        if(policy == MSG_OVERFLOW_DROP_NEWEST)
+        {
+            capacity = 0;
+        }
+        else if(policy == MSG_OVERFLOW_COALESCE)
+        {
+            capacity = 1;
+        }
+        while(entry->pending_count > capacity)
+        {
+            stale_messages[stale_count] = entry->pending_messages[entry->pending_head];
+            stale_count++;
+            entry->pending_head = (entry->pending_head + 1) % MSG_OVERFLOW_BACKLOG;
+            entry->pending_count--;
+        }
+        if(policy == MSG_OVERFLOW_DROP_NEWEST)
+        {
+            //markers still in the queue find the backlog empty and are ignored
+            entry->in_use = false;
+            queue->overflow_policy_count--;
+        }
+        else
+        {
+            entry->policy = policy;
+        }
+    }
+    else if(policy != MSG_OVERFLOW_DROP_NEWEST)
+    {
+        for(uint8_t policy_iter = 0; policy_iter < MAX_OVERFLOW_POLICIES; policy_iter++)
+        {
+            if(!queue->overflow_policies[policy_iter].in_use)
+            {
+                entry = &queue->overflow_policies[policy_iter];
+                break;
+            }
+        }
+        if(entry == NULL)
+        {
+            portEXIT_CRITICAL(&s_policy_lock);
+            return 2;
+        }
+        entry->component_handle = handle;
+        entry->message_type = message_type;
+        entry->policy = policy;
+        entry->pending_head = 0;
+        entry->pending_count = 0;
+        entry->in_use = true;
+        queue->overflow_policy_count++;
+    }
+    portEXIT_CRITICAL(&s_policy_lock);
+    for(uint8_t stale_iter = 0; stale_iter < stale_count; stale_iter++)
+    {
+        discard_message(&stale_messages[stale_iter]);
+    }
+    if(stale_count && policy == MSG_OVERFLOW_COALESCE)
+    {
+        portENTER_CRITICAL(&s_stats_lock);
+        queue->stats.coalesced += stale_count;
+        portEXIT_CRITICAL(&s_stats_lock);
     }
+    return 0;
 }
 
 uint8_t clear_all_handles(void)
@@ -115,7 +461,7 @@ uint8_t clear_all_handles(void)
 
 uint8_t create_handle_for_component(component_handle_t* handle)
 {
-    if(!normal_queue_active && !priority_queue_active)
+    if(!is_any_queue_active())
     {
         return 1;
     }
@@ -128,15 +474,12 @@ uint8_t create_handle_for_component(component_handle_t* handle)
         return 3;
     }
     *handle = lowest_unregistered_queue_handle;
-    if(normal_queue_active)
+    for(uint8_t queuetype = 0; queuetype < MAX_MESSAGE_QUEUES; queuetype++)
     {
-        normal_queue_handlers[lowest_unregistered_queue_handle].is_component_registered = true;
-        normal_queue_handlers[lowest_unregistered_queue_handle].callback_list_start = NULL;
-    }
-    if(priority_queue_active)
-    {
-        priority_queue_handlers[lowest_unregistered_queue_handle].is_component_registered = true;
-        priority_queue_handlers[lowest_unregistered_queue_handle].callback_list_start = NULL;
+        if(s_queues[queuetype].is_active)
+        {
+            reset_component_handler(&s_queues[queuetype], &s_queues[queuetype].handlers[lowest_unregistered_queue_handle], true);
+        }
     }
     queue_handle_cnt++;
     for(component_handle_t i = 0; is_handle_registered(i) && i < queue_handle_cnt; i++)
@@ -148,33 +491,21 @@ uint8_t create_handle_for_component(component_handle_t* handle)
 
 uint8_t delete_handle_for_component(component_handle_t handle)
 {
-    callback_handler_t* handler_ptr = NULL;
-    callback_handler_t* next_ptr = NULL;
-    if(!normal_queue_active && !priority_queue_active)
+    if(!is_any_queue_active())
     {
         return 1;
     }
-    if(normal_queue_active)
+    if(handle >= MAX_COMPONENT_REGISTRATIONS)
     {
-        handler_ptr = normal_queue_handlers[handle].callback_list_start;
-        while(handler_ptr != NULL)
-        {
-            next_ptr = handler_ptr->next_handler;
-            free(handler_ptr);
-            handler_ptr = next_ptr;
-        }
-        normal_queue_handlers[handle].is_component_registered = false;
+        return 2;
     }
-    if(priority_queue_active)
+    for(uint8_t queuetype = 0; queuetype < MAX_MESSAGE_QUEUES; queuetype++)
     {
-        handler_ptr = priority_queue_handlers[handle].callback_list_start;
-        while(handler_ptr != NULL)
+        if(s_queues[queuetype].is_active)
         {
-            next_ptr = handler_ptr->next_handler;
-            free(handler_ptr);
-            handler_ptr = next_ptr;
+            reset_component_handler(&s_queues[queuetype], &s_queues[queuetype].handlers[handle], false);
+            clear_overflow_policies(&s_queues[queuetype], handle);
         }
-        priority_queue_handlers[handle].is_component_registered = false;
     }
     if(handle < lowest_unregistered_queue_handle)
     {
@@ -186,213 +517,1543 @@ uint8_t delete_handle_for_component(component_handle_t handle)
 
 callback_handle_t register_component_handler_for_messages(void (*func_ptr)(component_handle_t, uint8_t, void*, size_t), component_handle_t handle)
 {
-    callback_handle_t return_handle = 0;
-    if(normal_queue_handlers[handle].is_component_registered && normal_queue_active)
-    {
-        callback_handler_t* new_handler = malloc(sizeof(callback_handler_t));
-        callback_handler_t* handler_iter = normal_queue_handlers[handle].callback_list_start;
-        if(handler_iter == NULL)
-        {
-            normal_queue_handlers[handle].callback_list_start = new_handler;
-            return_handle = 1;
-        }
-        else
-        {
-            callback_handler_t* prev_handler_iter = NULL;
-            while((handler_iter) != NULL)
-            {
-                return_handle = handler_iter->callback_handle;
-                prev_handler_iter = handler_iter;
-                handler_iter = handler_iter->next_handler;
-            }
-            if(prev_handler_iter == NULL)
-            {
-                //should maybe panic here but I'm just going to return failure for now
-                free(new_handler);
-                return 0;
-            }
-            prev_handler_iter->next_handler = new_handler;
-            return_handle++;
-        }
-        new_handler->callback_handle = return_handle;
-        new_handler->callback_ptr = func_ptr;
-        new_handler->next_handler = NULL;
-    }
-    return return_handle;
+    return register_handler(&s_queues[MSG_QUEUE_NORMAL], func_ptr, handle, MSG_TYPE_MASK_ALL, false);
+}
+
+callback_handle_t register_component_handler_for_message_types(void (*func_ptr)(component_handle_t, uint8_t, void*, size_t), component_handle_t handle, uint32_t type_mask)
+{
+    return register_handler(&s_queues[MSG_QUEUE_NORMAL], func_ptr, handle, type_mask, false);
+}
+
+callback_handle_t register_component_deferred_handler_for_message_types(void (*func_ptr)(component_handle_t, uint8_t, void*, size_t), component_handle_t handle, uint32_t type_mask)
+{
+    return register_handler(&s_queues[MSG_QUEUE_NORMAL], func_ptr, handle, type_mask, true);
 }
 
 uint8_t unregister_component_handler_for_messages(component_handle_t handle, callback_handle_t function_handle)
 {
-    callback_handler_t* handler_iter = normal_queue_handlers[handle].callback_list_start;
-    callback_handler_t* prev_handler_iter = NULL;
-    if(handler_iter == NULL || !normal_queue_active) return 1;
-    while(handler_iter != NULL)
-    {
-        if(handler_iter->callback_handle == function_handle)
-        {
-            if(prev_handler_iter != NULL)
-            {
-                prev_handler_iter->next_handler = handler_iter->next_handler;
-            }
-            else
-            {
-                normal_queue_handlers[handle].callback_list_start = handler_iter->next_handler;
-            }
-            free(handler_iter);
-            return 0;
-        }
-        prev_handler_iter = handler_iter;
-        handler_iter = handler_iter->next_handler;
-    }
-    return 1;
+    return unregister_handler(&s_queues[MSG_QUEUE_NORMAL], handle, function_handle);
 }
 
 uint8_t send_message_to_normal_queue(message_info_t message_info)
 {
-    if(!normal_queue_active) return 1;
-    xQueueSend(normal_message_queue, &message_info, ( TickType_t ) 0);
-    return 0;
+    return send_message(&s_queues[MSG_QUEUE_NORMAL], &message_info);
 }
 
 callback_handle_t register_priority_handler_for_messages(void (*func_ptr)(component_handle_t, uint8_t, void*, size_t), component_handle_t handle)
 {
-    callback_handle_t return_handle = 0;
-    if(priority_queue_handlers[handle].is_component_registered && priority_queue_active)
-    {
-        callback_handler_t* new_handler = malloc(sizeof(callback_handler_t));
-        callback_handler_t* handler_iter = priority_queue_handlers[handle].callback_list_start;
-        if(handler_iter == NULL)
-        {
-            priority_queue_handlers[handle].callback_list_start = new_handler;
-            return_handle = 1;
-        }
-        else
-        {
-            callback_handler_t* prev_handler_iter = NULL;
-            while((handler_iter) != NULL)
-            {
-                return_handle = handler_iter->callback_handle;
-                prev_handler_iter = handler_iter;
-                handler_iter = handler_iter->next_handler;
-            }
-            if(prev_handler_iter == NULL)
-            {
-                //should maybe panic here but I'm just going to return failure for now
-                free(new_handler);
-                return 0;
-            }
-            prev_handler_iter->next_handler = new_handler;
-            return_handle++;
-        }
-        new_handler->callback_handle = return_handle;
-        new_handler->callback_ptr = func_ptr;
-        new_handler->next_handler = NULL;
-    }
-    return return_handle;
+    return register_handler(&s_queues[MSG_QUEUE_PRIORITY], func_ptr, handle, MSG_TYPE_MASK_ALL, false);
+}
+
+callback_handle_t register_priority_handler_for_message_types(void (*func_ptr)(component_handle_t, uint8_t, void*, size_t), component_handle_t handle, uint32_t type_mask)
+{
+    return register_handler(&s_queues[MSG_QUEUE_PRIORITY], func_ptr, handle, type_mask, false);
+}
+
+callback_handle_t register_priority_deferred_handler_for_message_types(void (*func_ptr)(component_handle_t, uint8_t, void*, size_t), component_handle_t handle, uint32_t type_mask)
+{
+    return register_handler(&s_queues[MSG_QUEUE_PRIORITY], func_ptr, handle, type_mask, true);
 }
 
 uint8_t unregister_priority_handler_for_messages(component_handle_t handle, callback_handle_t function_handle)
 {
-    callback_handler_t* handler_iter = priority_queue_handlers[handle].callback_list_start;
-    callback_handler_t* prev_handler_iter = NULL;
-    if(handler_iter == NULL || !priority_queue_active) return 1;
-    while(handler_iter != NULL)
+    return unregister_handler(&s_queues[MSG_QUEUE_PRIORITY], handle, function_handle);
+}
+
+uint8_t send_message_to_priority_queue(message_info_t message_info)
+{
+    return send_message(&s_queues[MSG_QUEUE_PRIORITY], &message_info);
+}
+
+callback_handle_t register_queue_handler_for_message_types(uint8_t queue_id, void (*func_ptr)(component_handle_t, uint8_t, void*, size_t), component_handle_t handle, uint32_t type_mask)
+{
+    if(queue_id >= MAX_MESSAGE_QUEUES) return 0;
+    return register_handler(&s_queues[queue_id], func_ptr, handle, type_mask, false);
+}
+
+callback_handle_t register_queue_deferred_handler_for_message_types(uint8_t queue_id, void (*func_ptr)(component_handle_t, uint8_t, void*, size_t), component_handle_t handle, uint32_t type_mask)
+{
+    if(queue_id >= MAX_MESSAGE_QUEUES) return 0;
+    return register_handler(&s_queues[queue_id], func_ptr, handle, type_mask, true);
+}
+
+uint8_t unregister_queue_handler_for_messages(uint8_t queue_id, component_handle_t handle, callback_handle_t function_handle)
+{
+    if(queue_id >= MAX_MESSAGE_QUEUES) return 1;
+    return unregister_handler(&s_queues[queue_id], handle, function_handle);
+}
+
+callback_handle_t register_wildcard_handler_for_message_types(uint8_t queue_id, void (*func_ptr)(component_handle_t, uint8_t, void*, size_t), uint32_t type_mask)
+{
+    if(queue_id >= MAX_MESSAGE_QUEUES) return 0;
+    return add_callback(&s_queues[queue_id], &s_queues[queue_id].wildcard_handler, func_ptr, type_mask, false);
+}
+
+callback_handle_t register_wildcard_deferred_handler_for_message_types(uint8_t queue_id, void (*func_ptr)(component_handle_t, uint8_t, void*, size_t), uint32_t type_mask)
+{
+    if(queue_id >= MAX_MESSAGE_QUEUES) return 0;
+    return add_callback(&s_queues[queue_id], &s_queues[queue_id].wildcard_handler, func_ptr, type_mask, true);
+}
+
+uint8_t unregister_wildcard_handler_for_messages(uint8_t queue_id, callback_handle_t function_handle)
+{
+    if(queue_id >= MAX_MESSAGE_QUEUES) return 1;
+    return remove_callback(&s_queues[queue_id], &s_queues[queue_id].wildcard_handler, function_handle);
+}
+
+uint8_t send_message_to_queue(uint8_t queue_id, message_info_t message_info)
+{
+    if(queue_id >= MAX_MESSAGE_QUEUES) return 1;
+    return send_message(&s_queues[queue_id], &message_info);
+}
+
+static void reset_component_handler(queue_context_t* queue, component_handler_t* component_handler, bool is_registered)
+{
+    portENTER_CRITICAL(&s_handler_lock);
+    callback_table_t* empty_table = get_spare_callback_table(queue, component_handler);
+    empty_table->callback_count = 0;
+    __atomic_store_n(&component_handler->active_table, empty_table, __ATOMIC_SEQ_CST);
+    for(uint8_t handle_slot = 0; handle_slot < MAX_HANDLERS_PER_COMPONENT; handle_slot++)
     {
-        if(handler_iter->callback_handle == function_handle)
-        {
-            if(prev_handler_iter != NULL)
-            {
-                prev_handler_iter->next_handler = handler_iter->next_handler;
-            }
-            else
-            {
-                priority_queue_handlers[handle].callback_list_start = handler_iter->next_handler;
-            }
-            free(handler_iter);
-            return 0;
-        }
-        prev_handler_iter = handler_iter;
-        handler_iter = handler_iter->next_handler;
+        __atomic_store_n(&component_handler->handle_callbacks[handle_slot], NULL, __ATOMIC_RELEASE);
     }
-    return 1;
+    component_handler->free_handle_mask = (uint8_t) ((1U << MAX_HANDLERS_PER_COMPONENT) - 1);
+    component_handler->is_component_registered = is_registered;
+    portEXIT_CRITICAL(&s_handler_lock);
 }
 
-uint8_t send_message_to_priority_queue(message_info_t message_info)
+static callback_handle_t register_handler(queue_context_t* queue, void (*func_ptr)(component_handle_t, uint8_t, void*, size_t), component_handle_t handle, uint32_t type_mask, bool is_deferred)
 {
-    if(!priority_queue_active) return 1;
-    xQueueSend(priority_message_queue, &message_info, ( TickType_t ) 0);
-    return 0;
+    if(handle >= MAX_COMPONENT_REGISTRATIONS) return 0;
+    return add_callback(queue, &queue->handlers[handle], func_ptr, type_mask, is_deferred);
 }
 
-static void normal_queue_loop(void* args)
+static uint8_t unregister_handler(queue_context_t* queue, component_handle_t handle, callback_handle_t function_handle)
 {
-    message_info_t message_info;
-    while(normal_queue_active)
+    if(handle >= MAX_COMPONENT_REGISTRATIONS) return 1;
+    return remove_callback(queue, &queue->handlers[handle], function_handle);
+}
+
+static callback_handle_t add_callback(queue_context_t* queue, component_handler_t* component_handler, void (*func_ptr)(component_handle_t, uint8_t, void*, size_t), uint32_t type_mask, bool is_deferred)
+{
+    if(func_ptr == NULL || type_mask == 0) return 0;
+    if(!component_handler->is_component_registered || !queue->is_active) return 0;
+    if(is_deferred)
     {
-        if (xQueueReceive(normal_message_queue, &message_info, portMAX_DELAY))
-        {
-            component_handler_t component_handler = normal_queue_handlers[message_info.component_handle];
-            callback_handler_t* callback_iter = NULL;
-            if(component_handler.is_component_registered)
-            {
-                callback_iter = component_handler.callback_list_start;
-            }
-            while(callback_iter != NULL)
-            {
-                (*(callback_iter->callback_ptr))(message_info.component_handle, message_info.message_type, message_info.message_data, message_info.message_size);
-                callback_iter = callback_iter->next_handler;
-            }
-            if(message_info.is_pointer)
-            {
-                free(message_info.message_data);
-            }
-        }
-        else
-        {
-            vTaskDelay(1 / portTICK_PERIOD_MS);
-        }
-        if(args != NULL)
-        {
-            break;
-        }
+        init_worker_pool();
+    }
+    portENTER_CRITICAL(&s_handler_lock);
+    if(component_handler->free_handle_mask == 0)
+    {
+        portEXIT_CRITICAL(&s_handler_lock);
+        return 0;
     }
+    //handles are 1 based so 0 can keep meaning registration failed
+    uint8_t handle_slot = (uint8_t) __builtin_ctz(component_handler->free_handle_mask);
+    component_handler->free_handle_mask &= (uint8_t) ~(1U << handle_slot);
+    callback_table_t* active_table = component_handler->active_table;
+    callback_table_t* new_table = get_spare_callback_table(queue, component_handler);
+    *new_table = *active_table;
+    callback_entry_t* new_entry = &new_table->callbacks[new_table->callback_count];
+    new_entry->callback_ptr = func_ptr;
+    new_entry->type_mask = type_mask;
+    new_entry->callback_handle = handle_slot + 1;
+    new_entry->is_deferred = is_deferred;
+    new_table->callback_count++;
+    __atomic_store_n(&component_handler->handle_callbacks[handle_slot], func_ptr, __ATOMIC_RELEASE);
+    __atomic_store_n(&component_handler->active_table, new_table, __ATOMIC_SEQ_CST);
+    portEXIT_CRITICAL(&s_handler_lock);
+    return handle_slot + 1;
 }
 
-static void priority_queue_loop(void* args)
+static uint8_t remove_callback(queue_context_t* queue, component_handler_t* component_handler, callback_handle_t function_handle)
 {
-    message_info_t message_info;
-    while(priority_queue_active)
+    if(!queue->is_active) return 1;
+    if(function_handle == 0 || function_handle > MAX_HANDLERS_PER_COMPONENT) return 1;
+    uint8_t handle_slot = function_handle - 1;
+    portENTER_CRITICAL(&s_handler_lock);
+    if(component_handler->handle_callbacks[handle_slot] == NULL)
     {
-        if (xQueueReceive(priority_message_queue, &message_info, portMAX_DELAY))
-        {
-            component_handler_t component_handler = priority_queue_handlers[message_info.component_handle];
-            callback_handler_t* callback_iter = NULL;
-            if(component_handler.is_component_registered)
-            {
-                callback_iter = component_handler.callback_list_start;
-            }
-            while(callback_iter != NULL)
-            {
-                (*(callback_iter->callback_ptr))(message_info.component_handle, message_info.message_type, message_info.message_data, message_info.message_size);
-                callback_iter = callback_iter->next_handler;
-            }
-            if(message_info.is_pointer)
-            {
-                free(message_info.message_data);
-            }
-        }
-        else
+        portEXIT_CRITICAL(&s_handler_lock);
+        return 1;
+    }
+    //copy everything but the removed callback, keeping the order the rest were registered in
+    callback_table_t* active_table = component_handler->active_table;
+    callback_table_t* new_table = get_spare_callback_table(queue, component_handler);
+    new_table->callback_count = 0;
+    for(uint8_t callback_iter = 0; callback_iter < active_table->callback_count; callback_iter++)
+    {
+        if(active_table->callbacks[callback_iter].callback_handle != function_handle)
         {
-            vTaskDelay(1 / portTICK_PERIOD_MS);
+            new_table->callbacks[new_table->callback_count] = active_table->callbacks[callback_iter];
+            new_table->callback_count++;
         }
-        if(args != NULL)
+    }
+    __atomic_store_n(&component_handler->active_table, new_table, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&component_handler->handle_callbacks[handle_slot], NULL, __ATOMIC_RELEASE);
+    component_handler->free_handle_mask |= (uint8_t) (1U << handle_slot);
+    portEXIT_CRITICAL(&s_handler_lock);
+    return 0;
+}
+
+//call with s_handler_lock held. The spare is neither the published table nor the one the queue task
+//has pinned, and the queue task can only pin what was published, so nothing reads it while it is rebuilt.
+static callback_table_t* get_spare_callback_table(queue_context_t* queue, component_handler_t* component_handler)
+{
+    callback_table_t* pinned_table = __atomic_load_n(&queue->pinned_table, __ATOMIC_SEQ_CST);
+    for(uint8_t table_iter = 0; table_iter < CALLBACK_TABLE_COPIES; table_iter++)
+    {
+        callback_table_t* table = &component_handler->tables[table_iter];
+        if(table != component_handler->active_table && table != pinned_table)
         {
-            break;
+            return table;
         }
     }
+    return NULL;
 }
 
-static bool is_handle_registered(component_handle_t handle)
+//hazard pointer style pin. If a writer picked its spare before the pin became visible it had
+//already published a newer table, so the recheck fails and the queue task pins that one instead.
+static callback_table_t* pin_callback_table(queue_context_t* queue, component_handler_t* component_handler)
+{
+    callback_table_t* table;
+    do
+    {
+        table = __atomic_load_n(&component_handler->active_table, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&queue->pinned_table, table, __ATOMIC_SEQ_CST);
+    } while(table != __atomic_load_n(&component_handler->active_table, __ATOMIC_SEQ_CST));
+    return table;
+}
+
+static uint8_t send_message(queue_context_t* queue, message_info_t* message_info)
 {
-    return (normal_queue_handlers[handle].is_component_registered || priority_queue_handlers[handle].is_component_registered);
+    if(!queue->is_active) return 1;
+    message_info->enqueue_time_us = (uint32_t) esp_timer_get_time();
+    if(queue->overflow_policy_count)
+    {
+        return hold_message(queue, message_info);
+    }
+    return enqueue_message(queue, message_info);
+}
+
+static uint8_t enqueue_message(queue_context_t* queue, message_info_t* message_info)
+{
+    bool is_sent = xQueueSend(queue->message_queue, message_info, ( TickType_t ) 0);
+    if(!is_sent)
+    {
+        msg_trace_record(MSG_TRACE_DROP, queue->queue_id, message_info->component_handle, message_info->message_type);
+        portENTER_CRITICAL(&s_stats_lock);
+        queue->stats.dropped++;
+        portEXIT_CRITICAL(&s_stats_lock);
+        //queue full, the payload would never be dispatched so give it back now
+        if(message_info->is_pointer)
+        {
+            release_dispatched_payload(message_info->message_data);
+        }
+        return 2;
+    }
+    msg_trace_record(MSG_TRACE_ENQUEUE, queue->queue_id, message_info->component_handle, message_info->message_type);
+    UBaseType_t depth = uxQueueMessagesWaiting(queue->message_queue);
+    portENTER_CRITICAL(&s_stats_lock);
+    queue->stats.enqueued++;
+    if(depth > queue->stats.depth_high_water)
+    {
+        queue->stats.depth_high_water = (uint16_t) depth;
+    }
+    portEXIT_CRITICAL(&s_stats_lock);
+    return 0;
+}
+
+//sends the message as is when its pair has no policy
+static uint8_t hold_message(queue_context_t* queue, message_info_t* message_info)
+{
+    message_info_t stale_message;
+    //look up, check and append under one lock, so a policy change cannot free, reuse or resize the entry in between
+    portENTER_CRITICAL(&s_policy_lock);
+    overflow_policy_entry_t* entry = find_overflow_policy(queue, message_info->component_handle, message_info->message_type);
+    if(entry == NULL)
+    {
+        portEXIT_CRITICAL(&s_policy_lock);
+        return enqueue_message(queue, message_info);
+    }
+    uint8_t capacity = (entry->policy == MSG_OVERFLOW_COALESCE) ? 1 : MSG_OVERFLOW_BACKLOG;
+    if(entry->pending_count >= capacity)
+    {
+        //backlog full, the newest message goes to the back and the oldest gives up its marker
+        stale_message = entry->pending_messages[entry->pending_head];
+        entry->pending_head = (entry->pending_head + 1) % MSG_OVERFLOW_BACKLOG;
+        entry->pending_messages[(entry->pending_head + entry->pending_count - 1) % MSG_OVERFLOW_BACKLOG] = *message_info;
+        bool is_coalesced = (entry->policy == MSG_OVERFLOW_COALESCE);
+        portEXIT_CRITICAL(&s_policy_lock);
+        discard_message(&stale_message);
+        portENTER_CRITICAL(&s_stats_lock);
+        if(is_coalesced)
+        {
+            queue->stats.coalesced++;
+        }
+        else
+        {
+            queue->stats.evicted++;
+        }
+        portEXIT_CRITICAL(&s_stats_lock);
+        return 0;
+    }
+    entry->pending_messages[(entry->pending_head + entry->pending_count) % MSG_OVERFLOW_BACKLOG] = *message_info;
+    entry->pending_count++;
+    portEXIT_CRITICAL(&s_policy_lock);
+
+    message_info_t marker = {0};
+    marker.message_data = (void*) entry;
+    marker.component_handle = MSG_COALESCE_MARKER_HANDLE;
+    marker.enqueue_time_us = message_info->enqueue_time_us;
+    marker.trace_id = MSG_TRACE_NONE;
+    marker.request_id = MSG_REQUEST_NONE;
+    if(!enqueue_message(queue, &marker))
+    {
+        return 0;
+    }
+
+    //queue full. If an older message of this pair is still pending it is evicted and the new one takes
+    //its marker, otherwise the new one is dropped like any other send to a full queue
+    portENTER_CRITICAL(&s_policy_lock);
+    if(!entry->in_use || entry->component_handle != message_info->component_handle
+        || entry->message_type != message_info->message_type || entry->pending_count == 0)
+    {
+        //the policy was removed or trimmed meanwhile and gave the message back already
+        portEXIT_CRITICAL(&s_policy_lock);
+        return 2;
+    }
+    bool is_evicted = (entry->pending_count > 1 && entry->policy == MSG_OVERFLOW_DROP_OLDEST);
+    if(is_evicted)
+    {
+        stale_message = entry->pending_messages[entry->pending_head];
+        entry->pending_head = (entry->pending_head + 1) % MSG_OVERFLOW_BACKLOG;
+    }
+    else
+    {
+        stale_message = entry->pending_messages[(entry->pending_head + entry->pending_count - 1) % MSG_OVERFLOW_BACKLOG];
+    }
+    entry->pending_count--;
+    portEXIT_CRITICAL(&s_policy_lock);
+    discard_message(&stale_message);
+    if(is_evicted)
+    {
+        //enqueue_message counted the marker as dropped
+        portENTER_CRITICAL(&s_stats_lock);
+        queue->stats.dropped--;
+        queue->stats.evicted++;
+        portEXIT_CRITICAL(&s_stats_lock);
+        return 0;
+    }
+    return 2;
+}
+
+//pops the oldest held message for a marker, false when the policy was removed under it
+static bool take_held_message(overflow_policy_entry_t* entry, message_info_t* message_info)
+{
+    portENTER_CRITICAL(&s_policy_lock);
+    if(entry->pending_count == 0)
+    {
+        portEXIT_CRITICAL(&s_policy_lock);
+        return false;
+    }
+    *message_info = entry->pending_messages[entry->pending_head];
+    entry->pending_head = (entry->pending_head + 1) % MSG_OVERFLOW_BACKLOG;
+    entry->pending_count--;
+    portEXIT_CRITICAL(&s_policy_lock);
+    return true;
+}
+
+//call with s_policy_lock held, the entry is only valid until it is released
+static overflow_policy_entry_t* find_overflow_policy(queue_context_t* queue, component_handle_t handle, uint8_t message_type)
+{
+    for(uint8_t policy_iter = 0; policy_iter < MAX_OVERFLOW_POLICIES; policy_iter++)
+    {
+        overflow_policy_entry_t* entry = &queue->overflow_policies[policy_iter];
+        if(entry->in_use && entry->component_handle == handle && entry->message_type == message_type)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void clear_overflow_policies(queue_context_t* queue, component_handle_t handle)
+{
+    for(uint8_t policy_iter = 0; policy_iter < MAX_OVERFLOW_POLICIES; policy_iter++)
+    {
+        overflow_policy_entry_t* entry = &queue->overflow_policies[policy_iter];
+        if(entry->in_use && entry->component_handle == handle)
+        {
+            remove_overflow_policy(queue, entry);
+        }
+    }
+}
+
+static void remove_overflow_policy(queue_context_t* queue, overflow_policy_entry_t* entry)
+{
+    message_info_t stale_message;
+    portENTER_CRITICAL(&s_policy_lock);
+    entry->in_use = false;
+    queue->overflow_policy_count--;
+    portEXIT_CRITICAL(&s_policy_lock);
+    //markers still in the queue find the backlog empty and are ignored
+    while(take_held_message(entry, &stale_message))
+    {
+        discard_message(&stale_message);
+    }
+}
+
+//gives back whatever a message holds without dispatching it
+static void discard_message(message_info_t* message_info)
+{
+    if(message_info->component_handle == MSG_RING_DOORBELL_HANDLE)
+    {
+        //the ring keeps its messages, the next publish rings again
+        msg_ring_t* ring = (msg_ring_t*) message_info->message_data;
+        __atomic_store_n(&ring->doorbell_pending, 0, __ATOMIC_SEQ_CST);
+        return;
+    }
+    if(message_info->component_handle == MSG_COALESCE_MARKER_HANDLE)
+    {
+        message_info_t stale_message;
+        if(take_held_message((overflow_policy_entry_t*) message_info->message_data, &stale_message))
+        {
+            discard_message(&stale_message);
+        }
+        return;
+    }
+    if(message_info->is_pointer)
+    {
+        release_dispatched_payload(message_info->message_data);
+    }
+}
+
+static void init_queue(uint8_t queue_id, const msg_queue_config_t* config)
+{
+    queue_context_t* queue = &s_queues[queue_id];
+    MESSAGE_POOL_INIT();
+    queue->queue_id = queue_id;
+    strncpy(queue->task_name, config->name, MSG_QUEUE_NAME_MAX - 1);
+    queue->task_name[MSG_QUEUE_NAME_MAX - 1] = '\0';
+    queue->message_queue = xQueueCreate(config->depth, sizeof(message_info_t));
+    //components that already hold a handle can register on the new queue straight away
+    for(component_handle_t handle = 0; handle < MAX_COMPONENT_REGISTRATIONS; handle++)
+    {
+        reset_component_handler(queue, &queue->handlers[handle], is_handle_registered(handle));
+    }
+    reset_component_handler(queue, &queue->wildcard_handler, true);
+    reset_queue_stats(queue_id);
+    queue->is_active = true;
+    xTaskCreatePinnedToCore(queue_task, queue->task_name, config->stack_size, (void*) queue, config->task_priority, NULL,
+        (config->core_id == MSG_QUEUE_NO_AFFINITY) ? tskNO_AFFINITY : config->core_id);
+}
+
+static void queue_task(void* args)
+{
+    queue_context_t* queue = (queue_context_t*) args;
+    message_info_t message_info;
+    while(queue->is_active)
+    {
+        if (xQueueReceive(queue->message_queue, &message_info, portMAX_DELAY))
+        {
+            //drain whatever else is already pending without blocking so a burst costs one wakeup
+            uint8_t batch_cnt = 0;
+            do
+            {
+                dispatch_message(queue, &message_info);
+                batch_cnt++;
+            } while(batch_cnt < queue->batch_size && xQueueReceive(queue->message_queue, &message_info, ( TickType_t ) 0));
+            queue->batch_wakeups++;
+            queue->batch_messages += batch_cnt;
+        }
+        else
+        {
+            vTaskDelay(1 / portTICK_PERIOD_MS);
+        }
+#ifdef FUNCTIONAL_TESTS
+        if(isTaskSpinningOnce())
+        {
+            break;
+        }
+#endif
+    }
+#ifndef FUNCTIONAL_TESTS
+    vTaskDelete(NULL);
+#endif
+}
+
+static void dispatch_message(queue_context_t* queue, message_info_t* message_info)
+{
+    if(message_info->component_handle == MSG_RING_DOORBELL_HANDLE)
+    {
+        drain_ring(queue, (msg_ring_t*) message_info->message_data);
+        return;
+    }
+    if(message_info->component_handle == MSG_COALESCE_MARKER_HANDLE)
+    {
+        message_info_t held_message;
+        if(take_held_message((overflow_policy_entry_t*) message_info->message_data, &held_message))
+        {
+            dispatch_message(queue, &held_message);
+        }
+        return;
+    }
+    msg_trace_record(MSG_TRACE_DEQUEUE, queue->queue_id, message_info->component_handle, message_info->message_type);
+    if(message_info->is_inline)
+    {
+        //point at this copy, the sender's pointer is stale by now
+        message_info->message_data = (void*) message_info->inline_payload;
+    }
+    record_dispatch_latency(queue, message_info);
+    if(message_info->component_handle == MSG_RPC_RESPONSE_HANDLE)
+    {
+        complete_request(queue, message_info);
+        return;
+    }
+    //handlers pick the trace up from here for the messages they derive from this one
+    uint16_t outer_trace_id = queue->dispatch_trace_id;
+    uint32_t outer_origin_time_us = queue->dispatch_origin_time_us;
+    uint16_t outer_request_id = queue->dispatch_request_id;
+    queue->dispatch_trace_id = message_info->trace_id;
+    queue->dispatch_origin_time_us = message_info->origin_time_us;
+    queue->dispatch_request_id = message_info->request_id;
+    if(message_info->trace_id != MSG_TRACE_NONE)
+    {
+        record_trace_stage(message_info->component_handle, message_info->message_type, message_info->trace_id, message_info->origin_time_us);
+    }
+    if(message_info->component_handle < MAX_COMPONENT_REGISTRATIONS
+        && queue->handlers[message_info->component_handle].is_component_registered)
+    {
+        call_handlers(queue, &queue->handlers[message_info->component_handle], message_info);
+        call_handlers(queue, &queue->wildcard_handler, message_info);
+    }
+    queue->dispatch_trace_id = outer_trace_id;
+    queue->dispatch_origin_time_us = outer_origin_time_us;
+    queue->dispatch_request_id = outer_request_id;
+    if(message_info->is_pointer)
+    {
+        release_dispatched_payload(message_info->message_data);
+    }
+}
+
+static void call_handlers(queue_context_t* queue, component_handler_t* component_handler, message_info_t* message_info)
+{
+    uint32_t type_bit = MSG_TYPE_BIT(message_info->message_type);
+    //handlers registered or unregistered by a callback take effect from the next message
+    callback_table_t* table = pin_callback_table(queue, component_handler);
+    for(uint8_t callback_iter = 0; callback_iter < table->callback_count; callback_iter++)
+    {
+        callback_entry_t* entry = &table->callbacks[callback_iter];
+        if(!(entry->type_mask & type_bit))
+        {
+            continue;
+        }
+        if(entry->is_deferred && defer_handler_call(queue, component_handler, entry, message_info))
+        {
+            continue;
+        }
+        msg_trace_record(MSG_TRACE_HANDLER_START, queue->queue_id, message_info->component_handle, message_info->message_type);
+        (*(entry->callback_ptr))(message_info->component_handle, message_info->message_type, message_info->message_data, message_info->message_size);
+        msg_trace_record(MSG_TRACE_HANDLER_END, queue->queue_id, message_info->component_handle, message_info->message_type);
+    }
+    __atomic_store_n(&queue->pinned_table, NULL, __ATOMIC_RELEASE);
+}
+
+static bool is_handle_registered(component_handle_t handle)
+{
+    if(handle >= MAX_COMPONENT_REGISTRATIONS) return false;
+    for(uint8_t queue_iter = 0; queue_iter < MAX_MESSAGE_QUEUES; queue_iter++)
+    {
+        if(s_queues[queue_iter].is_active && s_queues[queue_iter].handlers[handle].is_component_registered)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool is_any_queue_active(void)
+{
+    for(uint8_t queue_iter = 0; queue_iter < MAX_MESSAGE_QUEUES; queue_iter++)
+    {
+        if(s_queues[queue_iter].is_active)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint8_t set_message_inline_payload(message_info_t* message_info, const void* payload, size_t payload_size)
+{
+    if(message_info == NULL || payload_size > MSG_INLINE_PAYLOAD_SIZE) return 1;
+    if(payload_size)
+    {
+        memcpy(message_info->inline_payload, payload, payload_size);
+    }
+    message_info->message_data = (void*) message_info->inline_payload;
+    message_info->message_size = payload_size;
+    message_info->is_pointer = false;
+    message_info->is_inline = true;
+    return 0;
+}
+
+void* acquire_message_payload(size_t payload_size)
+{
+    void* payload = NULL;
+    if(!s_pool_initialized) return NULL;
+    portENTER_CRITICAL(&s_pool_lock);
+    uint8_t last_class = MSG_POOL_LARGE;
+    bool found_class = false;
+    //use the smallest class that fits, a full small class spills into the medium one
+    for(uint8_t pool_iter = 0; pool_iter < MSG_POOL_CLASS_MAX; pool_iter++)
+    {
+        payload_pool_t* pool = &s_payload_pools[pool_iter];
+        if(pool->stats.block_size < payload_size)
+        {
+            continue;
+        }
+        //large blocks are kept for the requests that need them, like tof frames
+        if(pool_iter == MSG_POOL_LARGE && found_class)
+        {
+            break;
+        }
+        found_class = true;
+        last_class = pool_iter;
+        if(pool->free_top == 0)
+        {
+            continue;
+        }
+        pool->free_top--;
+        pool->ref_counts[pool->free_stack[pool->free_top]] = 1;
+        payload = pool->arena + (pool->free_stack[pool->free_top] * pool->stats.block_size);
+        pool->stats.acquire_count++;
+        pool->stats.blocks_in_use++;
+        if(pool->stats.blocks_in_use > pool->stats.high_water_mark)
+        {
+            pool->stats.high_water_mark = pool->stats.blocks_in_use;
+        }
+        break;
+    }
+    //a failed acquire counts once, against the last class it tried
+    if(payload == NULL)
+    {
+        s_payload_pools[last_class].stats.exhausted_count++;
+    }
+    portEXIT_CRITICAL(&s_pool_lock);
+    return payload;
+}
+
+uint8_t retain_message_payload(void* payload)
+{
+    payload_pool_t* pool;
+    uint16_t block_index;
+    if(!find_pool_block(payload, &pool, &block_index)) return 1;
+    portENTER_CRITICAL(&s_pool_lock);
+    if(pool->ref_counts[block_index] == 0 || pool->ref_counts[block_index] == UINT8_MAX)
+    {
+        portEXIT_CRITICAL(&s_pool_lock);
+        return 2;
+    }
+    pool->ref_counts[block_index]++;
+    portEXIT_CRITICAL(&s_pool_lock);
+    return 0;
+}
+
+uint8_t release_message_payload(void* payload)
+{
+    payload_pool_t* pool;
+    uint16_t block_index;
+    if(!find_pool_block(payload, &pool, &block_index)) return 1;
+    portENTER_CRITICAL(&s_pool_lock);
+    if(pool->ref_counts[block_index] == 0)
+    {
+        //already back in the pool, a second release would corrupt the free stack
+        portEXIT_CRITICAL(&s_pool_lock);
+        return 2;
+    }
+    pool->ref_counts[block_index]--;
+    if(pool->ref_counts[block_index] == 0)
+    {
+        pool->free_stack[pool->free_top] = block_index;
+        pool->free_top++;
+        pool->stats.blocks_in_use--;
+    }
+    portEXIT_CRITICAL(&s_pool_lock);
+    return 0;
+}
+
+uint8_t get_message_payload_ref_count(void* payload)
+{
+    payload_pool_t* pool;
+    uint16_t block_index;
+    if(!find_pool_block(payload, &pool, &block_index)) return 0;
+    return pool->ref_counts[block_index];
+}
+
+static bool find_pool_block(void* payload, payload_pool_t** pool_out, uint16_t* block_index)
+{
+    uint8_t* block = (uint8_t*) payload;
+    if(block == NULL) return false;
+    for(uint8_t pool_iter = 0; pool_iter < MSG_POOL_CLASS_MAX; pool_iter++)
+    {
+        payload_pool_t* pool = &s_payload_pools[pool_iter];
+        size_t arena_size = pool->stats.block_size * pool->stats.block_count;
+        if(block < pool->arena || block >= pool->arena + arena_size)
+        {
+            continue;
+        }
+        size_t offset = (size_t) (block - pool->arena);
+        if(offset % pool->stats.block_size)
+        {
+            //pointer into the middle of a block
+            return false;
+        }
+        *pool_out = pool;
+        *block_index = (uint16_t) (offset / pool->stats.block_size);
+        return true;
+    }
+    return false;
+}
+
+uint8_t get_message_pool_stats(msg_pool_class_t pool_class, msg_pool_stats_t* stats)
+{
+    if(pool_class >= MSG_POOL_CLASS_MAX || stats == NULL) return 1;
+    portENTER_CRITICAL(&s_pool_lock);
+    *stats = s_payload_pools[pool_class].stats;
+    portEXIT_CRITICAL(&s_pool_lock);
+    return 0;
+}
+
+uint16_t start_message_trace(message_info_t* message_info)
+{
+    //ids wrap, skipping MSG_TRACE_NONE
+    uint16_t trace_id = __atomic_add_fetch(&s_last_trace_id, 1, __ATOMIC_RELAXED);
+    if(trace_id == MSG_TRACE_NONE)
+    {
+        trace_id = __atomic_add_fetch(&s_last_trace_id, 1, __ATOMIC_RELAXED);
+    }
+    message_info->trace_id = trace_id;
+    message_info->origin_time_us = (uint32_t) esp_timer_get_time();
+    return trace_id;
+}
+
+void inherit_message_trace(uint8_t queuetype, message_info_t* message_info)
+{
+    message_info->trace_id = MSG_TRACE_NONE;
+    message_info->origin_time_us = 0;
+    if(queuetype >= MAX_MESSAGE_QUEUES) return;
+    message_info->trace_id = s_queues[queuetype].dispatch_trace_id;
+    message_info->origin_time_us = s_queues[queuetype].dispatch_origin_time_us;
+}
+
+uint8_t mark_trace_stage(uint8_t queuetype, component_handle_t handle, uint8_t message_type)
+{
+    if(queuetype >= MAX_MESSAGE_QUEUES) return 1;
+    queue_context_t* queue = &s_queues[queuetype];
+    if(queue->dispatch_trace_id == MSG_TRACE_NONE) return 1;
+    return record_trace_stage(handle, message_type, queue->dispatch_trace_id, queue->dispatch_origin_time_us);
+}
+
+uint8_t get_trace_stage_stats(uint8_t stage_index, msg_trace_stage_stats_t* stats)
+{
+    if(stats == NULL) return 1;
+    portENTER_CRITICAL(&s_trace_lock);
+    if(stage_index >= s_trace_stage_count)
+    {
+        portEXIT_CRITICAL(&s_trace_lock);
+        return 1;
+    }
+    *stats = s_trace_stages[stage_index];
+    portEXIT_CRITICAL(&s_trace_lock);
+    return 0;
+}
+
+void reset_trace_stats(void)
+{
+    portENTER_CRITICAL(&s_trace_lock);
+    memset(s_trace_stages, 0, sizeof(s_trace_stages));
+    s_trace_stage_count = 0;
+    portEXIT_CRITICAL(&s_trace_lock);
+}
+
+uint8_t send_message_after(uint8_t queue_id, message_info_t message_info, uint32_t delay_ms, msg_timer_handle_t* timer_handle)
+{
+    //round up so the message never goes out before delay_ms
+    uint64_t due_ms = ((uint64_t) esp_timer_get_time() / 1000) + delay_ms;
+    return schedule_delayed_message(queue_id, &message_info, (due_ms + MSG_TIMER_TICK_MS - 1) / MSG_TIMER_TICK_MS, timer_handle);
+}
+
+uint8_t send_message_at(uint8_t queue_id, message_info_t message_info, uint64_t time_ms, msg_timer_handle_t* timer_handle)
+{
+    return schedule_delayed_message(queue_id, &message_info, (time_ms + MSG_TIMER_TICK_MS - 1) / MSG_TIMER_TICK_MS, timer_handle);
+}
+
+uint8_t cancel_delayed_message(msg_timer_handle_t timer_handle)
+{
+    uint8_t entry_index = (uint8_t) (timer_handle & 0xFF) - 1;
+    if(timer_handle == MSG_TIMER_INVALID_HANDLE || entry_index >= MAX_DELAYED_MESSAGES) return 1;
+    uint8_t queue_id;
+    message_info_t message_info;
+    bool was_pending = false;
+    portENTER_CRITICAL(&s_timer_lock);
+    if(s_delayed_messages[entry_index].generation == (uint8_t) (timer_handle >> 8))
+    {
+        was_pending = take_delayed_message(entry_index, &queue_id, &message_info);
+    }
+    portEXIT_CRITICAL(&s_timer_lock);
+    if(!was_pending) return 1;
+    discard_message(&message_info);
+    return 0;
+}
+
+uint8_t get_delayed_message_count(void)
+{
+    portENTER_CRITICAL(&s_timer_lock);
+    uint8_t count = s_delayed_count;
+    portEXIT_CRITICAL(&s_timer_lock);
+    return count;
+}
+
+uint8_t send_request(uint8_t queue_id, message_info_t message_info, uint8_t reply_queue_id, msg_response_callback_t callback, void* context, uint32_t timeout_ms, uint16_t* request_id)
+{
+    if(request_id != NULL)
+    {
+        *request_id = MSG_REQUEST_NONE;
+    }
+    //the request owns its payload from here on, every failure gives it back like a failed send would
+    if(callback == NULL || queue_id >= MAX_MESSAGE_QUEUES || reply_queue_id >= MAX_MESSAGE_QUEUES
+        || !s_queues[queue_id].is_active || !s_queues[reply_queue_id].is_active)
+    {
+        discard_message(&message_info);
+        return 1;
+    }
+    pending_request_t* request = NULL;
+    portENTER_CRITICAL(&s_request_lock);
+    for(uint8_t request_iter = 0; request_iter < MAX_PENDING_REQUESTS; request_iter++)
+    {
+        if(!s_pending_requests[request_iter].is_pending)
+        {
+            request = &s_pending_requests[request_iter];
+            break;
+        }
+    }
+    if(request == NULL)
+    {
+        portEXIT_CRITICAL(&s_request_lock);
+        discard_message(&message_info);
+        return 2;
+    }
+    s_last_request_id++;
+    if(s_last_request_id == MSG_REQUEST_NONE)
+    {
+        s_last_request_id++;
+    }
+    uint16_t new_request_id = s_last_request_id;
+    request->callback = callback;
+    request->context = context;
+    request->timeout_handle = MSG_TIMER_INVALID_HANDLE;
+    request->request_id = new_request_id;
+    request->reply_queue_id = reply_queue_id;
+    request->is_pending = true;
+    portEXIT_CRITICAL(&s_request_lock);
+
+    //the timeout is armed before the request goes out so a fast response always finds it to cancel
+    msg_timer_handle_t timeout_handle = MSG_TIMER_INVALID_HANDLE;
+    if(timeout_ms)
+    {
+        message_info_t timeout_message;
+        set_message_inline_payload(&timeout_message, NULL, 0);
+        timeout_message.component_handle = MSG_RPC_RESPONSE_HANDLE;
+        timeout_message.message_type = MSG_RPC_TIMEOUT;
+        timeout_message.trace_id = MSG_TRACE_NONE;
+        timeout_message.request_id = new_request_id;
+        if(send_message_after(reply_queue_id, timeout_message, timeout_ms, &timeout_handle))
+        {
+            take_pending_request(new_request_id, NULL);
+            discard_message(&message_info);
+            return 3;
+        }
+        portENTER_CRITICAL(&s_request_lock);
+        request->timeout_handle = timeout_handle;
+        portEXIT_CRITICAL(&s_request_lock);
+    }
+    message_info.request_id = new_request_id;
+    uint8_t send_error = send_message(&s_queues[queue_id], &message_info);
+    if(send_error)
+    {
+        take_pending_request(new_request_id, NULL);
+        cancel_delayed_message(timeout_handle);
+        //a full queue has released the payload already, only an inactive one hands it back
+        if(send_error == 1)
+        {
+            discard_message(&message_info);
+        }
+        return 3;
+    }
+    if(request_id != NULL)
+    {
+        *request_id = new_request_id;
+    }
+    return 0;
+}
+
+uint16_t get_dispatch_request_id(uint8_t queuetype)
+{
+    if(queuetype >= MAX_MESSAGE_QUEUES) return MSG_REQUEST_NONE;
+    return s_queues[queuetype].dispatch_request_id;
+}
+
+uint8_t send_response(uint16_t request_id, uint8_t status, const void* response_data, size_t response_size)
+{
+    if(request_id == MSG_REQUEST_NONE) return 1;
+    //the requester could not tell this status from a real timeout
+    if(status == MSG_RPC_TIMEOUT || response_size > MSG_INLINE_PAYLOAD_SIZE) return 2;
+    uint8_t reply_queue_id = MSG_QUEUE_INVALID;
+    msg_timer_handle_t timeout_handle = MSG_TIMER_INVALID_HANDLE;
+    portENTER_CRITICAL(&s_request_lock);
+    for(uint8_t request_iter = 0; request_iter < MAX_PENDING_REQUESTS; request_iter++)
+    {
+        if(s_pending_requests[request_iter].is_pending && s_pending_requests[request_iter].request_id == request_id)
+        {
+            reply_queue_id = s_pending_requests[request_iter].reply_queue_id;
+            timeout_handle = s_pending_requests[request_iter].timeout_handle;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_request_lock);
+    if(reply_queue_id == MSG_QUEUE_INVALID) return 1;
+    //the request is only completed when this is dispatched, whichever of response and timeout gets there first wins
+    message_info_t response;
+    set_message_inline_payload(&response, response_data, response_size);
+    response.component_handle = MSG_RPC_RESPONSE_HANDLE;
+    response.message_type = status;
+    response.trace_id = MSG_TRACE_NONE;
+    response.request_id = request_id;
+    if(send_message(&s_queues[reply_queue_id], &response))
+    {
+        //an armed timeout still tells the requester and frees the slot, without one the slot would never come back
+        if(timeout_handle == MSG_TIMER_INVALID_HANDLE)
+        {
+            take_pending_request(request_id, NULL);
+        }
+        return 3;
+    }
+    return 0;
+}
+
+uint8_t msg_ring_init(msg_ring_t* ring, message_info_t* storage, uint32_t capacity, uint8_t queuetype)
+{
+    if(ring == NULL || storage == NULL || queuetype >= MAX_MESSAGE_QUEUES) return 1;
+    if(capacity == 0 || (capacity & (capacity - 1))) return 1;
+    ring->slots = storage;
+    ring->capacity = capacity;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->doorbell_pending = 0;
+    ring->dropped = 0;
+    ring->queuetype = queuetype;
+    return 0;
+}
+
+uint8_t msg_ring_push(msg_ring_t* ring, message_info_t message_info)
+{
+    //head and tail run freely and are masked on access, so full is head - tail == capacity
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if(head - tail >= ring->capacity)
+    {
+        msg_trace_record(MSG_TRACE_DROP, ring->queuetype, message_info.component_handle, message_info.message_type);
+        ring->dropped++;
+        return 1;
+    }
+    message_info.enqueue_time_us = (uint32_t) esp_timer_get_time();
+    ring->slots[head & (ring->capacity - 1)] = message_info;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    msg_trace_record(MSG_TRACE_ENQUEUE, ring->queuetype, message_info.component_handle, message_info.message_type);
+    return 0;
+}
+
+uint8_t msg_ring_pop(msg_ring_t* ring, message_info_t* message_info)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if(head == tail)
+    {
+        return 1;
+    }
+    *message_info = ring->slots[tail & (ring->capacity - 1)];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+uint8_t msg_ring_publish(msg_ring_t* ring, message_info_t message_info)
+{
+    if(msg_ring_push(ring, message_info))
+    {
+        return 1;
+    }
+    //the dispatch task clears the flag before draining, so a doorbell is only needed when it is clear
+    if(__atomic_exchange_n(&ring->doorbell_pending, 1, __ATOMIC_SEQ_CST))
+    {
+        return 0;
+    }
+    queue_context_t* queue = &s_queues[ring->queuetype];
+    if(!queue->is_active)
+    {
+        __atomic_store_n(&ring->doorbell_pending, 0, __ATOMIC_SEQ_CST);
+        return 2;
+    }
+    message_info_t doorbell = {0};
+    doorbell.message_data = (void*) ring;
+    doorbell.component_handle = MSG_RING_DOORBELL_HANDLE;
+    doorbell.trace_id = MSG_TRACE_NONE;
+    doorbell.request_id = MSG_REQUEST_NONE;
+    if(send_message(queue, &doorbell))
+    {
+        //queue is full, the next publish retries the doorbell
+        __atomic_store_n(&ring->doorbell_pending, 0, __ATOMIC_SEQ_CST);
+    }
+    return 0;
+}
+
+uint8_t msg_ring_publish_from_isr(msg_ring_t* ring, message_info_t message_info, BaseType_t* higher_priority_task_woken)
+{
+    if(msg_ring_push(ring, message_info))
+    {
+        return 1;
+    }
+    if(__atomic_exchange_n(&ring->doorbell_pending, 1, __ATOMIC_SEQ_CST))
+    {
+        return 0;
+    }
+    queue_context_t* queue = &s_queues[ring->queuetype];
+    if(!queue->is_active)
+    {
+        __atomic_store_n(&ring->doorbell_pending, 0, __ATOMIC_SEQ_CST);
+        return 2;
+    }
+    //doorbells never match an overflow policy, so this skips send_message and its task side locks
+    message_info_t doorbell = {0};
+    doorbell.message_data = (void*) ring;
+    doorbell.component_handle = MSG_RING_DOORBELL_HANDLE;
+    doorbell.trace_id = MSG_TRACE_NONE;
+    doorbell.request_id = MSG_REQUEST_NONE;
+    doorbell.enqueue_time_us = (uint32_t) esp_timer_get_time();
+    bool is_sent = xQueueSendFromISR(queue->message_queue, &doorbell, higher_priority_task_woken);
+    if(!is_sent)
+    {
+        __atomic_store_n(&ring->doorbell_pending, 0, __ATOMIC_SEQ_CST);
+    }
+    portENTER_CRITICAL_ISR(&s_stats_lock);
+    if(is_sent)
+    {
+        queue->stats.enqueued++;
+    }
+    else
+    {
+        queue->stats.dropped++;
+    }
+    portEXIT_CRITICAL_ISR(&s_stats_lock);
+    return 0;
+}
+
+static void drain_ring(queue_context_t* queue, msg_ring_t* ring)
+{
+    message_info_t message_info;
+    message_info_t next_message;
+    __atomic_store_n(&ring->doorbell_pending, 0, __ATOMIC_SEQ_CST);
+    if(msg_ring_pop(ring, &message_info))
+    {
+        return;
+    }
+    while(!msg_ring_pop(ring, &next_message))
+    {
+        //a coalesced message followed by another of the same kind is already stale
+        bool is_coalesced = false;
+        if(queue->overflow_policy_count && next_message.component_handle == message_info.component_handle
+            && next_message.message_type == message_info.message_type)
+        {
+            portENTER_CRITICAL(&s_policy_lock);
+            overflow_policy_entry_t* entry = find_overflow_policy(queue, message_info.component_handle, message_info.message_type);
+            is_coalesced = (entry != NULL && entry->policy == MSG_OVERFLOW_COALESCE);
+            portEXIT_CRITICAL(&s_policy_lock);
+        }
+        if(is_coalesced)
+        {
+            discard_message(&message_info);
+            portENTER_CRITICAL(&s_stats_lock);
+            queue->stats.coalesced++;
+            portEXIT_CRITICAL(&s_stats_lock);
+        }
+        else
+        {
+            dispatch_message(queue, &message_info);
+        }
+        message_info = next_message;
+    }
+    dispatch_message(queue, &message_info);
+}
+
+static void record_dispatch_latency(queue_context_t* queue, message_info_t* message_info)
+{
+    //unsigned subtraction keeps this right across the 32 bit wrap
+    uint32_t latency_us = (uint32_t) esp_timer_get_time() - message_info->enqueue_time_us;
+    uint32_t scaled = latency_us >> QUEUE_LATENCY_BUCKET_0_SHIFT;
+    uint8_t bucket = 0;
+    if(scaled)
+    {
+        bucket = 32 - __builtin_clz(scaled);
+        if(bucket >= QUEUE_LATENCY_BUCKETS)
+        {
+            bucket = QUEUE_LATENCY_BUCKETS - 1;
+        }
+    }
+    //only the queue task writes these, the lock keeps readers from seeing a torn update
+    portENTER_CRITICAL(&s_stats_lock);
+    queue->stats.latency_histogram[bucket]++;
+    if(latency_us > queue->stats.max_latency_us)
+    {
+        queue->stats.max_latency_us = latency_us;
+    }
+    portEXIT_CRITICAL(&s_stats_lock);
+}
+
+static void release_dispatched_payload(void* payload)
+{
+    if(release_message_payload(payload) == 1)
+    {
+        //payload was not from the pool, assume it came from the heap
+        free(payload);
+    }
+}
+
+static void init_worker_pool(void)
+{
+    //workers are shared by every queue and started with the first deferred handler, only one registration starts them
+    portENTER_CRITICAL(&s_handler_lock);
+    if(s_worker_pool_started)
+    {
+        portEXIT_CRITICAL(&s_handler_lock);
+        return;
+    }
+    s_worker_pool_started = true;
+    portEXIT_CRITICAL(&s_handler_lock);
+    for(uint8_t worker_iter = 0; worker_iter < MSG_WORKER_COUNT; worker_iter++)
+    {
+        __atomic_store_n(&s_worker_queues[worker_iter], xQueueCreate(MSG_WORKER_QUEUE_LENGTH, sizeof(deferred_job_t)), __ATOMIC_RELEASE);
+        snprintf(s_worker_names[worker_iter], MSG_QUEUE_NAME_MAX, "msg_worker_%u", worker_iter);
+        xTaskCreatePinnedToCore(worker_task, s_worker_names[worker_iter], MSG_WORKER_STACK_SIZE, (void*) (uintptr_t) worker_iter, MSG_WORKER_PRIORITY, NULL, tskNO_AFFINITY);
+    }
+}
+
+static void worker_task(void* args)
+{
+    uint8_t worker_id = (uint8_t) (uintptr_t) args;
+    uint8_t trace_lane = MSG_TRACE_WORKER_LANE + worker_id;
+    QueueHandle_t worker_queue = s_worker_queues[worker_id];
+    deferred_job_t job;
+    while(worker_queue != NULL)
+    {
+        if(xQueueReceive(worker_queue, &job, portMAX_DELAY))
+        {
+            //skip the call if the handler was unregistered while the job was waiting
+            if(job.message_info.is_inline)
+            {
+                job.message_info.message_data = (void*) job.message_info.inline_payload;
+            }
+            if(job.queue->is_active
+                && __atomic_load_n(&job.component_handler->handle_callbacks[job.callback_handle - 1], __ATOMIC_ACQUIRE) == job.callback_ptr)
+            {
+                msg_trace_record(MSG_TRACE_HANDLER_START, trace_lane, job.message_info.component_handle, job.message_info.message_type);
+                (*(job.callback_ptr))(job.message_info.component_handle, job.message_info.message_type, job.message_info.message_data, job.message_info.message_size);
+                msg_trace_record(MSG_TRACE_HANDLER_END, trace_lane, job.message_info.component_handle, job.message_info.message_type);
+            }
+            if(job.message_info.is_pointer)
+            {
+                release_message_payload(job.message_info.message_data);
+            }
+        }
+#ifdef FUNCTIONAL_TESTS
+        if(isTaskSpinningOnce())
+        {
+            break;
+        }
+#endif
+    }
+#ifndef FUNCTIONAL_TESTS
+    vTaskDelete(NULL);
+#endif
+}
+
+//returns false if the handler has to be called on the queue task instead
+static bool defer_handler_call(queue_context_t* queue, component_handler_t* component_handler, callback_entry_t* entry, message_info_t* message_info)
+{
+    //one callback always goes to the same worker, so its calls run one at a time and in dispatch order
+    uint8_t worker_id = (uint8_t) (((uintptr_t) entry->callback_ptr >> 2) % MSG_WORKER_COUNT);
+    //the pool another registration is still starting has no queue yet
+    QueueHandle_t worker_queue = __atomic_load_n(&s_worker_queues[worker_id], __ATOMIC_ACQUIRE);
+    if(worker_queue == NULL) return false;
+    if(message_info->is_pointer && retain_message_payload(message_info->message_data))
+    {
+        //heap payloads are freed right after dispatch so the worker cannot hold on to them
+        return false;
+    }
+    if(!message_info->is_pointer && !message_info->is_inline && message_info->message_data != NULL)
+    {
+        //raw pointers point into the sender's memory, which is only promised to last until dispatch
+        return false;
+    }
+    deferred_job_t job;
+    job.queue = queue;
+    job.component_handler = component_handler;
+    job.callback_ptr = entry->callback_ptr;
+    job.callback_handle = entry->callback_handle;
+    job.message_info = *message_info;
+    bool is_sent = xQueueSend(worker_queue, &job, ( TickType_t ) 0);
+    if(!is_sent)
+    {
+        msg_trace_record(MSG_TRACE_DROP, MSG_TRACE_WORKER_LANE + worker_id, message_info->component_handle, message_info->message_type);
+    }
+    if(!is_sent && message_info->is_pointer)
+    {
+        release_message_payload(message_info->message_data);
+    }
+    portENTER_CRITICAL(&s_stats_lock);
+    if(is_sent)
+    {
+        queue->stats.deferred++;
+    }
+    else
+    {
+        queue->stats.deferred_dropped++;
+    }
+    portEXIT_CRITICAL(&s_stats_lock);
+    return true;
+}
+
+static void drain_worker_queue(void)
+{
+    deferred_job_t job;
+    for(uint8_t worker_iter = 0; worker_iter < MSG_WORKER_COUNT; worker_iter++)
+    {
+        if(s_worker_queues[worker_iter] == NULL) continue;
+        while(xQueueReceive(s_worker_queues[worker_iter], &job, ( TickType_t ) 0))
+        {
+            if(job.message_info.is_pointer)
+            {
+                release_message_payload(job.message_info.message_data);
+            }
+        }
+    }
+}
+
+static uint8_t record_trace_stage(component_handle_t handle, uint8_t message_type, uint16_t trace_id, uint32_t origin_time_us)
+{
+    uint32_t latency_us = (uint32_t) esp_timer_get_time() - origin_time_us;
+    msg_trace_stage_stats_t* stage = NULL;
+    portENTER_CRITICAL(&s_trace_lock);
+    for(uint8_t stage_iter = 0; stage_iter < s_trace_stage_count; stage_iter++)
+    {
+        if(s_trace_stages[stage_iter].component_handle == handle && s_trace_stages[stage_iter].message_type == message_type)
+        {
+            stage = &s_trace_stages[stage_iter];
+            break;
+        }
+    }
+    if(stage == NULL)
+    {
+        if(s_trace_stage_count >= MAX_TRACE_STAGES)
+        {
+            portEXIT_CRITICAL(&s_trace_lock);
+            return 2;
+        }
+        stage = &s_trace_stages[s_trace_stage_count];
+        s_trace_stage_count++;
+        stage->component_handle = handle;
+        stage->message_type = message_type;
+    }
+    stage->count++;
+    stage->total_latency_us += latency_us;
+    if(latency_us > stage->max_latency_us)
+    {
+        stage->max_latency_us = latency_us;
+    }
+    stage->last_trace_id = trace_id;
+    stage->last_latency_us = latency_us;
+    portEXIT_CRITICAL(&s_trace_lock);
+    return 0;
+}
+
+static void init_timer_wheel(void)
+{
+    //the wheel is shared by every queue and started with the first delayed message. Only the sender
+    //that claims it resets the lists, so a concurrent first send never loses its entry.
+    portENTER_CRITICAL(&s_timer_lock);
+    if(s_timer_wheel_started)
+    {
+        portEXIT_CRITICAL(&s_timer_lock);
+        return;
+    }
+    s_timer_wheel_started = true;
+    for(uint8_t list_iter = 0; list_iter <= MSG_TIMER_WHEEL_SLOTS; list_iter++)
+    {
+        s_timer_lists[list_iter] = MSG_TIMER_NO_ENTRY;
+    }
+    for(uint8_t entry_iter = 0; entry_iter < MAX_DELAYED_MESSAGES; entry_iter++)
+    {
+        s_delayed_messages[entry_iter].is_pending = false;
+        s_delayed_messages[entry_iter].next = (entry_iter + 1 < MAX_DELAYED_MESSAGES) ? entry_iter + 1 : MSG_TIMER_NO_ENTRY;
+    }
+    s_timer_free_head = 0;
+    s_delayed_count = 0;
+    s_timer_wheel_tick = ((uint64_t) esp_timer_get_time() / 1000) / MSG_TIMER_TICK_MS;
+    portEXIT_CRITICAL(&s_timer_lock);
+    __atomic_store_n(&s_timer_wake_queue, xQueueCreate(1, sizeof(uint8_t)), __ATOMIC_RELEASE);
+    xTaskCreatePinnedToCore(timer_task, "msg_timer", MSG_QUEUE_DEFAULT_STACK_SIZE, NULL, MSG_TIMER_PRIORITY, NULL, tskNO_AFFINITY);
+}
+
+static void timer_task(void* args)
+{
+    (void) args;
+    uint8_t wake;
+    while(s_timer_wake_queue != NULL)
+    {
+        //new messages wake the task early in case they are due before the slot it is waiting on
+        xQueueReceive(s_timer_wake_queue, &wake, get_timer_wait());
+        advance_timer_wheel();
+#ifdef FUNCTIONAL_TESTS
+        if(isTaskSpinningOnce())
+        {
+            break;
+        }
+#endif
+    }
+#ifndef FUNCTIONAL_TESTS
+    vTaskDelete(NULL);
+#endif
+}
+
+static uint8_t schedule_delayed_message(uint8_t queue_id, message_info_t* message_info, uint64_t due_tick, msg_timer_handle_t* timer_handle)
+{
+    if(timer_handle != NULL)
+    {
+        *timer_handle = MSG_TIMER_INVALID_HANDLE;
+    }
+    if(queue_id >= MAX_MESSAGE_QUEUES || !s_queues[queue_id].is_active) return 1;
+    init_timer_wheel();
+    portENTER_CRITICAL(&s_timer_lock);
+    uint8_t entry_index = s_timer_free_head;
+    if(entry_index == MSG_TIMER_NO_ENTRY)
+    {
+        portEXIT_CRITICAL(&s_timer_lock);
+        return 2;
+    }
+    delayed_message_t* entry = &s_delayed_messages[entry_index];
+    s_timer_free_head = entry->next;
+    if(due_tick <= s_timer_wheel_tick)
+    {
+        due_tick = s_timer_wheel_tick + 1;
+    }
+    entry->message_info = *message_info;
+    entry->queue_id = queue_id;
+    entry->rounds = (uint32_t) ((due_tick - s_timer_wheel_tick - 1) / MSG_TIMER_WHEEL_SLOTS);
+    entry->is_pending = true;
+    link_delayed_message((uint8_t) (due_tick & (MSG_TIMER_WHEEL_SLOTS - 1)), entry_index);
+    s_delayed_count++;
+    if(timer_handle != NULL)
+    {
+        *timer_handle = ((msg_timer_handle_t) entry->generation << 8) | (entry_index + 1);
+    }
+    portEXIT_CRITICAL(&s_timer_lock);
+    //a wheel still being started has no wake queue yet, its task looks at the lists before it first sleeps
+    QueueHandle_t wake_queue = __atomic_load_n(&s_timer_wake_queue, __ATOMIC_ACQUIRE);
+    if(wake_queue != NULL)
+    {
+        uint8_t wake = 0;
+        xQueueSend(wake_queue, &wake, ( TickType_t ) 0);
+    }
+    return 0;
+}
+
+static void advance_timer_wheel(void)
+{
+    uint64_t now_tick = ((uint64_t) esp_timer_get_time() / 1000) / MSG_TIMER_TICK_MS;
+    while(s_timer_wheel_tick < now_tick)
+    {
+        //catch up one tick at a time so a late wakeup still visits every slot it slept through
+        portENTER_CRITICAL(&s_timer_lock);
+        s_timer_wheel_tick++;
+        uint8_t entry_index = s_timer_lists[s_timer_wheel_tick & (MSG_TIMER_WHEEL_SLOTS - 1)];
+        while(entry_index != MSG_TIMER_NO_ENTRY)
+        {
+            delayed_message_t* entry = &s_delayed_messages[entry_index];
+            uint8_t next_index = entry->next;
+            if(entry->rounds == 0)
+            {
+                unlink_delayed_message(entry_index);
+                link_delayed_message(MSG_TIMER_DUE_LIST, entry_index);
+            }
+            else
+            {
+                entry->rounds--;
+            }
+            entry_index = next_index;
+        }
+        portEXIT_CRITICAL(&s_timer_lock);
+        //queue sends cannot happen inside the critical section, so due messages go out one at a time
+        while(true)
+        {
+            uint8_t queue_id;
+            message_info_t message_info;
+            bool was_due = false;
+            portENTER_CRITICAL(&s_timer_lock);
+            if(s_timer_lists[MSG_TIMER_DUE_LIST] != MSG_TIMER_NO_ENTRY)
+            {
+                was_due = take_delayed_message(s_timer_lists[MSG_TIMER_DUE_LIST], &queue_id, &message_info);
+            }
+            portEXIT_CRITICAL(&s_timer_lock);
+            if(!was_due) break;
+            if(send_message(&s_queues[queue_id], &message_info))
+            {
+                discard_message(&message_info);
+            }
+        }
+    }
+}
+
+static TickType_t get_timer_wait(void)
+{
+    uint64_t ticks_ahead = 1;
+    portENTER_CRITICAL(&s_timer_lock);
+    uint8_t delayed_count = s_delayed_count;
+    uint64_t wheel_tick = s_timer_wheel_tick;
+    //sleep straight through empty slots
+    while(ticks_ahead < MSG_TIMER_WHEEL_SLOTS && s_timer_lists[(wheel_tick + ticks_ahead) & (MSG_TIMER_WHEEL_SLOTS - 1)] == MSG_TIMER_NO_ENTRY)
+    {
+        ticks_ahead++;
+    }
+    portEXIT_CRITICAL(&s_timer_lock);
+    if(delayed_count == 0) return portMAX_DELAY;
+    uint64_t now_ms = (uint64_t) esp_timer_get_time() / 1000;
+    uint64_t wake_ms = (wheel_tick + ticks_ahead) * MSG_TIMER_TICK_MS;
+    if(wake_ms <= now_ms) return 0;
+    return (TickType_t) ((wake_ms - now_ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS);
+}
+
+//call with s_timer_lock held. Frees the entry and copies out what it held, false if it was not pending.
+static bool take_delayed_message(uint8_t entry_index, uint8_t* queue_id, message_info_t* message_info)
+{
+    delayed_message_t* entry = &s_delayed_messages[entry_index];
+    if(!entry->is_pending) return false;
+    unlink_delayed_message(entry_index);
+    *queue_id = entry->queue_id;
+    *message_info = entry->message_info;
+    entry->is_pending = false;
+    entry->generation++;
+    entry->next = s_timer_free_head;
+    s_timer_free_head = entry_index;
+    s_delayed_count--;
+    return true;
+}
+
+//call with s_timer_lock held. Appends so messages due on the same tick keep their send order.
+static void link_delayed_message(uint8_t list, uint8_t entry_index)
+{
+    s_delayed_messages[entry_index].list = list;
+    s_delayed_messages[entry_index].next = MSG_TIMER_NO_ENTRY;
+    uint8_t* link = &s_timer_lists[list];
+    while(*link != MSG_TIMER_NO_ENTRY)
+    {
+        link = &s_delayed_messages[*link].next;
+    }
+    *link = entry_index;
+}
+
+//call with s_timer_lock held
+static void unlink_delayed_message(uint8_t entry_index)
+{
+    uint8_t* link = &s_timer_lists[s_delayed_messages[entry_index].list];
+    while(*link != MSG_TIMER_NO_ENTRY)
+    {
+        if(*link == entry_index)
+        {
+            *link = s_delayed_messages[entry_index].next;
+            return;
+        }
+        link = &s_delayed_messages[*link].next;
+    }
+}
+
+static void clear_delayed_messages(void)
+{
+    if(!__atomic_load_n(&s_timer_wheel_started, __ATOMIC_ACQUIRE)) return;
+    for(uint8_t entry_iter = 0; entry_iter < MAX_DELAYED_MESSAGES; entry_iter++)
+    {
+        uint8_t queue_id;
+        message_info_t message_info;
+        portENTER_CRITICAL(&s_timer_lock);
+        bool was_pending = take_delayed_message(entry_iter, &queue_id, &message_info);
+        portEXIT_CRITICAL(&s_timer_lock);
+        if(was_pending)
+        {
+            discard_message(&message_info);
+        }
+    }
+}
+
+static void complete_request(queue_context_t* queue, message_info_t* message_info)
+{
+    pending_request_t request;
+    if(!take_pending_request(message_info->request_id, &request))
+    {
+        //answered already, this is the timeout or a second response
+        return;
+    }
+    if(message_info->message_type != MSG_RPC_TIMEOUT)
+    {
+        cancel_delayed_message(request.timeout_handle);
+    }
+    msg_trace_record(MSG_TRACE_HANDLER_START, queue->queue_id, MSG_RPC_RESPONSE_HANDLE, message_info->message_type);
+    (*(request.callback))(request.request_id, message_info->message_type, message_info->message_data, message_info->message_size, request.context);
+    msg_trace_record(MSG_TRACE_HANDLER_END, queue->queue_id, MSG_RPC_RESPONSE_HANDLE, message_info->message_type);
+}
+
+//frees the pending entry of request_id, copying it to request if that is not NULL
+static bool take_pending_request(uint16_t request_id, pending_request_t* request)
+{
+    bool was_pending = false;
+    portENTER_CRITICAL(&s_request_lock);
+    for(uint8_t request_iter = 0; request_iter < MAX_PENDING_REQUESTS; request_iter++)
+    {
+        if(s_pending_requests[request_iter].is_pending && s_pending_requests[request_iter].request_id == request_id)
+        {
+            if(request != NULL)
+            {
+                *request = s_pending_requests[request_iter];
+            }
+            s_pending_requests[request_iter].is_pending = false;
+            was_pending = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_request_lock);
+    return was_pending;
+}
+
+static void clear_pending_requests(uint8_t reply_queue_id)
+{
+    for(uint8_t request_iter = 0; request_iter < MAX_PENDING_REQUESTS; request_iter++)
+    {
+        msg_timer_handle_t timeout_handle = MSG_TIMER_INVALID_HANDLE;
+        portENTER_CRITICAL(&s_request_lock);
+        if(s_pending_requests[request_iter].is_pending && s_pending_requests[request_iter].reply_queue_id == reply_queue_id)
+        {
+            timeout_handle = s_pending_requests[request_iter].timeout_handle;
+            s_pending_requests[request_iter].is_pending = false;
+        }
+        portEXIT_CRITICAL(&s_request_lock);
+        cancel_delayed_message(timeout_handle);
+    }
 }
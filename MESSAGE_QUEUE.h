@@ -3,29 +3,222 @@
 
 #include <stdbool.h>
 
+#ifdef FUNCTIONAL_TESTS
+#include "mocked_functions.h"
+#else
+#include "freertos/FreeRTOS.h"
+#endif
+
 #define MESSAGE_QUEUE_LENGTH 100
 
+// Payloads up to this many bytes can travel inside the message itself, see set_message_inline_payload.
+// Every queue slot carries this much space, so raising it grows every queue.
+#ifndef MSG_INLINE_PAYLOAD_SIZE
+#define MSG_INLINE_PAYLOAD_SIZE 16
+#endif
+
+// Queue ids. The normal and priority queues keep fixed ids, queues made with
+// create_message_queue take the remaining slots.
+#define MAX_MESSAGE_QUEUES 4
+#define MSG_QUEUE_NORMAL 0
+#define MSG_QUEUE_PRIORITY 1
+#define MSG_QUEUE_INVALID 0xFF
+#define MSG_QUEUE_NAME_MAX 16
+#define MSG_QUEUE_NO_AFFINITY -1
+
+// Component handles run from 0 to MAX_COMPONENT_REGISTRATIONS - 1, so they can index tables.
+#define MAX_COMPONENT_REGISTRATIONS 10
+
+// Upper limit on how many messages a queue task dispatches per wakeup.
+#define MAX_QUEUE_BATCH_SIZE 32
+
+// Dispatch latency histogram. Bucket 0 counts latencies under 64 us, each bucket after
+// that doubles the upper bound and the last bucket counts everything slower.
+#define QUEUE_LATENCY_BUCKETS 12
+#define QUEUE_LATENCY_BUCKET_0_SHIFT 6
+
+// Payload pool size classes. Pointer messages get their payload from here
+// instead of the heap so the queues never fragment it.
+#define MSG_POOL_SMALL_BLOCK_SIZE 32
+#define MSG_POOL_SMALL_BLOCK_COUNT 32
+#define MSG_POOL_MEDIUM_BLOCK_SIZE 128
+#define MSG_POOL_MEDIUM_BLOCK_COUNT 16
+#define MSG_POOL_LARGE_BLOCK_SIZE 1024
+#define MSG_POOL_LARGE_BLOCK_COUNT 8
+
+// Message type masks for filtered subscriptions. Types 31 and above all share bit 31.
+#define MSG_TYPE_BIT(message_type) (((message_type) < 31) ? (1UL << (message_type)) : (1UL << 31))
+#define MSG_TYPE_MASK_ALL 0xFFFFFFFFUL
+
+// Reserved component handles for ring doorbell and coalesce marker messages, never handed out to components.
+#define MSG_RING_DOORBELL_HANDLE 0xFF
+#define MSG_COALESCE_MARKER_HANDLE 0xFE
+
+// Number of (component, message type) pairs per queue that can have a non default overflow policy.
+#define MAX_OVERFLOW_POLICIES 8
+
+// Deferred handlers run on a shared pool of worker tasks instead of the queue task.
+// Worker tasks are named msg_worker_0, msg_worker_1 and so on, each with a queue of MSG_WORKER_QUEUE_LENGTH jobs.
+#define MSG_WORKER_COUNT 2
+#define MSG_WORKER_QUEUE_LENGTH 32
+
+// Pipeline tracing. A stage is a (component, message type) pair, timed from the origin of the
+// trace every time a traced message of that kind is dispatched or a handler marks the stage.
+#define MAX_TRACE_STAGES 8
+#define MSG_TRACE_NONE 0
+
+// Delayed delivery. Every delayed message sits on one timing wheel serviced by the msg_timer task,
+// delays are rounded up to whole ticks so nothing is ever sent early. Slots must be a power of 2.
+#define MSG_TIMER_TICK_MS 10
+#define MSG_TIMER_WHEEL_SLOTS 32
+#define MAX_DELAYED_MESSAGES 32
+#define MSG_TIMER_INVALID_HANDLE 0
+
+// Request/response. A request is an ordinary message carrying a request id, whichever handler serves it
+// answers with send_response, straight away or later from any task, and the requester's callback runs
+// on the reply queue task. MSG_RPC_TIMEOUT is the status callbacks see when no response came in time.
+#define MAX_PENDING_REQUESTS 16
+#define MSG_REQUEST_NONE 0
+#define MSG_RPC_TIMEOUT 0xFF
+#define MSG_RPC_RESPONSE_HANDLE 0xFD
+
 typedef uint8_t component_handle_t;
 
 typedef uint8_t callback_handle_t;
 
+typedef uint16_t msg_timer_handle_t;
+
+typedef void (*msg_response_callback_t)(uint16_t request_id, uint8_t status, void* response_data, size_t response_size, void* context);
+
 typedef struct
 {
     void* message_data;
     size_t message_size;
     bool is_pointer;
+    bool is_inline; //payload is in inline_payload, handlers get message_data pointing at the queue's copy
     component_handle_t component_handle;
     uint8_t message_type; //message_type should be casted from an enum
+    uint32_t enqueue_time_us; //set by the queue on send, low 32 bits of esp_timer_get_time()
+    uint16_t trace_id; //MSG_TRACE_NONE, or the trace this message belongs to
+    uint16_t request_id; //MSG_REQUEST_NONE, set by send_request
+    uint32_t origin_time_us; //when the trace was started, only valid with a trace id
+    uint8_t inline_payload[MSG_INLINE_PAYLOAD_SIZE];
 } message_info_t;
 
+// Single producer, single consumer ring for timer and ISR producers. The producer
+// only writes head and the consumer only writes tail, so neither side takes a lock.
+// The dispatch task of queuetype is the consumer. An ISR producer publishes with
+// msg_ring_publish_from_isr and must be the only producer of its ring.
+typedef struct
+{
+    message_info_t* slots;
+    uint32_t capacity; //must be a power of 2
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    volatile uint32_t doorbell_pending;
+    uint32_t dropped;
+    uint8_t queuetype;
+} msg_ring_t;
+
+typedef struct
+{
+    const char* name; //dispatch task name, copied and truncated to MSG_QUEUE_NAME_MAX
+    uint16_t depth;
+    uint8_t task_priority;
+    uint32_t stack_size;
+    int8_t core_id; //MSG_QUEUE_NO_AFFINITY lets the scheduler pick a core
+} msg_queue_config_t;
+
+#define MSG_OVERFLOW_BACKLOG 4 //pending messages kept per (component, type) under MSG_OVERFLOW_DROP_OLDEST
+
+typedef enum
+{
+    MSG_OVERFLOW_DROP_NEWEST, //default, a send to a full queue fails
+    MSG_OVERFLOW_DROP_OLDEST, //a send to a full queue or full backlog evicts the oldest pending message of the same type, never another component's
+    MSG_OVERFLOW_COALESCE, //only the latest pending instance is kept, earlier ones are replaced
+} msg_overflow_policy_t;
+
+typedef enum
+{
+    MSG_POOL_SMALL,
+    MSG_POOL_MEDIUM,
+    MSG_POOL_LARGE,
+    MSG_POOL_CLASS_MAX,
+} msg_pool_class_t;
+
+typedef struct
+{
+    size_t block_size;
+    uint16_t block_count;
+    uint16_t blocks_in_use;
+    uint16_t high_water_mark;
+    uint32_t acquire_count;
+    uint32_t exhausted_count; //failed acquires that ended on this class
+} msg_pool_stats_t;
+
+typedef struct
+{
+    uint8_t batch_size;
+    uint32_t wakeups;
+    uint32_t messages_dispatched;
+    uint16_t average_batch_x100; //messages per wakeup, times 100
+} queue_batch_stats_t;
+
+typedef struct
+{
+    uint32_t enqueued;
+    uint32_t dropped; //sends refused because the queue was full
+    uint32_t evicted; //pending messages of the same type dropped to make room under MSG_OVERFLOW_DROP_OLDEST
+    uint32_t coalesced; //pending messages replaced by a newer one under MSG_OVERFLOW_COALESCE
+    uint32_t deferred; //deferred handler calls handed to the worker pool
+    uint32_t deferred_dropped; //deferred handler calls skipped because the worker queue was full
+    uint16_t depth_high_water;
+    uint32_t max_latency_us;
+    uint32_t latency_histogram[QUEUE_LATENCY_BUCKETS]; //enqueue to callback time
+} queue_stats_t;
+
+typedef struct
+{
+    component_handle_t component_handle;
+    uint8_t message_type;
+    uint32_t count;
+    uint64_t total_latency_us;
+    uint32_t max_latency_us;
+    uint16_t last_trace_id; //latest frame through this stage
+    uint32_t last_latency_us;
+} msg_trace_stage_stats_t;
+
 void MESSAGE_QUEUE_INIT(void);
 
 void PRIORITY_MESSAGE_QUEUE_INIT(void);
 
+// Creates a queue with its own dispatch task. Returns 1 for a bad config and 2 if every queue slot is taken.
+uint8_t create_message_queue(const msg_queue_config_t* config, uint8_t* queue_id);
+
+// Sets up the payload pool free lists. Called by both queue inits, only runs once.
+void MESSAGE_POOL_INIT(void);
+
 void uninit_queue(uint8_t queuetype);
 
 bool check_is_queue_active(uint8_t queuetype);
 
+// Sets how many pending messages the queue task drains back to back per wakeup.
+// 1 dispatches one message per wakeup. Returns 1 for an invalid queue or size.
+uint8_t set_queue_batch_size(uint8_t queuetype, uint8_t batch_size);
+
+uint8_t get_queue_batch_stats(uint8_t queuetype, queue_batch_stats_t* stats);
+
+uint8_t get_queue_stats(uint8_t queuetype, queue_stats_t* stats);
+
+// Clears the health counters, latency histogram and batch counters of a queue.
+uint8_t reset_queue_stats(uint8_t queuetype);
+
+// Sets the overflow policy for one message type of a component. Policies are dropped with the
+// component handle. Messages held under the old policy beyond what the new one keeps are released,
+// so switching to coalesce keeps only the newest one. Returns 1 for invalid arguments and 2 if the
+// policy table is full.
+uint8_t set_message_overflow_policy(uint8_t queuetype, component_handle_t handle, uint8_t message_type, msg_overflow_policy_t policy);
+
 uint8_t clear_all_handles(void);
 
 uint8_t create_handle_for_component(component_handle_t* handle);
@@ -36,12 +229,142 @@ callback_handle_t register_component_handler_for_messages(void (*func_ptr)(compo
 
 uint8_t unregister_component_handler_for_messages(component_handle_t handle, callback_handle_t function_handle);
 
+// Same as register_component_handler_for_messages, but the handler is only called for
+// message types whose MSG_TYPE_BIT is set in type_mask.
+callback_handle_t register_component_handler_for_message_types(void (*func_ptr)(component_handle_t, uint8_t, void*, size_t), component_handle_t handle, uint32_t type_mask);
+
 uint8_t send_message_to_normal_queue(message_info_t message_info);
 
 callback_handle_t register_priority_handler_for_messages(void (*func_ptr)(component_handle_t, uint8_t, void*, size_t), component_handle_t handle);
 
 uint8_t unregister_priority_handler_for_messages(component_handle_t handle, callback_handle_t function_handle);
 
+callback_handle_t register_priority_handler_for_message_types(void (*func_ptr)(component_handle_t, uint8_t, void*, size_t), component_handle_t handle, uint32_t type_mask);
+
+// Deferred versions of the filtered registrations. The queue task hands each matching message
+// to the worker pool and moves on, so a slow handler such as console output never holds up the
+// other handlers on the queue. Pool payloads stay retained until the worker has run the handler and
+// inline payloads are copied into the job. Heap payloads and raw pointers to the sender's memory cannot
+// be kept past the dispatch, so for those messages the handler is still called on the queue task.
+// Every deferred call of one handler function goes to the same worker, so those calls never overlap
+// and run in dispatch order, across components and queues. Different handlers may run at once, and
+// calls that fall back to the queue task are not ordered against the deferred ones.
+// Unregister with the normal unregister calls.
+callback_handle_t register_component_deferred_handler_for_message_types(void (*func_ptr)(component_handle_t, uint8_t, void*, size_t), component_handle_t handle, uint32_t type_mask);
+
+callback_handle_t register_priority_deferred_handler_for_message_types(void (*func_ptr)(component_handle_t, uint8_t, void*, size_t), component_handle_t handle, uint32_t type_mask);
+
 uint8_t send_message_to_priority_queue(message_info_t message_info);
 
+// Queue id based versions of the calls above, usable with any queue.
+callback_handle_t register_queue_handler_for_message_types(uint8_t queue_id, void (*func_ptr)(component_handle_t, uint8_t, void*, size_t), component_handle_t handle, uint32_t type_mask);
+
+callback_handle_t register_queue_deferred_handler_for_message_types(uint8_t queue_id, void (*func_ptr)(component_handle_t, uint8_t, void*, size_t), component_handle_t handle, uint32_t type_mask);
+
+uint8_t unregister_queue_handler_for_messages(uint8_t queue_id, component_handle_t handle, callback_handle_t function_handle);
+
+uint8_t send_message_to_queue(uint8_t queue_id, message_info_t message_info);
+
+// Wildcard handlers see the messages of every component on the queue, after that component's own
+// handlers. The sender's handle is passed as the first argument so bridges need no lookup.
+callback_handle_t register_wildcard_handler_for_message_types(uint8_t queue_id, void (*func_ptr)(component_handle_t, uint8_t, void*, size_t), uint32_t type_mask);
+
+callback_handle_t register_wildcard_deferred_handler_for_message_types(uint8_t queue_id, void (*func_ptr)(component_handle_t, uint8_t, void*, size_t), uint32_t type_mask);
+
+uint8_t unregister_wildcard_handler_for_messages(uint8_t queue_id, callback_handle_t function_handle);
+
+// Storage must hold capacity messages and outlive the ring. Returns 1 if capacity is not a power of 2.
+uint8_t msg_ring_init(msg_ring_t* ring, message_info_t* storage, uint32_t capacity, uint8_t queuetype);
+
+// Producer side, safe from an ISR. Returns 1 if the ring is full.
+uint8_t msg_ring_push(msg_ring_t* ring, message_info_t message_info);
+
+// Consumer side. Returns 1 if the ring is empty.
+uint8_t msg_ring_pop(msg_ring_t* ring, message_info_t* message_info);
+
+// Pushes the message and wakes the dispatch task. Only the first publish after the
+// dispatch task drains the ring sends a doorbell message through the queue.
+// Task context only. Returns 1 if the ring is full and 2 if the queue is inactive.
+uint8_t msg_ring_publish(msg_ring_t* ring, message_info_t message_info);
+
+// msg_ring_publish for ISRs. The doorbell goes out with xQueueSendFromISR, and the caller
+// passes higher_priority_task_woken on to portYIELD_FROM_ISR. Same return values.
+// Runs from flash, so it is not safe from ISRs registered with ESP_INTR_FLAG_IRAM.
+uint8_t msg_ring_publish_from_isr(msg_ring_t* ring, message_info_t message_info, BaseType_t* higher_priority_task_woken);
+
+// Copies a small payload into the message so it is queued by value, with no pool block and nothing
+// for the sender to keep alive. The data handlers see is only valid during their callback.
+// Returns 1 if payload_size is larger than MSG_INLINE_PAYLOAD_SIZE.
+uint8_t set_message_inline_payload(message_info_t* message_info, const void* payload, size_t payload_size);
+
+// Returns a pool block of at least payload_size bytes, or NULL if the pool is exhausted.
+// A full small class spills into the medium one, but only requests larger than the medium blocks get a large block.
+// Messages carrying these blocks must set is_pointer so the queue releases them after dispatch.
+void* acquire_message_payload(size_t payload_size);
+
+// Pool blocks are reference counted. acquire hands out one reference, and sending the block
+// as a pointer message passes that reference to the queue, which drops it after dispatch.
+// A handler that wants the payload past its callback retains it and releases it when done.
+// Returns 1 if the pointer does not belong to the pool, 2 if the block is free or the count is saturated.
+uint8_t retain_message_payload(void* payload);
+
+// Drops one reference, the block goes back to the pool with the last one.
+// Returns 1 if the pointer does not belong to the pool and 2 if the block is already free.
+uint8_t release_message_payload(void* payload);
+
+// Returns 0 for free blocks and pointers outside the pool.
+uint8_t get_message_payload_ref_count(void* payload);
+
+uint8_t get_message_pool_stats(msg_pool_class_t pool_class, msg_pool_stats_t* stats);
+
+// Gives the message a new trace id and stamps the trace origin. Call where the sample is taken.
+uint16_t start_message_trace(message_info_t* message_info);
+
+// Copies the trace of the message queuetype is dispatching into a derived message, or clears
+// it if that queue is not dispatching a traced message. Only valid from a handler on that
+// queue task, deferred handlers run outside the dispatch and never see a trace.
+void inherit_message_trace(uint8_t queuetype, message_info_t* message_info);
+
+// Records a stage for the trace queuetype is dispatching, for work that ends without sending a message.
+// Returns 1 if no traced message is being dispatched and 2 if the stage table is full.
+uint8_t mark_trace_stage(uint8_t queuetype, component_handle_t handle, uint8_t message_type);
+
+// Stages are numbered in the order they were first seen. Returns 1 past the last stage.
+uint8_t get_trace_stage_stats(uint8_t stage_index, msg_trace_stage_stats_t* stats);
+
+void reset_trace_stats(void);
+
+// Sends the message to queue_id once delay_ms has passed. The wheel owns pool payloads from here on,
+// the same as a queue would. timer_handle may be NULL if the message is never cancelled.
+// Returns 1 if the queue is inactive and 2 if every delayed message slot is in use.
+uint8_t send_message_after(uint8_t queue_id, message_info_t message_info, uint32_t delay_ms, msg_timer_handle_t* timer_handle);
+
+// Same as send_message_after, at an esp_timer_get_time based time in ms. Past times go out on the next tick.
+uint8_t send_message_at(uint8_t queue_id, message_info_t message_info, uint64_t time_ms, msg_timer_handle_t* timer_handle);
+
+// Drops a delayed message before it is sent and releases its pool payload.
+// Returns 1 if the message was already sent or cancelled.
+uint8_t cancel_delayed_message(msg_timer_handle_t timer_handle);
+
+uint8_t get_delayed_message_count(void);
+
+// Sends message_info to queue_id as a request. callback gets the response on reply_queue_id's task, or
+// MSG_RPC_TIMEOUT once timeout_ms has passed without one. A timeout of 0 waits for as long as it takes.
+// The request always takes over the payload, a pool payload is released on every failure the same as
+// when a send to a full queue fails, so the caller never releases it after calling this.
+// Returns 1 for a missing callback or inactive queue, 2 if MAX_PENDING_REQUESTS are outstanding
+// and 3 if the request or its timeout could not be queued.
+uint8_t send_request(uint8_t queue_id, message_info_t message_info, uint8_t reply_queue_id, msg_response_callback_t callback, void* context, uint32_t timeout_ms, uint16_t* request_id);
+
+// Request id of the message queuetype is dispatching, MSG_REQUEST_NONE for plain messages.
+// Same rules as inherit_message_trace, servers keep the id to respond after their handler returns.
+uint16_t get_dispatch_request_id(uint8_t queuetype);
+
+// Answers a request, status is normally the return code of the work that was asked for and may not be
+// MSG_RPC_TIMEOUT. The response data is copied, so it can be at most MSG_INLINE_PAYLOAD_SIZE bytes.
+// If the reply queue is full, a request with a timeout is left to time out and one without is dropped.
+// Returns 1 if the request is unknown or already answered or timed out, 2 if the status is MSG_RPC_TIMEOUT
+// or the response is too large and 3 if the reply queue is full.
+uint8_t send_response(uint16_t request_id, uint8_t status, const void* response_data, size_t response_size);
+
 #endif
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <string.h>
+
+#ifdef FUNCTIONAL_TESTS
+#include "mocked_functions.h"
+#else
+#include "esp_cpu.h"
+#include "sdkconfig.h"
+#endif
+
+#include "MSG_TRACE.h"
+
+#ifdef FUNCTIONAL_TESTS
+#define MSG_TRACE_CYCLES_PER_US 1000
+#else
+#define MSG_TRACE_CYCLES_PER_US CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ
+#endif
+
+static void encode_header(uint8_t* header);
+static void encode_event(uint8_t* encoded, const msg_trace_event_t* event);
+static uint32_t get_first_event(void);
+
+static msg_trace_event_t s_trace_events[MSG_TRACE_EVENT_COUNT];
+//runs freely and is masked on access, so it also counts every event ever recorded
+static volatile uint32_t s_trace_head = 0;
+static volatile bool s_trace_enabled = true;
+
+void msg_trace_record(msg_trace_event_type_t event_type, uint8_t lane, uint8_t component_handle, uint8_t message_type)
+{
+    if(!s_trace_enabled) return;
+    //each writer claims its own slot, a reader can only see a torn event while recording is on
+    uint32_t slot = __atomic_fetch_add(&s_trace_head, 1, __ATOMIC_RELAXED);
+    msg_trace_event_t* event = &s_trace_events[slot & (MSG_TRACE_EVENT_COUNT - 1)];
+    event->cycles = esp_cpu_get_cycle_count();
+    event->event_type = (uint8_t) event_type;
+    event->lane = lane;
+    event->component_handle = component_handle;
+    event->message_type = message_type;
+}
+
+void msg_trace_enable(bool enable)
+{
+    s_trace_enabled = enable;
+}
+
+bool msg_trace_is_enabled(void)
+{
+    return s_trace_enabled;
+}
+
+void msg_trace_clear(void)
+{
+    __atomic_store_n(&s_trace_head, 0, __ATOMIC_SEQ_CST);
+}
+
+size_t msg_trace_get_blob_size(void)
+{
+    uint32_t head = __atomic_load_n(&s_trace_head, __ATOMIC_ACQUIRE);
+    return MSG_TRACE_HEADER_SIZE + ((head - get_first_event()) * MSG_TRACE_EVENT_SIZE);
+}
+
+size_t msg_trace_serialize(uint8_t* out, size_t out_size, size_t blob_offset)
+{
+    uint8_t encoded[MSG_TRACE_HEADER_SIZE];
+    size_t blob_size = msg_trace_get_blob_size();
+    uint32_t first_event = get_first_event();
+    size_t copied = 0;
+    if(out == NULL) return 0;
+    while(copied < out_size && blob_offset < blob_size)
+    {
+        //encode the header or event under blob_offset and copy as much of it as fits
+        size_t piece_offset;
+        size_t piece_size;
+        if(blob_offset < MSG_TRACE_HEADER_SIZE)
+        {
+            encode_header(encoded);
+            piece_offset = blob_offset;
+            piece_size = MSG_TRACE_HEADER_SIZE;
+        }
+        else
+        {
+            size_t event_offset = blob_offset - MSG_TRACE_HEADER_SIZE;
+            uint32_t slot = first_event + (uint32_t) (event_offset / MSG_TRACE_EVENT_SIZE);
+            encode_event(encoded, &s_trace_events[slot & (MSG_TRACE_EVENT_COUNT - 1)]);
+            piece_offset = event_offset % MSG_TRACE_EVENT_SIZE;
+            piece_size = MSG_TRACE_EVENT_SIZE;
+        }
+        size_t copy_size = piece_size - piece_offset;
+        if(copy_size > out_size - copied)
+        {
+            copy_size = out_size - copied;
+        }
+        memcpy(out + copied, encoded + piece_offset, copy_size);
+        copied += copy_size;
+        blob_offset += copy_size;
+    }
+    return copied;
+}
+
+static void encode_header(uint8_t* header)
+{
+    uint32_t head = __atomic_load_n(&s_trace_head, __ATOMIC_ACQUIRE);
+    uint16_t event_count = (uint16_t) (head - get_first_event());
+    header[0] = MSG_TRACE_BLOB_MAGIC & 0xFF;
+    header[1] = (MSG_TRACE_BLOB_MAGIC >> 8) & 0xFF;
+    header[2] = (MSG_TRACE_BLOB_MAGIC >> 16) & 0xFF;
+    header[3] = (MSG_TRACE_BLOB_MAGIC >> 24) & 0xFF;
+    header[4] = MSG_TRACE_BLOB_VERSION;
+    header[5] = MSG_TRACE_EVENT_SIZE;
+    header[6] = MSG_TRACE_CYCLES_PER_US & 0xFF;
+    header[7] = (MSG_TRACE_CYCLES_PER_US >> 8) & 0xFF;
+    header[8] = event_count & 0xFF;
+    header[9] = (event_count >> 8) & 0xFF;
+    header[10] = 0;
+    header[11] = 0;
+    header[12] = head & 0xFF;
+    header[13] = (head >> 8) & 0xFF;
+    header[14] = (head >> 16) & 0xFF;
+    header[15] = (head >> 24) & 0xFF;
+}
+
+static void encode_event(uint8_t* encoded, const msg_trace_event_t* event)
+{
+    encoded[0] = event->cycles & 0xFF;
+    encoded[1] = (event->cycles >> 8) & 0xFF;
+    encoded[2] = (event->cycles >> 16) & 0xFF;
+    encoded[3] = (event->cycles >> 24) & 0xFF;
+    encoded[4] = event->event_type;
+    encoded[5] = event->lane;
+    encoded[6] = event->component_handle;
+    encoded[7] = event->message_type;
+}
+
+static uint32_t get_first_event(void)
+{
+    uint32_t head = __atomic_load_n(&s_trace_head, __ATOMIC_ACQUIRE);
+    return (head > MSG_TRACE_EVENT_COUNT) ? head - MSG_TRACE_EVENT_COUNT : 0;
+}
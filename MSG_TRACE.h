@@ -0,0 +1,59 @@
+#ifndef H_MSG_TRACE
+#define H_MSG_TRACE
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Number of events the recorder keeps, older events are overwritten. Must be a power of 2.
+#define MSG_TRACE_EVENT_COUNT 512
+
+// Dump format: a 16 byte header followed by the events oldest first, all little endian.
+//   header: magic (4), version (1), event size (1), cycles per us (2), event count (2), reserved (2), total recorded (4)
+//   event: cycle count (4), event type (1), lane (1), component handle (1), message type (1)
+#define MSG_TRACE_BLOB_MAGIC 0x4352544DUL //"MTRC"
+#define MSG_TRACE_BLOB_VERSION 1
+#define MSG_TRACE_HEADER_SIZE 16
+#define MSG_TRACE_EVENT_SIZE 8
+
+// Lanes group events by task. The dispatch task of queue n records on lane n and
+// worker n on MSG_TRACE_WORKER_LANE + n. Sends are recorded on the lane of the target queue.
+#define MSG_TRACE_WORKER_LANE 0x10
+
+typedef enum
+{
+    MSG_TRACE_ENQUEUE,
+    MSG_TRACE_DEQUEUE,
+    MSG_TRACE_HANDLER_START,
+    MSG_TRACE_HANDLER_END,
+    MSG_TRACE_DROP,
+    MSG_TRACE_EVENT_TYPE_MAX,
+} msg_trace_event_type_t;
+
+typedef struct
+{
+    uint32_t cycles; //cpu cycle counter of the recording core
+    uint8_t event_type;
+    uint8_t lane;
+    uint8_t component_handle;
+    uint8_t message_type;
+} msg_trace_event_t;
+
+// Safe from any task or ISR, never blocks.
+void msg_trace_record(msg_trace_event_type_t event_type, uint8_t lane, uint8_t component_handle, uint8_t message_type);
+
+// Recording is on from boot. Pause it while dumping so the ring holds still.
+void msg_trace_enable(bool enable);
+
+bool msg_trace_is_enabled(void);
+
+void msg_trace_clear(void);
+
+// Size of the dump for the events currently held.
+size_t msg_trace_get_blob_size(void);
+
+// Copies out_size bytes of the dump starting at blob_offset, so it can be written out in chunks.
+// Returns the number of bytes copied, 0 once blob_offset is past the end.
+size_t msg_trace_serialize(uint8_t* out, size_t out_size, size_t blob_offset);
+
+#endif
@@ -69,9 +69,9 @@ static void nav_algo_check_tof_array_against_map(TOF_DATA_t* tof_data);
 
 bool nav_algo_init(void)
 {
-    s_nav_tof_handle = register_priority_handler_for_messages(nav_algo_queue_handler, ToF_public_component);
-    s_nav_imu_handle = register_priority_handler_for_messages(nav_algo_queue_handler, imu_public_component);
-    if(check_is_queue_active(0))
+    s_nav_tof_handle = register_priority_handler_for_message_types(nav_algo_queue_handler, ToF_public_component, MSG_TYPE_BIT(TOF_MSG_NEW_DEPTH_ARRAY));
+    s_nav_imu_handle = register_priority_handler_for_message_types(nav_algo_queue_handler, imu_public_component, MSG_TYPE_BIT(IMU_MSG_RAW_DATA));
+    if(check_is_queue_active(MSG_QUEUE_NORMAL))
 	{
 		create_handle_for_component(&nav_algo_public_component);
 	}
@@ -193,7 +193,8 @@ static dfs_feature_details_t nav_algo_create_new_feature_with_dfs(uint8_t v_iter
     double current_diff = (double) (h_iter < tof_data->horizontal_size - 1) ? s_gradient_map.graph_points[v_iter][h_iter].h_diff : s_gradient_map.graph_points[v_iter][h_iter - 1].h_diff;
     double current_pixel_diff = (((double) (h_iter) - 4.0) * DEGREES_PER_TOF_PIXEL) + OFFSET_AT_MIDDLE_POSITION;
     //need to calculate z distance per cell using sin, then calculate slope.
-    double current_run = ((double) tof_data->depth_pixel_field[v_iter][h_iter]) * sin(DEGREES_TO_RAD * current_pixel_diff);
+    uint8_t zone = TOF_FRAME_ZONE(tof_data, v_iter, h_iter);
+    double current_run = ((double) tof_data->distance[TOF_FIRST_OBJECT][zone]) * sin(DEGREES_TO_RAD * current_pixel_diff);
     //from there, use arctan to calculate angle.
     double angle = DEGREES_TO_UINT8_T_ANGLE * RAD_TO_DEGREES * atan2(current_diff, current_run);
     dfs_feature_details_t node_details = 
@@ -204,8 +205,8 @@ static dfs_feature_details_t nav_algo_create_new_feature_with_dfs(uint8_t v_iter
         .min_y = v_iter,
         .max_y = v_iter,
         .average_angle = ((int16_t) angle & 0x00FF),
-        .average_distance = (tof_data->depth_pixel_field[v_iter][h_iter] & 0x0000FFFF),
-        .average_confidence = ((tof_data->depth_pixel_field[v_iter][h_iter] >> 24) & 0x00FF),
+        .average_distance = tof_data->distance[TOF_FIRST_OBJECT][zone],
+        .average_confidence = tof_data->confidence[TOF_FIRST_OBJECT][zone],
     };
     s_gradient_map.graph_points[v_iter][h_iter].visited = true;
     //for vertical angle, we only want to add if the angle is flat.
@@ -257,18 +258,21 @@ static feature_extraction_t nav_algo_feature_extraction_from_tof_data(TOF_DATA_t
     return_features_list.number_of_features = 0;
     //as all features are considered to be planes in this design, features are extracted like so:
     //1. create a 2x2 convolution of each point to determine vertical and horizontal gradient, starting from top left
+    const uint16_t* distance = tof_data->distance[TOF_FIRST_OBJECT];
+    uint8_t row_stride = tof_data->horizontal_size;
     for(uint8_t v_iter = 0; v_iter < tof_data->horizontal_size; v_iter++)
     {
         for(uint8_t h_iter = 0; h_iter < tof_data->horizontal_size; h_iter++)
         {
+            uint8_t zone = TOF_FRAME_ZONE(tof_data, v_iter, h_iter);
             //negative values are just very high numbers for unsigned integers, which is fine in this case
             if(v_iter < tof_data->horizontal_size - 1)
             {
-                s_gradient_map.graph_points[v_iter][h_iter].v_diff = (tof_data->depth_pixel_field[v_iter][h_iter] & 0xFFFF) - (tof_data->depth_pixel_field[v_iter + 1][h_iter] & 0xFFFF);
+                s_gradient_map.graph_points[v_iter][h_iter].v_diff = distance[zone] - distance[zone + row_stride];
             }
             if(h_iter < tof_data->horizontal_size - 1)
             {
-                s_gradient_map.graph_points[v_iter][h_iter].h_diff = (tof_data->depth_pixel_field[v_iter][h_iter] & 0xFFFF) - (tof_data->depth_pixel_field[v_iter][h_iter + 1] & 0xFFFF);
+                s_gradient_map.graph_points[v_iter][h_iter].h_diff = distance[zone] - distance[zone + 1];
             }
             s_gradient_map.graph_points[v_iter][h_iter].visited = false;
         }
@@ -447,18 +451,24 @@ static void nav_algo_check_tof_array_against_map(TOF_DATA_t* tof_data)
         landmark_list[list_iter] = nav_algo_convert_node_details_to_landmark(features_list.node_details[list_iter]);
     }
 
-    if(s_is_debug_enabled && check_is_queue_active(0))
+    if(s_is_debug_enabled && check_is_queue_active(MSG_QUEUE_NORMAL))
     {
         //send features list to the message queue
 		message_info_t convert_feature_msg;
-        NAV_POINT_T* msg_features_list = malloc(features_list.number_of_features * sizeof(NAV_POINT_T));
-        memcpy(msg_features_list, landmark_list, features_list.number_of_features * sizeof(NAV_POINT_T));
-		convert_feature_msg.message_data = (void*) msg_features_list;
-		convert_feature_msg.message_size = features_list.number_of_features * sizeof(NAV_POINT_T);
-		convert_feature_msg.is_pointer = true;
-		convert_feature_msg.component_handle = nav_algo_public_component;
-		convert_feature_msg.message_type = NAV_RAW_FEATURE_DATA;
-		send_message_to_normal_queue(convert_feature_msg);
+        NAV_POINT_T* msg_features_list = acquire_message_payload(features_list.number_of_features * sizeof(NAV_POINT_T));
+        if(msg_features_list != NULL)
+        {
+            memcpy(msg_features_list, landmark_list, features_list.number_of_features * sizeof(NAV_POINT_T));
+            convert_feature_msg.message_data = (void*) msg_features_list;
+            convert_feature_msg.message_size = features_list.number_of_features * sizeof(NAV_POINT_T);
+            convert_feature_msg.is_pointer = true;
+            convert_feature_msg.is_inline = false;
+            convert_feature_msg.request_id = MSG_REQUEST_NONE;
+            convert_feature_msg.component_handle = nav_algo_public_component;
+            convert_feature_msg.message_type = NAV_RAW_FEATURE_DATA;
+            inherit_message_trace(MSG_QUEUE_PRIORITY, &convert_feature_msg);
+            send_message_to_normal_queue(convert_feature_msg);
+        }
     }
 
     //step 2: find 2 most confident landmarks
@@ -499,18 +509,24 @@ static void nav_algo_check_tof_array_against_map(TOF_DATA_t* tof_data)
         }
     }
 
-    if(s_is_debug_enabled && check_is_queue_active(0))
+    if(s_is_debug_enabled && check_is_queue_active(MSG_QUEUE_NORMAL))
     {
         //send transform list to the message queue
 		message_info_t transform_msg;
-        NAV_POINT_T* msg_features_list = malloc(MAX_POINTS_PER_SUBMAP * sizeof(NAV_POINT_T));
-        memcpy(msg_features_list, landmark_list, MAX_POINTS_PER_SUBMAP * sizeof(NAV_POINT_T));
-		transform_msg.message_data = (void*) msg_features_list;
-		transform_msg.message_size = MAX_POINTS_PER_SUBMAP * sizeof(NAV_POINT_T);
-		transform_msg.is_pointer = true;
-		transform_msg.component_handle = nav_algo_public_component;
-		transform_msg.message_type = NAV_RAW_FEATURE_DATA;
-		send_message_to_normal_queue(transform_msg);
+        NAV_POINT_T* msg_features_list = acquire_message_payload(MAX_POINTS_PER_SUBMAP * sizeof(NAV_POINT_T));
+        if(msg_features_list != NULL)
+        {
+            memcpy(msg_features_list, landmark_list, MAX_POINTS_PER_SUBMAP * sizeof(NAV_POINT_T));
+            transform_msg.message_data = (void*) msg_features_list;
+            transform_msg.message_size = MAX_POINTS_PER_SUBMAP * sizeof(NAV_POINT_T);
+            transform_msg.is_pointer = true;
+            transform_msg.is_inline = false;
+            transform_msg.request_id = MSG_REQUEST_NONE;
+            transform_msg.component_handle = nav_algo_public_component;
+            transform_msg.message_type = NAV_RAW_FEATURE_DATA;
+            inherit_message_trace(MSG_QUEUE_PRIORITY, &transform_msg);
+            send_message_to_normal_queue(transform_msg);
+        }
     }
 
 
@@ -544,6 +560,9 @@ static void nav_algo_check_tof_array_against_map(TOF_DATA_t* tof_data)
             s_nav_robot_position.submap_x--;
         }
     }
+
+    //end of the ToF to pose update pipeline for this frame
+    mark_trace_stage(MSG_QUEUE_PRIORITY, nav_algo_public_component, NAV_TRANSFORM_DATA);
     
     //step 5: update submap with map landmark info
 
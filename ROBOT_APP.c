@@ -76,6 +76,8 @@ void app_main(void)
 
 	//Init priority queue
 	PRIORITY_MESSAGE_QUEUE_INIT();
+	//sensor traffic arrives in bursts, drain several messages per wakeup
+	set_queue_batch_size(MSG_QUEUE_PRIORITY, 8);
 
 	UART_INIT();
 	
@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef FUNCTIONAL_TESTS
+#include "mocked_functions.h"
+#else
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#endif
+
+#include "SENSOR_SCHED.h"
+
+#define SENSOR_SCHED_PRIORITY 12 //above the queue tasks and the message timer so polls are not held up by dispatch
+#define SENSOR_SCHED_STACK_SIZE 4096
+#define SENSOR_SCHED_NO_JOB 0xFF
+
+typedef struct
+{
+    sensor_job_func_t func;
+    void* context;
+    char name[SENSOR_JOB_NAME_MAX];
+    uint32_t period_us;
+    uint32_t phase_us;
+    uint32_t budget_us;
+    int64_t next_release_us;
+    sensor_job_stats_t stats;
+    uint8_t next; //next running job in release order
+    bool is_running;
+} sensor_job_t;
+
+static void init_sensor_sched(void);
+static void sensor_sched_task(void* args);
+static void run_due_jobs(void);
+static TickType_t get_sched_wait(void);
+static void link_job(uint8_t job_index);
+static void unlink_job(uint8_t job_index);
+
+static sensor_job_t s_jobs[MAX_SENSOR_JOBS];
+static uint8_t s_job_count = 0;
+//running jobs linked earliest release first, so the task only ever looks at the head
+static uint8_t s_run_head = SENSOR_SCHED_NO_JOB;
+//every release is counted from here, which keeps the phases of different jobs lined up
+static int64_t s_sched_epoch_us = 0;
+static bool s_sched_started = false; //claimed under s_sched_lock, the wake queue and task follow after it
+static QueueHandle_t s_sched_wake_queue = NULL;
+static portMUX_TYPE s_sched_lock = portMUX_INITIALIZER_UNLOCKED;
+
+uint8_t sensor_sched_register_job(const char* name, sensor_job_func_t func, void* context, uint32_t period_ms, uint32_t phase_ms, uint32_t budget_us, sensor_job_handle_t* job)
+{
+    if(name == NULL || func == NULL || job == NULL) return 1;
+    if(period_ms == 0 || phase_ms >= period_ms) return 1;
+    init_sensor_sched();
+    portENTER_CRITICAL(&s_sched_lock);
+    if(s_job_count >= MAX_SENSOR_JOBS)
+    {
+        portEXIT_CRITICAL(&s_sched_lock);
+        return 2;
+    }
+    uint8_t job_index = s_job_count;
+    sensor_job_t* new_job = &s_jobs[job_index];
+    memset(new_job, 0, sizeof(sensor_job_t));
+    strncpy(new_job->name, name, SENSOR_JOB_NAME_MAX - 1);
+    new_job->func = func;
+    new_job->context = context;
+    new_job->period_us = period_ms * 1000;
+    new_job->phase_us = phase_ms * 1000;
+    new_job->budget_us = budget_us;
+    new_job->next = SENSOR_SCHED_NO_JOB;
+    new_job->is_running = false;
+    s_job_count++;
+    portEXIT_CRITICAL(&s_sched_lock);
+    *job = job_index;
+    return 0;
+}
+
+uint8_t sensor_sched_start_job(sensor_job_handle_t job)
+{
+    if(job >= s_job_count) return 1;
+    sensor_job_t* start_job = &s_jobs[job];
+    int64_t now_us = esp_timer_get_time();
+    portENTER_CRITICAL(&s_sched_lock);
+    if(start_job->is_running)
+    {
+        portEXIT_CRITICAL(&s_sched_lock);
+        return 0;
+    }
+    //first release of this job's phase that is still ahead
+    int64_t since_first_us = now_us - (s_sched_epoch_us + start_job->phase_us);
+    int64_t periods = (since_first_us < 0) ? 0 : (since_first_us / start_job->period_us) + 1;
+    start_job->next_release_us = s_sched_epoch_us + start_job->phase_us + (periods * start_job->period_us);
+    start_job->is_running = true;
+    link_job(job);
+    portEXIT_CRITICAL(&s_sched_lock);
+    //the task may be sleeping towards a later release. One still being started looks at the run list before it sleeps.
+    QueueHandle_t wake_queue = __atomic_load_n(&s_sched_wake_queue, __ATOMIC_ACQUIRE);
+    if(wake_queue != NULL)
+    {
+        uint8_t wake = 0;
+        xQueueSend(wake_queue, &wake, ( TickType_t ) 0);
+    }
+    return 0;
+}
+
+uint8_t sensor_sched_stop_job(sensor_job_handle_t job)
+{
+    if(job >= s_job_count) return 1;
+    portENTER_CRITICAL(&s_sched_lock);
+    if(s_jobs[job].is_running)
+    {
+        unlink_job(job);
+        s_jobs[job].is_running = false;
+    }
+    portEXIT_CRITICAL(&s_sched_lock);
+    return 0;
+}
+
+bool sensor_sched_is_job_running(sensor_job_handle_t job)
+{
+    if(job >= s_job_count) return false;
+    return s_jobs[job].is_running;
+}
+
+uint8_t sensor_sched_get_job_count(void)
+{
+    return s_job_count;
+}
+
+uint8_t sensor_sched_get_job_info(sensor_job_handle_t job, sensor_job_info_t* info)
+{
+    if(job >= s_job_count || info == NULL) return 1;
+    portENTER_CRITICAL(&s_sched_lock);
+    memcpy(info->name, s_jobs[job].name, SENSOR_JOB_NAME_MAX);
+    info->period_us = s_jobs[job].period_us;
+    info->phase_us = s_jobs[job].phase_us;
+    info->budget_us = s_jobs[job].budget_us;
+    info->is_running = s_jobs[job].is_running;
+    portEXIT_CRITICAL(&s_sched_lock);
+    return 0;
+}
+
+uint8_t sensor_sched_get_job_stats(sensor_job_handle_t job, sensor_job_stats_t* stats)
+{
+    if(job >= s_job_count || stats == NULL) return 1;
+    portENTER_CRITICAL(&s_sched_lock);
+    *stats = s_jobs[job].stats;
+    portEXIT_CRITICAL(&s_sched_lock);
+    return 0;
+}
+
+uint8_t sensor_sched_reset_job_stats(sensor_job_handle_t job)
+{
+    if(job >= s_job_count) return 1;
+    portENTER_CRITICAL(&s_sched_lock);
+    memset(&s_jobs[job].stats, 0, sizeof(sensor_job_stats_t));
+    portEXIT_CRITICAL(&s_sched_lock);
+    return 0;
+}
+
+static void init_sensor_sched(void)
+{
+    //started by the first driver that registers a job. The epoch is only set once, before any job can be linked.
+    int64_t now_us = esp_timer_get_time();
+    portENTER_CRITICAL(&s_sched_lock);
+    if(s_sched_started)
+    {
+        portEXIT_CRITICAL(&s_sched_lock);
+        return;
+    }
+    s_sched_started = true;
+    s_sched_epoch_us = now_us;
+    portEXIT_CRITICAL(&s_sched_lock);
+    __atomic_store_n(&s_sched_wake_queue, xQueueCreate(1, sizeof(uint8_t)), __ATOMIC_RELEASE);
+    xTaskCreatePinnedToCore(sensor_sched_task, "sensor_sched", SENSOR_SCHED_STACK_SIZE, NULL, SENSOR_SCHED_PRIORITY, NULL, tskNO_AFFINITY);
+}
+
+static void sensor_sched_task(void* args)
+{
+    (void) args;
+    uint8_t wake;
+    while(s_sched_wake_queue != NULL)
+    {
+        //a job started while sleeping wakes the task early in case it is due first
+        xQueueReceive(s_sched_wake_queue, &wake, get_sched_wait());
+        run_due_jobs();
+#ifdef FUNCTIONAL_TESTS
+        if(isTaskSpinningOnce())
+        {
+            break;
+        }
+#endif
+    }
+#ifndef FUNCTIONAL_TESTS
+    vTaskDelete(NULL);
+#endif
+}
+
+//runs every job whose release has passed, earliest release first. A job that fell more than a period
+//behind runs once and skips the releases it missed, so it cannot hog the bus catching up.
+static void run_due_jobs(void)
+{
+    while(true)
+    {
+        int64_t now_us = esp_timer_get_time();
+        portENTER_CRITICAL(&s_sched_lock);
+        uint8_t job_index = s_run_head;
+        if(job_index == SENSOR_SCHED_NO_JOB || s_jobs[job_index].next_release_us > now_us)
+        {
+            portEXIT_CRITICAL(&s_sched_lock);
+            return;
+        }
+        sensor_job_t* job = &s_jobs[job_index];
+        //run for the latest release that has passed, jitter is measured from that one
+        int64_t release_us = job->next_release_us;
+        uint32_t missed = 0;
+        while(release_us + job->period_us <= now_us)
+        {
+            release_us += job->period_us;
+            missed++;
+        }
+        job->next_release_us = release_us + job->period_us;
+        unlink_job(job_index);
+        link_job(job_index);
+        sensor_job_func_t func = job->func;
+        void* context = job->context;
+        portEXIT_CRITICAL(&s_sched_lock);
+
+        int64_t start_us = esp_timer_get_time();
+        (*func)(context);
+        uint32_t run_us = (uint32_t) (esp_timer_get_time() - start_us);
+        uint32_t jitter_us = (uint32_t) (start_us - release_us);
+
+        portENTER_CRITICAL(&s_sched_lock);
+        job->stats.runs++;
+        job->stats.missed += missed;
+        job->stats.last_jitter_us = jitter_us;
+        job->stats.total_jitter_us += jitter_us;
+        if(jitter_us > job->stats.max_jitter_us)
+        {
+            job->stats.max_jitter_us = jitter_us;
+        }
+        job->stats.last_run_us = run_us;
+        if(run_us > job->stats.max_run_us)
+        {
+            job->stats.max_run_us = run_us;
+        }
+        if(job->budget_us && run_us > job->budget_us)
+        {
+            job->stats.overruns++;
+        }
+        portEXIT_CRITICAL(&s_sched_lock);
+    }
+}
+
+static TickType_t get_sched_wait(void)
+{
+    portENTER_CRITICAL(&s_sched_lock);
+    bool has_job = (s_run_head != SENSOR_SCHED_NO_JOB);
+    int64_t release_us = has_job ? s_jobs[s_run_head].next_release_us : 0;
+    portEXIT_CRITICAL(&s_sched_lock);
+    if(!has_job) return portMAX_DELAY;
+    int64_t wait_us = release_us - esp_timer_get_time();
+    if(wait_us <= 0) return 0;
+    //round up, waking a tick early would only mean sleeping again
+    int64_t wait_ticks = (wait_us + (portTICK_PERIOD_MS * 1000) - 1) / (portTICK_PERIOD_MS * 1000);
+    return (wait_ticks < portMAX_DELAY) ? (TickType_t) wait_ticks : portMAX_DELAY - 1;
+}
+
+//call with s_sched_lock held. Jobs released at the same time keep the order they were linked in.
+static void link_job(uint8_t job_index)
+{
+    int64_t release_us = s_jobs[job_index].next_release_us;
+    uint8_t* link = &s_run_head;
+    while(*link != SENSOR_SCHED_NO_JOB && s_jobs[*link].next_release_us <= release_us)
+    {
+        link = &s_jobs[*link].next;
+    }
+    s_jobs[job_index].next = *link;
+    *link = job_index;
+}
+
+//call with s_sched_lock held
+static void unlink_job(uint8_t job_index)
+{
+    uint8_t* link = &s_run_head;
+    while(*link != SENSOR_SCHED_NO_JOB)
+    {
+        if(*link == job_index)
+        {
+            *link = s_jobs[job_index].next;
+            s_jobs[job_index].next = SENSOR_SCHED_NO_JOB;
+            return;
+        }
+        link = &s_jobs[*link].next;
+    }
+}
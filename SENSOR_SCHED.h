@@ -0,0 +1,61 @@
+#ifndef H_SENSOR_SCHED
+#define H_SENSOR_SCHED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// One task runs every periodic sensor job, so bus transactions never overlap and each
+// job can be given its own phase within the period.
+#define MAX_SENSOR_JOBS 8
+#define SENSOR_JOB_NAME_MAX 16
+#define SENSOR_SCHED_INVALID_JOB 0xFF
+
+typedef uint8_t sensor_job_handle_t;
+
+typedef void (*sensor_job_func_t)(void* context);
+
+typedef struct
+{
+    uint32_t runs;
+    uint32_t missed; //releases skipped because the job was still waiting for an earlier one
+    uint32_t overruns; //runs that took longer than the budget
+    uint32_t last_jitter_us; //release time to start time
+    uint32_t max_jitter_us;
+    uint64_t total_jitter_us;
+    uint32_t last_run_us;
+    uint32_t max_run_us;
+} sensor_job_stats_t;
+
+typedef struct
+{
+    char name[SENSOR_JOB_NAME_MAX];
+    uint32_t period_us;
+    uint32_t phase_us;
+    uint32_t budget_us;
+    bool is_running;
+} sensor_job_info_t;
+
+// Releases happen at phase_ms + n * period_ms after the scheduler started, so jobs with the same
+// period stay apart by their phase difference however late they are started. budget_us is how long
+// a run is expected to take, longer runs are counted as overruns. Jobs are created stopped.
+// Returns 1 for bad arguments and 2 when every job slot is taken.
+uint8_t sensor_sched_register_job(const char* name, sensor_job_func_t func, void* context, uint32_t period_ms, uint32_t phase_ms, uint32_t budget_us, sensor_job_handle_t* job);
+
+// Starting a running job or stopping a stopped one does nothing. Return 1 for an unknown job.
+uint8_t sensor_sched_start_job(sensor_job_handle_t job);
+
+uint8_t sensor_sched_stop_job(sensor_job_handle_t job);
+
+bool sensor_sched_is_job_running(sensor_job_handle_t job);
+
+uint8_t sensor_sched_get_job_count(void);
+
+// Return 1 for an unknown job.
+uint8_t sensor_sched_get_job_info(sensor_job_handle_t job, sensor_job_info_t* info);
+
+uint8_t sensor_sched_get_job_stats(sensor_job_handle_t job, sensor_job_stats_t* stats);
+
+uint8_t sensor_sched_reset_job_stats(sensor_job_handle_t job);
+
+#endif
@@ -5,15 +5,19 @@
 #ifdef FUNCTIONAL_TESTS
 #include "mocked_functions.h"
 #else
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "driver/i2c.h"
 #include "driver/gpio.h"
-#include "freertos/timers.h"
 #endif
 
 #include "ToF_I2C.h"
 #include "tof_bin_image.h"
 #include "FLASH_SPI.h"
+#include "SENSOR_SCHED.h"
 
 //I2C definitions
 
@@ -33,9 +37,19 @@
 //Defines
 
 #define FW_HEADER_LEN 4
+#define TOF_FW_SAFE_CHUNK_LEN 64
+#define TOF_FW_FAST_CHUNK_LEN 128 //largest W_RAM payload the bootloader takes
+#define TOF_FW_MAX_FAST_CHUNKS 128 //checksums cached for up to 16 KiB of image
 #define MEASUREMENT_BUF_SIZE 12
+#define TOF_RING_SIZE 8 //power of 2
 #define MEASUREMENT_DAT_SIZE 0x84
-#define DEPTH_ARRAY_BUF_SIZE 8
+#define TOF_WRITE_SETTLE_MS 5
+#define TOF_POLL_PERIOD_MS 32 //a multiple of the imu period, so the two polls never meet
+#define TOF_POLL_PHASE_MS 0
+#define TOF_POLL_BUDGET_US 200 //only posts the read, the I2C traffic runs on the tof queue task
+#define TOF_QUEUE_DEPTH 16
+#define TOF_QUEUE_PRIORITY 9 //below the priority queue, so a firmware download or config load never holds up imu samples
+#define TOF_QUEUE_STACK_SIZE 4096
 
 //Commands
 
@@ -47,11 +61,47 @@ static uint8_t CHECK_CONFIG_PAGE_LOADED[4] = {0x16, 0x00, 0xBC, 0x00};
 
 static const char *TAG = "TOF LOG";
 
+// Every sensor I2C transaction runs on this queue's task, so the sleeps between them never block the priority queue
+static const msg_queue_config_t s_tof_queue_config =
+{
+	.name = "tof_queue",
+	.depth = TOF_QUEUE_DEPTH,
+	.task_priority = TOF_QUEUE_PRIORITY,
+	.stack_size = TOF_QUEUE_STACK_SIZE,
+	.core_id = MSG_QUEUE_NO_AFFINITY,
+};
+
+//Result Decoding
+
+#define TOF_TMF8828_SUBCAPTURES 4
+#define TOF_TMF8828_PAIRS 8 //16 zones of the 8x8 grid per subcapture, as pairs of neighbouring zones
+#define TOF_TMF8821_ZONES 16 //first object only
+#define TOF_RESULT_OFFSET 0x18 //confidence byte of the first object result
+#define TOF_RESULT_LEN 3 //confidence byte, then the distance in mm, low byte first
+#define TOF_TMF8828_PLANE_STRIDE 0x1B //8 results plus a skipped one, first object left zones come first
+
+// Left zone of each pair, in register order so the decode walks the block front to back. tmf8828 mode
+// works upside down and each subcapture fills every other zone of every other row. The block holds four
+// planes of 8 results, TOF_TMF8828_PLANE_STRIDE apart: first object left zones, first object right
+// zones, then the same for the second object. The right zone of a pair is always left zone + 1, and
+// left zones are even so a pair never straddles a row.
+static const uint8_t s_tmf8828_pair_zones[TOF_TMF8828_SUBCAPTURES][TOF_TMF8828_PAIRS] =
+{
+	{56, 60, 40, 44, 24, 28,  8, 12}, //subcapture 0
+	{58, 62, 42, 46, 26, 30, 10, 14}, //subcapture 1
+	{48, 52, 32, 36, 16, 20,  0,  4}, //subcapture 2
+	{50, 54, 34, 38, 18, 22,  2,  6}, //subcapture 3
+};
+
 // Internal Functions
 
 static uint8_t TOF_FIRMWARE_CHECK(void);
 static uint8_t TOF_FIRMWARE_DOWNLOAD(void);
-static uint8_t TOF_DOWNLOAD_CMD(unsigned long firmware_idx, uint8_t firmware_length);
+static uint8_t TOF_DOWNLOAD_CMD(unsigned long firmware_idx, uint8_t firmware_length, uint8_t checksum);
+static uint8_t TOF_FW_CHUNK_CHECKSUM(unsigned long firmware_idx, uint8_t firmware_length);
+static void TOF_PRECOMPUTE_FW_CHECKSUMS(void);
+// Runs the firmware check, downloading if needed, and records how long the sensor took to boot.
+static uint8_t TOF_BOOT_APP(void);
 static uint8_t TOF_WAIT_UNTIL_READY(void);
 static uint8_t TOF_WAIT_UNTIL_READY_APP(uint32_t delay_between_attempts);
 static uint8_t TOF_CHECK_REGISTERS(uint8_t* read_reg, uint8_t* comp_reg, uint8_t size);
@@ -59,18 +109,45 @@ static esp_err_t TOF_READ_WRITE_APP(uint8_t* TOF_OUT, uint8_t out_dat_size, uint
 static esp_err_t TOF_WRITE_APP(uint8_t* TOF_IN, uint8_t dat_size, uint8_t wait_ms);
 static uint8_t TOF_SET_FACTORY_CAL_BLOB_NAME(uint8_t iter, char* blob_name);
 
+// Factory calibration state machine, each step is a delayed message to the internal handler
+typedef enum
+{
+	TOF_FACTORY_CAL_STEP_START,
+	TOF_FACTORY_CAL_STEP_POLL,
+} TOF_FACTORY_CAL_STEP_t;
+
+static uint8_t TOF_SCHEDULE_FACTORY_CAL_STEP(TOF_FACTORY_CAL_STEP_t step, uint32_t delay_ms);
+static void TOF_RUN_FACTORY_CAL_STEP(TOF_FACTORY_CAL_STEP_t step);
+static void TOF_FINISH_FACTORY_CALIBRATION(uint8_t err);
+
 // Internal Variables
 
 static bool s_is_tmf8828_mode = false;
-static TOF_DATA_t s_ring_buffer_ptr[DEPTH_ARRAY_BUF_SIZE] = {0};
-static uint8_t s_ring_buffer_iter = 0;
 static uint8_t s_measurement_iter = 0;
 static uint8_t s_starting_iter = 0;
 static uint8_t s_measurement_buffer[MEASUREMENT_BUF_SIZE][MEASUREMENT_DAT_SIZE] = {0};
 static uint32_t s_measurement_flags = 0;
 static uint8_t s_current_config = 0;
+static bool s_factory_cal_running = false;
+static uint8_t s_factory_cal_remaining = 0;
+static uint8_t s_factory_cal_attempt = 0;
+static uint16_t s_factory_cal_request_id = MSG_REQUEST_NONE;
 static component_handle_t s_internal_comp_handle = 0;
-TimerHandle_t s_tof_timer = NULL;
+static uint8_t s_tof_queue_id = MSG_QUEUE_INVALID;
+static message_info_t s_tof_ring_storage[TOF_RING_SIZE];
+static msg_ring_t s_tof_ring;
+static sensor_job_handle_t s_tof_poll_job = SENSOR_SCHED_INVALID_JOB;
+static volatile TOF_ACQ_MODE_t s_acq_mode = TOF_ACQ_MODE_INTERRUPT;
+static volatile bool s_is_measuring = false;
+static bool s_is_read_deferred = false; //a result was left on the sensor because the buffer was full
+static int64_t s_result_ready_us = 0; //TOF_INTR edge of the result not read yet, 0 when there is none
+static TOF_ACQ_STATS_t s_acq_stats = {0};
+static portMUX_TYPE s_acq_lock = portMUX_INITIALIZER_UNLOCKED;
+static TOF_FW_DOWNLOAD_MODE_t s_fw_download_mode = TOF_FW_DOWNLOAD_MODE_FAST;
+static uint8_t s_fw_packet[FW_HEADER_LEN + TOF_FW_FAST_CHUNK_LEN]; //reused by every chunk
+static uint8_t s_fw_chunk_checksums[TOF_FW_MAX_FAST_CHUNKS];
+static uint16_t s_fw_checksum_count = 0; //fast mode chunks with a cached checksum
+static TOF_BOOT_STATS_t s_boot_stats = {0};
 
 // Externs
 
@@ -78,15 +155,26 @@ component_handle_t ToF_public_component = 0;
 
 // Interrupt Handler
 
-static void TOF_MEASUREMENT_INTR_HANDLE(TimerHandle_t xTimer);
+// Only timestamps the edge and posts a read through s_tof_ring, its only producer.
+static void TOF_RESULT_READY_ISR(void* args);
 
 // Task Handling
 
+// Poll job, posts a read like the interrupt does.
+static void TOF_POLL_RESULT(void* context);
+static void TOF_QUEUE_READ_RESULT(void);
+// Reads one result if the sensor has one. Only runs on the tof queue task, which owns the I2C bus
+// and the measurement buffer flags.
+static void TOF_READ_RESULT(void);
+
 // Message Handler
 static void TOF_INTERNAL_MESSAGE_HANDLER(component_handle_t comp_handle, uint8_t internal_msg_type, void* data, size_t data_len);
+// Serves requests from other components, so all sensor I2C traffic runs on the tof queue task
+static void TOF_REQUEST_HANDLER(component_handle_t comp_handle, uint8_t request_type, void* data, size_t data_len);
 
 // Task to Convert Read Buffer to a distance array
 static uint8_t TOF_CONVERT_READ_BUFFER_TO_ARRAY(void);
+static TOF_DATA_t* TOF_ACQUIRE_FRAME(uint8_t horizontal_size, uint8_t vertical_size);
 
 
 void TOF_INIT(void)
@@ -146,14 +234,29 @@ void TOF_INIT(void)
 
 #endif
 
-	if(check_is_queue_active(1))
+	//depth frames and calibration results are published on the priority queue, everything else runs on the tof queue
+	if(check_is_queue_active(MSG_QUEUE_PRIORITY))
 	{
+		if(!check_is_queue_active(s_tof_queue_id) && create_message_queue(&s_tof_queue_config, &s_tof_queue_id))
+		{
+			ESP_LOGE(TAG, "Could not create the tof queue.");
+		}
 		create_handle_for_component(&s_internal_comp_handle);
 		create_handle_for_component(&ToF_public_component);
-		register_priority_handler_for_messages(TOF_INTERNAL_MESSAGE_HANDLER, s_internal_comp_handle);
+	}
+	if(check_is_queue_active(s_tof_queue_id))
+	{
+		register_queue_handler_for_message_types(s_tof_queue_id, TOF_INTERNAL_MESSAGE_HANDLER, s_internal_comp_handle,
+			MSG_TYPE_BIT(TOF_MSG_INTERNAL_CONVERT_I2C) | MSG_TYPE_BIT(TOF_MSG_INTERNAL_FACTORY_CAL) | MSG_TYPE_BIT(TOF_MSG_INTERNAL_READ_RESULT));
+		register_queue_handler_for_message_types(s_tof_queue_id, TOF_REQUEST_HANDLER, ToF_public_component, TOF_REQUEST_TYPE_MASK);
+		//one convert drains every complete measurement, so queued duplicates are redundant
+		set_message_overflow_policy(s_tof_queue_id, s_internal_comp_handle, TOF_MSG_INTERNAL_CONVERT_I2C, MSG_OVERFLOW_COALESCE);
+		//a read takes whatever result is ready, one pending read is enough
+		set_message_overflow_policy(s_tof_queue_id, s_internal_comp_handle, TOF_MSG_INTERNAL_READ_RESULT, MSG_OVERFLOW_COALESCE);
+		msg_ring_init(&s_tof_ring, s_tof_ring_storage, TOF_RING_SIZE, s_tof_queue_id);
 	}
 	
-	if(!TOF_FIRMWARE_CHECK())
+	if(!TOF_BOOT_APP())
 	{
 		ESP_LOGI(TAG, "TOF app initialized successfully.");
 	}
@@ -162,10 +265,14 @@ void TOF_INIT(void)
 	TOF_SET_TMF8828_MODE(true);
 
 	//TOF INTERRUPT HANDLER
-	//gpio_isr_handler_add(TOF_INTR, TOF_MEASUREMENT_INTR_HANDLE, NULL);
+	//installed in polling mode as well, so latency is measured the same way in both
+	gpio_isr_handler_add(TOF_INTR, TOF_RESULT_READY_ISR, NULL);
 
-	//Try Polling instead
-	s_tof_timer = xTimerCreate("tof_timer", 30 / portTICK_PERIOD_MS, pdTRUE, (void*) 0, TOF_MEASUREMENT_INTR_HANDLE);
+	//polling is the fallback when the interrupt line can't be relied on
+	if(s_tof_poll_job == SENSOR_SCHED_INVALID_JOB)
+	{
+		sensor_sched_register_job("tof_poll", TOF_POLL_RESULT, NULL, TOF_POLL_PERIOD_MS, TOF_POLL_PHASE_MS, TOF_POLL_BUDGET_US, &s_tof_poll_job);
+	}
 }
 
 bool TOF_SET_TMF8828_MODE(bool set_tmf8828)
@@ -285,7 +392,7 @@ uint8_t TOF_RESET(void)
 	write_data[0] = 0xF0; 
 	write_data[0] = 0x80;
 	if(TOF_WRITE_APP(write_data, 2, 5) != ESP_OK) return 1;
-	if(TOF_FIRMWARE_CHECK()) return 1;
+	if(TOF_BOOT_APP()) return 1;
 	return 0;
 }
 
@@ -293,12 +400,27 @@ uint8_t TOF_FACTORY_CALIBRATION(void)
 {
 	uint8_t number_of_factory_calibrations = (s_is_tmf8828_mode) ? 4 : 1;
 	uint8_t write_data[2] = {0, 0};
+
+	if(s_factory_cal_running) return 2;
 	
 	// Steps:
 
 	// Reset Factory Calibration Counter
 	write_data[0] = 0x08;
 	write_data[1] = 0x1F;
+	if(check_is_queue_active(s_tof_queue_id))
+	{
+		//each calibration takes about a second per attempt, so let the handler step through it
+		if(TOF_WRITE(write_data, 2) != ESP_OK) return 1;
+		s_factory_cal_remaining = number_of_factory_calibrations;
+		s_factory_cal_running = true;
+		if(TOF_SCHEDULE_FACTORY_CAL_STEP(TOF_FACTORY_CAL_STEP_START, TOF_WRITE_SETTLE_MS))
+		{
+			s_factory_cal_running = false;
+			return 1;
+		}
+		return 0;
+	}
 	if(TOF_WRITE_APP(write_data, 2, 5) != ESP_OK) return 1;
 
 	for(int i = 0; i < number_of_factory_calibrations; i++)
@@ -309,12 +431,17 @@ uint8_t TOF_FACTORY_CALIBRATION(void)
 		if(TOF_WRITE_APP(write_data, 2, 5) != ESP_OK) return 1;
 
 		// Check command was executed
-		if(TOF_WAIT_UNTIL_READY_APP(1000)) return 1;
+		if(TOF_WAIT_UNTIL_READY_APP(TOF_FACTORY_CAL_POLL_MS)) return 1;
 	}
 
 	return 0;
 }
 
+bool TOF_IS_FACTORY_CALIBRATION_RUNNING(void)
+{
+	return s_factory_cal_running;
+}
+
 uint8_t TOF_STORE_FACTORY_CALIBRATION(void)
 {
 	uint8_t number_of_factory_calibrations = (s_is_tmf8828_mode) ? 4 : 1;
@@ -473,9 +600,10 @@ uint8_t TOF_START_MEASUREMENTS(void)
 
 	TOF_WAIT_UNTIL_READY_APP(3);
 
-	if(!xTimerIsTimerActive(s_tof_timer))
+	s_is_measuring = true;
+	if(s_acq_mode == TOF_ACQ_MODE_POLLING)
 	{
-		xTimerStart(s_tof_timer, 0);
+		sensor_sched_start_job(s_tof_poll_job);
 	}
 	return 0;
 }
@@ -483,10 +611,8 @@ uint8_t TOF_START_MEASUREMENTS(void)
 uint8_t TOF_STOP_MEASUREMENTS(void)
 {
 	uint8_t write_data[2] = {0, 0};
-	if(xTimerIsTimerActive(s_tof_timer))
-	{
-		xTimerStop(s_tof_timer, 0);
-	}
+	s_is_measuring = false;
+	sensor_sched_stop_job(s_tof_poll_job);
 	write_data[0] = 0x08;
 	write_data[1] = 0xFF;
 	if(TOF_WRITE_APP(write_data, 2, 5) != ESP_OK) return 1;
@@ -495,6 +621,63 @@ uint8_t TOF_STOP_MEASUREMENTS(void)
 	return 0;
 }
 
+uint8_t TOF_SET_ACQUISITION_MODE(TOF_ACQ_MODE_t mode)
+{
+	if(mode != TOF_ACQ_MODE_INTERRUPT && mode != TOF_ACQ_MODE_POLLING) return 1;
+	s_acq_mode = mode;
+	if(!s_is_measuring) return 0;
+	if(mode == TOF_ACQ_MODE_POLLING)
+	{
+		sensor_sched_start_job(s_tof_poll_job);
+	}
+	else
+	{
+		sensor_sched_stop_job(s_tof_poll_job);
+		//a result that arrived while polling already pulled TOF_INTR low, no edge will announce it
+		TOF_QUEUE_READ_RESULT();
+	}
+	return 0;
+}
+
+TOF_ACQ_MODE_t TOF_GET_ACQUISITION_MODE(void)
+{
+	return s_acq_mode;
+}
+
+void TOF_GET_ACQUISITION_STATS(TOF_ACQ_STATS_t* stats)
+{
+	portENTER_CRITICAL(&s_acq_lock);
+	*stats = s_acq_stats;
+	portEXIT_CRITICAL(&s_acq_lock);
+}
+
+void TOF_RESET_ACQUISITION_STATS(void)
+{
+	portENTER_CRITICAL(&s_acq_lock);
+	memset(&s_acq_stats, 0, sizeof(TOF_ACQ_STATS_t));
+	portEXIT_CRITICAL(&s_acq_lock);
+}
+
+void TOF_SET_FIRMWARE_DOWNLOAD_MODE(TOF_FW_DOWNLOAD_MODE_t mode)
+{
+	s_fw_download_mode = mode;
+}
+
+TOF_FW_DOWNLOAD_MODE_t TOF_GET_FIRMWARE_DOWNLOAD_MODE(void)
+{
+	return s_fw_download_mode;
+}
+
+void TOF_GET_BOOT_STATS(TOF_BOOT_STATS_t* stats)
+{
+	*stats = s_boot_stats;
+}
+
+uint8_t TOF_GET_QUEUE_ID(void)
+{
+	return s_tof_queue_id;
+}
+
 static esp_err_t TOF_READ_WRITE_APP(uint8_t* TOF_OUT, uint8_t out_dat_size, uint8_t* TOF_IN, uint8_t in_dat_size, uint8_t wait_ms)
 {
 	esp_err_t err = TOF_READ_WRITE(TOF_OUT, out_dat_size, TOF_IN, in_dat_size);
@@ -605,13 +788,13 @@ static uint8_t TOF_FIRMWARE_CHECK(void)
 	uint8_t tof_data[3] = {0, 0, 0};
 	while((tof_data[0] & 0xCF) != 0x41) // wait until it is b01xx_0001
 	{
-		if(TOF_READ_WRITE(tof_data, 1, &tof_reg_addr, 1) == ESP_OK)
+		if(TOF_READ_WRITE(tof_data, 1, &tof_reg_addr, 1) != ESP_OK)
 		{
-			ESP_LOGI(TAG, "TOF enable return is %x", tof_data[0]);
+			return 1;
 		}
-		else
+		if(s_fw_download_mode == TOF_FW_DOWNLOAD_MODE_SAFE)
 		{
-			return 1;
+			ESP_LOGI(TAG, "TOF enable return is %x", tof_data[0]);
 		}
 	}
 	tof_reg_addr = 0x00;
@@ -654,45 +837,59 @@ static uint8_t TOF_FIRMWARE_CHECK(void)
 
 static uint8_t TOF_FIRMWARE_DOWNLOAD(void)
 {
-	//TODO:
-	//1. Put TMF8828 into bootloader mode
-	//2. Go to correct location in memory
-	//3. Loop writing Firmware into TMF8828 via i2c_conf
-	//4. Restart TMF8288 into application mode
-	
-	// Step 2:
+	//1. Go to correct location in memory
+	//2. Loop writing Firmware into TMF8828 via i2c
+	//3. Restart TMF8828 into application mode
+
+	bool is_fast = (s_fw_download_mode == TOF_FW_DOWNLOAD_MODE_FAST);
+	uint8_t chunk_len = (is_fast) ? TOF_FW_FAST_CHUNK_LEN : TOF_FW_SAFE_CHUNK_LEN;
+	int64_t start_us = esp_timer_get_time();
+	s_boot_stats.is_downloaded = true;
+	s_boot_stats.chunk_len = chunk_len;
+	s_boot_stats.chunks = 0;
+	s_boot_stats.busy_polls = 0;
+	if(is_fast)
+	{
+		TOF_PRECOMPUTE_FW_CHECKSUMS();
+	}
+
+	// Step 1:
 
 	ESP_LOGI(TAG, "Sending FW ADDR Command");
 
 	if(TOF_WRITE(SET_FW_ADDR, 6) != ESP_OK) return 1;
-	
+
 	if(TOF_WAIT_UNTIL_READY()) return 1;
-	
-	// Step 3:
 
-	ESP_LOGI(TAG, "Sending Firmware Data");
-	
+	// Step 2:
+
+	ESP_LOGI(TAG, "Sending Firmware Data in %u byte chunks", chunk_len);
+
 	unsigned long firmware_idx = 0;
-	uint8_t firmware_length = 64;
-	
+
 	while(firmware_idx < tof_bin_image_length)
 	{
+		//the last chunk only carries what is left of the image
 		unsigned long data_remaining = tof_bin_image_length - firmware_idx;
-		if(data_remaining)
-		if(TOF_DOWNLOAD_CMD(firmware_idx, firmware_length)) return 1;
+		uint8_t firmware_length = (data_remaining < chunk_len) ? data_remaining : chunk_len;
+		uint16_t chunk = s_boot_stats.chunks;
+		uint8_t checksum = (is_fast && chunk < s_fw_checksum_count) ? s_fw_chunk_checksums[chunk] : TOF_FW_CHUNK_CHECKSUM(firmware_idx, firmware_length);
+		if(TOF_DOWNLOAD_CMD(firmware_idx, firmware_length, checksum)) return 1;
 		firmware_idx += firmware_length;
-		
+		s_boot_stats.chunks++;
+
+		//the bootloader takes one command at a time, so each chunk has to be acknowledged before the next
 		if(TOF_WAIT_UNTIL_READY()) return 1;
 	}
 
 	uint8_t write_data[2] = {0xE0, 0x21};
 	if(TOF_WRITE(write_data, 2) != ESP_OK) return 1;
 
-	// Step 4:
+	// Step 3:
 
 	ESP_LOGI(TAG, "Sending RAM Remap Command");
 
-	TOF_WRITE(RAM_REMAP, 5);
+	TOF_WRITE(RAM_REMAP, sizeof(RAM_REMAP));
 
 	vTaskDelay(5 / portTICK_PERIOD_MS); //wait about 5 milliseconds for reboot before checking that App is running
 
@@ -701,60 +898,94 @@ static uint8_t TOF_FIRMWARE_DOWNLOAD(void)
 	if(TOF_FIRMWARE_CHECK())
 	{
 		ESP_LOGE(TAG, "Bootloader Download failed.");
-		
+
 		return 1;
 	}
 
+	s_boot_stats.download_us = (uint32_t) (esp_timer_get_time() - start_us);
+
 	return 0;
 }
 
-static uint8_t TOF_DOWNLOAD_CMD(unsigned long firmware_idx, uint8_t firmware_length)
+static uint8_t TOF_DOWNLOAD_CMD(unsigned long firmware_idx, uint8_t firmware_length, uint8_t checksum)
 {
 	uint8_t packet_len = (firmware_length + FW_HEADER_LEN);
-	
-	uint8_t *cmd_and_data = malloc(packet_len * sizeof(uint8_t));
-	
-	*cmd_and_data = 0x08;
-	
-	*(cmd_and_data + 1) = 0x41;
-	
-	uint8_t checksum = 0x41;
-	
-	*(cmd_and_data + 2) = firmware_length;
-	
-	checksum += firmware_length;
-	
-	unsigned long current_fw_idx = firmware_idx;
-	
-	ESP_LOGI(TAG, "Creating Data Packet. Packet length is %u. Current FW index is %lx.", packet_len, firmware_idx);
 
-	int i = 0;
-	
-	for(i = 3; i < packet_len - 1; i++)
+	s_fw_packet[0] = 0x08;
+
+	s_fw_packet[1] = 0x41;
+
+	s_fw_packet[2] = firmware_length;
+
+	memcpy(&s_fw_packet[3], &tof_bin_image[firmware_idx], firmware_length);
+
+	s_fw_packet[packet_len - 1] = checksum;
+
+	if(s_fw_download_mode == TOF_FW_DOWNLOAD_MODE_SAFE)
 	{
-		*(cmd_and_data + i) = tof_bin_image[current_fw_idx];
-		checksum += tof_bin_image[current_fw_idx];
-		current_fw_idx++;
+		ESP_LOGI(TAG, "Creating Data Packet. Packet length is %u. Current FW index is %lx.", packet_len, firmware_idx);
+		ESP_LOGI(TAG, "Checksum is %x.", checksum);
 	}
-	
-	ESP_LOGI(TAG, "Checksum is %x.", ~checksum);
-	
-	*(cmd_and_data + i) = ~checksum;
-	
-	esp_err_t i2c_write_err = TOF_WRITE(cmd_and_data, packet_len);
-	free(cmd_and_data);
-	
-	if(i2c_write_err == ESP_OK)
+
+	if(TOF_WRITE(s_fw_packet, packet_len) == ESP_OK)
 	{
 		return 0;
 	}
 	else
 	{
-		ESP_LOGI(TAG, "Failed to send firmware data i2c packet.");
+		ESP_LOGE(TAG, "Failed to send firmware data i2c packet at FW index %lx.", firmware_idx);
 		return 1;
 	}
 }
 
+static uint8_t TOF_FW_CHUNK_CHECKSUM(unsigned long firmware_idx, uint8_t firmware_length)
+{
+	//inverted sum of the command, length and data bytes
+	uint8_t checksum = 0x41 + firmware_length;
+	for(uint8_t i = 0; i < firmware_length; i++)
+	{
+		checksum += tof_bin_image[firmware_idx + i];
+	}
+	return ~checksum;
+}
+
+static void TOF_PRECOMPUTE_FW_CHECKSUMS(void)
+{
+	//the image is const, so fast mode checksums are summed once and reused by every later reset
+	unsigned long firmware_idx = (unsigned long) s_fw_checksum_count * TOF_FW_FAST_CHUNK_LEN;
+	while(firmware_idx < tof_bin_image_length && s_fw_checksum_count < TOF_FW_MAX_FAST_CHUNKS)
+	{
+		unsigned long data_remaining = tof_bin_image_length - firmware_idx;
+		uint8_t firmware_length = (data_remaining < TOF_FW_FAST_CHUNK_LEN) ? data_remaining : TOF_FW_FAST_CHUNK_LEN;
+		s_fw_chunk_checksums[s_fw_checksum_count] = TOF_FW_CHUNK_CHECKSUM(firmware_idx, firmware_length);
+		s_fw_checksum_count++;
+		firmware_idx += firmware_length;
+	}
+}
+
+static uint8_t TOF_BOOT_APP(void)
+{
+	memset(&s_boot_stats, 0, sizeof(TOF_BOOT_STATS_t));
+	int64_t start_us = esp_timer_get_time();
+	uint8_t err = TOF_FIRMWARE_CHECK();
+	s_boot_stats.boot_us = (uint32_t) (esp_timer_get_time() - start_us);
+	if(err)
+	{
+		return err;
+	}
+	if(s_boot_stats.is_downloaded)
+	{
+		ESP_LOGI(TAG, "TOF booted in %lu us, firmware download took %lu us in %u chunks of %u bytes with %u busy polls.",
+			(unsigned long) s_boot_stats.boot_us, (unsigned long) s_boot_stats.download_us, s_boot_stats.chunks,
+			s_boot_stats.chunk_len, s_boot_stats.busy_polls);
+	}
+	else
+	{
+		ESP_LOGI(TAG, "TOF booted in %lu us, app was already running.", (unsigned long) s_boot_stats.boot_us);
+	}
+	return 0;
+}
+
 static uint8_t TOF_WAIT_UNTIL_READY(void)
 {
 	//Check that command was received properly. Otherwise return failed
@@ -764,10 +995,13 @@ static uint8_t TOF_WAIT_UNTIL_READY(void)
 	{
 		if(TOF_READ_WRITE(tof_data, 3, &tof_reg_addr, 1) == ESP_OK)
 		{
-			ESP_LOGI(TAG, "TOF enable return is %x, %x, %x", tof_data[0], tof_data[1], tof_data[2]);
-			if(tof_data[0] && (tof_data[2] != 0xFF)) 
+			if(s_fw_download_mode == TOF_FW_DOWNLOAD_MODE_SAFE)
 			{
-				ESP_LOGE(TAG, "Return code was unexpected.");
+				ESP_LOGI(TAG, "TOF enable return is %x, %x, %x", tof_data[0], tof_data[1], tof_data[2]);
+			}
+			if(tof_data[0] && (tof_data[2] != 0xFF))
+			{
+				s_boot_stats.busy_polls++;
 			}
 			else
 			{
@@ -840,7 +1074,23 @@ static void TOF_INTERNAL_MESSAGE_HANDLER(component_handle_t comp_handle, uint8_t
 	switch((TOF_MESSAGE_TYPES_t) internal_msg_type)
 	{
 		case TOF_MSG_INTERNAL_CONVERT_I2C:
-			TOF_CONVERT_READ_BUFFER_TO_ARRAY();
+			//convert triggers are coalesced, so keep going until no full measurement is left
+			for(uint8_t convert_cnt = 0; convert_cnt < MEASUREMENT_BUF_SIZE; convert_cnt++)
+			{
+				if(TOF_CONVERT_READ_BUFFER_TO_ARRAY()) break;
+			}
+			//the result left behind has no edge coming for it, polling would just pick it up next period
+			if(s_is_read_deferred && s_acq_mode == TOF_ACQ_MODE_INTERRUPT)
+			{
+				s_is_read_deferred = false;
+				TOF_READ_RESULT();
+			}
+			break;
+		case TOF_MSG_INTERNAL_READ_RESULT:
+			TOF_READ_RESULT();
+			break;
+		case TOF_MSG_INTERNAL_FACTORY_CAL:
+			TOF_RUN_FACTORY_CAL_STEP((TOF_FACTORY_CAL_STEP_t) *((uint8_t*) data));
 			break;
 		case TOF_MSG_MAX:
 		default:
@@ -849,13 +1099,154 @@ static void TOF_INTERNAL_MESSAGE_HANDLER(component_handle_t comp_handle, uint8_t
 	}
 }
 
+static void TOF_REQUEST_HANDLER(component_handle_t comp_handle, uint8_t request_type, void* data, size_t data_len)
+{
+	(void) comp_handle; //only registered for ToF_public_component
+	uint16_t request_id = get_dispatch_request_id(s_tof_queue_id);
+	uint8_t argument = (data_len) ? *((uint8_t*) data) : 0;
+	uint8_t response_data = 0;
+	uint8_t err = 0;
+	switch((TOF_MESSAGE_TYPES_t) request_type)
+	{
+		case TOF_MSG_REQUEST_LOAD_CONFIG:
+			err = TOF_LOAD_CONFIG(argument);
+			break;
+		case TOF_MSG_REQUEST_RESET:
+			err = TOF_RESET();
+			break;
+		case TOF_MSG_REQUEST_SET_MODE:
+			response_data = (uint8_t) TOF_SET_TMF8828_MODE(argument != 0);
+			send_response(request_id, 0, &response_data, sizeof(response_data));
+			return;
+		case TOF_MSG_REQUEST_FACTORY_CAL:
+			err = TOF_FACTORY_CALIBRATION();
+			if(!err && s_factory_cal_running)
+			{
+				//answered by TOF_FINISH_FACTORY_CALIBRATION
+				s_factory_cal_request_id = request_id;
+				return;
+			}
+			break;
+		case TOF_MSG_REQUEST_CAL_STATUS:
+			response_data = TOF_RETURN_CALIBRATION_STATUS();
+			send_response(request_id, 0, &response_data, sizeof(response_data));
+			return;
+		case TOF_MSG_REQUEST_STORE_CAL:
+			err = TOF_STORE_FACTORY_CALIBRATION();
+			break;
+		case TOF_MSG_REQUEST_LOAD_CAL:
+			err = TOF_LOAD_FACTORY_CALIBRATION();
+			break;
+		case TOF_MSG_REQUEST_START_MEASUREMENTS:
+			err = TOF_START_MEASUREMENTS();
+			break;
+		case TOF_MSG_REQUEST_STOP_MEASUREMENTS:
+			err = TOF_STOP_MEASUREMENTS();
+			break;
+		case TOF_MSG_REQUEST_SET_ACQ_MODE:
+			err = TOF_SET_ACQUISITION_MODE((TOF_ACQ_MODE_t) argument);
+			break;
+		default:
+			ESP_LOGE(TAG, "Invalid tof request type %u.", request_type);
+			err = 1;
+			break;
+	}
+	send_response(request_id, err, NULL, 0);
+}
+
+static uint8_t TOF_SCHEDULE_FACTORY_CAL_STEP(TOF_FACTORY_CAL_STEP_t step, uint32_t delay_ms)
+{
+	uint8_t step_id = (uint8_t) step;
+	message_info_t step_msg;
+	set_message_inline_payload(&step_msg, &step_id, sizeof(step_id));
+	step_msg.component_handle=s_internal_comp_handle;
+	step_msg.message_type=TOF_MSG_INTERNAL_FACTORY_CAL;
+	step_msg.trace_id=MSG_TRACE_NONE;
+	step_msg.request_id=MSG_REQUEST_NONE;
+	return send_message_after(s_tof_queue_id, step_msg, delay_ms, NULL);
+}
+
+static void TOF_RUN_FACTORY_CAL_STEP(TOF_FACTORY_CAL_STEP_t step)
+{
+	uint8_t write_data[2] = {0x08, 0x20};
+	uint8_t tof_reg_addr = 0x08;
+	uint8_t tof_data = 0;
+	if(!s_factory_cal_running) return;
+	switch(step)
+	{
+		case TOF_FACTORY_CAL_STEP_START:
+			// Start Factory Calibration
+			if(TOF_WRITE(write_data, 2) != ESP_OK)
+			{
+				TOF_FINISH_FACTORY_CALIBRATION(1);
+				return;
+			}
+			s_factory_cal_attempt = 0;
+			if(TOF_SCHEDULE_FACTORY_CAL_STEP(TOF_FACTORY_CAL_STEP_POLL, TOF_WRITE_SETTLE_MS)) TOF_FINISH_FACTORY_CALIBRATION(1);
+			break;
+		case TOF_FACTORY_CAL_STEP_POLL:
+			// Check command was executed, same checks as TOF_WAIT_UNTIL_READY_APP
+			if(TOF_READ_WRITE(&tof_data, 1, &tof_reg_addr, 1) != ESP_OK)
+			{
+				ESP_LOGE(TAG, "Failed to send i2c command.");
+				TOF_FINISH_FACTORY_CALIBRATION(1);
+				return;
+			}
+			ESP_LOGI(TAG, "TOF enable return is %x", tof_data);
+			if(tof_data == 0x00 || tof_data == 0x01)
+			{
+				s_factory_cal_remaining--;
+				if(s_factory_cal_remaining == 0)
+				{
+					TOF_FINISH_FACTORY_CALIBRATION(0);
+				}
+				else if(TOF_SCHEDULE_FACTORY_CAL_STEP(TOF_FACTORY_CAL_STEP_START, TOF_WRITE_SETTLE_MS))
+				{
+					TOF_FINISH_FACTORY_CALIBRATION(1);
+				}
+				return;
+			}
+			ESP_LOGE(TAG, "Return code was unexpected.");
+			s_factory_cal_attempt++;
+			if(s_factory_cal_attempt >= TOF_FACTORY_CAL_ATTEMPTS)
+			{
+				ESP_LOGE(TAG, "Failed to receive correct return code.");
+				TOF_FINISH_FACTORY_CALIBRATION(1);
+			}
+			else if(TOF_SCHEDULE_FACTORY_CAL_STEP(TOF_FACTORY_CAL_STEP_POLL, TOF_FACTORY_CAL_POLL_MS))
+			{
+				TOF_FINISH_FACTORY_CALIBRATION(1);
+			}
+			break;
+		default:
+			ESP_LOGE(TAG, "Invalid factory calibration step %u.", step);
+			break;
+	}
+}
+
+static void TOF_FINISH_FACTORY_CALIBRATION(uint8_t err)
+{
+	s_factory_cal_running = false;
+	if(s_factory_cal_request_id != MSG_REQUEST_NONE)
+	{
+		uint8_t cal_status = (err) ? 1 : TOF_RETURN_CALIBRATION_STATUS();
+		send_response(s_factory_cal_request_id, err, &cal_status, sizeof(cal_status));
+		s_factory_cal_request_id = MSG_REQUEST_NONE;
+	}
+	message_info_t done_msg;
+	set_message_inline_payload(&done_msg, &err, sizeof(err));
+	done_msg.component_handle=ToF_public_component;
+	done_msg.message_type=TOF_MSG_FACTORY_CAL_DONE;
+	done_msg.trace_id=MSG_TRACE_NONE;
+	done_msg.request_id=MSG_REQUEST_NONE;
+	send_message_to_priority_queue(done_msg);
+}
+
 static uint8_t TOF_CONVERT_READ_BUFFER_TO_ARRAY(void)
 {
 	uint8_t number_of_measurements = (s_is_tmf8828_mode) ? 4 : 1;
 	//ESP_LOGI(TAG, "converting i2c buffer to array, in 8828 mode: %u.", s_is_tmf8828_mode);
 
-	//ESP_LOGI(TAG, "operating on ring buffer pointer: %p.", &(s_ring_buffer_ptr[s_ring_buffer_iter]));
-
 	//temporarily using this just to check that we have enough data
 	uint8_t ending_iter = s_measurement_iter;
 	
@@ -883,50 +1274,14 @@ static uint8_t TOF_CONVERT_READ_BUFFER_TO_ARRAY(void)
 		ending_iter -= MEASUREMENT_BUF_SIZE;
 	}
 
-	if(s_is_tmf8828_mode)
-	{
-		if(s_ring_buffer_ptr[s_ring_buffer_iter].horizontal_size != 8)
-		{
-			if(s_ring_buffer_ptr[s_ring_buffer_iter].horizontal_size == 4)
-			{
-				for(uint8_t pixel_row = 0; pixel_row < 16; pixel_row++)
-				{
-					free(s_ring_buffer_ptr[s_ring_buffer_iter].depth_pixel_field[pixel_row]);
-				}
-				free(s_ring_buffer_ptr[s_ring_buffer_iter].depth_pixel_field);
-			}
-			s_ring_buffer_ptr[s_ring_buffer_iter].depth_pixel_field = malloc(16 * sizeof(uint32_t*));
-			for(uint8_t pixel_row = 0; pixel_row < 16; pixel_row++)
-			{
-				s_ring_buffer_ptr[s_ring_buffer_iter].depth_pixel_field[pixel_row] = malloc(8 * sizeof(uint32_t));
-			}
-			s_ring_buffer_ptr[s_ring_buffer_iter].horizontal_size = 8;
-			s_ring_buffer_ptr[s_ring_buffer_iter].vertical_size = 16;
-		}
-	}
-	else
+	//tmf8828 mode is 8x8 with the second object in its own planes.
+	//technically the SPAD map can be 3x3 or 3x6, assuming the map is 4x4 right now.
+	TOF_DATA_t* tof_frame = (s_is_tmf8828_mode) ? TOF_ACQUIRE_FRAME(8, 8) : TOF_ACQUIRE_FRAME(4, 4);
+	if(tof_frame == NULL)
 	{
-		//technically the SPAD map can be 3x3 or 3x6.
-		//assuming the Map is 4x4 right now.
-
-		if(s_ring_buffer_ptr[s_ring_buffer_iter].horizontal_size != 4)
-		{
-			if(s_ring_buffer_ptr[s_ring_buffer_iter].horizontal_size == 8)
-			{
-				for(uint8_t pixel_row = 0; pixel_row < 8; pixel_row++)
-				{
-					free(s_ring_buffer_ptr[s_ring_buffer_iter].depth_pixel_field[pixel_row]);
-				}
-				free(s_ring_buffer_ptr[s_ring_buffer_iter].depth_pixel_field);
-			}
-			s_ring_buffer_ptr[s_ring_buffer_iter].depth_pixel_field = malloc(4 * sizeof(uint32_t*));
-			for(uint8_t pixel_row = 0; pixel_row < 4; pixel_row++)
-			{
-				s_ring_buffer_ptr[s_ring_buffer_iter].depth_pixel_field[pixel_row] = malloc(4 * sizeof(uint32_t));
-			}
-			s_ring_buffer_ptr[s_ring_buffer_iter].horizontal_size = 4;
-			s_ring_buffer_ptr[s_ring_buffer_iter].vertical_size = 4;
-		}
+		//measurements stay flagged, the next convert picks them up
+		ESP_LOGE(TAG, "no payload block free for a depth frame.");
+		return 1;
 	}
 
 	for(uint8_t i = s_starting_iter; i != ending_iter; i++)
@@ -943,58 +1298,9 @@ static uint8_t TOF_CONVERT_READ_BUFFER_TO_ARRAY(void)
 			continue;
 		}
 
-		//determines subcapture of the data. used in 8x8 mode.
-		uint8_t convert_loop_cnt = s_measurement_buffer[i][0x04];
-		//ESP_LOGI(TAG, "buffer capture value is %x, subcapture %x.", convert_loop_cnt, convert_loop_cnt & 0x03);
 		//ESP_LOGI(TAG, "number of valid results is %u.", s_measurement_buffer[i][0x06]);
 
-		//convert i2c data to depth pixel grid
-		//note: nested for loops like this are fucking unreadable, do better
-		//note 2: remember that tmf packets actually send the closest and second closest object in each pixel, should record both.
-		if(s_is_tmf8828_mode)
-		{
-			for(uint8_t j = 0; j < 4; j++)
-			{
-				for(uint8_t k = 0; k < 2; k++)
-				{
-					//tmf8828 mode works upside down
-					uint8_t lin_val = 3 * (k + (j * 2));
-					uint8_t v_iter = (7 - (j * 2)) - ((convert_loop_cnt & 0x02) / 2);
-					uint8_t h_iter = (k * 4) + (2 * (convert_loop_cnt & 0x01));
-					//First Object
-					s_ring_buffer_ptr[s_ring_buffer_iter].depth_pixel_field[v_iter][h_iter] = 
-						(s_measurement_buffer[i][0x19 + lin_val]) + 
-						(s_measurement_buffer[i][0x1A + lin_val] << 8) + 
-						(s_measurement_buffer[i][0x18 + lin_val] << 24);
-					s_ring_buffer_ptr[s_ring_buffer_iter].depth_pixel_field[v_iter][h_iter + 1] = 
-						(s_measurement_buffer[i][0x34 + lin_val]) + 
-						(s_measurement_buffer[i][0x35 + lin_val] << 8) + 
-						(s_measurement_buffer[i][0x33 + lin_val] << 24);
-
-					//Second Object
-					s_ring_buffer_ptr[s_ring_buffer_iter].depth_pixel_field[v_iter + 8][h_iter] = 
-						(s_measurement_buffer[i][0x4F + lin_val]) + 
-						(s_measurement_buffer[i][0x50 + lin_val] << 8) + 
-						(s_measurement_buffer[i][0x4E + lin_val] << 24);
-					s_ring_buffer_ptr[s_ring_buffer_iter].depth_pixel_field[v_iter + 8][h_iter + 1] = 
-						(s_measurement_buffer[i][0x6A + lin_val]) + 
-						(s_measurement_buffer[i][0x6B + lin_val] << 8) + 
-						(s_measurement_buffer[i][0x69 + lin_val] << 24);
-				}
-			}
-		}
-		else
-		{
-			for(uint8_t j = 0; j < 4; j++)
-			{
-				for(uint8_t k = 0; k < 4; k++)
-				{
-					uint8_t lin_val = 3 * ((4 * j) + k);
-					s_ring_buffer_ptr[s_ring_buffer_iter].depth_pixel_field[j][k] = s_measurement_buffer[i][0x19 + lin_val];
-					s_ring_buffer_ptr[s_ring_buffer_iter].depth_pixel_field[j][k] += s_measurement_buffer[i][0x1A + lin_val] << 8;
-				}
-			}
-		}
+		TOF_DECODE_RESULT(tof_frame, s_measurement_buffer[i], s_is_tmf8828_mode);
 
 		//clear flag at buffer location so it can be used
 		s_measurement_flags &= ~(1 << i);
@@ -1008,34 +1314,121 @@ static uint8_t TOF_CONVERT_READ_BUFFER_TO_ARRAY(void)
 
 	ESP_LOGI(TAG, "starting iter is now: %u, flags are %lx.", s_starting_iter, s_measurement_flags);
 
-	s_ring_buffer_ptr[s_ring_buffer_iter].is_populated = true;
+	tof_frame->is_populated = true;
+	//the queue owns the frame reference now, subscribers retain it to keep the frame past their callback
 	message_info_t depth_array_msg;
-	depth_array_msg.message_data = (void*) &(s_ring_buffer_ptr[s_ring_buffer_iter]);
+	depth_array_msg.message_data = (void*) tof_frame;
 	depth_array_msg.message_size = sizeof(TOF_DATA_t);
-	depth_array_msg.is_pointer = false;
+	depth_array_msg.is_pointer = true;
+	depth_array_msg.is_inline = false;
+	depth_array_msg.request_id = MSG_REQUEST_NONE;
 	depth_array_msg.component_handle = ToF_public_component;
 	depth_array_msg.message_type = TOF_MSG_NEW_DEPTH_ARRAY;
+	//the frame carries on the trace started when its measurement was read
+	inherit_message_trace(s_tof_queue_id, &depth_array_msg);
 	send_message_to_priority_queue(depth_array_msg);
 
-	s_ring_buffer_iter++;
-	if(s_ring_buffer_iter >= DEPTH_ARRAY_BUF_SIZE)
+	return 0;
+}
+
+static TOF_DATA_t* TOF_ACQUIRE_FRAME(uint8_t horizontal_size, uint8_t vertical_size)
+{
+	//every frame is a large pool block whatever the mode, so switching modes never changes what is allocated
+	TOF_DATA_t* tof_frame = acquire_message_payload(sizeof(TOF_DATA_t));
+	if(tof_frame == NULL) return NULL;
+
+	//zones the sensor reports no second object for keep these zeros
+	memset(tof_frame, 0, sizeof(TOF_DATA_t));
+	tof_frame->horizontal_size = horizontal_size;
+	tof_frame->vertical_size = vertical_size;
+	tof_frame->is_populated = false;
+	return tof_frame;
+}
+
+void TOF_DECODE_RESULT(TOF_DATA_t* tof_frame, const uint8_t* result_block, bool is_tmf8828)
+{
+	const uint8_t* result = &result_block[TOF_RESULT_OFFSET];
+	if(!is_tmf8828)
 	{
-		s_ring_buffer_iter = 0;
+		//zones are in register order
+		for(uint8_t zone = 0; zone < TOF_TMF8821_ZONES; zone++, result += TOF_RESULT_LEN)
+		{
+			tof_frame->confidence[TOF_FIRST_OBJECT][zone] = result[0];
+			tof_frame->distance[TOF_FIRST_OBJECT][zone] = result[1] + (result[2] << 8);
+		}
+		return;
 	}
+	//byte 4 is the subcapture
+	const uint8_t* pair_zones = s_tmf8828_pair_zones[result_block[0x04] & 0x03];
+	for(uint8_t pair_iter = 0; pair_iter < TOF_TMF8828_PAIRS; pair_iter++, result += TOF_RESULT_LEN)
+	{
+		uint8_t zone = pair_zones[pair_iter];
+		for(uint8_t object = 0; object < TOF_FRAME_OBJECTS; object++)
+		{
+			//both zones of a pair are neighbours in every plane, so each plane takes one store per pair.
+			//The left zone goes in the low half, the frame is little endian like the sensor.
+			const uint8_t* left = result + (2 * object * TOF_TMF8828_PLANE_STRIDE);
+			const uint8_t* right = left + TOF_TMF8828_PLANE_STRIDE;
+			uint16_t confidence_pair = left[0] | (right[0] << 8);
+			uint32_t distance_pair = (left[1] | (left[2] << 8)) | ((uint32_t) (right[1] | (right[2] << 8)) << 16);
+			memcpy(&tof_frame->confidence[object][zone], &confidence_pair, sizeof(confidence_pair));
+			memcpy(&tof_frame->distance[object][zone], &distance_pair, sizeof(distance_pair));
+		}
+	}
+}
 
-	return 0;
+static void TOF_RESULT_READY_ISR(void* args)
+{
+	(void) args;
+	int64_t now_us = esp_timer_get_time();
+	//only the first edge counts, the line stays low until the result is read and cleared
+	portENTER_CRITICAL_ISR(&s_acq_lock);
+	if(s_result_ready_us == 0)
+	{
+		s_result_ready_us = now_us;
+	}
+	portEXIT_CRITICAL_ISR(&s_acq_lock);
+	if(s_acq_mode != TOF_ACQ_MODE_INTERRUPT || !s_is_measuring) return;
+
+	BaseType_t higher_priority_task_woken = pdFALSE;
+	message_info_t read_msg = {0};
+	read_msg.component_handle = s_internal_comp_handle;
+	read_msg.message_type = TOF_MSG_INTERNAL_READ_RESULT;
+	read_msg.trace_id = MSG_TRACE_NONE;
+	read_msg.request_id = MSG_REQUEST_NONE;
+	//a full ring means reads are already pending, any of them picks this result up
+	msg_ring_publish_from_isr(&s_tof_ring, read_msg, &higher_priority_task_woken);
+	portYIELD_FROM_ISR(higher_priority_task_woken);
+}
+
+static void TOF_POLL_RESULT(void* context)
+{
+	(void) context;
+	TOF_QUEUE_READ_RESULT();
 }
 
-static void TOF_MEASUREMENT_INTR_HANDLE(TimerHandle_t xTimer)
+static void TOF_QUEUE_READ_RESULT(void)
+{
+	if(!check_is_queue_active(s_tof_queue_id)) return;
+	message_info_t read_msg = {0};
+	read_msg.component_handle = s_internal_comp_handle;
+	read_msg.message_type = TOF_MSG_INTERNAL_READ_RESULT;
+	read_msg.trace_id = MSG_TRACE_NONE;
+	read_msg.request_id = MSG_REQUEST_NONE;
+	send_message_to_queue(s_tof_queue_id, read_msg);
+}
+
+static void TOF_READ_RESULT(void)
 {
 	uint8_t write_data[2] = {0, 0};
 	uint8_t read_data[1] = {0};
 
-	// Steps:
-
-	//Exit early if we are overwriting the buffer
-	//Should kick off a timer to retry handler at regular intervals
-	if(s_measurement_flags & (0x01 << s_measurement_iter)) return;
+	//Exit early if we are overwriting the buffer, the next convert retries
+	if(s_measurement_flags & (0x01 << s_measurement_iter))
+	{
+		s_is_read_deferred = true;
+		return;
+	}
 
 	//Read Interrupt Settings
 	//For example setting interrupts for results with this
@@ -1044,11 +1437,40 @@ static void TOF_MEASUREMENT_INTR_HANDLE(TimerHandle_t xTimer)
 
 	//ESP_LOGI(TAG, "interrupts that need to be cleared are the following: %u.", read_data[0]);
 
+	//the edge for the next result can only come after this one is cleared, so the timestamp is taken here
+	int64_t read_start_us = esp_timer_get_time();
+	portENTER_CRITICAL(&s_acq_lock);
+	int64_t ready_us = s_result_ready_us;
+	s_result_ready_us = 0;
+	if(!(read_data[0] & 0x02))
+	{
+		s_acq_stats.empty_polls++;
+	}
+	portEXIT_CRITICAL(&s_acq_lock);
+
 	if(!(read_data[0] & 0x02)) return;
 	
 	// Read out Measurement
 	write_data[0] = 0x20;
-	if(!TOF_READ_WRITE_APP(s_measurement_buffer[s_measurement_iter], MEASUREMENT_DAT_SIZE, write_data, 1, 1) == ESP_OK) return;
+	if(TOF_READ_WRITE_APP(s_measurement_buffer[s_measurement_iter], MEASUREMENT_DAT_SIZE, write_data, 1, 1) != ESP_OK) return;
+
+	portENTER_CRITICAL(&s_acq_lock);
+	s_acq_stats.reads++;
+	if(ready_us == 0)
+	{
+		s_acq_stats.untimed_reads++;
+	}
+	else
+	{
+		uint32_t latency_us = (uint32_t) (read_start_us - ready_us);
+		s_acq_stats.last_latency_us = latency_us;
+		s_acq_stats.total_latency_us += latency_us;
+		if(latency_us > s_acq_stats.max_latency_us)
+		{
+			s_acq_stats.max_latency_us = latency_us;
+		}
+	}
+	portEXIT_CRITICAL(&s_acq_lock);
 
 	//Set flags for buffers
 	s_measurement_flags |= (1 << s_measurement_iter);
@@ -1061,21 +1483,24 @@ static void TOF_MEASUREMENT_INTR_HANDLE(TimerHandle_t xTimer)
 	}
 
 	//Queue Message to Process Read Buffer
-	if(check_is_queue_active(1))
+	if(check_is_queue_active(s_tof_queue_id))
 	{
 		message_info_t convert_i2c_msg;
 		convert_i2c_msg.message_data=NULL;
 		convert_i2c_msg.message_size=0;
 		convert_i2c_msg.is_pointer=false;
+		convert_i2c_msg.is_inline=false;
+		convert_i2c_msg.request_id=MSG_REQUEST_NONE;
 		convert_i2c_msg.component_handle=s_internal_comp_handle;
 		convert_i2c_msg.message_type=TOF_MSG_INTERNAL_CONVERT_I2C;
-		send_message_to_priority_queue(convert_i2c_msg);
+		start_message_trace(&convert_i2c_msg);
+		send_message_to_queue(s_tof_queue_id, convert_i2c_msg);
 	}
 
 	//Clear pending interrupts
 	write_data[0] = 0xE1;
 	write_data[1] = read_data[0];
-	if(TOF_WRITE_APP(write_data, 2, 1) != ESP_OK) return;
+	TOF_WRITE_APP(write_data, 2, 1);
 
 	//ESP_LOGI(TAG, "Read measurement successfully, measurement buffer at %u.", s_measurement_iter);
-}
\ No newline at end of file
+}
@@ -15,21 +15,98 @@
 #define tmf8828_fac_cal_3	"tmf8828_fac_3"
 #define tmf8828_fac_cal_4	"tmf8828_fac_4"
 
+// Timing
+#define TOF_FACTORY_CAL_POLL_MS 1000
+#define TOF_FACTORY_CAL_ATTEMPTS 5
+#define TOF_REQUEST_TIMEOUT_MS 2000 //how long a TOF_MSG_REQUEST_* caller waits for the response
+#define TOF_FACTORY_CAL_TIMEOUT_MS 30000 //up to four calibrations of TOF_FACTORY_CAL_ATTEMPTS polls, plus margin
+
+// tmf8828 mode has the largest grid, 8x8 zones with up to two objects in each
+#define TOF_FRAME_MAX_ZONES 64
+#define TOF_FRAME_OBJECTS 2
+#define TOF_FIRST_OBJECT 0 //closest object in each zone
+#define TOF_SECOND_OBJECT 1
+
+// Frames are fixed size so they always come from the same payload pool class. Every plane is
+// indexed by zone and only the first horizontal_size * vertical_size zones are used. A zone
+// without a second object has distance and confidence 0 in the second object planes.
 typedef struct
 {
-    uint32_t** depth_pixel_field;
     uint8_t horizontal_size;
     uint8_t vertical_size;
     bool is_populated;
+    uint16_t distance[TOF_FRAME_OBJECTS][TOF_FRAME_MAX_ZONES]; //mm
+    uint8_t confidence[TOF_FRAME_OBJECTS][TOF_FRAME_MAX_ZONES];
 } TOF_DATA_t;
 
+// Zones are row-major with a stride of horizontal_size, so a row or a whole plane is a linear scan.
+#define TOF_FRAME_ZONE(frame, row, column) (((row) * (frame)->horizontal_size) + (column))
+
+// How finished results are noticed. Interrupt mode reads a result as soon as TOF_INTR falls,
+// polling checks the result status every poll period on the sensor scheduler. Either way the
+// read itself runs on the tof queue task, like every other ToF I2C transaction.
+typedef enum
+{
+    TOF_ACQ_MODE_INTERRUPT,
+    TOF_ACQ_MODE_POLLING,
+} TOF_ACQ_MODE_t;
+
+typedef struct
+{
+    uint32_t reads; //results read off the sensor
+    uint32_t empty_polls; //status reads that found no result ready
+    uint32_t untimed_reads; //results read without a TOF_INTR edge to time them from
+    uint32_t last_latency_us; //TOF_INTR edge to the start of the result read
+    uint32_t max_latency_us;
+    uint64_t total_latency_us;
+} TOF_ACQ_STATS_t;
+
+// How firmware goes to the bootloader when the app isn't running. Fast mode is the default, safe mode
+// sends the smaller chunks the driver always used and logs every packet for bring-up.
+typedef enum
+{
+    TOF_FW_DOWNLOAD_MODE_FAST,
+    TOF_FW_DOWNLOAD_MODE_SAFE,
+} TOF_FW_DOWNLOAD_MODE_t;
+
+typedef struct
+{
+    uint32_t boot_us; //first app id check to the app running, includes the download
+    uint32_t download_us; //firmware address command to the app running
+    uint16_t chunks;
+    uint16_t busy_polls; //status reads that found the bootloader still busy with a chunk
+    uint8_t chunk_len;
+    bool is_downloaded; //false when the app was already running
+} TOF_BOOT_STATS_t;
+
 typedef enum
 {
     TOF_MSG_INTERNAL_CONVERT_I2C,
     TOF_MSG_NEW_DEPTH_ARRAY,
+    TOF_MSG_INTERNAL_FACTORY_CAL,
+    TOF_MSG_FACTORY_CAL_DONE, //inline uint8_t, 0 on success
+    // Requests to ToF_public_component on the queue from TOF_GET_QUEUE_ID, see send_request. The status of
+    // every response is the return code of the matching driver call.
+    TOF_MSG_REQUEST_LOAD_CONFIG, //inline uint8_t config
+    TOF_MSG_REQUEST_RESET,
+    TOF_MSG_REQUEST_SET_MODE, //inline bool, responds with the mode now set
+    TOF_MSG_REQUEST_FACTORY_CAL, //responds with the calibration status once the calibration has finished
+    TOF_MSG_REQUEST_CAL_STATUS, //responds with the calibration status byte
+    TOF_MSG_REQUEST_STORE_CAL,
+    TOF_MSG_REQUEST_LOAD_CAL,
+    TOF_MSG_REQUEST_START_MEASUREMENTS,
+    TOF_MSG_REQUEST_STOP_MEASUREMENTS,
+    TOF_MSG_REQUEST_SET_ACQ_MODE, //inline uint8_t TOF_ACQ_MODE_t
+    TOF_MSG_INTERNAL_READ_RESULT, //posted by TOF_INTR and the poll job, the read runs on the tof queue task
     TOF_MSG_MAX,
 } TOF_MESSAGE_TYPES_t;
 
+#define TOF_REQUEST_TYPE_MASK (MSG_TYPE_BIT(TOF_MSG_REQUEST_LOAD_CONFIG) | MSG_TYPE_BIT(TOF_MSG_REQUEST_RESET) | \
+    MSG_TYPE_BIT(TOF_MSG_REQUEST_SET_MODE) | MSG_TYPE_BIT(TOF_MSG_REQUEST_FACTORY_CAL) | MSG_TYPE_BIT(TOF_MSG_REQUEST_CAL_STATUS) | \
+    MSG_TYPE_BIT(TOF_MSG_REQUEST_STORE_CAL) | MSG_TYPE_BIT(TOF_MSG_REQUEST_LOAD_CAL) | \
+    MSG_TYPE_BIT(TOF_MSG_REQUEST_START_MEASUREMENTS) | MSG_TYPE_BIT(TOF_MSG_REQUEST_STOP_MEASUREMENTS) | \
+    MSG_TYPE_BIT(TOF_MSG_REQUEST_SET_ACQ_MODE))
+
 extern component_handle_t ToF_public_component;
 
 // Initializes firmware on TOF sensor.
@@ -44,8 +121,13 @@ uint8_t TOF_RESET(void);
 // Performs Factory Calibration.
 // If there is an existing factory calibration, load it.
 // Return Failure if SPAD map does not match between sensor and factory calibration.
+// With the tof queue running this only starts the calibration, which then steps itself along with
+// delayed messages and sends TOF_MSG_FACTORY_CAL_DONE to the priority queue when finished.
+// Returns 2 if one is already running.
 uint8_t TOF_FACTORY_CALIBRATION(void);
 
+bool TOF_IS_FACTORY_CALIBRATION_RUNNING(void);
+
 // Store Factory Calibration to Flash Memory
 uint8_t TOF_STORE_FACTORY_CALIBRATION(void);
 
@@ -65,6 +147,33 @@ uint8_t TOF_START_MEASUREMENTS(void);
 // Tells TOF Sensor to stop measuring data.
 uint8_t TOF_STOP_MEASUREMENTS(void);
 
+// Switches how results are picked up, also while measuring. Interrupt mode is the default.
+// Return 1 for an unknown mode.
+uint8_t TOF_SET_ACQUISITION_MODE(TOF_ACQ_MODE_t mode);
+
+TOF_ACQ_MODE_t TOF_GET_ACQUISITION_MODE(void);
+
+// Latency is timed from the TOF_INTR edge in both modes, polling only stops acting on it.
+void TOF_GET_ACQUISITION_STATS(TOF_ACQ_STATS_t* stats);
+
+void TOF_RESET_ACQUISITION_STATS(void);
+
+// Takes effect at the next download, on TOF_INIT or TOF_RESET.
+void TOF_SET_FIRMWARE_DOWNLOAD_MODE(TOF_FW_DOWNLOAD_MODE_t mode);
+
+TOF_FW_DOWNLOAD_MODE_t TOF_GET_FIRMWARE_DOWNLOAD_MODE(void);
+
+// Timing of the last boot, from TOF_INIT or TOF_RESET.
+void TOF_GET_BOOT_STATS(TOF_BOOT_STATS_t* stats);
+
+// Queue the driver serves requests and sensor reads on, created by TOF_INIT when the priority queue runs.
+// Depth frames still go out on the priority queue. MSG_QUEUE_INVALID when there is no tof queue.
+uint8_t TOF_GET_QUEUE_ID(void);
+
+// Decodes one 0x84 byte result block, as read from register 0x20, into the frame. In tmf8828 mode
+// a block only fills the quarter of the 8x8 zones named by its subcapture.
+void TOF_DECODE_RESULT(TOF_DATA_t* tof_frame, const uint8_t* result_block, bool is_tmf8828);
+
 // Set TOF sensor mode for measurements
 bool TOF_SET_TMF8828_MODE(bool set_tmf8828);
 
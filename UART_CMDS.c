@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <fcntl.h>
 
@@ -17,13 +18,17 @@
 #include "FLASH_SPI.h"
 #include "IMU_SPI.h"
 #include "MESSAGE_QUEUE.h"
+#include "MSG_TRACE.h"
 #include "MTR_DRVR.h"
 #include "NAV_ALGO.h"
+#include "SENSOR_SCHED.h"
 
 #define UART_MAX_ARGS 10
 #define UART_INVALID_CHARACTER 100
 #define UART_SERIAL_MAX 200
 #define RAW_HEADER_BASE 6
+#define UART_INVALID_QUEUE 0xFF
+#define UART_HEX_LINE_BYTES 16
 
 static const char *TAG = "USB_UART";
 
@@ -32,6 +37,8 @@ static component_handle_t s_uart_component_handle = 0;
 static bool s_has_component_handle = false;
 static bool s_serialize = false;
 static callback_handle_t UART_callback_handles[dispatcher_max] = {0};
+static callback_handle_t s_wildcard_callback_handles[MAX_MESSAGE_QUEUES] = {0};
+static dispatcher_type_t s_component_dispatchers[MAX_COMPONENT_REGISTRATIONS]; //filled in on registration
 static callback_handle_t s_ToF_callback_handle;
 static callback_handle_t s_imu_callback_handle;
 static callback_handle_t s_nav_callback_handle;
@@ -43,6 +50,7 @@ static dispatcher_type_t uart_get_dispatcher(char * disp_str);
 static uint8_t uart_convert_str_to_args(char * cmd_buf, char** argv_ptr, uint8_t argv_max);
 static uint8_t uart_convert_str_to_handedness(char * cmd_buf);
 static mtr_direction_t uart_convert_str_to_direction(char * cmd_buf);
+static uint8_t uart_convert_str_to_queuetype(char * cmd_buf);
 static void run_command(uint8_t rx_size, char *buf);
 
 // message queue functions
@@ -52,6 +60,9 @@ static char* uart_return_string_from_dispatcher(dispatcher_type_t dispatcher);
 static dispatcher_type_t uart_get_dispatcher_from_component(component_handle_t component);
 static component_handle_t uart_get_component_handle_from_dispatcher(dispatcher_type_t dispatcher);
 static bool uart_does_component_have_a_handle(dispatcher_type_t dispatcher);
+static void uart_map_component_dispatchers(void);
+static void uart_register_wildcard_cb(uint8_t argc, char** argv);
+static void uart_unregister_wildcard_cb(uint8_t argc, char** argv);
 
 // uart command lists
 
@@ -64,6 +75,10 @@ static void uart_imu_cmds(uint8_t argc, char** argv);
 static void uart_mtr_cmds(uint8_t argc, char** argv);
 static void uart_serial_cmds(uint8_t argc, char** argv);
 static void uart_nav_cmds(uint8_t argc, char** argv);
+static void uart_sched_cmds(uint8_t argc, char** argv);
+
+static uint8_t uart_send_tof_request(uint8_t request_type, uint8_t argument, const char* request_name, uint32_t timeout_ms);
+static void uart_tof_response_handler(uint16_t request_id, uint8_t status, void* response_data, size_t response_size, void* context);
 
 // function defs
 
@@ -81,11 +96,11 @@ static void uart_tof_cmds(uint8_t argc, char** argv)
         {
             config_type = (uint8_t) (argv[2][0] - '0');
         }
-        TOF_LOAD_CONFIG(config_type);
+        uart_send_tof_request(TOF_MSG_REQUEST_LOAD_CONFIG, config_type, "load_config", TOF_REQUEST_TIMEOUT_MS);
     }
     else if(strcmp((char*) argv[1], (const char*) "reset_tof") == 0)
     {
-        TOF_RESET();
+        uart_send_tof_request(TOF_MSG_REQUEST_RESET, 0, "reset_tof", TOF_REQUEST_TIMEOUT_MS);
     }
     else if(strcmp((char*) argv[1], (const char*) "read_i2c") == 0)
     {
@@ -166,24 +181,18 @@ static void uart_tof_cmds(uint8_t argc, char** argv)
     }
     else if(strcmp((char*) argv[1], (const char*) "factory_calibrate") == 0)
     {
-        //factory calibration
-        uint8_t err = TOF_FACTORY_CALIBRATION();
-        ESP_LOGI(TAG, "Error code is: %u", err);
-
-        err = TOF_RETURN_CALIBRATION_STATUS();
-        ESP_LOGI(TAG, "calibration status is is: %x", err);
+        //factory calibration, the response carries the calibration status
+        uart_send_tof_request(TOF_MSG_REQUEST_FACTORY_CAL, 0, "factory_calibrate", TOF_FACTORY_CAL_TIMEOUT_MS);
     }
     else if(strcmp((char*) argv[1], (const char*) "store_calibration") == 0)
     {
         //store calibration
-        uint8_t err = TOF_STORE_FACTORY_CALIBRATION();
-        ESP_LOGI(TAG, "Error code is: %u", err);
+        uart_send_tof_request(TOF_MSG_REQUEST_STORE_CAL, 0, "store_calibration", TOF_REQUEST_TIMEOUT_MS);
     }
     else if(strcmp((char*) argv[1], (const char*) "load_calibration") == 0)
     {
         //load calibration
-        uint8_t err = TOF_LOAD_FACTORY_CALIBRATION();
-        ESP_LOGI(TAG, "Error code is: %u", err);
+        uart_send_tof_request(TOF_MSG_REQUEST_LOAD_CAL, 0, "load_calibration", TOF_REQUEST_TIMEOUT_MS);
     }
     else if(strcmp((char*) argv[1], (const char*) "read_cal_flash") == 0)
     {
@@ -274,16 +283,14 @@ static void uart_tof_cmds(uint8_t argc, char** argv)
     else if(strcmp((char*) argv[1], (const char*) "start_measurements") == 0)
     {
         //start taking measurements from sensor
-        s_ToF_callback_handle = register_priority_handler_for_messages(uart_msg_queue_handler, ToF_public_component);
-        uint8_t err = TOF_START_MEASUREMENTS();
-        ESP_LOGI(TAG, "Error code is: %u", err);
+        s_ToF_callback_handle = register_priority_deferred_handler_for_message_types(uart_msg_queue_handler, ToF_public_component, MSG_TYPE_BIT(TOF_MSG_NEW_DEPTH_ARRAY));
+        uart_send_tof_request(TOF_MSG_REQUEST_START_MEASUREMENTS, 0, "start_measurements", TOF_REQUEST_TIMEOUT_MS);
     }
     else if(strcmp((char*) argv[1], (const char*) "stop_measurements") == 0)
     {
         //stop taking measurements from sensor
-        uint8_t err = TOF_STOP_MEASUREMENTS();
-        ESP_LOGI(TAG, "Error code is: %u", err);
-        err = unregister_priority_handler_for_messages(ToF_public_component, s_ToF_callback_handle);
+        uart_send_tof_request(TOF_MSG_REQUEST_STOP_MEASUREMENTS, 0, "stop_measurements", TOF_REQUEST_TIMEOUT_MS);
+        uint8_t err = unregister_priority_handler_for_messages(ToF_public_component, s_ToF_callback_handle);
         ESP_LOGI(TAG, "Unreigster error code is: %u", err);
         s_ToF_callback_handle = 0;
     }
@@ -300,18 +307,129 @@ static void uart_tof_cmds(uint8_t argc, char** argv)
         {
             set_mode = true;
         }
-        bool mode_val = TOF_SET_TMF8828_MODE(set_mode);
-        if(mode_val)
+        uart_send_tof_request(TOF_MSG_REQUEST_SET_MODE, set_mode, "set_tof_mode", TOF_REQUEST_TIMEOUT_MS);
+    }
+    else if(strcmp((char*) argv[1], (const char*) "acq_mode") == 0)
+    {
+        //pick up results on TOF_INTR or by polling the result status
+        if(argc < 3)
+        {
+            ESP_LOGE(TAG, "Incorrect size args");
+            return;
+        }
+        TOF_ACQ_MODE_t acq_mode;
+        if(strcmp((char*) argv[2], (const char*) "intr") == 0)
+        {
+            acq_mode = TOF_ACQ_MODE_INTERRUPT;
+        }
+        else if(strcmp((char*) argv[2], (const char*) "poll") == 0)
         {
-            ESP_LOGI(TAG, "Mode is now tmf8828.");
+            acq_mode = TOF_ACQ_MODE_POLLING;
         }
         else
         {
-            ESP_LOGI(TAG, "Mode is now tmf8821.");
+            ESP_LOGE(TAG, "acq_mode is intr or poll");
+            return;
+        }
+        uart_send_tof_request(TOF_MSG_REQUEST_SET_ACQ_MODE, (uint8_t) acq_mode, "acq_mode", TOF_REQUEST_TIMEOUT_MS);
+    }
+    else if(strcmp((char*) argv[1], (const char*) "acq_stats") == 0)
+    {
+        TOF_ACQ_STATS_t stats;
+        TOF_GET_ACQUISITION_STATS(&stats);
+        uint32_t timed_reads = stats.reads - stats.untimed_reads;
+        ESP_LOGI(TAG, "%s mode: reads %lu, empty polls %lu, untimed reads %lu",
+            (TOF_GET_ACQUISITION_MODE() == TOF_ACQ_MODE_INTERRUPT) ? "intr" : "poll",
+            (unsigned long) stats.reads, (unsigned long) stats.empty_polls, (unsigned long) stats.untimed_reads);
+        ESP_LOGI(TAG, "  ready to read latency avg %lu us, last %lu us, max %lu us",
+            (unsigned long) (timed_reads ? stats.total_latency_us / timed_reads : 0),
+            (unsigned long) stats.last_latency_us, (unsigned long) stats.max_latency_us);
+    }
+    else if(strcmp((char*) argv[1], (const char*) "acq_reset") == 0)
+    {
+        TOF_RESET_ACQUISITION_STATS();
+        ESP_LOGI(TAG, "tof acquisition stats cleared.");
+    }
+    else if(strcmp((char*) argv[1], (const char*) "fw_mode") == 0)
+    {
+        //only used when the bootloader is running, so follow with reset_tof to time it
+        if(argc < 3)
+        {
+            ESP_LOGE(TAG, "Incorrect size args");
+            return;
+        }
+        if(strcmp((char*) argv[2], (const char*) "fast") == 0)
+        {
+            TOF_SET_FIRMWARE_DOWNLOAD_MODE(TOF_FW_DOWNLOAD_MODE_FAST);
+        }
+        else if(strcmp((char*) argv[2], (const char*) "safe") == 0)
+        {
+            TOF_SET_FIRMWARE_DOWNLOAD_MODE(TOF_FW_DOWNLOAD_MODE_SAFE);
+        }
+        else
+        {
+            ESP_LOGE(TAG, "fw_mode is fast or safe");
+            return;
+        }
+        ESP_LOGI(TAG, "tof firmware download mode set to %s.", argv[2]);
+    }
+    else if(strcmp((char*) argv[1], (const char*) "boot_stats") == 0)
+    {
+        TOF_BOOT_STATS_t stats;
+        TOF_GET_BOOT_STATS(&stats);
+        ESP_LOGI(TAG, "%s download mode: boot %lu us", (TOF_GET_FIRMWARE_DOWNLOAD_MODE() == TOF_FW_DOWNLOAD_MODE_FAST) ? "fast" : "safe",
+            (unsigned long) stats.boot_us);
+        if(stats.is_downloaded)
+        {
+            ESP_LOGI(TAG, "  firmware download %lu us, %u chunks of %u bytes, %u busy polls",
+                (unsigned long) stats.download_us, stats.chunks, stats.chunk_len, stats.busy_polls);
+        }
+        else
+        {
+            ESP_LOGI(TAG, "  app was already running, no download");
         }
     }
 }
 
+// ToF commands are requests served on the tof queue task, which owns the sensor's I2C bus.
+// Responses come back on the normal queue when it runs, otherwise on the priority queue.
+static uint8_t uart_send_tof_request(uint8_t request_type, uint8_t argument, const char* request_name, uint32_t timeout_ms)
+{
+    message_info_t request;
+    set_message_inline_payload(&request, &argument, sizeof(argument));
+    request.component_handle = ToF_public_component;
+    request.message_type = request_type;
+    request.trace_id = MSG_TRACE_NONE;
+    uint8_t reply_queue_id = check_is_queue_active(MSG_QUEUE_NORMAL) ? MSG_QUEUE_NORMAL : MSG_QUEUE_PRIORITY;
+    uint16_t request_id = MSG_REQUEST_NONE;
+    uint8_t err = send_request(TOF_GET_QUEUE_ID(), request, reply_queue_id, uart_tof_response_handler, (void*) request_name, timeout_ms, &request_id);
+    if(err)
+    {
+        ESP_LOGE(TAG, "could not send %s request, error code is: %u", request_name, err);
+        return err;
+    }
+    ESP_LOGI(TAG, "sent %s request %u.", request_name, request_id);
+    return 0;
+}
+
+static void uart_tof_response_handler(uint16_t request_id, uint8_t status, void* response_data, size_t response_size, void* context)
+{
+    const char* request_name = (const char*) context;
+    if(status == MSG_RPC_TIMEOUT)
+    {
+        ESP_LOGE(TAG, "%s request %u timed out.", request_name, request_id);
+        return;
+    }
+    if(response_size)
+    {
+        ESP_LOGI(TAG, "%s request %u finished, error code is: %u, response is: %x", request_name, request_id, status, *((uint8_t*) response_data));
+    }
+    else
+    {
+        ESP_LOGI(TAG, "%s request %u finished, error code is: %u", request_name, request_id, status);
+    }
+}
+
 static void uart_flash_cmds(uint8_t argc, char** argv)
 {
     if(argc < 2)
@@ -503,6 +621,11 @@ static void uart_msg_queue_cmds(uint8_t argc, char** argv)
             ESP_LOGE(TAG, "Incorrect size args");
             return;
         }
+        if(strcmp((char*) argv[2], (const char*) "all") == 0)
+        {
+            uart_register_wildcard_cb(argc, argv);
+            return;
+        }
         dispatcher_type_t callback_index = uart_get_dispatcher(argv[2]);
         if(!uart_does_component_have_a_handle(callback_index))
         {
@@ -510,8 +633,9 @@ static void uart_msg_queue_cmds(uint8_t argc, char** argv)
             return;
         }
         component_handle_t component = uart_get_component_handle_from_dispatcher(callback_index);
+        uart_map_component_dispatchers();
         ESP_LOGI(TAG, "registering UART handler for %s messages:", uart_return_string_from_dispatcher(callback_index));
-        UART_callback_handles[callback_index] = register_component_handler_for_messages(uart_msg_queue_handler, component);
+        UART_callback_handles[callback_index] = register_component_deferred_handler_for_message_types(uart_msg_queue_handler, component, MSG_TYPE_MASK_ALL);
         if(UART_callback_handles[callback_index]) //returning 0 means no callback handle was generated.
         {
             ESP_LOGI(TAG, "registration successful!");
@@ -528,6 +652,11 @@ static void uart_msg_queue_cmds(uint8_t argc, char** argv)
             ESP_LOGE(TAG, "Incorrect size args");
             return;
         }
+        if(strcmp((char*) argv[2], (const char*) "all") == 0)
+        {
+            uart_unregister_wildcard_cb(argc, argv);
+            return;
+        }
         dispatcher_type_t callback_index = uart_get_dispatcher(argv[2]);
         if(!uart_does_component_have_a_handle(callback_index))
         {
@@ -563,38 +692,54 @@ static void uart_msg_queue_cmds(uint8_t argc, char** argv)
             message_info_t message;
             message.component_handle = s_uart_component_handle;
             message.message_type = 0;
-            message.is_pointer = false;
-            char* uart_msg = malloc(sizeof(char) * (strlen(argv[3]) + 1));
-            memcpy(uart_msg, argv[3], sizeof(char) * strlen(argv[3]));
-            uart_msg[strlen(argv[3])] = '\0';
-            message.message_data = (void*) uart_msg;
-            message.message_size = sizeof(char) * (strlen(argv[3]) + 1);
+            message.trace_id = MSG_TRACE_NONE;
+            message.request_id = MSG_REQUEST_NONE;
+            //short strings travel inside the message, longer ones take a pool block
+            if(set_message_inline_payload(&message, argv[3], sizeof(char) * (strlen(argv[3]) + 1)))
+            {
+                char* uart_msg = acquire_message_payload(sizeof(char) * (strlen(argv[3]) + 1));
+                if(uart_msg == NULL)
+                {
+                    ESP_LOGE(TAG, "message payload pool is exhausted.");
+                    return;
+                }
+                memcpy(uart_msg, argv[3], sizeof(char) * strlen(argv[3]));
+                uart_msg[strlen(argv[3])] = '\0';
+                message.message_data = (void*) uart_msg;
+                message.message_size = sizeof(char) * (strlen(argv[3]) + 1);
+                message.is_pointer = true;
+                message.is_inline = false;
+            }
             if(strcmp((char*) argv[2], (const char*) "priority") == 0)
             {
-                if(check_is_queue_active(1))
+                if(check_is_queue_active(MSG_QUEUE_PRIORITY))
                 {
                     send_message_to_priority_queue(message);
                     ESP_LOGI(TAG, "sent priority queue message with payload %s.", argv[3]);
                 }
                 else
                 {
+                    //ignored for inline payloads, they are not pool blocks
+                    release_message_payload(message.message_data);
                     ESP_LOGE(TAG, "priority queue is inactive.");
                 }
             }
             else if(strcmp((char*) argv[2], (const char*) "normal") == 0)
             {
-                if(check_is_queue_active(0))
+                if(check_is_queue_active(MSG_QUEUE_NORMAL))
                 {
                     send_message_to_normal_queue(message);
                     ESP_LOGI(TAG, "sent normal queue message with payload %s.", argv[3]);
                 }
                 else
                 {
+                    release_message_payload(message.message_data);
                     ESP_LOGE(TAG, "normal queue is inactive.");
                 }
             }
             else
             {
+                release_message_payload(message.message_data);
                 ESP_LOGE(TAG, "send failed, must set priority");
             }
         }
@@ -614,11 +759,158 @@ static void uart_msg_queue_cmds(uint8_t argc, char** argv)
             ESP_LOGI(TAG, "successfully deleted all queue component handles.");
         }
     }
+    else if(strcmp((char*) argv[1], (const char*) "msg_pool_stats") == 0)
+    {
+        msg_pool_stats_t pool_stats;
+        for(msg_pool_class_t pool_class = 0; pool_class < MSG_POOL_CLASS_MAX; pool_class++)
+        {
+            if(get_message_pool_stats(pool_class, &pool_stats))
+            {
+                ESP_LOGE(TAG, "failed to read stats for pool class %u.", pool_class);
+                continue;
+            }
+            ESP_LOGI(TAG, "%zu byte blocks: %u/%u in use, high water %u, acquired %lu, exhausted %lu.",
+                pool_stats.block_size, pool_stats.blocks_in_use, pool_stats.block_count, pool_stats.high_water_mark,
+                (unsigned long) pool_stats.acquire_count, (unsigned long) pool_stats.exhausted_count);
+        }
+    }
+    else if(strcmp((char*) argv[1], (const char*) "msg_batch") == 0)
+    {
+        if(argc < 3)
+        {
+            ESP_LOGE(TAG, "Incorrect size args");
+            return;
+        }
+        uint8_t queuetype = uart_convert_str_to_queuetype((char*) argv[2]);
+        if(queuetype == UART_INVALID_QUEUE)
+        {
+            ESP_LOGE(TAG, "must specify normal, priority or a queue id.");
+            return;
+        }
+        if(argc > 3)
+        {
+            uint8_t batch_size = 0;
+            for(uint8_t i = 0; i < strlen(argv[3]); i++)
+            {
+                if(argv[3][i] >= '0' && argv[3][i] <= '9')
+                {
+                    batch_size = batch_size * 10;
+                    batch_size += (uint8_t) (argv[3][i] - '0');
+                }
+            }
+            if(set_queue_batch_size(queuetype, batch_size))
+            {
+                ESP_LOGE(TAG, "batch size must be between 1 and %u.", MAX_QUEUE_BATCH_SIZE);
+                return;
+            }
+        }
+        queue_batch_stats_t batch_stats;
+        get_queue_batch_stats(queuetype, &batch_stats);
+        ESP_LOGI(TAG, "%s queue batch size %u: %lu messages over %lu wakeups, average batch %u.%02u.",
+            argv[2], batch_stats.batch_size, (unsigned long) batch_stats.messages_dispatched,
+            (unsigned long) batch_stats.wakeups, batch_stats.average_batch_x100 / 100, batch_stats.average_batch_x100 % 100);
+    }
+    else if(strcmp((char*) argv[1], (const char*) "msg_stats") == 0)
+    {
+        if(argc < 3)
+        {
+            ESP_LOGE(TAG, "Incorrect size args");
+            return;
+        }
+        uint8_t queuetype = uart_convert_str_to_queuetype((char*) argv[2]);
+        if(queuetype == UART_INVALID_QUEUE)
+        {
+            ESP_LOGE(TAG, "must specify normal, priority or a queue id.");
+            return;
+        }
+        queue_stats_t queue_stats;
+        get_queue_stats(queuetype, &queue_stats);
+        ESP_LOGI(TAG, "%s queue: enqueued %lu, dropped %lu, evicted %lu, coalesced %lu, high water %u/%u, max latency %lu us.",
+            argv[2], (unsigned long) queue_stats.enqueued, (unsigned long) queue_stats.dropped,
+            (unsigned long) queue_stats.evicted, (unsigned long) queue_stats.coalesced,
+            queue_stats.depth_high_water, MESSAGE_QUEUE_LENGTH, (unsigned long) queue_stats.max_latency_us);
+        ESP_LOGI(TAG, "deferred to workers %lu, worker queue full %lu, delayed messages pending %u/%u.",
+            (unsigned long) queue_stats.deferred, (unsigned long) queue_stats.deferred_dropped,
+            get_delayed_message_count(), MAX_DELAYED_MESSAGES);
+        for(uint8_t bucket = 0; bucket < QUEUE_LATENCY_BUCKETS; bucket++)
+        {
+            if(bucket == QUEUE_LATENCY_BUCKETS - 1)
+            {
+                ESP_LOGI(TAG, "  >= %lu us: %lu", 1UL << (QUEUE_LATENCY_BUCKET_0_SHIFT + bucket - 1),
+                    (unsigned long) queue_stats.latency_histogram[bucket]);
+            }
+            else
+            {
+                ESP_LOGI(TAG, "  < %lu us: %lu", 1UL << (QUEUE_LATENCY_BUCKET_0_SHIFT + bucket),
+                    (unsigned long) queue_stats.latency_histogram[bucket]);
+            }
+        }
+        if(argc > 3 && strcmp((char*) argv[3], (const char*) "reset") == 0)
+        {
+            reset_queue_stats(queuetype);
+            ESP_LOGI(TAG, "%s queue stats reset.", argv[2]);
+        }
+    }
+    else if(strcmp((char*) argv[1], (const char*) "msg_trace") == 0)
+    {
+        msg_trace_stage_stats_t stage_stats;
+        for(uint8_t stage = 0; !get_trace_stage_stats(stage, &stage_stats); stage++)
+        {
+            ESP_LOGI(TAG, "%s type %u: %lu frames, average %lu us, max %lu us, last frame %u took %lu us.",
+                uart_return_string_from_dispatcher(uart_get_dispatcher_from_component(stage_stats.component_handle)),
+                stage_stats.message_type, (unsigned long) stage_stats.count,
+                (unsigned long) (stage_stats.total_latency_us / stage_stats.count), (unsigned long) stage_stats.max_latency_us,
+                stage_stats.last_trace_id, (unsigned long) stage_stats.last_latency_us);
+        }
+        if(argc > 2 && strcmp((char*) argv[2], (const char*) "reset") == 0)
+        {
+            reset_trace_stats();
+            ESP_LOGI(TAG, "trace stats reset.");
+        }
+    }
+    else if(strcmp((char*) argv[1], (const char*) "msg_events") == 0)
+    {
+        if(argc < 3)
+        {
+            ESP_LOGE(TAG, "Incorrect size args");
+            return;
+        }
+        if(strcmp((char*) argv[2], (const char*) "dump") == 0)
+        {
+            //binary only, the functional tests decoder turns this back into a timeline
+            uint8_t serial_out[UART_SERIAL_MAX];
+            bool was_enabled = msg_trace_is_enabled();
+            msg_trace_enable(false);
+            size_t blob_offset = 0;
+            size_t chunk_size;
+            while((chunk_size = msg_trace_serialize(serial_out, UART_SERIAL_MAX, blob_offset)) > 0)
+            {
+                fwrite(serial_out, sizeof(uint8_t), chunk_size, stdout);
+                blob_offset += chunk_size;
+            }
+            fflush(stdout);
+            msg_trace_enable(was_enabled);
+        }
+        else if(strcmp((char*) argv[2], (const char*) "clear") == 0)
+        {
+            msg_trace_clear();
+            ESP_LOGI(TAG, "event trace cleared.");
+        }
+        else if(strcmp((char*) argv[2], (const char*) "on") == 0 || strcmp((char*) argv[2], (const char*) "off") == 0)
+        {
+            msg_trace_enable(argv[2][1] == 'n');
+            ESP_LOGI(TAG, "event trace recording %s.", argv[2]);
+        }
+        else
+        {
+            ESP_LOGE(TAG, "must specify dump, clear, on or off.");
+        }
+    }
     else if(strcmp((char*) argv[1], (const char*) "init_normal_queue") == 0)
     {
         MESSAGE_QUEUE_INIT();
-        bool is_active = check_is_queue_active(0);
-        bool is_priority_active = check_is_queue_active(1);
+        bool is_active = check_is_queue_active(MSG_QUEUE_NORMAL);
+        bool is_priority_active = check_is_queue_active(MSG_QUEUE_PRIORITY);
         ESP_LOGI(TAG, "normal queue active: %u. priority queue active: %u.", is_active, is_priority_active);
     }
 }
@@ -727,7 +1019,7 @@ static void uart_imu_cmds(uint8_t argc, char** argv)
     else if(strcmp((char*) argv[1], (const char*) "start_measurements") == 0)
     {
         //start taking measurements from sensor
-        s_imu_callback_handle = register_priority_handler_for_messages(uart_msg_queue_handler, imu_public_component);
+        s_imu_callback_handle = register_priority_deferred_handler_for_message_types(uart_msg_queue_handler, imu_public_component, MSG_TYPE_BIT(IMU_MSG_RAW_DATA));
         imu_accel_config();
         imu_gyro_config();
         imu_set_interrupts();
@@ -909,6 +1201,43 @@ static void uart_serial_cmds(uint8_t argc, char** argv)
     }
 }
 
+static void uart_sched_cmds(uint8_t argc, char** argv)
+{
+    if(argc < 2)
+    {
+        ESP_LOGE(TAG, "incorrect number of args");
+        return;
+    }
+    if(strcmp((char*) argv[1], (const char*) "stats") == 0)
+    {
+        for(sensor_job_handle_t job = 0; job < sensor_sched_get_job_count(); job++)
+        {
+            sensor_job_info_t info;
+            sensor_job_stats_t stats;
+            sensor_sched_get_job_info(job, &info);
+            sensor_sched_get_job_stats(job, &stats);
+            ESP_LOGI(TAG, "%s: %s, period %lu us, phase %lu us, budget %lu us", info.name, info.is_running ? "running" : "stopped",
+                (unsigned long) info.period_us, (unsigned long) info.phase_us, (unsigned long) info.budget_us);
+            ESP_LOGI(TAG, "  runs %lu, missed %lu, overruns %lu", (unsigned long) stats.runs, (unsigned long) stats.missed, (unsigned long) stats.overruns);
+            ESP_LOGI(TAG, "  jitter avg %lu us, max %lu us, run time last %lu us, max %lu us",
+                (unsigned long) (stats.runs ? stats.total_jitter_us / stats.runs : 0), (unsigned long) stats.max_jitter_us,
+                (unsigned long) stats.last_run_us, (unsigned long) stats.max_run_us);
+        }
+    }
+    else if(strcmp((char*) argv[1], (const char*) "reset") == 0)
+    {
+        for(sensor_job_handle_t job = 0; job < sensor_sched_get_job_count(); job++)
+        {
+            sensor_sched_reset_job_stats(job);
+        }
+        ESP_LOGI(TAG, "sensor job stats cleared.");
+    }
+    else
+    {
+        ESP_LOGE(TAG, "unknown sched command");
+    }
+}
+
 static void uart_nav_cmds(uint8_t argc, char** argv)
 {
     if(argc < 3)
@@ -920,7 +1249,8 @@ static void uart_nav_cmds(uint8_t argc, char** argv)
     {
         if(strcmp((char*) argv[2], (const char*) "enable") == 0)
         {
-            s_nav_callback_handle = register_component_handler_for_messages(uart_msg_queue_handler, nav_algo_public_component);
+            s_nav_callback_handle = register_component_deferred_handler_for_message_types(uart_msg_queue_handler, nav_algo_public_component,
+                MSG_TYPE_BIT(NAV_RAW_FEATURE_DATA) | MSG_TYPE_BIT(NAV_TRANSFORM_DATA) | MSG_TYPE_BIT(NAV_MAP_DATA));
             nav_algo_enable_debug_messages(true);
             ESP_LOGI(TAG, "Nav debug callback handle is: %u", s_nav_callback_handle);
         }
@@ -968,6 +1298,24 @@ static mtr_direction_t uart_convert_str_to_direction(char * cmd_buf)
     return MTR_DIR_INVALID;
 }
 
+static uint8_t uart_convert_str_to_queuetype(char * cmd_buf)
+{
+    if(strcmp(cmd_buf, (const char*) "normal") == 0)
+    {
+        return MSG_QUEUE_NORMAL;
+    }
+    else if(strcmp(cmd_buf, (const char*) "priority") == 0)
+    {
+        return MSG_QUEUE_PRIORITY;
+    }
+    else if(cmd_buf[0] >= '0' && cmd_buf[0] < ('0' + MAX_MESSAGE_QUEUES) && cmd_buf[1] == '\0')
+    {
+        //queues made with create_message_queue are picked by id
+        return (uint8_t) (cmd_buf[0] - '0');
+    }
+    return UART_INVALID_QUEUE;
+}
+
 static uint8_t uart_get_hex_from_char(char to_convert)
 {
     if(to_convert >= '0' && to_convert <= '9')
@@ -1026,6 +1374,10 @@ static dispatcher_type_t uart_get_dispatcher(char * disp_str)
     {
         return uart;
     }
+    else if(strcmp(disp_str, (const char*) "sched") == 0)
+    {
+        return sched;
+    }
     else
     {
         return not_specified;
@@ -1062,7 +1414,7 @@ static void uart_msg_queue_handler(component_handle_t component_type, uint8_t me
     serial_out[5] = 0; //invalid type
     if(!s_serialize)
     {
-        ESP_LOGI(TAG, "message from %s with message type %u and size %u.", uart_return_string_from_dispatcher(dispatcher), message_type, message_size);
+        ESP_LOGI(TAG, "message from %s with message type %u and size %zu.", uart_return_string_from_dispatcher(dispatcher), message_type, message_size);
     }
     if(component_type == ToF_public_component && message_type == TOF_MSG_NEW_DEPTH_ARRAY)
     {
@@ -1070,7 +1422,9 @@ static void uart_msg_queue_handler(component_handle_t component_type, uint8_t me
         TOF_DATA_t* tof_data = (TOF_DATA_t*) message_data;
         uint8_t h_size = tof_data->horizontal_size;
         uint8_t v_size = tof_data->vertical_size;
-        uint32_t** array_ptr = tof_data->depth_pixel_field;
+        uint8_t zone_count = h_size * v_size;
+        const uint16_t* distance = tof_data->distance[TOF_FIRST_OBJECT];
+        const uint8_t* confidence = tof_data->confidence[TOF_FIRST_OBJECT];
         if(s_serialize)
         {
             //write header data to serial_out
@@ -1078,60 +1432,34 @@ static void uart_msg_queue_handler(component_handle_t component_type, uint8_t me
             serial_out[1] = 'r';
             serial_out[2] = 'a';
             serial_out[3] = 'w';
-            if(h_size == 8)
-            {
-                serial_out[4] = 192; //192 bytes of data
-            }
-            else
+            serial_out[4] = zone_count * 3; //192 bytes of data for 8x8, 48 for 4x4
+            serial_out[5] = 4; //data type is ToF
+            //first object of each zone in row order, distance low byte, high byte, then confidence
+            for(uint8_t zone = 0; zone < zone_count; zone++)
             {
-                serial_out[4] = 48; //48 bytes of data
+                serial_out[(zone * 3) + RAW_HEADER_BASE] = distance[zone] & 0xFF;
+                serial_out[(zone * 3) + RAW_HEADER_BASE + 1] = (distance[zone] >> 8) & 0xFF;
+                serial_out[(zone * 3) + RAW_HEADER_BASE + 2] = confidence[zone];
             }
-            serial_out[5] = 4; //data type is ToF
         }
         else
         {
             ESP_LOGI(TAG, "outputting %ux%u depth array:", h_size, v_size);
-        }
-        for(uint8_t j = 0; j < h_size; j++)
-        {
-            if(h_size == 8)
+            for(uint8_t row = 0; row < v_size; row++)
             {
-                if(s_serialize)
+                const uint16_t* row_ptr = &distance[TOF_FRAME_ZONE(tof_data, row, 0)];
+                if(h_size == 8)
                 {
-                    //serialize 128 bytes of data
-                    for(uint8_t k = 0; k < h_size; k++)
-                    {
-                        serial_out[(24*j) + (k*3) + RAW_HEADER_BASE] = array_ptr[j][k] & 0xFF;
-                        serial_out[(24*j) + (k*3) + RAW_HEADER_BASE + 1] = ((array_ptr[j][k] >> 8) & 0xFF);
-                        serial_out[(24*j) + (k*3) + RAW_HEADER_BASE + 2] = ((array_ptr[j][k] >> 24) & 0xFF);
-                    }
+                    ESP_LOGI(TAG, "%04u %04u %04u %04u %04u %04u %04u %04u", 
+                        row_ptr[0], row_ptr[1], row_ptr[2], row_ptr[3],
+                        row_ptr[4], row_ptr[5], row_ptr[6], row_ptr[7]);
                 }
-                else
+                else if(h_size == 4)
                 {
-                    ESP_LOGI(TAG, "%04lu %04lu %04lu %04lu %04lu %04lu %04lu %04lu", 
-                        array_ptr[j][0], array_ptr[j][1], array_ptr[j][2], array_ptr[j][3],
-                        array_ptr[j][4], array_ptr[j][5], array_ptr[j][6], array_ptr[j][7]);
+                    ESP_LOGI(TAG, "%04u %04u %04u %04u", 
+                        row_ptr[0], row_ptr[1], row_ptr[2], row_ptr[3]);
                 }
             }
-            else if(h_size == 4)
-            {
-                if(s_serialize)
-                {
-                    //serialize 32 bytes of data
-                    for(uint8_t k = 0; k < v_size; k++)
-                    {
-                        serial_out[(24*j) + (k*3) + RAW_HEADER_BASE] = array_ptr[j][k] & 0xFF;
-                        serial_out[(24*j) + (k*3) + RAW_HEADER_BASE + 1] = ((array_ptr[j][k] >> 8) & 0xFF);
-                        serial_out[(24*j) + (k*3) + RAW_HEADER_BASE + 2] = ((array_ptr[j][k] >> 24) & 0xFF);
-                    }
-                }
-                else
-                {
-                    ESP_LOGI(TAG, "%04lu %04lu %04lu %04lu", 
-                        array_ptr[j][0], array_ptr[j][1], array_ptr[j][2], array_ptr[j][3]);
-                }
-            }
-            
         }
     }
     else if (component_type == imu_public_component && message_type == IMU_MSG_RAW_DATA)
@@ -1173,7 +1501,7 @@ static void uart_msg_queue_handler(component_handle_t component_type, uint8_t me
         }
         else
         {
-            ESP_LOGI(TAG, "timestamp %lu imu data:", timestamp);
+            ESP_LOGI(TAG, "timestamp %" PRIu32 " imu data:", timestamp);
             for(uint8_t i = 0; i < 3; i++)
             {
                 uint16_t raw_accel = (imu_data->acc_data[(2*i) + 1] << 8) + imu_data->acc_data[(2*i)];
@@ -1230,9 +1558,28 @@ static void uart_msg_queue_handler(component_handle_t component_type, uint8_t me
             ESP_LOGE(TAG, "message size too large:");
             return;
         }
-        ESP_LOGI(TAG, "message data:");
-        char* output_data = (char*) message_data;
-        ESP_LOGI(TAG, "%s", output_data);
+        if(dispatcher == uart)
+        {
+            //uart's own payloads are strings, bounded by the size in case one is not terminated
+            ESP_LOGI(TAG, "message data:");
+            ESP_LOGI(TAG, "%.*s", (int) message_size, (const char*) message_data);
+        }
+        else
+        {
+            //wildcard registrations hand in other components' binary payloads
+            ESP_LOGI(TAG, "message data from handle %u with type %u:", component_type, message_type);
+            const uint8_t* payload = (const uint8_t*) message_data;
+            char hex_line[(UART_HEX_LINE_BYTES * 3) + 1];
+            for(size_t line_start = 0; payload != NULL && line_start < message_size; line_start += UART_HEX_LINE_BYTES)
+            {
+                size_t line_len = 0;
+                for(size_t byte_iter = line_start; byte_iter < message_size && byte_iter < line_start + UART_HEX_LINE_BYTES; byte_iter++)
+                {
+                    line_len += snprintf(hex_line + line_len, sizeof(hex_line) - line_len, "%02X ", payload[byte_iter]);
+                }
+                ESP_LOGI(TAG, "%s", hex_line);
+            }
+        }
     }
     if(s_serialize)
     {
@@ -1260,6 +1607,8 @@ static char* uart_return_string_from_dispatcher(dispatcher_type_t dispatcher)
         case led: return "led";
         case mesh: return "mesh";
         case uart: return "uart";
+        case nav: return "nav";
+        case sched: return "sched";
         case error: return "error";
         default: return "unknown component";
     }
@@ -1267,14 +1616,80 @@ static char* uart_return_string_from_dispatcher(dispatcher_type_t dispatcher)
 
 static dispatcher_type_t uart_get_dispatcher_from_component(component_handle_t component)
 {
-    for(dispatcher_type_t i = 0; i < dispatcher_max; i++)
+    if(component >= MAX_COMPONENT_REGISTRATIONS)
     {
-        if(UART_callback_handles[i] == component)
-        {
-            return i;
-        }
+        return error;
+    }
+    return s_component_dispatchers[component];
+}
+
+//drivers take their handles during init, so by the time a handler is registered they are known.
+//uart goes last since its handle is only valid while s_has_component_handle is set.
+static void uart_map_component_dispatchers(void)
+{
+    for(component_handle_t handle = 0; handle < MAX_COMPONENT_REGISTRATIONS; handle++)
+    {
+        s_component_dispatchers[handle] = not_specified;
+    }
+    s_component_dispatchers[ToF_public_component] = tof;
+    s_component_dispatchers[imu_public_component] = imu;
+    s_component_dispatchers[nav_algo_public_component] = nav;
+    if(s_has_component_handle)
+    {
+        s_component_dispatchers[s_uart_component_handle] = uart;
+    }
+}
+
+//msg_register_cb all [queue]: one handler for every component on the queue, normal by default
+static void uart_register_wildcard_cb(uint8_t argc, char** argv)
+{
+    uint8_t queuetype = (argc > 3) ? uart_convert_str_to_queuetype((char*) argv[3]) : MSG_QUEUE_NORMAL;
+    if(queuetype == UART_INVALID_QUEUE)
+    {
+        ESP_LOGE(TAG, "invalid queue type.");
+        return;
+    }
+    if(s_wildcard_callback_handles[queuetype])
+    {
+        ESP_LOGE(TAG, "UART is already registered for all messages on queue %u.", queuetype);
+        return;
+    }
+    uart_map_component_dispatchers();
+    ESP_LOGI(TAG, "registering UART handler for all messages on queue %u:", queuetype);
+    s_wildcard_callback_handles[queuetype] = register_wildcard_deferred_handler_for_message_types(queuetype, uart_msg_queue_handler, MSG_TYPE_MASK_ALL);
+    if(s_wildcard_callback_handles[queuetype])
+    {
+        ESP_LOGI(TAG, "registration successful!");
+    }
+    else
+    {
+        ESP_LOGE(TAG, "registration failed!");
+    }
+}
+
+static void uart_unregister_wildcard_cb(uint8_t argc, char** argv)
+{
+    uint8_t queuetype = (argc > 3) ? uart_convert_str_to_queuetype((char*) argv[3]) : MSG_QUEUE_NORMAL;
+    if(queuetype == UART_INVALID_QUEUE)
+    {
+        ESP_LOGE(TAG, "invalid queue type.");
+        return;
+    }
+    if(s_wildcard_callback_handles[queuetype] == 0)
+    {
+        ESP_LOGE(TAG, "failed to unregister: callback handle does not exist.");
+        return;
+    }
+    ESP_LOGI(TAG, "unregistering UART handler from all messages on queue %u:", queuetype);
+    if(unregister_wildcard_handler_for_messages(queuetype, s_wildcard_callback_handles[queuetype]))
+    {
+        ESP_LOGE(TAG, "unregistration failed!");
+    }
+    else
+    {
+        ESP_LOGI(TAG, "unregistration successful!");
+        s_wildcard_callback_handles[queuetype] = 0;
     }
-    return error;
 }
 
 static component_handle_t uart_get_component_handle_from_dispatcher(dispatcher_type_t dispatcher)
@@ -1390,6 +1805,11 @@ static void run_command(uint8_t rx_size, char *buf)
             uart_nav_cmds(argc, argv);
             break;
         }
+        case sched:
+        {
+            uart_sched_cmds(argc, argv);
+            break;
+        }
         default:
         {
             ESP_LOGI(TAG, "invalid specifier");
@@ -1414,6 +1834,8 @@ void UART_INIT(void)
 #endif
 
     memset(UART_callback_handles, 0, sizeof(UART_callback_handles));
+    memset(s_wildcard_callback_handles, 0, sizeof(s_wildcard_callback_handles));
+    uart_map_component_dispatchers();
 
     ESP_LOGI(TAG, "USB initialization DONE");
 }
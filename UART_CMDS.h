@@ -13,6 +13,7 @@ typedef enum
     mesh,
     uart,
     nav,
+    sched,
     error,
     dispatcher_max,
 } dispatcher_type_t;
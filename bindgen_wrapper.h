@@ -1,6 +1,8 @@
 #include "mocked_functions.h"
 #include "FLASH_SPI.h"
 #include "MESSAGE_QUEUE.h"
+#include "MSG_TRACE.h"
+#include "SENSOR_SCHED.h"
 #include "LED_DRVR.h"
 #include "IMU_SPI.h"
 #include "ToF_I2C.h"
@@ -0,0 +1,218 @@
+// Host benchmark for the message bus. Needs the threaded mocks, so the queue tasks run for real:
+//   cmake -S functional_tests -B build -DMOCK_PTHREAD_BACKEND=ON && cmake --build build --target msg_bus_bench
+//   ./build/msg_bus_bench [messages per run] [output file]
+// Prints one JSON object per configuration, one per line, so runs can be diffed over time.
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "mocked_functions.h"
+#include "MESSAGE_QUEUE.h"
+
+#define BENCH_DEFAULT_MESSAGES 20000
+#define BENCH_MAX_PRODUCERS 4
+#define BENCH_MAX_SUBSCRIBERS 4
+#define BENCH_DRAIN_TIMEOUT_US 10000000
+
+typedef struct
+{
+    uint8_t queue_id;
+    size_t payload_size; //inline up to MSG_INLINE_PAYLOAD_SIZE, pool blocks past that
+    uint8_t subscribers;
+    uint8_t producers;
+} bench_config_t;
+
+typedef struct
+{
+    const bench_config_t* config;
+    uint32_t message_count;
+    uint32_t send_retries;
+} bench_producer_t;
+
+static const uint8_t s_bench_queues[] = {MSG_QUEUE_NORMAL, MSG_QUEUE_PRIORITY};
+static const size_t s_bench_payload_sizes[] = {8, MSG_INLINE_PAYLOAD_SIZE, 64, 512};
+static const uint8_t s_bench_subscriber_counts[] = {1, BENCH_MAX_SUBSCRIBERS};
+static const uint8_t s_bench_producer_counts[] = {1, BENCH_MAX_PRODUCERS};
+
+static component_handle_t s_bench_component;
+static uint32_t* s_latencies_us = NULL;
+static uint32_t s_received = 0; //only the queue task writes it
+static int64_t s_last_dispatch_us = 0;
+static volatile uint8_t s_sink = 0;
+
+static void bench_timed_handler(component_handle_t component, uint8_t message_type, void* message_data, size_t message_size);
+static void bench_extra_handler(component_handle_t component, uint8_t message_type, void* message_data, size_t message_size);
+static void* bench_producer(void* args);
+static bool build_bench_message(const bench_config_t* config, message_info_t* message_info);
+static bool run_config(const bench_config_t* config, uint32_t message_count, FILE* output);
+static int compare_latency(const void* first, const void* second);
+
+int main(int argc, char** argv)
+{
+    uint32_t message_count = (argc > 1) ? (uint32_t) strtoul(argv[1], NULL, 10) : BENCH_DEFAULT_MESSAGES;
+    FILE* output = (argc > 2) ? fopen(argv[2], "w") : stdout;
+    if(message_count == 0 || output == NULL)
+    {
+        fprintf(stderr, "usage: %s [messages per run] [output file]\n", argv[0]);
+        return 1;
+    }
+    s_latencies_us = malloc(message_count * sizeof(uint32_t));
+    MESSAGE_QUEUE_INIT();
+    PRIORITY_MESSAGE_QUEUE_INIT();
+    if(create_handle_for_component(&s_bench_component))
+    {
+        fprintf(stderr, "no component handle for the benchmark\n");
+        return 1;
+    }
+    bool is_complete = true;
+    for(uint8_t queue_iter = 0; queue_iter < sizeof(s_bench_queues); queue_iter++)
+    {
+        for(uint8_t size_iter = 0; size_iter < sizeof(s_bench_payload_sizes) / sizeof(s_bench_payload_sizes[0]); size_iter++)
+        {
+            for(uint8_t sub_iter = 0; sub_iter < sizeof(s_bench_subscriber_counts); sub_iter++)
+            {
+                for(uint8_t prod_iter = 0; prod_iter < sizeof(s_bench_producer_counts); prod_iter++)
+                {
+                    bench_config_t config =
+                    {
+                        .queue_id = s_bench_queues[queue_iter],
+                        .payload_size = s_bench_payload_sizes[size_iter],
+                        .subscribers = s_bench_subscriber_counts[sub_iter],
+                        .producers = s_bench_producer_counts[prod_iter],
+                    };
+                    is_complete &= run_config(&config, message_count, output);
+                }
+            }
+        }
+    }
+    if(output != stdout)
+    {
+        fclose(output);
+    }
+    free(s_latencies_us);
+    //the queue tasks block forever on their queues, so the process just exits
+    return is_complete ? 0 : 2;
+}
+
+static bool run_config(const bench_config_t* config, uint32_t message_count, FILE* output)
+{
+    callback_handle_t callback_handles[BENCH_MAX_SUBSCRIBERS] = {0};
+    callback_handles[0] = register_queue_handler_for_message_types(config->queue_id, bench_timed_handler, s_bench_component, MSG_TYPE_MASK_ALL);
+    for(uint8_t sub_iter = 1; sub_iter < config->subscribers; sub_iter++)
+    {
+        callback_handles[sub_iter] = register_queue_handler_for_message_types(config->queue_id, bench_extra_handler, s_bench_component, MSG_TYPE_MASK_ALL);
+    }
+    __atomic_store_n(&s_received, 0, __ATOMIC_SEQ_CST);
+
+    pthread_t threads[BENCH_MAX_PRODUCERS];
+    bench_producer_t producers[BENCH_MAX_PRODUCERS];
+    int64_t start_us = esp_timer_get_time();
+    for(uint8_t prod_iter = 0; prod_iter < config->producers; prod_iter++)
+    {
+        producers[prod_iter].config = config;
+        producers[prod_iter].message_count = (message_count / config->producers) + ((prod_iter < message_count % config->producers) ? 1 : 0);
+        producers[prod_iter].send_retries = 0;
+        pthread_create(&threads[prod_iter], NULL, bench_producer, &producers[prod_iter]);
+    }
+    uint32_t send_retries = 0;
+    for(uint8_t prod_iter = 0; prod_iter < config->producers; prod_iter++)
+    {
+        pthread_join(threads[prod_iter], NULL);
+        send_retries += producers[prod_iter].send_retries;
+    }
+    while(__atomic_load_n(&s_received, __ATOMIC_ACQUIRE) < message_count && esp_timer_get_time() - start_us < BENCH_DRAIN_TIMEOUT_US)
+    {
+        sched_yield();
+    }
+    uint32_t received = __atomic_load_n(&s_received, __ATOMIC_ACQUIRE);
+    int64_t elapsed_us = __atomic_load_n(&s_last_dispatch_us, __ATOMIC_ACQUIRE) - start_us;
+    for(uint8_t sub_iter = 0; sub_iter < config->subscribers; sub_iter++)
+    {
+        unregister_queue_handler_for_messages(config->queue_id, s_bench_component, callback_handles[sub_iter]);
+    }
+
+    qsort(s_latencies_us, received, sizeof(uint32_t), compare_latency);
+    uint32_t p50_us = received ? s_latencies_us[(received - 1) / 2] : 0;
+    uint32_t p99_us = received ? s_latencies_us[((uint64_t) (received - 1) * 99) / 100] : 0;
+    uint32_t max_us = received ? s_latencies_us[received - 1] : 0;
+    double msgs_per_sec = (elapsed_us > 0) ? ((double) received * 1000000.0) / (double) elapsed_us : 0.0;
+    fprintf(output, "{\"queue\":\"%s\",\"payload_bytes\":%zu,\"subscribers\":%u,\"producers\":%u,\"messages\":%u,\"received\":%u,"
+        "\"msgs_per_sec\":%.0f,\"p50_us\":%u,\"p99_us\":%u,\"max_us\":%u,\"send_retries\":%u}\n",
+        (config->queue_id == MSG_QUEUE_PRIORITY) ? "priority" : "normal", config->payload_size, config->subscribers, config->producers,
+        message_count, received, msgs_per_sec, p50_us, p99_us, max_us, send_retries);
+    fflush(output);
+    return received == message_count;
+}
+
+//first subscriber, times each message from the send that got it into the queue
+static void bench_timed_handler(component_handle_t component, uint8_t message_type, void* message_data, size_t message_size)
+{
+    (void) component;
+    (void) message_type;
+    (void) message_size;
+    int64_t now_us = esp_timer_get_time();
+    int64_t sent_us;
+    memcpy(&sent_us, message_data, sizeof(sent_us));
+    uint32_t received = __atomic_load_n(&s_received, __ATOMIC_RELAXED);
+    s_latencies_us[received] = (uint32_t) (now_us - sent_us);
+    __atomic_store_n(&s_last_dispatch_us, now_us, __ATOMIC_RELEASE);
+    __atomic_store_n(&s_received, received + 1, __ATOMIC_RELEASE);
+}
+
+//the other subscribers only read the payload, so they cost what a cheap real handler would
+static void bench_extra_handler(component_handle_t component, uint8_t message_type, void* message_data, size_t message_size)
+{
+    (void) component;
+    (void) message_type;
+    s_sink ^= ((uint8_t*) message_data)[message_size - 1];
+}
+
+static void* bench_producer(void* args)
+{
+    bench_producer_t* producer = (bench_producer_t*) args;
+    for(uint32_t message_iter = 0; message_iter < producer->message_count; message_iter++)
+    {
+        message_info_t message_info;
+        //a full queue gives the pool block back, so every attempt starts from a fresh message
+        while(!build_bench_message(producer->config, &message_info) || send_message_to_queue(producer->config->queue_id, message_info))
+        {
+            producer->send_retries++;
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static bool build_bench_message(const bench_config_t* config, message_info_t* message_info)
+{
+    uint8_t payload[512] = {0};
+    int64_t sent_us = esp_timer_get_time();
+    memcpy(payload, &sent_us, sizeof(sent_us));
+    memset(message_info, 0, sizeof(message_info_t));
+    message_info->component_handle = s_bench_component;
+    message_info->message_type = 0;
+    message_info->trace_id = MSG_TRACE_NONE;
+    message_info->request_id = MSG_REQUEST_NONE;
+    if(config->payload_size <= MSG_INLINE_PAYLOAD_SIZE)
+    {
+        return set_message_inline_payload(message_info, payload, config->payload_size) == 0;
+    }
+    void* pool_payload = acquire_message_payload(config->payload_size);
+    if(pool_payload == NULL)
+    {
+        //every block is still queued, wait for the queue task to hand some back
+        return false;
+    }
+    memcpy(pool_payload, payload, config->payload_size);
+    message_info->message_data = pool_payload;
+    message_info->message_size = config->payload_size;
+    message_info->is_pointer = true;
+    return true;
+}
+
+static int compare_latency(const void* first, const void* second)
+{
+    uint32_t first_latency = *(const uint32_t*) first;
+    uint32_t second_latency = *(const uint32_t*) second;
+    return (first_latency > second_latency) - (first_latency < second_latency);
+}
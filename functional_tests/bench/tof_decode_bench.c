@@ -0,0 +1,170 @@
+// Host microbenchmark for decoding ToF result blocks into frames:
+//   cmake -S functional_tests -B build && cmake --build build --target tof_decode_bench
+//   ./build/tof_decode_bench [frames per run]
+// Times the per-zone index loop the driver used before against the zone tables in TOF_DECODE_RESULT,
+// after checking that both decode every subcapture to the same frame. Prints one JSON object per line.
+
+#include <time.h>
+
+#include "mocked_functions.h"
+#include "ToF_I2C.h"
+
+#define BENCH_DEFAULT_FRAMES 40000
+#define BENCH_RESULT_BLOCK_SIZE 0x84
+#define BENCH_TMF8828_BLOCKS 4 //a full 8x8 frame is one block per subcapture
+#define BENCH_RUNS 31 //the fastest run is reported, slower ones were interrupted
+#define BENCH_DECODERS 2 //index loop, zone tables
+
+typedef void (*bench_decoder_t)(TOF_DATA_t* tof_frame, const uint8_t* result_block, bool is_tmf8828);
+
+static uint8_t s_result_blocks[BENCH_TMF8828_BLOCKS][BENCH_RESULT_BLOCK_SIZE];
+static volatile uint32_t s_sink = 0;
+
+static void __attribute__((noinline)) decode_with_index_loop(TOF_DATA_t* tof_frame, const uint8_t* result_block, bool is_tmf8828);
+static void store_zone_result(TOF_DATA_t* tof_frame, uint8_t object, uint8_t zone, const uint8_t* result);
+static bool check_decoders_match(bool is_tmf8828);
+static void time_decoders(const bench_decoder_t* decoders, bool is_tmf8828, uint32_t frame_count, double* ns_per_frame);
+static int64_t time_decoder_run(bench_decoder_t decoder, bool is_tmf8828, uint32_t frame_count);
+static int64_t get_time_ns(void);
+
+int main(int argc, char** argv)
+{
+    uint32_t frame_count = (argc > 1) ? (uint32_t) strtoul(argv[1], NULL, 10) : BENCH_DEFAULT_FRAMES;
+    if(frame_count == 0)
+    {
+        fprintf(stderr, "usage: %s [frames per run]\n", argv[0]);
+        return 1;
+    }
+    srand(1);
+    for(uint8_t block = 0; block < BENCH_TMF8828_BLOCKS; block++)
+    {
+        for(uint8_t byte_iter = 0; byte_iter < BENCH_RESULT_BLOCK_SIZE; byte_iter++)
+        {
+            s_result_blocks[block][byte_iter] = (uint8_t) rand();
+        }
+        s_result_blocks[block][0x04] = block; //subcapture
+    }
+    for(uint8_t mode = 0; mode < 2; mode++)
+    {
+        bool is_tmf8828 = (mode == 1);
+        if(!check_decoders_match(is_tmf8828))
+        {
+            fprintf(stderr, "decoders disagree in %s mode\n", is_tmf8828 ? "tmf8828" : "tmf8821");
+            return 2;
+        }
+        const bench_decoder_t decoders[BENCH_DECODERS] = {decode_with_index_loop, TOF_DECODE_RESULT};
+        double ns_per_frame[BENCH_DECODERS];
+        time_decoders(decoders, is_tmf8828, frame_count, ns_per_frame);
+        double loop_ns = ns_per_frame[0];
+        double table_ns = ns_per_frame[1];
+        printf("{\"mode\":\"%s\",\"frames\":%u,\"index_loop_ns_per_frame\":%.1f,\"zone_table_ns_per_frame\":%.1f,\"speedup\":%.2f}\n",
+            is_tmf8828 ? "tmf8828" : "tmf8821", frame_count, loop_ns, table_ns, (table_ns > 0.0) ? loop_ns / table_ns : 0.0);
+    }
+    return 0;
+}
+
+//the decode TOF_CONVERT_READ_BUFFER_TO_ARRAY ran before the zone map tables, kept as the baseline
+static void decode_with_index_loop(TOF_DATA_t* tof_frame, const uint8_t* result_block, bool is_tmf8828)
+{
+    uint8_t convert_loop_cnt = result_block[0x04];
+    if(is_tmf8828)
+    {
+        for(uint8_t j = 0; j < 4; j++)
+        {
+            for(uint8_t k = 0; k < 2; k++)
+            {
+                uint8_t lin_val = 3 * (k + (j * 2));
+                uint8_t v_iter = (7 - (j * 2)) - ((convert_loop_cnt & 0x02) / 2);
+                uint8_t h_iter = (k * 4) + (2 * (convert_loop_cnt & 0x01));
+                uint8_t zone = TOF_FRAME_ZONE(tof_frame, v_iter, h_iter);
+                store_zone_result(tof_frame, TOF_FIRST_OBJECT, zone, &result_block[0x18 + lin_val]);
+                store_zone_result(tof_frame, TOF_FIRST_OBJECT, zone + 1, &result_block[0x33 + lin_val]);
+                store_zone_result(tof_frame, TOF_SECOND_OBJECT, zone, &result_block[0x4E + lin_val]);
+                store_zone_result(tof_frame, TOF_SECOND_OBJECT, zone + 1, &result_block[0x69 + lin_val]);
+            }
+        }
+    }
+    else
+    {
+        for(uint8_t j = 0; j < 4; j++)
+        {
+            for(uint8_t k = 0; k < 4; k++)
+            {
+                uint8_t lin_val = 3 * ((4 * j) + k);
+                store_zone_result(tof_frame, TOF_FIRST_OBJECT, TOF_FRAME_ZONE(tof_frame, j, k), &result_block[0x18 + lin_val]);
+            }
+        }
+    }
+}
+
+static void store_zone_result(TOF_DATA_t* tof_frame, uint8_t object, uint8_t zone, const uint8_t* result)
+{
+    tof_frame->confidence[object][zone] = result[0];
+    tof_frame->distance[object][zone] = result[1] + (result[2] << 8);
+}
+
+static bool check_decoders_match(bool is_tmf8828)
+{
+    TOF_DATA_t loop_frame = {0};
+    TOF_DATA_t table_frame = {0};
+    loop_frame.horizontal_size = table_frame.horizontal_size = is_tmf8828 ? 8 : 4;
+    loop_frame.vertical_size = table_frame.vertical_size = is_tmf8828 ? 8 : 4;
+    uint8_t block_count = is_tmf8828 ? BENCH_TMF8828_BLOCKS : 1;
+    for(uint8_t block = 0; block < block_count; block++)
+    {
+        decode_with_index_loop(&loop_frame, s_result_blocks[block], is_tmf8828);
+        TOF_DECODE_RESULT(&table_frame, s_result_blocks[block], is_tmf8828);
+    }
+    return memcmp(&loop_frame, &table_frame, sizeof(TOF_DATA_t)) == 0;
+}
+
+//runs alternate between the decoders so a slow stretch of the host hits both alike
+static void time_decoders(const bench_decoder_t* decoders, bool is_tmf8828, uint32_t frame_count, double* ns_per_frame)
+{
+    int64_t best_ns[BENCH_DECODERS];
+    for(uint8_t decoder = 0; decoder < BENCH_DECODERS; decoder++)
+    {
+        best_ns[decoder] = INT64_MAX;
+    }
+    for(uint8_t run = 0; run < BENCH_RUNS; run++)
+    {
+        for(uint8_t decoder = 0; decoder < BENCH_DECODERS; decoder++)
+        {
+            int64_t elapsed_ns = time_decoder_run(decoders[decoder], is_tmf8828, frame_count);
+            if(elapsed_ns < best_ns[decoder])
+            {
+                best_ns[decoder] = elapsed_ns;
+            }
+        }
+    }
+    for(uint8_t decoder = 0; decoder < BENCH_DECODERS; decoder++)
+    {
+        ns_per_frame[decoder] = (double) best_ns[decoder] / (double) frame_count;
+    }
+}
+
+static int64_t time_decoder_run(bench_decoder_t decoder, bool is_tmf8828, uint32_t frame_count)
+{
+    TOF_DATA_t tof_frame = {0};
+    tof_frame.horizontal_size = is_tmf8828 ? 8 : 4;
+    tof_frame.vertical_size = is_tmf8828 ? 8 : 4;
+    uint8_t block_count = is_tmf8828 ? BENCH_TMF8828_BLOCKS : 1;
+    int64_t start_ns = get_time_ns();
+    for(uint32_t frame_iter = 0; frame_iter < frame_count; frame_iter++)
+    {
+        for(uint8_t block = 0; block < block_count; block++)
+        {
+            decoder(&tof_frame, s_result_blocks[block], is_tmf8828);
+        }
+        //read the frame back so the decode can't be dropped
+        s_sink += tof_frame.distance[TOF_FIRST_OBJECT][frame_iter % (tof_frame.horizontal_size * tof_frame.vertical_size)];
+    }
+    return get_time_ns() - start_ns;
+}
+
+static int64_t get_time_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((int64_t) now.tv_sec * 1000000000) + now.tv_nsec;
+}
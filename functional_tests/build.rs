@@ -1,6 +1,7 @@
 extern crate bindgen;
 extern crate cmake;
 
+use std::env;
 use std::path::PathBuf;
 
 fn main() {
@@ -16,11 +17,22 @@ fn main() {
     let headers_path = libdir_path.join("bindgen_wrapper.h");
     let headers_path_str = headers_path.to_str().expect("Path is not a valid string");
 
-    let dst = cmake::Config::new(".").generator("Ninja").always_configure(true).build();
+    // MOCK_PTHREAD_BACKEND=1 cargo build picks the threaded mocks, the headers change with it.
+    let pthread_backend = env::var("MOCK_PTHREAD_BACKEND").map_or(false, |val| val == "1" || val == "ON");
+
+    let dst = cmake::Config::new(".")
+        .generator("Ninja")
+        .define("MOCK_PTHREAD_BACKEND", if pthread_backend { "ON" } else { "OFF" })
+        .always_configure(true)
+        .build();
 
     println!("cargo:rustc-link-search=native={}", dst.display());
     println!("cargo:rustc-link-lib=static=unit_test_lib");
+    if pthread_backend {
+        println!("cargo:rustc-link-lib=pthread");
+    }
     println!("cargo:rerun-if-changed={}", headers_path_str);
+    println!("cargo:rerun-if-env-changed=MOCK_PTHREAD_BACKEND");
 
     // The bindgen::Builder is the main entry point
     // to bindgen, and lets you build up options for
@@ -33,6 +45,7 @@ fn main() {
         // included header files changed.
         .parse_callbacks(Box::new(bindgen::CargoCallbacks::new()))
         .clang_arg("-I..")
+        .clang_arg(if pthread_backend { "-DMOCK_PTHREAD_BACKEND" } else { "-UMOCK_PTHREAD_BACKEND" })
         // Finish the builder and generate the bindings.
         .generate()
         // Unwrap the Result and panic on failure.
@@ -4,6 +4,8 @@
 
 mod spi_flash;
 mod message_queue;
+mod msg_trace;
+mod sensor_sched;
 mod tof_i2c;
 
 include!("bindings.rs");
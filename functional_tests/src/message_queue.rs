@@ -1,8 +1,18 @@
 use crate::component_handle_t;
 use crate::message_info_t;
 use crate::callback_handle_t;
+use crate::msg_pool_stats_t;
+use crate::msg_pool_class_t;
+use crate::queue_batch_stats_t;
+use crate::msg_ring_t;
+use crate::queue_stats_t;
+use crate::msg_overflow_policy_t;
+use crate::msg_queue_config_t;
+use std::mem;
+use std::thread;
 use std::slice;
 use std::str;
+use std::time::Duration;
 
 static mut lastCompHandleOne: component_handle_t = 0;
 static mut lastMsgTypeOne: u8 = 0;
@@ -107,6 +117,13 @@ pub fn createNewMessageNormal(msg_type: u8, compHandle: component_handle_t, data
         component_handle: compHandle,
         message_data: data,
         message_size: len,
+        is_pointer: false,
+        is_inline: false,
+        enqueue_time_us: 0,
+        trace_id: 0,
+        request_id: 0,
+        origin_time_us: 0,
+        inline_payload: [0; crate::MSG_INLINE_PAYLOAD_SIZE as usize],
     };
 
     let retVal = unsafe { crate::send_message_to_normal_queue(mutData) };
@@ -134,6 +151,21 @@ pub fn unregisterTestHandlerPriority(compHandle: component_handle_t, callHandle:
     retVal
 }
 
+pub fn registerTestHandlerPriorityFiltered(handler: u8, compHandle: component_handle_t, typeMask: u32) -> callback_handle_t
+{
+    let mut funcPtr: Option<unsafe extern "C" fn(u8, u8, *mut ::std::os::raw::c_void, usize)> = None;
+    
+    match handler
+    {
+        1 => funcPtr = Some(testMessageHandlerOne),
+        2 => funcPtr = Some(testMessageHandlerTwo),
+        3 => funcPtr = Some(testMessageHandlerThree),
+        _ => funcPtr = None,
+    }
+    let retCall = unsafe { crate::register_priority_handler_for_message_types(funcPtr, compHandle, typeMask) };
+    retCall
+}
+
 pub fn createNewMessagePriority(msg_type: u8, compHandle: component_handle_t, data: *mut ::std::os::raw::c_void, len: usize) -> u8
 {
     let mutData = message_info_t
@@ -142,12 +174,152 @@ pub fn createNewMessagePriority(msg_type: u8, compHandle: component_handle_t, da
         component_handle: compHandle,
         message_data: data,
         message_size: len,
+        is_pointer: false,
+        is_inline: false,
+        enqueue_time_us: 0,
+        trace_id: 0,
+        request_id: 0,
+        origin_time_us: 0,
+        inline_payload: [0; crate::MSG_INLINE_PAYLOAD_SIZE as usize],
     };
 
     let retVal = unsafe { crate::send_message_to_priority_queue(mutData) };
     retVal
 }
 
+pub fn acquirePoolPayload(size: usize) -> *mut ::std::os::raw::c_void
+{
+    let retVal = unsafe { crate::acquire_message_payload(size) };
+    retVal
+}
+
+pub fn releasePoolPayload(payload: *mut ::std::os::raw::c_void) -> u8
+{
+    let retVal = unsafe { crate::release_message_payload(payload) };
+    retVal
+}
+
+pub fn getPoolStats(poolClass: msg_pool_class_t) -> msg_pool_stats_t
+{
+    let mut stats: msg_pool_stats_t = unsafe { mem::zeroed() };
+    let error = unsafe { crate::get_message_pool_stats(poolClass, &mut stats as *mut msg_pool_stats_t) };
+    assert_eq!(error, 0);
+    stats
+}
+
+pub fn setQueueBatchSize(queueType: u8, batchSize: u8) -> u8
+{
+    let retVal = unsafe { crate::set_queue_batch_size(queueType, batchSize) };
+    retVal
+}
+
+pub fn getQueueBatchStats(queueType: u8) -> queue_batch_stats_t
+{
+    let mut stats: queue_batch_stats_t = unsafe { mem::zeroed() };
+    let error = unsafe { crate::get_queue_batch_stats(queueType, &mut stats as *mut queue_batch_stats_t) };
+    assert_eq!(error, 0);
+    stats
+}
+
+pub fn getQueueStats(queueType: u8) -> queue_stats_t
+{
+    let mut stats: queue_stats_t = unsafe { mem::zeroed() };
+    let error = unsafe { crate::get_queue_stats(queueType, &mut stats as *mut queue_stats_t) };
+    assert_eq!(error, 0);
+    stats
+}
+
+pub fn setOverflowPolicy(queueType: u8, compHandle: component_handle_t, msg_type: u8, policy: msg_overflow_policy_t) -> u8
+{
+    let retVal = unsafe { crate::set_message_overflow_policy(queueType, compHandle, msg_type, policy) };
+    retVal
+}
+
+pub fn createQueue(name: &str, depth: u16, priority: u8) -> (u8, u8)
+{
+    let config = msg_queue_config_t
+    {
+        name: name.as_ptr() as *const i8,
+        depth: depth,
+        task_priority: priority,
+        stack_size: 2048,
+        core_id: crate::MSG_QUEUE_NO_AFFINITY as i8,
+    };
+    let mut queueId: u8 = 0;
+    let error = unsafe { crate::create_message_queue(&config as *const msg_queue_config_t, &mut queueId as *mut u8) };
+    (queueId, error)
+}
+
+pub fn registerTestHandlerOnQueue(queueId: u8, handler: u8, compHandle: component_handle_t) -> callback_handle_t
+{
+    let mut funcPtr: Option<unsafe extern "C" fn(u8, u8, *mut ::std::os::raw::c_void, usize)> = None;
+    
+    match handler
+    {
+        1 => funcPtr = Some(testMessageHandlerOne),
+        2 => funcPtr = Some(testMessageHandlerTwo),
+        3 => funcPtr = Some(testMessageHandlerThree),
+        _ => funcPtr = None,
+    }
+    let retCall = unsafe { crate::register_queue_handler_for_message_types(queueId, funcPtr, compHandle, crate::MSG_TYPE_MASK_ALL as u32) };
+    retCall
+}
+
+pub fn registerTestHandlerDeferred(queueId: u8, handler: u8, compHandle: component_handle_t) -> callback_handle_t
+{
+    let mut funcPtr: Option<unsafe extern "C" fn(u8, u8, *mut ::std::os::raw::c_void, usize)> = None;
+    
+    match handler
+    {
+        1 => funcPtr = Some(testMessageHandlerOne),
+        2 => funcPtr = Some(testMessageHandlerTwo),
+        3 => funcPtr = Some(testMessageHandlerThree),
+        _ => funcPtr = None,
+    }
+    let retCall = unsafe { crate::register_queue_deferred_handler_for_message_types(queueId, funcPtr, compHandle, crate::MSG_TYPE_MASK_ALL as u32) };
+    retCall
+}
+
+pub fn createNewMessageOnQueue(queueId: u8, msg_type: u8, compHandle: component_handle_t, data: *mut ::std::os::raw::c_void, len: usize) -> u8
+{
+    let mutData = message_info_t
+    {
+        message_type: msg_type,
+        component_handle: compHandle,
+        message_data: data,
+        message_size: len,
+        is_pointer: false,
+        is_inline: false,
+        enqueue_time_us: 0,
+        trace_id: 0,
+        request_id: 0,
+        origin_time_us: 0,
+        inline_payload: [0; crate::MSG_INLINE_PAYLOAD_SIZE as usize],
+    };
+
+    let retVal = unsafe { crate::send_message_to_queue(queueId, mutData) };
+    retVal
+}
+
+//lets the ring pointer move into the producer thread, the ring itself does the synchronisation
+struct RingPtr(*mut msg_ring_t);
+unsafe impl Send for RingPtr {}
+
+pub fn ringPushSequence(ring: *mut msg_ring_t, seq: usize) -> u8
+{
+    let mut message: message_info_t = unsafe { mem::zeroed() };
+    message.message_size = seq;
+    let retVal = unsafe { crate::msg_ring_push(ring, message) };
+    retVal
+}
+
+pub fn ringPop(ring: *mut msg_ring_t) -> Option<message_info_t>
+{
+    let mut message: message_info_t = unsafe { mem::zeroed() };
+    let error = unsafe { crate::msg_ring_pop(ring, &mut message as *mut message_info_t) };
+    if error == 0 { Some(message) } else { None }
+}
+
 pub fn spin_normal_queue_once() -> bool
 {
     let queue_type = "normal_queue\0".as_ptr() as *const i8;
@@ -155,6 +327,25 @@ pub fn spin_normal_queue_once() -> bool
     retVal
 }
 
+//handlers are spread over the workers, so every worker gets one pass
+pub fn spin_msg_worker_once() -> bool
+{
+    let mut retVal = true;
+    for worker in 0..crate::MSG_WORKER_COUNT
+    {
+        let task_name = format!("msg_worker_{}\0", worker);
+        retVal &= unsafe { crate::spinQueueTaskOnce(task_name.as_ptr() as *const i8) };
+    }
+    retVal
+}
+
+pub fn spin_msg_timer_once() -> bool
+{
+    let task_name = "msg_timer\0".as_ptr() as *const i8;
+    let retVal = unsafe { crate::spinQueueTaskOnce(task_name) };
+    retVal
+}
+
 pub fn spin_priority_queue_once() -> bool
 {
     let queue_type = "priority_queue\0".as_ptr() as *const i8;
@@ -299,4 +490,1277 @@ mod tests
         unsafe{ crate::uninit_queue(0) };
         unsafe{ crate::uninit_queue(1) };
     }
-}
\ No newline at end of file
+
+    #[test]
+    fn test_payload_pool()
+    {
+        initMessageQueue();
+        let smallCount = crate::MSG_POOL_SMALL_BLOCK_COUNT as usize;
+        let smallBefore = getPoolStats(crate::msg_pool_class_t_MSG_POOL_SMALL);
+        let mediumBefore = getPoolStats(crate::msg_pool_class_t_MSG_POOL_MEDIUM);
+        assert_eq!(smallBefore.blocks_in_use, 0);
+
+        //drain the small class, the next acquire should spill into the medium class
+        let mut payloads = Vec::new();
+        for _ in 0..smallCount
+        {
+            let payload = acquirePoolPayload(16);
+            assert_eq!(payload.is_null(), false);
+            payloads.push(payload);
+        }
+        let spilled = acquirePoolPayload(16);
+        assert_eq!(spilled.is_null(), false);
+        let smallFull = getPoolStats(crate::msg_pool_class_t_MSG_POOL_SMALL);
+        assert_eq!(smallFull.blocks_in_use as usize, smallCount);
+        assert_eq!(smallFull.exhausted_count, smallBefore.exhausted_count);
+        assert_eq!(getPoolStats(crate::msg_pool_class_t_MSG_POOL_MEDIUM).blocks_in_use, mediumBefore.blocks_in_use + 1);
+
+        //with the medium class drained too, small requests fail rather than take the large blocks
+        let largeBefore = getPoolStats(crate::msg_pool_class_t_MSG_POOL_LARGE);
+        let mut mediumPayloads = Vec::new();
+        for _ in (mediumBefore.blocks_in_use as usize + 1)..(crate::MSG_POOL_MEDIUM_BLOCK_COUNT as usize)
+        {
+            let payload = acquirePoolPayload(16);
+            assert_eq!(payload.is_null(), false);
+            mediumPayloads.push(payload);
+        }
+        assert_eq!(acquirePoolPayload(16).is_null(), true);
+        assert_eq!(getPoolStats(crate::msg_pool_class_t_MSG_POOL_SMALL).exhausted_count, smallBefore.exhausted_count);
+        assert_eq!(getPoolStats(crate::msg_pool_class_t_MSG_POOL_MEDIUM).exhausted_count, mediumBefore.exhausted_count + 1);
+        let largeAfter = getPoolStats(crate::msg_pool_class_t_MSG_POOL_LARGE);
+        assert_eq!(largeAfter.blocks_in_use, largeBefore.blocks_in_use);
+        assert_eq!(largeAfter.exhausted_count, largeBefore.exhausted_count);
+        for payload in mediumPayloads
+        {
+            assert_eq!(releasePoolPayload(payload), 0);
+        }
+
+        //oversized requests fail instead of touching the heap
+        assert_eq!(acquirePoolPayload((crate::MSG_POOL_LARGE_BLOCK_SIZE + 1) as usize).is_null(), true);
+
+        for payload in payloads
+        {
+            assert_eq!(releasePoolPayload(payload), 0);
+        }
+        assert_eq!(releasePoolPayload(spilled), 0);
+        let heapPtr = unsafe { crate::createVoidPtr("heap\0".as_ptr() as *const i8, 5) };
+        assert_eq!(releasePoolPayload(heapPtr), 1);
+        assert_eq!(getPoolStats(crate::msg_pool_class_t_MSG_POOL_SMALL).blocks_in_use, 0);
+
+        //pointer messages are released back into the pool after dispatch
+        let (testComponent, error) = generateTestComponentHandle();
+        assert_eq!(error, 0);
+        let testCallback = registerTestHandlerNormal(1, testComponent);
+        let testMsg: &str = "pool Message\0";
+        let testPtr = acquirePoolPayload(testMsg.len());
+        unsafe { std::ptr::copy_nonoverlapping(testMsg.as_ptr(), testPtr as *mut u8, testMsg.len()) };
+        let mutData = message_info_t
+        {
+            message_type: 2,
+            component_handle: testComponent,
+            message_data: testPtr,
+            message_size: testMsg.len(),
+            is_pointer: true,
+            is_inline: false,
+            enqueue_time_us: 0,
+            trace_id: 0,
+            request_id: 0,
+            origin_time_us: 0,
+            inline_payload: [0; crate::MSG_INLINE_PAYLOAD_SIZE as usize],
+        };
+        assert_eq!(unsafe { crate::send_message_to_normal_queue(mutData) }, 0);
+        assert_eq!(getPoolStats(crate::msg_pool_class_t_MSG_POOL_SMALL).blocks_in_use, 1);
+        assert_eq!(spin_normal_queue_once(), true);
+        unsafe
+        {
+            assert_eq!(testMsg, lastStrDatOne);
+        }
+        assert_eq!(getPoolStats(crate::msg_pool_class_t_MSG_POOL_SMALL).blocks_in_use, 0);
+        unregisterTestHandlerNormal(testComponent, testCallback);
+        removeTestComponentHandle(testComponent);
+        unsafe{ crate::uninit_queue(0) };
+    }
+
+    #[test]
+    fn test_handler_handles_are_stable()
+    {
+        let testMsg: &str = "stable Message\0";
+        let strPtr = testMsg.as_ptr() as *const i8;
+        let testPtr = unsafe{ crate::createVoidPtr(strPtr, testMsg.len()) };
+        initMessageQueue();
+        let (testComponent, error) = generateTestComponentHandle();
+        assert_eq!(error, 0);
+        let testCallbackOne = registerTestHandlerNormal(1, testComponent);
+        let testCallbackTwo = registerTestHandlerNormal(2, testComponent);
+        let testCallbackThree = registerTestHandlerNormal(3, testComponent);
+        assert_ne!(testCallbackOne, 0);
+        assert_ne!(testCallbackOne, testCallbackTwo);
+        assert_ne!(testCallbackTwo, testCallbackThree);
+
+        //removing from the middle must not invalidate the other handles
+        assert_eq!(unregisterTestHandlerNormal(testComponent, testCallbackTwo), 0);
+        assert_eq!(unregisterTestHandlerNormal(testComponent, testCallbackTwo), 1);
+        unsafe
+        {
+            lastStrDatTwo = "";
+        }
+        createNewMessageNormal(4, testComponent, testPtr, testMsg.len());
+        assert_eq!(spin_normal_queue_once(), true);
+        unsafe
+        {
+            assert_eq!(testMsg, lastStrDatOne);
+            assert_eq!("", lastStrDatTwo);
+            assert_eq!(testMsg, lastStrDatThree);
+        }
+
+        //freed handle gets reused
+        assert_eq!(registerTestHandlerNormal(2, testComponent), testCallbackTwo);
+        assert_eq!(unregisterTestHandlerNormal(testComponent, testCallbackThree), 0);
+        assert_eq!(unregisterTestHandlerNormal(testComponent, testCallbackOne), 0);
+        assert_eq!(unregisterTestHandlerNormal(testComponent, testCallbackTwo), 0);
+        removeTestComponentHandle(testComponent);
+        unsafe{ crate::uninit_queue(0) };
+    }
+
+    #[test]
+    fn test_filtered_priority_handlers()
+    {
+        let testMsgA: &str = "type one\0";
+        let testPtrA = unsafe{ crate::createVoidPtr(testMsgA.as_ptr() as *const i8, testMsgA.len()) };
+        let testMsgB: &str = "type two\0";
+        let testPtrB = unsafe{ crate::createVoidPtr(testMsgB.as_ptr() as *const i8, testMsgB.len()) };
+        initPriorityMessageQueue();
+        let (testComponent, error) = generateTestComponentHandle();
+        assert_eq!(error, 0);
+        let testCallbackOne = registerTestHandlerPriorityFiltered(1, testComponent, 1 << 1);
+        let testCallbackTwo = registerTestHandlerPriorityFiltered(2, testComponent, 1 << 2);
+        let testCallbackThree = registerTestHandlerPriority(3, testComponent);
+        //an empty mask can never match so registration is refused
+        assert_eq!(registerTestHandlerPriorityFiltered(1, testComponent, 0), 0);
+        unsafe
+        {
+            lastStrDatOne = "";
+            lastStrDatTwo = "";
+        }
+
+        createNewMessagePriority(1, testComponent, testPtrA, testMsgA.len());
+        assert_eq!(spin_priority_queue_once(), true);
+        unsafe
+        {
+            assert_eq!(testMsgA, lastStrDatOne);
+            assert_eq!("", lastStrDatTwo);
+            assert_eq!(testMsgA, lastStrDatThree);
+        }
+
+        createNewMessagePriority(2, testComponent, testPtrB, testMsgB.len());
+        assert_eq!(spin_priority_queue_once(), true);
+        unsafe
+        {
+            assert_eq!(testMsgA, lastStrDatOne);
+            assert_eq!(testMsgB, lastStrDatTwo);
+            assert_eq!(testMsgB, lastStrDatThree);
+        }
+
+        unregisterTestHandlerPriority(testComponent, testCallbackOne);
+        unregisterTestHandlerPriority(testComponent, testCallbackTwo);
+        unregisterTestHandlerPriority(testComponent, testCallbackThree);
+        removeTestComponentHandle(testComponent);
+        unsafe{ crate::uninit_queue(1) };
+    }
+
+    #[test]
+    fn test_batched_drain()
+    {
+        let testMsgs: [&str; 3] = ["batch one\0", "batch two\0", "batch three\0"];
+        initMessageQueue();
+        assert_eq!(setQueueBatchSize(0, 0), 1);
+        assert_eq!(setQueueBatchSize(0, crate::MAX_QUEUE_BATCH_SIZE as u8 + 1), 1);
+        assert_eq!(setQueueBatchSize(0, 4), 0);
+        let (testComponent, error) = generateTestComponentHandle();
+        assert_eq!(error, 0);
+        let testCallbackOne = registerTestHandlerNormal(1, testComponent);
+        for testMsg in testMsgs
+        {
+            let testPtr = unsafe{ crate::createVoidPtr(testMsg.as_ptr() as *const i8, testMsg.len()) };
+            assert_eq!(createNewMessageNormal(1, testComponent, testPtr, testMsg.len()), 0);
+        }
+
+        //a single wakeup drains everything already pending
+        assert_eq!(spin_normal_queue_once(), true);
+        unsafe
+        {
+            assert_eq!(testMsgs[2], lastStrDatOne);
+        }
+        let stats = getQueueBatchStats(0);
+        assert_eq!(stats.batch_size, 4);
+        assert_eq!(stats.wakeups, 1);
+        assert_eq!(stats.messages_dispatched, 3);
+        assert_eq!(stats.average_batch_x100, 300);
+
+        assert_eq!(setQueueBatchSize(0, 1), 0);
+        unregisterTestHandlerNormal(testComponent, testCallbackOne);
+        removeTestComponentHandle(testComponent);
+        unsafe{ crate::uninit_queue(0) };
+    }
+
+    #[test]
+    fn test_spsc_ring_stress()
+    {
+        const RING_SIZE: usize = 64;
+        const MESSAGE_COUNT: usize = 1000000;
+        let mut storage: Vec<message_info_t> = vec![unsafe { mem::zeroed() }; RING_SIZE];
+        let mut ring: Box<msg_ring_t> = Box::new(unsafe { mem::zeroed() });
+        let ringPtr: *mut msg_ring_t = &mut *ring;
+        assert_eq!(unsafe { crate::msg_ring_init(ringPtr, storage.as_mut_ptr(), 48, 0) }, 1);
+        assert_eq!(unsafe { crate::msg_ring_init(ringPtr, storage.as_mut_ptr(), RING_SIZE as u32, 0) }, 0);
+
+        let producerRing = RingPtr(ringPtr);
+        let producer = thread::spawn(move ||
+        {
+            let producerRing = producerRing;
+            let mut seq: usize = 0;
+            while seq < MESSAGE_COUNT
+            {
+                if ringPushSequence(producerRing.0, seq) == 0
+                {
+                    seq += 1;
+                }
+                else
+                {
+                    thread::yield_now();
+                }
+            }
+        });
+
+        //every sequence number must come out exactly once and in order
+        let mut expected: usize = 0;
+        while expected < MESSAGE_COUNT
+        {
+            match ringPop(ringPtr)
+            {
+                Some(message) =>
+                {
+                    assert_eq!(message.message_size, expected);
+                    expected += 1;
+                }
+                None => thread::yield_now(),
+            }
+        }
+        producer.join().unwrap();
+        assert!(ringPop(ringPtr).is_none());
+    }
+
+    #[test]
+    fn test_ring_publish_doorbell()
+    {
+        let testMsg: &str = "ring message\0";
+        let mut storage: Vec<message_info_t> = vec![unsafe { mem::zeroed() }; 8];
+        let mut ring: Box<msg_ring_t> = Box::new(unsafe { mem::zeroed() });
+        let ringPtr: *mut msg_ring_t = &mut *ring;
+        initPriorityMessageQueue();
+        assert_eq!(unsafe { crate::msg_ring_init(ringPtr, storage.as_mut_ptr(), 8, 1) }, 0);
+        let (testComponent, error) = generateTestComponentHandle();
+        assert_eq!(error, 0);
+        let testCallbackOne = registerTestHandlerPriority(1, testComponent);
+        let mut message: message_info_t = unsafe { mem::zeroed() };
+        message.component_handle = testComponent;
+        message.message_data = testMsg.as_ptr() as *mut ::std::os::raw::c_void;
+        message.message_size = testMsg.len();
+        for _ in 0..8
+        {
+            assert_eq!(unsafe { crate::msg_ring_publish(ringPtr, message) }, 0);
+        }
+        //full ring refuses the message instead of blocking
+        assert_eq!(unsafe { crate::msg_ring_publish(ringPtr, message) }, 1);
+        assert_eq!(ring.doorbell_pending, 1);
+        assert_eq!(ring.dropped, 1);
+
+        //one doorbell drains everything published before it
+        assert_eq!(spin_priority_queue_once(), true);
+        unsafe
+        {
+            assert_eq!(testMsg, lastStrDatOne);
+        }
+        assert_eq!(ring.doorbell_pending, 0);
+        assert!(ringPop(ringPtr).is_none());
+
+        //an ISR producer rings the same doorbell without going through the task side send
+        let enqueuedBefore = getQueueStats(1).enqueued;
+        let mut taskWoken: crate::BaseType_t = 0;
+        for _ in 0..2
+        {
+            assert_eq!(unsafe { crate::msg_ring_publish_from_isr(ringPtr, message, &mut taskWoken) }, 0);
+        }
+        assert_eq!(ring.doorbell_pending, 1);
+        assert_eq!(getQueueStats(1).enqueued, enqueuedBefore + 1);
+        unsafe{ lastStrDatOne = "" };
+        assert_eq!(spin_priority_queue_once(), true);
+        unsafe
+        {
+            assert_eq!(testMsg, lastStrDatOne);
+        }
+        assert_eq!(ring.doorbell_pending, 0);
+        assert!(ringPop(ringPtr).is_none());
+
+        unregisterTestHandlerPriority(testComponent, testCallbackOne);
+        removeTestComponentHandle(testComponent);
+        unsafe{ crate::uninit_queue(1) };
+    }
+
+    #[test]
+    fn test_queue_health_metrics()
+    {
+        let testMsg: &str = "metrics\0";
+        let testPtr = testMsg.as_ptr() as *mut ::std::os::raw::c_void;
+        initMessageQueue();
+        let (testComponent, error) = generateTestComponentHandle();
+        assert_eq!(error, 0);
+        let testCallbackOne = registerTestHandlerNormal(1, testComponent);
+        let stats = getQueueStats(0);
+        assert_eq!(stats.enqueued, 0);
+        assert_eq!(stats.dropped, 0);
+
+        //fill the queue past its length so the extra sends are counted as drops
+        let queueLength = crate::MESSAGE_QUEUE_LENGTH as usize;
+        for _ in 0..(queueLength + 3)
+        {
+            createNewMessageNormal(1, testComponent, testPtr, testMsg.len());
+        }
+        let stats = getQueueStats(0);
+        assert_eq!(stats.enqueued as usize, queueLength);
+        assert_eq!(stats.dropped, 3);
+        assert_eq!(stats.depth_high_water as usize, queueLength);
+
+        for _ in 0..queueLength
+        {
+            assert_eq!(spin_normal_queue_once(), true);
+        }
+        let stats = getQueueStats(0);
+        let dispatched: u32 = stats.latency_histogram.iter().sum();
+        assert_eq!(dispatched as usize, queueLength);
+
+        assert_eq!(unsafe { crate::reset_queue_stats(0) }, 0);
+        let stats = getQueueStats(0);
+        assert_eq!(stats.enqueued, 0);
+        assert_eq!(stats.depth_high_water, 0);
+        assert_eq!(stats.latency_histogram.iter().sum::<u32>(), 0);
+
+        unregisterTestHandlerNormal(testComponent, testCallbackOne);
+        removeTestComponentHandle(testComponent);
+        unsafe{ crate::uninit_queue(0) };
+    }
+
+    #[test]
+    fn test_overflow_policies()
+    {
+        let staleMsg: &str = "stale\0";
+        let stalePtr = staleMsg.as_ptr() as *mut ::std::os::raw::c_void;
+        let latestMsg: &str = "latest\0";
+        let latestPtr = latestMsg.as_ptr() as *mut ::std::os::raw::c_void;
+        initMessageQueue();
+        let (testComponent, error) = generateTestComponentHandle();
+        assert_eq!(error, 0);
+        let testCallbackOne = registerTestHandlerNormal(1, testComponent);
+        assert_eq!(setOverflowPolicy(0, testComponent, 1, crate::msg_overflow_policy_t_MSG_OVERFLOW_COALESCE), 0);
+        assert_eq!(setOverflowPolicy(0, testComponent, 2, crate::msg_overflow_policy_t_MSG_OVERFLOW_DROP_OLDEST), 0);
+        unsafe{ crate::reset_queue_stats(0) };
+
+        //coalesced sends keep one queue entry holding the latest message
+        createNewMessageNormal(1, testComponent, stalePtr, staleMsg.len());
+        createNewMessageNormal(1, testComponent, stalePtr, staleMsg.len());
+        createNewMessageNormal(1, testComponent, latestPtr, latestMsg.len());
+        let stats = getQueueStats(0);
+        assert_eq!(stats.enqueued, 1);
+        assert_eq!(stats.coalesced, 2);
+        assert_eq!(spin_normal_queue_once(), true);
+        unsafe
+        {
+            assert_eq!(latestMsg, lastStrDatOne);
+            assert_eq!(1, lastMsgTypeOne);
+        }
+
+        //drop oldest keeps a bounded backlog and evicts the oldest message of that type
+        let queueLength = crate::MESSAGE_QUEUE_LENGTH as usize;
+        let backlog = crate::MSG_OVERFLOW_BACKLOG as usize;
+        for _ in 0..backlog
+        {
+            createNewMessageNormal(2, testComponent, stalePtr, staleMsg.len());
+        }
+        assert_eq!(createNewMessageNormal(2, testComponent, latestPtr, latestMsg.len()), 0);
+        let stats = getQueueStats(0);
+        assert_eq!(stats.evicted, 1);
+        assert_eq!(stats.dropped, 0);
+        for _ in 0..backlog
+        {
+            assert_eq!(spin_normal_queue_once(), true);
+        }
+        unsafe
+        {
+            assert_eq!(latestMsg, lastStrDatOne);
+        }
+
+        //switching a backlog to coalesce keeps only its newest message
+        for _ in 0..(backlog - 1)
+        {
+            createNewMessageNormal(2, testComponent, stalePtr, staleMsg.len());
+        }
+        createNewMessageNormal(2, testComponent, latestPtr, latestMsg.len());
+        unsafe{ crate::reset_queue_stats(0) };
+        assert_eq!(setOverflowPolicy(0, testComponent, 2, crate::msg_overflow_policy_t_MSG_OVERFLOW_COALESCE), 0);
+        assert_eq!(getQueueStats(0).coalesced as usize, backlog - 1);
+        unsafe
+        {
+            lastStrDatOne = "";
+        }
+        for _ in 0..backlog
+        {
+            assert_eq!(spin_normal_queue_once(), true);
+        }
+        unsafe
+        {
+            assert_eq!(latestMsg, lastStrDatOne);
+        }
+
+        //the default policy still refuses sends to a full queue
+        for _ in 0..queueLength
+        {
+            createNewMessageNormal(3, testComponent, stalePtr, staleMsg.len());
+        }
+        assert_eq!(createNewMessageNormal(3, testComponent, latestPtr, latestMsg.len()), 2);
+        for _ in 0..queueLength
+        {
+            assert_eq!(spin_normal_queue_once(), true);
+        }
+        unsafe
+        {
+            assert_eq!(staleMsg, lastStrDatOne);
+        }
+
+        unregisterTestHandlerNormal(testComponent, testCallbackOne);
+        removeTestComponentHandle(testComponent);
+        unsafe{ crate::uninit_queue(0) };
+    }
+
+    #[test]
+    fn test_drop_oldest_spares_other_components()
+    {
+        static mut calls: [u32; 2] = [0; 2];
+        static mut lastOwnData: u8 = 0;
+        unsafe extern "C" fn otherHandler(_compHandle: component_handle_t, _msg_type: u8, _msg_data: *mut ::std::os::raw::c_void, _msg_size: usize)
+        {
+            calls[0] += 1;
+        }
+        unsafe extern "C" fn ownHandler(_compHandle: component_handle_t, _msg_type: u8, msg_data: *mut ::std::os::raw::c_void, _msg_size: usize)
+        {
+            calls[1] += 1;
+            lastOwnData = *(msg_data as *const u8);
+        }
+
+        let mut ownData: [u8; 3] = [1, 2, 3];
+        let mut otherData: u8 = 0;
+        let queueLength = crate::MESSAGE_QUEUE_LENGTH as usize;
+        initMessageQueue();
+        let (ownComponent, error) = generateTestComponentHandle();
+        assert_eq!(error, 0);
+        let (otherComponent, error) = generateTestComponentHandle();
+        assert_eq!(error, 0);
+        let ownCallback = unsafe { crate::register_component_handler_for_messages(Some(ownHandler), ownComponent) };
+        let otherCallback = unsafe { crate::register_component_handler_for_messages(Some(otherHandler), otherComponent) };
+        assert_eq!(setOverflowPolicy(0, ownComponent, 2, crate::msg_overflow_policy_t_MSG_OVERFLOW_DROP_OLDEST), 0);
+        unsafe
+        {
+            calls = [0; 2];
+            crate::reset_queue_stats(0);
+        }
+
+        //a full queue of mostly other messages only gives up our own older message
+        for _ in 0..queueLength - 2
+        {
+            assert_eq!(createNewMessageNormal(2, otherComponent, &mut otherData as *mut u8 as *mut ::std::os::raw::c_void, 1), 0);
+        }
+        for dataIdx in 0..3
+        {
+            assert_eq!(createNewMessageNormal(2, ownComponent, &mut ownData[dataIdx] as *mut u8 as *mut ::std::os::raw::c_void, 1), 0);
+        }
+        let stats = getQueueStats(0);
+        assert_eq!(stats.evicted, 1);
+        assert_eq!(stats.dropped, 0);
+        for _ in 0..queueLength
+        {
+            assert_eq!(spin_normal_queue_once(), true);
+        }
+        unsafe
+        {
+            assert_eq!(calls[0], (queueLength - 2) as u32);
+            assert_eq!(calls[1], 2);
+            assert_eq!(lastOwnData, 3);
+        }
+
+        //with nothing of ours pending there is nothing to evict, so the new message is dropped
+        unsafe{ calls = [0; 2] };
+        for _ in 0..queueLength
+        {
+            assert_eq!(createNewMessageNormal(2, otherComponent, &mut otherData as *mut u8 as *mut ::std::os::raw::c_void, 1), 0);
+        }
+        assert_eq!(createNewMessageNormal(2, ownComponent, &mut ownData[0] as *mut u8 as *mut ::std::os::raw::c_void, 1), 2);
+        let stats = getQueueStats(0);
+        assert_eq!(stats.evicted, 1);
+        assert_eq!(stats.dropped, 1);
+        for _ in 0..queueLength
+        {
+            assert_eq!(spin_normal_queue_once(), true);
+        }
+        unsafe
+        {
+            assert_eq!(calls[0], queueLength as u32);
+            assert_eq!(calls[1], 0);
+        }
+
+        unsafe
+        {
+            crate::unregister_component_handler_for_messages(ownComponent, ownCallback);
+            crate::unregister_component_handler_for_messages(otherComponent, otherCallback);
+        }
+        removeTestComponentHandle(ownComponent);
+        removeTestComponentHandle(otherComponent);
+        unsafe{ crate::uninit_queue(0) };
+    }
+
+    #[test]
+    fn test_generic_queues()
+    {
+        let telemetryMsg: &str = "telemetry\0";
+        let controlMsg: &str = "control\0";
+        initPriorityMessageQueue();
+        let (testComponent, error) = generateTestComponentHandle();
+        assert_eq!(error, 0);
+        let (controlQueue, error) = createQueue("control_queue\0", 8, 15);
+        assert_eq!(error, 0);
+        let (telemetryQueue, error) = createQueue("telemetry_queue\0", crate::MESSAGE_QUEUE_LENGTH as u16, 2);
+        assert_eq!(error, 0);
+        assert!(controlQueue > crate::MSG_QUEUE_PRIORITY as u8);
+        assert!(telemetryQueue > crate::MSG_QUEUE_PRIORITY as u8);
+        assert_ne!(controlQueue, telemetryQueue);
+        assert_eq!(checkQueueActive(controlQueue), true);
+
+        //handles made before a queue existed can still register on it
+        let controlCallback = registerTestHandlerOnQueue(controlQueue, 2, testComponent);
+        let telemetryCallback = registerTestHandlerOnQueue(telemetryQueue, 3, testComponent);
+        assert_ne!(controlCallback, 0);
+        assert_ne!(telemetryCallback, 0);
+
+        //a full telemetry backlog does not hold up the control queue
+        let queueLength = crate::MESSAGE_QUEUE_LENGTH as usize;
+        for _ in 0..queueLength
+        {
+            createNewMessageOnQueue(telemetryQueue, 1, testComponent, telemetryMsg.as_ptr() as *mut ::std::os::raw::c_void, telemetryMsg.len());
+        }
+        assert_eq!(createNewMessageOnQueue(controlQueue, 1, testComponent, controlMsg.as_ptr() as *mut ::std::os::raw::c_void, controlMsg.len()), 0);
+        let controlSpin = "control_queue\0".as_ptr() as *const i8;
+        assert_eq!(unsafe { crate::spinQueueTaskOnce(controlSpin) }, true);
+        unsafe
+        {
+            assert_eq!(controlMsg, lastStrDatTwo);
+        }
+        assert_eq!(getQueueStats(controlQueue).depth_high_water, 1);
+        assert_eq!(getQueueStats(telemetryQueue).depth_high_water as usize, queueLength);
+
+        unsafe{ crate::unregister_queue_handler_for_messages(controlQueue, testComponent, controlCallback) };
+        unsafe{ crate::unregister_queue_handler_for_messages(telemetryQueue, testComponent, telemetryCallback) };
+        removeTestComponentHandle(testComponent);
+        unsafe{ crate::uninit_queue(controlQueue) };
+        unsafe{ crate::uninit_queue(telemetryQueue) };
+        unsafe{ crate::uninit_queue(1) };
+    }
+
+    #[test]
+    fn test_payload_ref_counting()
+    {
+        initMessageQueue();
+        let (testComponent, error) = generateTestComponentHandle();
+        assert_eq!(error, 0);
+        let testCallback = registerTestHandlerNormal(1, testComponent);
+        let testMsg: &str = "shared frame\0";
+        let testPtr = acquirePoolPayload(testMsg.len());
+        unsafe { std::ptr::copy_nonoverlapping(testMsg.as_ptr(), testPtr as *mut u8, testMsg.len()) };
+        assert_eq!(unsafe { crate::get_message_payload_ref_count(testPtr) }, 1);
+
+        //a subscriber holding its own reference keeps the block alive past dispatch
+        assert_eq!(unsafe { crate::retain_message_payload(testPtr) }, 0);
+        let mut message: message_info_t = unsafe { mem::zeroed() };
+        message.component_handle = testComponent;
+        message.message_type = 1;
+        message.message_data = testPtr;
+        message.message_size = testMsg.len();
+        message.is_pointer = true;
+        assert_eq!(unsafe { crate::send_message_to_normal_queue(message) }, 0);
+        assert_eq!(spin_normal_queue_once(), true);
+        assert_eq!(unsafe { crate::get_message_payload_ref_count(testPtr) }, 1);
+        assert_eq!(getPoolStats(crate::msg_pool_class_t_MSG_POOL_SMALL).blocks_in_use, 1);
+        let heldMsg = unsafe { str::from_utf8(slice::from_raw_parts(testPtr as *const u8, testMsg.len())).unwrap() };
+        assert_eq!(testMsg, heldMsg);
+
+        //the last release returns the block, further releases are refused
+        assert_eq!(releasePoolPayload(testPtr), 0);
+        assert_eq!(getPoolStats(crate::msg_pool_class_t_MSG_POOL_SMALL).blocks_in_use, 0);
+        assert_eq!(releasePoolPayload(testPtr), 2);
+        assert_eq!(unsafe { crate::retain_message_payload(testPtr) }, 2);
+
+        unregisterTestHandlerNormal(testComponent, testCallback);
+        removeTestComponentHandle(testComponent);
+        unsafe{ crate::uninit_queue(0) };
+    }
+
+    #[test]
+    fn test_deferred_handlers()
+    {
+        initPriorityMessageQueue();
+        let (testComponent, error) = generateTestComponentHandle();
+        assert_eq!(error, 0);
+        unsafe
+        {
+            lastMsgTypeOne = 0;
+            lastMsgTypeTwo = 0;
+        }
+        let deferredCallback = registerTestHandlerDeferred(1, 1, testComponent);
+        assert_ne!(deferredCallback, 0);
+        let directCallback = registerTestHandlerPriority(2, testComponent);
+        let testMsg: &str = "slow console\0";
+        let testPtr = acquirePoolPayload(testMsg.len());
+        unsafe { std::ptr::copy_nonoverlapping(testMsg.as_ptr(), testPtr as *mut u8, testMsg.len()) };
+        let mut message: message_info_t = unsafe { mem::zeroed() };
+        message.component_handle = testComponent;
+        message.message_type = 3;
+        message.message_data = testPtr;
+        message.message_size = testMsg.len();
+        message.is_pointer = true;
+        assert_eq!(unsafe { crate::send_message_to_priority_queue(message) }, 0);
+
+        //the queue task only runs the direct handler and leaves the payload to the worker
+        assert_eq!(spin_priority_queue_once(), true);
+        unsafe
+        {
+            assert_eq!(lastMsgTypeTwo, 3);
+            assert_eq!(lastStrDatTwo, testMsg);
+            assert_eq!(lastMsgTypeOne, 0);
+        }
+        assert_eq!(unsafe { crate::get_message_payload_ref_count(testPtr) }, 1);
+        assert_eq!(getQueueStats(1).deferred, 1);
+
+        //the worker runs the deferred handler and drops the last reference
+        assert_eq!(spin_msg_worker_once(), true);
+        unsafe
+        {
+            assert_eq!(lastMsgTypeOne, 3);
+            assert_eq!(lastStrDatOne, testMsg);
+        }
+        assert_eq!(unsafe { crate::get_message_payload_ref_count(testPtr) }, 0);
+
+        //raw pointers into the sender's memory are not kept past the dispatch, so that handler runs on the queue task
+        unsafe { lastMsgTypeOne = 0; }
+        assert_eq!(createNewMessagePriority(5, testComponent, testMsg.as_ptr() as *mut ::std::os::raw::c_void, testMsg.len()), 0);
+        assert_eq!(spin_priority_queue_once(), true);
+        unsafe
+        {
+            assert_eq!(lastMsgTypeOne, 5);
+            assert_eq!(lastStrDatOne, testMsg);
+        }
+        assert_eq!(getQueueStats(1).deferred, 1);
+
+        //a job whose handler was unregistered before the worker ran is skipped
+        unsafe { lastMsgTypeOne = 0; }
+        let mut inlineMessage: message_info_t = unsafe { mem::zeroed() };
+        assert_eq!(unsafe { crate::set_message_inline_payload(&mut inlineMessage, testMsg.as_ptr() as *const ::std::os::raw::c_void, testMsg.len()) }, 0);
+        inlineMessage.component_handle = testComponent;
+        inlineMessage.message_type = 4;
+        assert_eq!(unsafe { crate::send_message_to_priority_queue(inlineMessage) }, 0);
+        assert_eq!(spin_priority_queue_once(), true);
+        assert_eq!(getQueueStats(1).deferred, 2);
+        assert_eq!(unregisterTestHandlerPriority(testComponent, deferredCallback), 0);
+        assert_eq!(spin_msg_worker_once(), true);
+        unsafe { assert_eq!(lastMsgTypeOne, 0); }
+
+        unregisterTestHandlerPriority(testComponent, directCallback);
+        removeTestComponentHandle(testComponent);
+        unsafe{ crate::uninit_queue(1) };
+    }
+
+    #[test]
+    fn test_deferred_handler_order()
+    {
+        static mut orderedTypes: [u8; 8] = [0; 8];
+        static mut orderedCount: usize = 0;
+        unsafe extern "C" fn orderedHandler(_compHandle: component_handle_t, msg_type: u8, _msg_data: *mut ::std::os::raw::c_void, _msg_size: usize)
+        {
+            orderedTypes[orderedCount] = msg_type;
+            orderedCount += 1;
+        }
+
+        initPriorityMessageQueue();
+        let (testComponent, error) = generateTestComponentHandle();
+        assert_eq!(error, 0);
+        unsafe { orderedCount = 0; }
+        let orderedCallback = unsafe { crate::register_priority_deferred_handler_for_message_types(Some(orderedHandler), testComponent, crate::MSG_TYPE_MASK_ALL as u32) };
+        assert_ne!(orderedCallback, 0);
+
+        //every call of one handler lands on the same worker, so they come out in the order they were sent
+        let messageCount = unsafe { orderedTypes.len() };
+        for msgType in 0..messageCount
+        {
+            let mut message: message_info_t = unsafe { mem::zeroed() };
+            assert_eq!(unsafe { crate::set_message_inline_payload(&mut message, std::ptr::null(), 0) }, 0);
+            message.component_handle = testComponent;
+            message.message_type = msgType as u8;
+            assert_eq!(unsafe { crate::send_message_to_priority_queue(message) }, 0);
+        }
+        for _ in 0..messageCount
+        {
+            assert_eq!(spin_priority_queue_once(), true);
+        }
+        assert_eq!(getQueueStats(1).deferred as usize, messageCount);
+        for _ in 0..messageCount
+        {
+            assert_eq!(spin_msg_worker_once(), true);
+        }
+        unsafe
+        {
+            assert_eq!(orderedCount, messageCount);
+            for msgType in 0..messageCount
+            {
+                assert_eq!(orderedTypes[msgType], msgType as u8);
+            }
+        }
+
+        unregisterTestHandlerPriority(testComponent, orderedCallback);
+        removeTestComponentHandle(testComponent);
+        unsafe{ crate::uninit_queue(1) };
+    }
+
+    #[test]
+    fn test_pipeline_tracing()
+    {
+        //stands in for a component that derives a message from the one it was handed
+        unsafe extern "C" fn traceRelayHandler(compHandle: component_handle_t, msg_type: u8, msg_data: *mut ::std::os::raw::c_void, msg_size: usize)
+        {
+            let mut derived: message_info_t = mem::zeroed();
+            derived.component_handle = compHandle;
+            derived.message_type = msg_type + 1;
+            derived.message_data = msg_data;
+            derived.message_size = msg_size;
+            crate::inherit_message_trace(0, &mut derived as *mut message_info_t);
+            crate::send_message_to_priority_queue(derived);
+        }
+
+        initMessageQueue();
+        initPriorityMessageQueue();
+        unsafe { crate::reset_trace_stats() };
+        let (testComponent, error) = generateTestComponentHandle();
+        assert_eq!(error, 0);
+        let relayCallback = unsafe { crate::register_component_handler_for_message_types(Some(traceRelayHandler), testComponent, 1 << 1) };
+        let sinkCallback = registerTestHandlerPriority(1, testComponent);
+
+        //marking outside a dispatch has no trace to attach to
+        assert_eq!(unsafe { crate::mark_trace_stage(0, testComponent, 9) }, 1);
+
+        let testMsg: &str = "frame\0";
+        let mut message: message_info_t = unsafe { mem::zeroed() };
+        message.component_handle = testComponent;
+        message.message_type = 1;
+        message.message_data = testMsg.as_ptr() as *mut ::std::os::raw::c_void;
+        message.message_size = testMsg.len();
+        let traceId = unsafe { crate::start_message_trace(&mut message as *mut message_info_t) };
+        assert_ne!(traceId, crate::MSG_TRACE_NONE as u16);
+        assert_eq!(unsafe { crate::send_message_to_normal_queue(message) }, 0);
+        assert_eq!(spin_normal_queue_once(), true);
+        assert_eq!(spin_priority_queue_once(), true);
+        unsafe { assert_eq!(lastMsgTypeOne, 2); }
+
+        //both hops are timed against the same origin, in the order they were seen
+        let mut firstStage: crate::msg_trace_stage_stats_t = unsafe { mem::zeroed() };
+        let mut secondStage: crate::msg_trace_stage_stats_t = unsafe { mem::zeroed() };
+        assert_eq!(unsafe { crate::get_trace_stage_stats(0, &mut firstStage) }, 0);
+        assert_eq!(unsafe { crate::get_trace_stage_stats(1, &mut secondStage) }, 0);
+        assert_eq!(unsafe { crate::get_trace_stage_stats(2, &mut secondStage) }, 1);
+        assert_eq!(unsafe { crate::get_trace_stage_stats(1, &mut secondStage) }, 0);
+        assert_eq!(firstStage.message_type, 1);
+        assert_eq!(secondStage.message_type, 2);
+        assert_eq!(firstStage.count, 1);
+        assert_eq!(secondStage.count, 1);
+        assert_eq!(firstStage.last_trace_id, traceId);
+        assert_eq!(secondStage.last_trace_id, traceId);
+        assert!(secondStage.last_latency_us >= firstStage.last_latency_us);
+
+        //untraced messages leave the stages alone
+        assert_eq!(createNewMessageNormal(1, testComponent, testMsg.as_ptr() as *mut ::std::os::raw::c_void, testMsg.len()), 0);
+        assert_eq!(spin_normal_queue_once(), true);
+        assert_eq!(spin_priority_queue_once(), true);
+        assert_eq!(unsafe { crate::get_trace_stage_stats(0, &mut firstStage) }, 0);
+        assert_eq!(firstStage.count, 1);
+
+        unsafe { crate::unregister_component_handler_for_messages(testComponent, relayCallback) };
+        unregisterTestHandlerPriority(testComponent, sinkCallback);
+        removeTestComponentHandle(testComponent);
+        unsafe
+        {
+            crate::reset_trace_stats();
+            crate::uninit_queue(0);
+            crate::uninit_queue(1);
+        }
+    }
+
+    #[test]
+    fn test_inline_payloads()
+    {
+        //inline data lives in the queue task's copy of the message, so it is copied out during the callback
+        static mut inlineSeen: [u8; 16] = [0; 16];
+        static mut inlineSeenCount: u8 = 0;
+        unsafe extern "C" fn inlineCopyHandler(_compHandle: component_handle_t, _msg_type: u8, msg_data: *mut ::std::os::raw::c_void, msg_size: usize)
+        {
+            std::ptr::copy_nonoverlapping(msg_data as *const u8, inlineSeen.as_mut_ptr(), msg_size);
+            inlineSeenCount += 1;
+        }
+
+        initMessageQueue();
+        initPriorityMessageQueue();
+        let (testComponent, error) = generateTestComponentHandle();
+        assert_eq!(error, 0);
+        let directCallback = unsafe { crate::register_component_handler_for_messages(Some(inlineCopyHandler), testComponent) };
+        let deferredCallback = unsafe { crate::register_queue_deferred_handler_for_message_types(1, Some(inlineCopyHandler), testComponent, crate::MSG_TYPE_MASK_ALL as u32) };
+        let poolBefore = getPoolStats(crate::msg_pool_class_t_MSG_POOL_SMALL).acquire_count;
+        unsafe { inlineSeenCount = 0; }
+
+        //the sender's buffer is reused straight after the send, handlers still see the original
+        let mut sample: [u8; 13] = *b"imu sample 1\0";
+        let mut message: message_info_t = unsafe { mem::zeroed() };
+        message.component_handle = testComponent;
+        message.message_type = 6;
+        assert_eq!(unsafe { crate::set_message_inline_payload(&mut message, sample.as_ptr() as *const ::std::os::raw::c_void, sample.len()) }, 0);
+        assert_eq!(message.is_inline, true);
+        assert_eq!(unsafe { crate::send_message_to_normal_queue(message) }, 0);
+        assert_eq!(unsafe { crate::send_message_to_queue(1, message) }, 0);
+        sample[11] = b'2';
+        assert_eq!(spin_normal_queue_once(), true);
+        unsafe
+        {
+            assert_eq!(inlineSeenCount, 1);
+            assert_eq!(&inlineSeen[..13], b"imu sample 1\0");
+            inlineSeen = [0; 16];
+        }
+
+        //deferred handlers get the worker's own copy
+        assert_eq!(spin_priority_queue_once(), true);
+        assert_eq!(spin_msg_worker_once(), true);
+        unsafe
+        {
+            assert_eq!(inlineSeenCount, 2);
+            assert_eq!(&inlineSeen[..13], b"imu sample 1\0");
+        }
+        assert_eq!(getPoolStats(crate::msg_pool_class_t_MSG_POOL_SMALL).acquire_count, poolBefore);
+
+        //too big to inline
+        let large = [0u8; crate::MSG_INLINE_PAYLOAD_SIZE as usize + 1];
+        assert_eq!(unsafe { crate::set_message_inline_payload(&mut message, large.as_ptr() as *const ::std::os::raw::c_void, large.len()) }, 1);
+
+        unsafe
+        {
+            crate::unregister_component_handler_for_messages(testComponent, directCallback);
+            crate::unregister_queue_handler_for_messages(1, testComponent, deferredCallback);
+        }
+        removeTestComponentHandle(testComponent);
+        unsafe
+        {
+            crate::uninit_queue(0);
+            crate::uninit_queue(1);
+        }
+    }
+
+    #[test]
+    fn test_delayed_messages()
+    {
+        static mut delayedTypes: [u8; 4] = [0; 4];
+        static mut delayedCount: usize = 0;
+        unsafe extern "C" fn delayedHandler(_compHandle: component_handle_t, msg_type: u8, _msg_data: *mut ::std::os::raw::c_void, _msg_size: usize)
+        {
+            delayedTypes[delayedCount] = msg_type;
+            delayedCount += 1;
+        }
+
+        initMessageQueue();
+        let (testComponent, error) = generateTestComponentHandle();
+        assert_eq!(error, 0);
+        let testCallback = unsafe { crate::register_component_handler_for_messages(Some(delayedHandler), testComponent) };
+        unsafe { delayedCount = 0; }
+        let mut message: message_info_t = unsafe { mem::zeroed() };
+        message.component_handle = testComponent;
+
+        //two messages due on the same tick go out in send order, a pool payload is held until cancelled
+        let mut firstHandle: crate::msg_timer_handle_t = 0;
+        let mut cancelHandle: crate::msg_timer_handle_t = 0;
+        message.message_type = 1;
+        assert_eq!(unsafe { crate::send_message_after(0, message, 30, &mut firstHandle) }, 0);
+        message.message_type = 2;
+        assert_eq!(unsafe { crate::send_message_after(0, message, 30, std::ptr::null_mut()) }, 0);
+        let payload = unsafe { crate::acquire_message_payload(8) };
+        assert!(!payload.is_null());
+        message.message_type = 3;
+        message.message_data = payload;
+        message.message_size = 8;
+        message.is_pointer = true;
+        assert_eq!(unsafe { crate::send_message_after(0, message, 2000, &mut cancelHandle) }, 0);
+        assert_eq!(unsafe { crate::get_delayed_message_count() }, 3);
+
+        //nothing is early
+        assert_eq!(spin_msg_timer_once(), true);
+        assert_eq!(spin_normal_queue_once(), true);
+        assert_eq!(unsafe { delayedCount }, 0);
+
+        thread::sleep(Duration::from_millis(50));
+        assert_eq!(spin_msg_timer_once(), true);
+        assert_eq!(spin_normal_queue_once(), true);
+        assert_eq!(spin_normal_queue_once(), true);
+        unsafe
+        {
+            assert_eq!(delayedCount, 2);
+            assert_eq!(delayedTypes[..2], [1, 2]);
+        }
+
+        //sent messages cannot be cancelled, pending ones give their payload back
+        assert_eq!(unsafe { crate::cancel_delayed_message(firstHandle) }, 1);
+        assert_eq!(unsafe { crate::get_message_payload_ref_count(payload) }, 1);
+        assert_eq!(unsafe { crate::cancel_delayed_message(cancelHandle) }, 0);
+        assert_eq!(unsafe { crate::get_message_payload_ref_count(payload) }, 0);
+        assert_eq!(unsafe { crate::cancel_delayed_message(cancelHandle) }, 1);
+        assert_eq!(unsafe { crate::get_delayed_message_count() }, 0);
+
+        //every slot in use
+        message.is_pointer = false;
+        message.message_data = std::ptr::null_mut();
+        for _ in 0..crate::MAX_DELAYED_MESSAGES
+        {
+            assert_eq!(unsafe { crate::send_message_after(0, message, 1000, std::ptr::null_mut()) }, 0);
+        }
+        assert_eq!(unsafe { crate::send_message_after(0, message, 1000, std::ptr::null_mut()) }, 2);
+        assert_eq!(unsafe { crate::send_message_after(3, message, 1000, std::ptr::null_mut()) }, 1);
+
+        unsafe { crate::unregister_component_handler_for_messages(testComponent, testCallback) };
+        removeTestComponentHandle(testComponent);
+        unsafe{ crate::uninit_queue(0) };
+        assert_eq!(unsafe { crate::get_delayed_message_count() }, 0);
+    }
+
+    #[test]
+    fn test_request_response()
+    {
+        static mut heldRequestId: u16 = 0;
+        static mut responseCount: u8 = 0;
+        static mut responseStatus: u8 = 0;
+        static mut responseData: [u8; 4] = [0; 4];
+        static mut responseContext: usize = 0;
+        //type 1 is answered straight away, type 2 is held for a response that never comes
+        unsafe extern "C" fn serverHandler(_compHandle: component_handle_t, msg_type: u8, msg_data: *mut ::std::os::raw::c_void, _msg_size: usize)
+        {
+            let requestId = crate::get_dispatch_request_id(0);
+            assert_ne!(requestId, crate::MSG_REQUEST_NONE as u16);
+            if msg_type == 1
+            {
+                let mut reply = *(msg_data as *const [u8; 4]);
+                reply.reverse();
+                assert_eq!(crate::send_response(requestId, 7, reply.as_ptr() as *const ::std::os::raw::c_void, reply.len()), 0);
+            }
+            else
+            {
+                heldRequestId = requestId;
+            }
+        }
+        unsafe extern "C" fn responseHandler(_requestId: u16, status: u8, response_data: *mut ::std::os::raw::c_void, response_size: usize, context: *mut ::std::os::raw::c_void)
+        {
+            responseCount += 1;
+            responseStatus = status;
+            responseContext = context as usize;
+            if response_size == 4
+            {
+                responseData = *(response_data as *const [u8; 4]);
+            }
+        }
+
+        initMessageQueue();
+        let (serverComponent, error) = generateTestComponentHandle();
+        assert_eq!(error, 0);
+        let serverCallback = unsafe { crate::register_component_handler_for_messages(Some(serverHandler), serverComponent) };
+        unsafe { responseCount = 0; }
+        let mut request: message_info_t = unsafe { mem::zeroed() };
+        let payload: [u8; 4] = [1, 2, 3, 4];
+        assert_eq!(unsafe { crate::set_message_inline_payload(&mut request, payload.as_ptr() as *const ::std::os::raw::c_void, payload.len()) }, 0);
+        request.component_handle = serverComponent;
+        request.message_type = 1;
+
+        //request, then the response, each one dispatch on the normal queue
+        let mut requestId: u16 = 0;
+        assert_eq!(unsafe { crate::send_request(0, request, 0, Some(responseHandler), 0x55 as *mut ::std::os::raw::c_void, 1000, &mut requestId) }, 0);
+        assert_ne!(requestId, crate::MSG_REQUEST_NONE as u16);
+        assert_eq!(unsafe { crate::get_delayed_message_count() }, 1);
+        assert_eq!(spin_normal_queue_once(), true);
+        assert_eq!(unsafe { responseCount }, 0);
+        assert_eq!(spin_normal_queue_once(), true);
+        unsafe
+        {
+            assert_eq!(responseCount, 1);
+            assert_eq!(responseStatus, 7);
+            assert_eq!(responseData, [4, 3, 2, 1]);
+            assert_eq!(responseContext, 0x55);
+        }
+        //answering cancelled the timeout, and a request is only answered once
+        assert_eq!(unsafe { crate::get_delayed_message_count() }, 0);
+        assert_eq!(unsafe { crate::send_response(requestId, 0, std::ptr::null(), 0) }, 1);
+        assert_eq!(unsafe { crate::get_dispatch_request_id(0) }, crate::MSG_REQUEST_NONE as u16);
+
+        //an unanswered request times out, and the late response is refused
+        request.message_type = 2;
+        assert_eq!(unsafe { crate::send_request(0, request, 0, Some(responseHandler), std::ptr::null_mut(), 20, &mut requestId) }, 0);
+        assert_eq!(spin_normal_queue_once(), true);
+        assert_eq!(unsafe { heldRequestId }, requestId);
+        thread::sleep(Duration::from_millis(40));
+        assert_eq!(spin_msg_timer_once(), true);
+        assert_eq!(spin_normal_queue_once(), true);
+        unsafe
+        {
+            assert_eq!(responseCount, 2);
+            assert_eq!(responseStatus, crate::MSG_RPC_TIMEOUT as u8);
+        }
+        assert_eq!(unsafe { crate::send_response(heldRequestId, 0, std::ptr::null(), 0) }, 1);
+
+        //responses are copied inline, no callback means no request
+        let large = [0u8; crate::MSG_INLINE_PAYLOAD_SIZE as usize + 1];
+        assert_eq!(unsafe { crate::send_request(0, request, 0, Some(responseHandler), std::ptr::null_mut(), 0, &mut requestId) }, 0);
+        assert_eq!(unsafe { crate::send_response(requestId, 0, large.as_ptr() as *const ::std::os::raw::c_void, large.len()) }, 2);
+        assert_eq!(unsafe { crate::send_response(requestId, crate::MSG_RPC_TIMEOUT as u8, std::ptr::null(), 0) }, 2);
+        assert_eq!(unsafe { crate::send_request(0, request, 0, None, std::ptr::null_mut(), 0, &mut requestId) }, 1);
+
+        //a response that finds the reply queue full drops a request without a timeout instead of leaking it
+        let (fillerComponent, error) = generateTestComponentHandle();
+        assert_eq!(error, 0);
+        let queueLength = crate::MESSAGE_QUEUE_LENGTH as usize;
+        for _ in 1..queueLength
+        {
+            assert_eq!(createNewMessageNormal(1, fillerComponent, std::ptr::null_mut(), 0), 0);
+        }
+        assert_eq!(unsafe { crate::send_response(requestId, 0, std::ptr::null(), 0) }, 3);
+        assert_eq!(unsafe { crate::send_response(requestId, 0, std::ptr::null(), 0) }, 1);
+        for _ in 0..queueLength
+        {
+            assert_eq!(spin_normal_queue_once(), true);
+        }
+        assert_eq!(unsafe { responseCount }, 2);
+        removeTestComponentHandle(fillerComponent);
+
+        unsafe { crate::unregister_component_handler_for_messages(serverComponent, serverCallback) };
+        removeTestComponentHandle(serverComponent);
+        unsafe{ crate::uninit_queue(0) };
+    }
+
+    #[test]
+    fn test_failed_request_releases_payload()
+    {
+        unsafe extern "C" fn unusedResponseHandler(_requestId: u16, _status: u8, _response_data: *mut ::std::os::raw::c_void, _response_size: usize, _context: *mut ::std::os::raw::c_void)
+        {
+        }
+
+        initMessageQueue();
+        let (serverComponent, error) = generateTestComponentHandle();
+        assert_eq!(error, 0);
+        let testMsg: &str = "request\0";
+        let testPtr = testMsg.as_ptr() as *mut ::std::os::raw::c_void;
+        let inUseBefore = getPoolStats(crate::msg_pool_class_t_MSG_POOL_SMALL).blocks_in_use;
+        let mut request: message_info_t = unsafe { mem::zeroed() };
+        request.component_handle = serverComponent;
+        request.message_type = 1;
+        request.message_size = testMsg.len();
+        request.is_pointer = true;
+
+        //the queue releases the payload of a request it has no room for, the caller must not release it again
+        let queueLength = crate::MESSAGE_QUEUE_LENGTH as usize;
+        for _ in 0..queueLength
+        {
+            assert_eq!(createNewMessageNormal(2, serverComponent, testPtr, testMsg.len()), 0);
+        }
+        let mut requestId: u16 = 0;
+        request.message_data = acquirePoolPayload(testMsg.len());
+        assert_eq!(unsafe { crate::send_request(0, request, 0, Some(unusedResponseHandler), std::ptr::null_mut(), 0, &mut requestId) }, 3);
+        assert_eq!(requestId, crate::MSG_REQUEST_NONE as u16);
+        assert_eq!(getPoolStats(crate::msg_pool_class_t_MSG_POOL_SMALL).blocks_in_use, inUseBefore);
+        for _ in 0..queueLength
+        {
+            assert_eq!(spin_normal_queue_once(), true);
+        }
+
+        //same when the timeout cannot be armed because every delayed message slot is taken
+        for _ in 0..crate::MAX_DELAYED_MESSAGES
+        {
+            let mut delayed: message_info_t = unsafe { mem::zeroed() };
+            delayed.component_handle = serverComponent;
+            assert_eq!(unsafe { crate::send_message_after(0, delayed, 10000, std::ptr::null_mut()) }, 0);
+        }
+        request.message_data = acquirePoolPayload(testMsg.len());
+        assert_eq!(unsafe { crate::send_request(0, request, 0, Some(unusedResponseHandler), std::ptr::null_mut(), 1000, &mut requestId) }, 3);
+        assert_eq!(getPoolStats(crate::msg_pool_class_t_MSG_POOL_SMALL).blocks_in_use, inUseBefore);
+
+        removeTestComponentHandle(serverComponent);
+        unsafe{ crate::uninit_queue(0) };
+        assert_eq!(unsafe { crate::get_delayed_message_count() }, 0);
+    }
+
+    #[test]
+    fn test_registration_during_dispatch()
+    {
+        static mut churnComponent: component_handle_t = 0;
+        static mut removedCallback: callback_handle_t = 0;
+        static mut addedCallback: callback_handle_t = 0;
+        static mut calls: [u32; 4] = [0; 4];
+        unsafe extern "C" fn churningHandler(compHandle: component_handle_t, _msg_type: u8, _msg_data: *mut ::std::os::raw::c_void, _msg_size: usize)
+        {
+            calls[0] += 1;
+            if addedCallback == 0
+            {
+                assert_eq!(crate::unregister_component_handler_for_messages(compHandle, removedCallback), 0);
+                addedCallback = crate::register_component_handler_for_messages(Some(addedHandler), compHandle);
+            }
+        }
+        unsafe extern "C" fn removedHandler(_compHandle: component_handle_t, _msg_type: u8, _msg_data: *mut ::std::os::raw::c_void, _msg_size: usize)
+        {
+            calls[1] += 1;
+        }
+        unsafe extern "C" fn addedHandler(_compHandle: component_handle_t, _msg_type: u8, _msg_data: *mut ::std::os::raw::c_void, _msg_size: usize)
+        {
+            calls[2] += 1;
+        }
+        unsafe extern "C" fn steadyHandler(_compHandle: component_handle_t, _msg_type: u8, _msg_data: *mut ::std::os::raw::c_void, _msg_size: usize)
+        {
+            calls[3] += 1;
+        }
+
+        initMessageQueue();
+        let (testComponent, error) = generateTestComponentHandle();
+        assert_eq!(error, 0);
+        unsafe
+        {
+            churnComponent = testComponent;
+            calls = [0; 4];
+            addedCallback = 0;
+        }
+        let churnCallback = unsafe { crate::register_component_handler_for_messages(Some(churningHandler), testComponent) };
+        unsafe { removedCallback = crate::register_component_handler_for_messages(Some(removedHandler), testComponent) };
+        let mut message: message_info_t = unsafe { mem::zeroed() };
+        message.component_handle = testComponent;
+
+        //the message being dispatched keeps the table it started with, changes apply from the next one
+        assert_eq!(unsafe { crate::send_message_to_normal_queue(message) }, 0);
+        assert_eq!(spin_normal_queue_once(), true);
+        assert_eq!(unsafe { calls }, [1, 1, 0, 0]);
+        assert_eq!(unsafe { crate::send_message_to_normal_queue(message) }, 0);
+        assert_eq!(spin_normal_queue_once(), true);
+        assert_eq!(unsafe { calls }, [2, 1, 1, 0]);
+        unsafe
+        {
+            crate::unregister_component_handler_for_messages(testComponent, churnCallback);
+            crate::unregister_component_handler_for_messages(testComponent, addedCallback);
+        }
+
+        //another task registering and unregistering never costs the steady handler a call
+        const MESSAGE_COUNT: u32 = 2000;
+        let steadyCallback = unsafe { crate::register_component_handler_for_messages(Some(steadyHandler), testComponent) };
+        let stopChurn = std::sync::Arc::new(std::sync::atomic::AtomicBool::new(false));
+        let churnStop = stopChurn.clone();
+        let churner = thread::spawn(move ||
+        {
+            while !churnStop.load(std::sync::atomic::Ordering::Relaxed)
+            {
+                unsafe
+                {
+                    let callback = crate::register_component_handler_for_messages(Some(removedHandler), churnComponent);
+                    assert_ne!(callback, 0);
+                    assert_eq!(crate::unregister_component_handler_for_messages(churnComponent, callback), 0);
+                }
+            }
+        });
+        for _ in 0..MESSAGE_COUNT
+        {
+            assert_eq!(unsafe { crate::send_message_to_normal_queue(message) }, 0);
+            assert_eq!(spin_normal_queue_once(), true);
+        }
+        stopChurn.store(true, std::sync::atomic::Ordering::Relaxed);
+        churner.join().unwrap();
+        assert_eq!(unsafe { calls[3] }, MESSAGE_COUNT);
+
+        unsafe { crate::unregister_component_handler_for_messages(testComponent, steadyCallback) };
+        removeTestComponentHandle(testComponent);
+        unsafe{ crate::uninit_queue(0) };
+    }
+
+    #[test]
+    fn test_wildcard_handlers()
+    {
+        static mut wildcardSeen: [(component_handle_t, u8); 8] = [(0, 0); 8];
+        static mut wildcardCount: usize = 0;
+        unsafe extern "C" fn wildcardHandler(compHandle: component_handle_t, msg_type: u8, _msg_data: *mut ::std::os::raw::c_void, _msg_size: usize)
+        {
+            //the component handlers ran first
+            assert_eq!(lastMsgTypeOne, msg_type);
+            wildcardSeen[wildcardCount] = (compHandle, msg_type);
+            wildcardCount += 1;
+        }
+        initPriorityMessageQueue();
+        let (firstComponent, error) = generateTestComponentHandle();
+        assert_eq!(error, 0);
+        let (secondComponent, error) = generateTestComponentHandle();
+        assert_eq!(error, 0);
+        let firstCallback = registerTestHandlerPriority(1, firstComponent);
+        let secondCallback = registerTestHandlerPriority(1, secondComponent);
+        let wildcardCallback = unsafe { crate::register_wildcard_handler_for_message_types(1, Some(wildcardHandler), (1 << 1) | (1 << 2)) };
+        assert_ne!(wildcardCallback, 0);
+        assert_eq!(unsafe { crate::register_wildcard_handler_for_message_types(1, Some(wildcardHandler), 0) }, 0);
+        assert_eq!(unsafe { crate::register_wildcard_handler_for_message_types(crate::MAX_MESSAGE_QUEUES as u8, Some(wildcardHandler), 1) }, 0);
+
+        //one registration sees every component, filtered by type, with the sender's handle
+        let testMsg: &str = "bridge\0";
+        unsafe { wildcardCount = 0; }
+        assert_eq!(createNewMessagePriority(1, firstComponent, testMsg.as_ptr() as *mut ::std::os::raw::c_void, testMsg.len()), 0);
+        assert_eq!(createNewMessagePriority(2, secondComponent, testMsg.as_ptr() as *mut ::std::os::raw::c_void, testMsg.len()), 0);
+        assert_eq!(createNewMessagePriority(5, secondComponent, testMsg.as_ptr() as *mut ::std::os::raw::c_void, testMsg.len()), 0);
+        for _ in 0..3
+        {
+            assert_eq!(spin_priority_queue_once(), true);
+        }
+        unsafe
+        {
+            assert_eq!(wildcardCount, 2);
+            assert_eq!(wildcardSeen[0], (firstComponent, 1));
+            assert_eq!(wildcardSeen[1], (secondComponent, 2));
+        }
+
+        //deferred wildcards run on the worker, and unregistering stops both kinds
+        let deferredCallback = unsafe { crate::register_wildcard_deferred_handler_for_message_types(1, Some(wildcardHandler), crate::MSG_TYPE_MASK_ALL) };
+        assert_ne!(deferredCallback, 0);
+        assert_eq!(unsafe { crate::unregister_wildcard_handler_for_messages(1, wildcardCallback) }, 0);
+        assert_eq!(unsafe { crate::unregister_wildcard_handler_for_messages(1, wildcardCallback) }, 1);
+        unsafe { wildcardCount = 0; }
+        assert_eq!(createNewMessagePriority(5, secondComponent, testMsg.as_ptr() as *mut ::std::os::raw::c_void, testMsg.len()), 0);
+        assert_eq!(spin_priority_queue_once(), true);
+        unsafe { assert_eq!(wildcardCount, 0); }
+        assert_eq!(spin_msg_worker_once(), true);
+        unsafe
+        {
+            assert_eq!(wildcardCount, 1);
+            assert_eq!(wildcardSeen[0], (secondComponent, 5));
+        }
+        assert_eq!(unsafe { crate::unregister_wildcard_handler_for_messages(1, deferredCallback) }, 0);
+        assert_eq!(createNewMessagePriority(5, secondComponent, testMsg.as_ptr() as *mut ::std::os::raw::c_void, testMsg.len()), 0);
+        assert_eq!(spin_priority_queue_once(), true);
+        unsafe { assert_eq!(wildcardCount, 1); }
+
+        unregisterTestHandlerPriority(firstComponent, firstCallback);
+        unregisterTestHandlerPriority(secondComponent, secondCallback);
+        removeTestComponentHandle(firstComponent);
+        removeTestComponentHandle(secondComponent);
+        unsafe{ crate::uninit_queue(1) };
+    }
+}
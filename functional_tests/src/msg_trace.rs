@@ -0,0 +1,218 @@
+use std::collections::BTreeMap;
+use std::fmt::Write;
+
+pub struct TraceEvent
+{
+    pub time_us: f64, //relative to the first event in the dump
+    pub eventType: u8,
+    pub lane: u8,
+    pub compHandle: u8,
+    pub msgType: u8,
+}
+
+pub struct TraceDump
+{
+    pub cyclesPerUs: u16,
+    pub totalRecorded: u32, //more than events.len() once the ring has wrapped
+    pub events: Vec<TraceEvent>,
+}
+
+pub fn dumpTraceBlob() -> Vec<u8>
+{
+    let blobSize = unsafe { crate::msg_trace_get_blob_size() };
+    let mut blob: Vec<u8> = vec![0; blobSize];
+    let copied = unsafe { crate::msg_trace_serialize(blob.as_mut_ptr(), blobSize, 0) };
+    blob.truncate(copied);
+    blob
+}
+
+fn readU16(dat: &[u8], offset: usize) -> u16
+{
+    (dat[offset] as u16) | ((dat[offset + 1] as u16) << 8)
+}
+
+fn readU32(dat: &[u8], offset: usize) -> u32
+{
+    (readU16(dat, offset) as u32) | ((readU16(dat, offset + 2) as u32) << 16)
+}
+
+pub fn decodeTraceBlob(blob: &[u8]) -> Option<TraceDump>
+{
+    let headerSize = crate::MSG_TRACE_HEADER_SIZE as usize;
+    let eventSize = crate::MSG_TRACE_EVENT_SIZE as usize;
+    if blob.len() < headerSize || readU32(blob, 0) != crate::MSG_TRACE_BLOB_MAGIC as u32
+    {
+        return None;
+    }
+    if blob[4] != crate::MSG_TRACE_BLOB_VERSION as u8 || blob[5] as usize != eventSize
+    {
+        return None;
+    }
+    let cyclesPerUs = readU16(blob, 6);
+    let eventCount = readU16(blob, 8) as usize;
+    if cyclesPerUs == 0 || blob.len() < headerSize + (eventCount * eventSize)
+    {
+        return None;
+    }
+    let mut events: Vec<TraceEvent> = Vec::with_capacity(eventCount);
+    let mut elapsedCycles: i64 = 0;
+    let mut lastCycles: u32 = 0;
+    for eventIter in 0..eventCount
+    {
+        let offset = headerSize + (eventIter * eventSize);
+        let cycles = readU32(blob, offset);
+        //the counter wraps every few seconds, small negative steps come from the other core
+        if eventIter > 0
+        {
+            elapsedCycles += cycles.wrapping_sub(lastCycles) as i32 as i64;
+        }
+        lastCycles = cycles;
+        events.push(TraceEvent
+        {
+            time_us: elapsedCycles as f64 / cyclesPerUs as f64,
+            eventType: blob[offset + 4],
+            lane: blob[offset + 5],
+            compHandle: blob[offset + 6],
+            msgType: blob[offset + 7],
+        });
+    }
+    Some(TraceDump { cyclesPerUs: cyclesPerUs, totalRecorded: readU32(blob, 12), events: events })
+}
+
+fn laneName(lane: u8) -> String
+{
+    let workerLane = crate::MSG_TRACE_WORKER_LANE as u8;
+    match lane
+    {
+        0 => String::from("normal_queue"),
+        1 => String::from("priority_queue"),
+        l if l >= workerLane => format!("msg_worker_{}", l - workerLane),
+        l => format!("queue_{}", l),
+    }
+}
+
+fn eventName(eventType: u8) -> &'static str
+{
+    match eventType as u32
+    {
+        crate::msg_trace_event_type_t_MSG_TRACE_ENQUEUE => "enqueue",
+        crate::msg_trace_event_type_t_MSG_TRACE_DEQUEUE => "dequeue",
+        crate::msg_trace_event_type_t_MSG_TRACE_HANDLER_START => "handler start",
+        crate::msg_trace_event_type_t_MSG_TRACE_HANDLER_END => "handler end",
+        crate::msg_trace_event_type_t_MSG_TRACE_DROP => "DROP",
+        _ => "unknown",
+    }
+}
+
+fn componentName(compHandle: u8) -> String
+{
+    match compHandle as u32
+    {
+        crate::MSG_RING_DOORBELL_HANDLE => String::from("ring doorbell"),
+        crate::MSG_COALESCE_MARKER_HANDLE => String::from("coalesce marker"),
+        c => format!("component {}", c),
+    }
+}
+
+// One block per lane, in time order. Handler ends show how long the handler ran.
+pub fn renderTimeline(dump: &TraceDump) -> String
+{
+    let mut lanes: BTreeMap<u8, Vec<&TraceEvent>> = BTreeMap::new();
+    for event in &dump.events
+    {
+        lanes.entry(event.lane).or_insert_with(Vec::new).push(event);
+    }
+    let mut timeline = String::new();
+    let lostEvents = dump.totalRecorded as usize - dump.events.len().min(dump.totalRecorded as usize);
+    writeln!(timeline, "{} events, {} lost to wraparound", dump.events.len(), lostEvents).unwrap();
+    for (lane, events) in &lanes
+    {
+        writeln!(timeline, "{}:", laneName(*lane)).unwrap();
+        let mut handlerStart: Option<f64> = None;
+        for event in events
+        {
+            write!(timeline, "  {:>12.3} us  {:<13} {} type {}", event.time_us, eventName(event.eventType),
+                componentName(event.compHandle), event.msgType).unwrap();
+            if event.eventType as u32 == crate::msg_trace_event_type_t_MSG_TRACE_HANDLER_START
+            {
+                handlerStart = Some(event.time_us);
+            }
+            else if event.eventType as u32 == crate::msg_trace_event_type_t_MSG_TRACE_HANDLER_END
+            {
+                if let Some(startTime) = handlerStart.take()
+                {
+                    write!(timeline, " ({:.3} us)", event.time_us - startTime).unwrap();
+                }
+            }
+            timeline.push('\n');
+        }
+    }
+    timeline
+}
+
+#[cfg(test)]
+mod tests
+{
+    use super::*;
+    use crate::message_queue::*;
+
+    #[test]
+    fn test_trace_timeline()
+    {
+        initMessageQueue();
+        unsafe
+        {
+            crate::msg_trace_clear();
+            crate::msg_trace_enable(true);
+        }
+        let (testComponent, error) = generateTestComponentHandle();
+        assert_eq!(error, 0);
+        let testCallback = registerTestHandlerNormal(1, testComponent);
+        let testMsg: &str = "traced\0";
+        assert_eq!(createNewMessageNormal(5, testComponent, testMsg.as_ptr() as *mut ::std::os::raw::c_void, testMsg.len()), 0);
+        assert_eq!(spin_normal_queue_once(), true);
+
+        //pause like the uart dump does so the ring holds still
+        unsafe { crate::msg_trace_enable(false) };
+        let blob = dumpTraceBlob();
+        unsafe { crate::msg_trace_enable(true) };
+        let dump = decodeTraceBlob(&blob).expect("trace blob did not decode");
+        assert_eq!(dump.cyclesPerUs, 1000);
+        assert_eq!(dump.totalRecorded, 4);
+        let expected = [crate::msg_trace_event_type_t_MSG_TRACE_ENQUEUE, crate::msg_trace_event_type_t_MSG_TRACE_DEQUEUE,
+            crate::msg_trace_event_type_t_MSG_TRACE_HANDLER_START, crate::msg_trace_event_type_t_MSG_TRACE_HANDLER_END];
+        assert_eq!(dump.events.len(), expected.len());
+        for (event, expectedType) in dump.events.iter().zip(expected.iter())
+        {
+            assert_eq!(event.eventType as u32, *expectedType);
+            assert_eq!(event.lane, 0);
+            assert_eq!(event.compHandle, testComponent);
+            assert_eq!(event.msgType, 5);
+        }
+        assert!(dump.events.windows(2).all(|pair| pair[1].time_us >= pair[0].time_us));
+        let timeline = renderTimeline(&dump);
+        println!("{}", timeline);
+        assert!(timeline.contains("normal_queue:"));
+        assert!(timeline.contains("handler end"));
+
+        //chunked reads give back the same bytes, and a corrupt header is refused
+        let mut chunked: Vec<u8> = Vec::new();
+        let mut chunk = [0u8; 5];
+        loop
+        {
+            let copied = unsafe { crate::msg_trace_serialize(chunk.as_mut_ptr(), chunk.len(), chunked.len()) };
+            if copied == 0
+            {
+                break;
+            }
+            chunked.extend_from_slice(&chunk[..copied]);
+        }
+        assert_eq!(chunked, blob);
+        chunked[0] ^= 0xFF;
+        assert!(decodeTraceBlob(&chunked).is_none());
+
+        unregisterTestHandlerNormal(testComponent, testCallback);
+        removeTestComponentHandle(testComponent);
+        unsafe{ crate::uninit_queue(0) };
+    }
+}
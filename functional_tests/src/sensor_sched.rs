@@ -0,0 +1,85 @@
+use crate::sensor_job_handle_t;
+use crate::sensor_job_stats_t;
+use std::mem;
+use std::thread;
+use std::time::Duration;
+
+static mut jobRunOrder: [usize; 8] = [0; 8];
+static mut jobRunCount: usize = 0;
+
+unsafe extern "C" fn recordingJob(context: *mut ::std::os::raw::c_void)
+{
+    jobRunOrder[jobRunCount] = context as usize;
+    jobRunCount += 1;
+}
+
+pub fn registerJob(name: &str, jobId: usize, periodMs: u32, phaseMs: u32) -> (sensor_job_handle_t, u8)
+{
+    let mut job: sensor_job_handle_t = 0;
+    let error = unsafe { crate::sensor_sched_register_job(name.as_ptr() as *const i8, Some(recordingJob),
+        jobId as *mut ::std::os::raw::c_void, periodMs, phaseMs, 100, &mut job) };
+    (job, error)
+}
+
+pub fn getJobStats(job: sensor_job_handle_t) -> sensor_job_stats_t
+{
+    let mut stats: sensor_job_stats_t = unsafe { mem::zeroed() };
+    assert_eq!(unsafe { crate::sensor_sched_get_job_stats(job, &mut stats) }, 0);
+    stats
+}
+
+pub fn spin_sensor_sched_once() -> bool
+{
+    let taskName: &str = "sensor_sched\0";
+    unsafe { crate::spinQueueTaskOnce(taskName.as_ptr() as *const i8) }
+}
+
+#[cfg(test)]
+mod tests
+{
+    use super::*;
+
+    #[test]
+    fn test_sensor_scheduler()
+    {
+        let (_, error) = registerJob("bad_phase\0", 0, 5, 5);
+        assert_eq!(error, 1);
+        let (_, error) = registerJob("bad_period\0", 0, 0, 0);
+        assert_eq!(error, 1);
+        let (firstJob, error) = registerJob("first\0", 1, 5, 0);
+        assert_eq!(error, 0);
+        let (secondJob, error) = registerJob("second\0", 2, 5, 2);
+        assert_eq!(error, 0);
+        assert_eq!(unsafe { crate::sensor_sched_is_job_running(firstJob) }, false);
+
+        //both jobs fall behind, each runs once in release order and skips what it missed
+        unsafe { jobRunCount = 0; }
+        assert_eq!(unsafe { crate::sensor_sched_start_job(firstJob) }, 0);
+        assert_eq!(unsafe { crate::sensor_sched_start_job(secondJob) }, 0);
+        thread::sleep(Duration::from_millis(12));
+        assert_eq!(spin_sensor_sched_once(), true);
+        let firstStats = getJobStats(firstJob);
+        let secondStats = getJobStats(secondJob);
+        unsafe { assert_eq!(jobRunCount, 2); }
+        assert_eq!(firstStats.runs, 1);
+        assert_eq!(secondStats.runs, 1);
+        assert!(firstStats.missed >= 1 && secondStats.missed >= 1);
+        assert!(firstStats.last_jitter_us < 5000 && secondStats.last_jitter_us < 5000);
+        //the phases keep their latest releases 2 or 3 ms apart, the runs themselves were back to back
+        let jitterDifference = (firstStats.last_jitter_us as i64 - secondStats.last_jitter_us as i64).abs();
+        assert!(jitterDifference >= 1000);
+        unsafe { assert!(jobRunOrder[0] != jobRunOrder[1]); }
+
+        //a stopped job is not released again
+        assert_eq!(unsafe { crate::sensor_sched_stop_job(firstJob) }, 0);
+        thread::sleep(Duration::from_millis(6));
+        assert_eq!(spin_sensor_sched_once(), true);
+        assert_eq!(getJobStats(firstJob).runs, 1);
+        assert_eq!(getJobStats(secondJob).runs, 2);
+
+        assert_eq!(unsafe { crate::sensor_sched_reset_job_stats(secondJob) }, 0);
+        assert_eq!(getJobStats(secondJob).runs, 0);
+        assert_eq!(unsafe { crate::sensor_sched_stop_job(secondJob) }, 0);
+        assert_eq!(unsafe { crate::sensor_sched_start_job(crate::SENSOR_SCHED_INVALID_JOB as u8) }, 1);
+    }
+}
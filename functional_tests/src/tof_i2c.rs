@@ -4,22 +4,36 @@ use crate::component_handle_t;
 use crate::message_info_t;
 use crate::callback_handle_t;
 use crate::TOF_DATA_t;
+use crate::TOF_ACQ_STATS_t;
+use crate::TOF_BOOT_STATS_t;
 use std::mem;
 use std::slice;
 use rand::Rng;
 use crate::spi_flash;
 use crate::message_queue;
+use crate::sensor_sched;
+use std::thread;
+use std::time::Duration;
 
 static mut ToFCompHandle: component_handle_t = 0;
 static mut ToFMsgType: u8 = 0;
 static mut TofArrayData: &[TOF_DATA_t] = &[];
+static mut DepthFrameCopy: Option<TOF_DATA_t> = None;
 
 unsafe extern "C" fn ToFMessageHandler(compHandle: component_handle_t, msg_type: u8, msg_data: *mut ::std::os::raw::c_void, msg_size: usize)
 {
     ToFCompHandle = compHandle;
     ToFMsgType = msg_type;
-    let msg_ptr = msg_data as *const *const TOF_DATA_t;
-    TofArrayData = slice::from_raw_parts(*msg_ptr, mem::size_of::<TOF_DATA_t>());
+    TofArrayData = slice::from_raw_parts(msg_data as *const TOF_DATA_t, 1);
+}
+
+unsafe extern "C" fn DepthFrameHandler(compHandle: component_handle_t, msg_type: u8, msg_data: *mut ::std::os::raw::c_void, msg_size: usize)
+{
+    if msg_type == crate::TOF_MESSAGE_TYPES_t_TOF_MSG_NEW_DEPTH_ARRAY as u8
+    {
+        //frames are plain values now, copy it before the pool block is handed back
+        DepthFrameCopy = Some(*(msg_data as *const TOF_DATA_t));
+    }
 }
 
 pub fn appendNewTOFSensorReturn(dat: &[u8])
@@ -104,12 +118,33 @@ pub fn tofGetCompHandle() -> component_handle_t
     retVal
 }
 
+pub fn spin_tof_queue_once() -> bool
+{
+    let queue_type = "tof_queue\0".as_ptr() as *const i8;
+    let retVal = unsafe { crate::spinQueueTaskOnce(queue_type) };
+    retVal
+}
+
 pub fn tofSpinISROnce(gpio_num: u8) -> bool
 {
     let retVal = unsafe{ crate::spinISROnce(gpio_num) };
     retVal
 }
 
+pub fn tofGetAcquisitionStats() -> TOF_ACQ_STATS_t
+{
+    let mut stats: TOF_ACQ_STATS_t = unsafe { mem::zeroed() };
+    unsafe { crate::TOF_GET_ACQUISITION_STATS(&mut stats) };
+    stats
+}
+
+pub fn tofGetBootStats() -> TOF_BOOT_STATS_t
+{
+    let mut stats: TOF_BOOT_STATS_t = unsafe { mem::zeroed() };
+    unsafe { crate::TOF_GET_BOOT_STATS(&mut stats) };
+    stats
+}
+
 /* I don't really see the need to test these but they exist I guess
 esp_err_t TOF_READ(uint8_t* TOF_OUT, uint8_t dat_size);
 
@@ -161,6 +196,27 @@ mod tests
         header
     }
 
+    //bootloader returns for a full download, the second chunk finds the bootloader busy once
+    fn appendFirmwareDownloadReturns(chunks: usize)
+    {
+        let busy: [u8; 3] = [0x01, 0x00, 0x00];
+        let ready: [u8; 3] = [0x00, 0x00, 0x00];
+        appendNewTOFSensorReturn(&[0x41]);
+        appendNewTOFSensorReturn(&[0x80, 0x00, 0x00]);
+        appendNewTOFSensorReturn(&ready);
+        for chunk in 0..chunks
+        {
+            if chunk == 1
+            {
+                appendNewTOFSensorReturn(&busy);
+            }
+            appendNewTOFSensorReturn(&ready);
+        }
+        appendNewTOFSensorReturn(&[0x41]);
+        appendNewTOFSensorReturn(&[0x03, 0x00, 0x00]);
+        appendNewTOFSensorReturn(&[0x00]);
+    }
+
     fn compareDataFrameToToFData(DataFrame: Vec<u8>) -> bool
     {
         false
@@ -355,6 +411,7 @@ mod tests
         let data_frame = createRandomMeasurementDataFrame(0);
         appendNewTOFSensorReturn(&data_frame[..]);
         assert_eq!(tofSpinISROnce(15), true);
+        assert_eq!(spin_tof_queue_once(), true);
 
         //Create New Measurement Data
         test_data[0] = 0x00;
@@ -362,6 +419,7 @@ mod tests
         let data_frame = createRandomMeasurementDataFrame(0);
         appendNewTOFSensorReturn(&data_frame[..]);
         assert_eq!(tofSpinISROnce(15), true);
+        assert_eq!(spin_tof_queue_once(), true);
 
         //Create New Measurement Data
         test_data[0] = 0x00;
@@ -369,6 +427,7 @@ mod tests
         let data_frame = createRandomMeasurementDataFrame(0);
         appendNewTOFSensorReturn(&data_frame[..]);
         assert_eq!(tofSpinISROnce(15), true);
+        assert_eq!(spin_tof_queue_once(), true);
 
         //Create New Measurement Data
         test_data[0] = 0x00;
@@ -376,18 +435,19 @@ mod tests
         let data_frame = createRandomMeasurementDataFrame(0);
         appendNewTOFSensorReturn(&data_frame[..]);
         assert_eq!(tofSpinISROnce(15), true);
+        assert_eq!(spin_tof_queue_once(), true);
 
         //Handle ISR data internally
-        assert_eq!(message_queue::spin_priority_queue_once(), true);
+        assert_eq!(spin_tof_queue_once(), true);
 
         //Handle ISR data internally
-        assert_eq!(message_queue::spin_priority_queue_once(), true);
+        assert_eq!(spin_tof_queue_once(), true);
 
         //Handle ISR data internally
-        assert_eq!(message_queue::spin_priority_queue_once(), true);
+        assert_eq!(spin_tof_queue_once(), true);
 
         //Handle ISR data internally
-        assert_eq!(message_queue::spin_priority_queue_once(), true);
+        assert_eq!(spin_tof_queue_once(), true);
 
         //Handle New Buffer data externally
         assert_eq!(message_queue::spin_priority_queue_once(), true);
@@ -485,6 +545,7 @@ mod tests
         let data_frame = createRandomMeasurementDataFrame(0);
         appendNewTOFSensorReturn(&data_frame[..]);
         assert_eq!(tofSpinISROnce(15), true);
+        assert_eq!(spin_tof_queue_once(), true);
 
         //Create New Measurement Data
         test_data[0] = 0x00;
@@ -492,6 +553,7 @@ mod tests
         let data_frame = createRandomMeasurementDataFrame(0);
         appendNewTOFSensorReturn(&data_frame[..]);
         assert_eq!(tofSpinISROnce(15), true);
+        assert_eq!(spin_tof_queue_once(), true);
 
         //Create New Measurement Data
         test_data[0] = 0x00;
@@ -499,6 +561,7 @@ mod tests
         let data_frame = createRandomMeasurementDataFrame(0);
         appendNewTOFSensorReturn(&data_frame[..]);
         assert_eq!(tofSpinISROnce(15), true);
+        assert_eq!(spin_tof_queue_once(), true);
 
         //Create New Measurement Data
         test_data[0] = 0x00;
@@ -506,18 +569,19 @@ mod tests
         let data_frame = createRandomMeasurementDataFrame(0);
         appendNewTOFSensorReturn(&data_frame[..]);
         assert_eq!(tofSpinISROnce(15), true);
+        assert_eq!(spin_tof_queue_once(), true);
 
         //Handle ISR data internally
-        assert_eq!(message_queue::spin_priority_queue_once(), true);
+        assert_eq!(spin_tof_queue_once(), true);
 
         //Handle ISR data internally
-        assert_eq!(message_queue::spin_priority_queue_once(), true);
+        assert_eq!(spin_tof_queue_once(), true);
 
         //Handle ISR data internally
-        assert_eq!(message_queue::spin_priority_queue_once(), true);
+        assert_eq!(spin_tof_queue_once(), true);
 
         //Handle ISR data internally
-        assert_eq!(message_queue::spin_priority_queue_once(), true);
+        assert_eq!(spin_tof_queue_once(), true);
 
         //Handle New Buffer data externally
         assert_eq!(message_queue::spin_priority_queue_once(), true);
@@ -538,4 +602,191 @@ mod tests
         assert_eq!(message_queue::clearMessageQueueHandles(), 0);
         unsafe{ crate::uninit_queue(1) };
     }
+
+    #[test]
+    fn test_acquisition_modes()
+    {
+        message_queue::initPriorityMessageQueue();
+
+        //Initialize
+        let mut test_data: [u8; 3] = [0; 3];
+        test_data[0] = 0x41;
+        appendNewTOFSensorReturn(&test_data[..1]);
+        test_data[0] = 0x03;
+        appendNewTOFSensorReturn(&test_data[..3]);
+        test_data[0] = 0x00;
+        appendNewTOFSensorReturn(&test_data[..1]);
+        test_data[0] = 0x08;
+        appendNewTOFSensorReturn(&test_data[..1]);
+        tofInitialize();
+
+        //Start Measurements
+        test_data[0] = 0x00;
+        appendNewTOFSensorReturn(&test_data[..1]);
+        assert_eq!(tofStartMeasurements(), 0);
+        unsafe { crate::TOF_RESET_ACQUISITION_STATS() };
+        assert_eq!(unsafe { crate::TOF_GET_ACQUISITION_MODE() }, crate::TOF_ACQ_MODE_t_TOF_ACQ_MODE_INTERRUPT);
+
+        //The edge only posts a read, the result is read on the tof queue task
+        test_data[0] = 0x02;
+        appendNewTOFSensorReturn(&test_data[..1]);
+        let data_frame = createRandomMeasurementDataFrame(0);
+        appendNewTOFSensorReturn(&data_frame[..]);
+        assert_eq!(tofSpinISROnce(15), true);
+        assert_eq!(tofGetAcquisitionStats().reads, 0);
+        thread::sleep(Duration::from_millis(2));
+        assert_eq!(spin_tof_queue_once(), true);
+        let stats = tofGetAcquisitionStats();
+        assert_eq!(stats.reads, 1);
+        assert_eq!(stats.untimed_reads, 0);
+        assert!(stats.last_latency_us >= 2000);
+        //the read posted a convert behind it
+        assert_eq!(spin_tof_queue_once(), true);
+
+        //Polling still times the edge but leaves posting the read to the poll job
+        assert_eq!(unsafe { crate::TOF_SET_ACQUISITION_MODE(crate::TOF_ACQ_MODE_t_TOF_ACQ_MODE_POLLING) }, 0);
+        test_data[0] = 0x02;
+        appendNewTOFSensorReturn(&test_data[..1]);
+        let data_frame = createRandomMeasurementDataFrame(0);
+        appendNewTOFSensorReturn(&data_frame[..]);
+        assert_eq!(tofSpinISROnce(15), true);
+        assert_eq!(spin_tof_queue_once(), true);
+        assert_eq!(tofGetAcquisitionStats().reads, 1);
+        thread::sleep(Duration::from_millis(33));
+        assert_eq!(sensor_sched::spin_sensor_sched_once(), true);
+        assert_eq!(tofGetAcquisitionStats().reads, 1);
+        assert_eq!(spin_tof_queue_once(), true);
+        let stats = tofGetAcquisitionStats();
+        assert_eq!(stats.reads, 2);
+        assert!(stats.last_latency_us >= 33000);
+        assert_eq!(stats.max_latency_us, stats.last_latency_us);
+        assert_eq!(spin_tof_queue_once(), true);
+
+        //A poll that finds nothing ready
+        test_data[0] = 0x00;
+        appendNewTOFSensorReturn(&test_data[..1]);
+        thread::sleep(Duration::from_millis(33));
+        assert_eq!(sensor_sched::spin_sensor_sched_once(), true);
+        assert_eq!(spin_tof_queue_once(), true);
+        let stats = tofGetAcquisitionStats();
+        assert_eq!(stats.reads, 2);
+        assert_eq!(stats.empty_polls, 1);
+
+        //Stop Measurements
+        test_data[0] = 0x00;
+        appendNewTOFSensorReturn(&test_data[..1]);
+        assert_eq!(tofStopMeasurements(), 0);
+        assert_eq!(unsafe { crate::TOF_SET_ACQUISITION_MODE(crate::TOF_ACQ_MODE_t_TOF_ACQ_MODE_INTERRUPT) }, 0);
+    }
+
+    #[test]
+    fn test_depth_frame_layout()
+    {
+        message_queue::initPriorityMessageQueue();
+
+        //Initialize
+        let mut test_data: [u8; 3] = [0; 3];
+        test_data[0] = 0x41;
+        appendNewTOFSensorReturn(&test_data[..1]);
+        test_data[0] = 0x03;
+        appendNewTOFSensorReturn(&test_data[..3]);
+        test_data[0] = 0x00;
+        appendNewTOFSensorReturn(&test_data[..1]);
+        test_data[0] = 0x08;
+        appendNewTOFSensorReturn(&test_data[..1]);
+        tofInitialize();
+
+        //Switch Mode
+        test_data[0] = 0x08;
+        appendNewTOFSensorReturn(&test_data[..1]);
+        test_data[0] = 0x00;
+        appendNewTOFSensorReturn(&test_data[..1]);
+        assert_eq!(tofSwitchTofMode(false), false);
+
+        let compHandle = tofGetCompHandle();
+        let callbackHandle = unsafe { crate::register_priority_handler_for_messages(Some(DepthFrameHandler), compHandle) };
+        unsafe { DepthFrameCopy = None; }
+        test_data[0] = 0x00;
+        appendNewTOFSensorReturn(&test_data[..1]);
+        tofStartMeasurements();
+
+        //Known result, every byte is its own offset
+        let mut data_frame: Vec<u8> = (0..0x84).map(|x| x as u8).collect();
+        data_frame[..5].copy_from_slice(&[0x20, 0, 0x84, 0, 0]);
+        test_data[0] = 0x02;
+        appendNewTOFSensorReturn(&test_data[..1]);
+        appendNewTOFSensorReturn(&data_frame[..]);
+        assert_eq!(tofSpinISROnce(15), true);
+        assert_eq!(spin_tof_queue_once(), true);
+
+        //Convert on the tof queue, then deliver the frame on the priority queue
+        for _ in 0..3
+        {
+            if unsafe { DepthFrameCopy.is_some() } { break; }
+            assert_eq!(spin_tof_queue_once(), true);
+            assert_eq!(message_queue::spin_priority_queue_once(), true);
+        }
+        let frame = unsafe { DepthFrameCopy.expect("no depth frame was sent") };
+        assert_eq!(frame.horizontal_size, 4);
+        assert_eq!(frame.vertical_size, 4);
+        assert_eq!(frame.is_populated, true);
+
+        //zones are row-major with a stride of horizontal_size, each object result is confidence then distance
+        for row in 0..4
+        {
+            for column in 0..4
+            {
+                let zone = (row * frame.horizontal_size as usize) + column;
+                let result = 0x18 + (3 * ((row * 4) + column));
+                let expected = (data_frame[result + 1] as u16) + ((data_frame[result + 2] as u16) << 8);
+                assert_eq!(frame.distance[crate::TOF_FIRST_OBJECT as usize][zone], expected);
+                assert_eq!(frame.confidence[crate::TOF_FIRST_OBJECT as usize][zone], data_frame[result]);
+                //tmf8821 mode only reads the first object
+                assert_eq!(frame.distance[crate::TOF_SECOND_OBJECT as usize][zone], 0);
+            }
+        }
+
+        unsafe { crate::unregister_priority_handler_for_messages(compHandle, callbackHandle) };
+        test_data[0] = 0x00;
+        appendNewTOFSensorReturn(&test_data[..1]);
+        tofStopMeasurements();
+    }
+
+    #[test]
+    fn test_firmware_download()
+    {
+        message_queue::initPriorityMessageQueue();
+        let image_length = unsafe { crate::tof_bin_image_length } as usize;
+
+        //Fast mode is the default, the image goes over in the largest chunks the bootloader takes
+        let fast_chunks = (image_length + 127) / 128;
+        appendFirmwareDownloadReturns(fast_chunks);
+        appendNewTOFSensorReturn(&[0x08]);
+        tofInitialize();
+        let stats = tofGetBootStats();
+        assert_eq!(stats.is_downloaded, true);
+        assert_eq!(stats.chunk_len, 128);
+        assert_eq!(stats.chunks as usize, fast_chunks);
+        assert_eq!(stats.busy_polls, 1);
+        assert!(stats.boot_us >= stats.download_us);
+
+        //Safe mode keeps the old chunk size
+        unsafe { crate::TOF_SET_FIRMWARE_DOWNLOAD_MODE(crate::TOF_FW_DOWNLOAD_MODE_t_TOF_FW_DOWNLOAD_MODE_SAFE) };
+        let safe_chunks = (image_length + 63) / 64;
+        appendFirmwareDownloadReturns(safe_chunks);
+        assert_eq!(tofResetSensor(), 0);
+        let stats = tofGetBootStats();
+        assert_eq!(stats.chunk_len, 64);
+        assert_eq!(stats.chunks as usize, safe_chunks);
+
+        //Nothing to download when the app is already running
+        appendNewTOFSensorReturn(&[0x41]);
+        appendNewTOFSensorReturn(&[0x03, 0x00, 0x00]);
+        appendNewTOFSensorReturn(&[0x00]);
+        assert_eq!(tofResetSensor(), 0);
+        let stats = tofGetBootStats();
+        assert_eq!(stats.is_downloaded, false);
+        assert_eq!(stats.chunks, 0);
+        unsafe { crate::TOF_SET_FIRMWARE_DOWNLOAD_MODE(crate::TOF_FW_DOWNLOAD_MODE_t_TOF_FW_DOWNLOAD_MODE_FAST) };
+    }
 }
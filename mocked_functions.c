@@ -1,7 +1,11 @@
+#include <time.h>
+
 #include "mocked_functions.h"
 
 #define MAX_TASK_REGISTRATIONS 10
 
+#define MAX_TIMER_REGISTRATIONS 8
+
 #define MAX_BLOBS 10
 
 typedef struct
@@ -29,10 +33,31 @@ struct TOF_queue_t
 
 typedef struct TOF_queue_t TOF_queue_node_t;
 
+#ifndef MOCK_PTHREAD_BACKEND
+
+struct mock_timer_t
+{
+    const char* name;
+    TickType_t period;
+    uint32_t auto_reload;
+    void* timer_id;
+    void (*callback)(TimerHandle_t);
+    bool is_active;
+};
+
 static TaskType_t task_array[MAX_TASK_REGISTRATIONS] = {0};
 
+static struct mock_timer_t timer_array[MAX_TIMER_REGISTRATIONS] = {0};
+
+static uint8_t s_timer_count = 0;
+
+#endif
+
 static TOF_queue_node_t* TOF_read_queue = NULL;
 
+//the test thread queues reads that the ToF task takes when tasks run on threads
+static portMUX_TYPE s_tof_read_lock = portMUX_INITIALIZER_UNLOCKED;
+
 static nvs_handle_t current_handle = 0;
 
 static bool can_write = 0;
@@ -43,12 +68,20 @@ static void (*s_isr_func_ptr)(void*) = NULL;
 
 static uint8_t s_isr_gpio = 0;
 
+#ifndef MOCK_PTHREAD_BACKEND
+
+static bool s_is_spinning_once = false;
+
 //static function defs
 
 static uint8_t getTaskFromName(const char* name);
 
+#endif
+
 // functions for testing purposes
 
+#ifndef MOCK_PTHREAD_BACKEND
+
 bool spinQueueTaskOnce(const char* name)
 {
     uint8_t task_array_iterator = getTaskFromName(name);
@@ -57,10 +90,33 @@ bool spinQueueTaskOnce(const char* name)
         return false;
     }
     printf("spinning task %s\n", task_array[task_array_iterator].name);
-    (*(task_array[task_array_iterator].func_ptr))(name);
+    s_is_spinning_once = true;
+    (*(task_array[task_array_iterator].func_ptr))(task_array[task_array_iterator].pvParams);
+    s_is_spinning_once = false;
     return true;
 }
 
+bool isTaskSpinningOnce(void)
+{
+    return s_is_spinning_once;
+}
+
+bool spinTimerOnce(const char* name)
+{
+    for(uint8_t i = 0; i < s_timer_count; i++)
+    {
+        if(timer_array[i].is_active && !strcmp(name, timer_array[i].name))
+        {
+            timer_array[i].is_active = (timer_array[i].auto_reload == pdTRUE);
+            (*(timer_array[i].callback))(&timer_array[i]);
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif
+
 bool spinISROnce(uint8_t gpio_num)
 {
     if(s_isr_gpio == gpio_num)
@@ -71,6 +127,8 @@ bool spinISROnce(uint8_t gpio_num)
     return false;
 }
 
+#ifndef MOCK_PTHREAD_BACKEND
+
 bool deleteTask(const char* name)
 {
     uint8_t task_array_iterator = getTaskFromName(name);
@@ -96,8 +154,11 @@ void deleteQueue(QueueHandle_t handle)
     free(handle);
 }
 
+#endif
+
 bool setTOFReadVal(const uint8_t* read_data, size_t size)
 {
+    portENTER_CRITICAL(&s_tof_read_lock);
     if(TOF_read_queue == NULL)
     {
         TOF_read_queue = malloc(sizeof(TOF_queue_node_t));
@@ -118,6 +179,7 @@ bool setTOFReadVal(const uint8_t* read_data, size_t size)
         lastNode->ToF_data = malloc(size * sizeof(uint8_t));
         memcpy(lastNode->ToF_data, read_data, size * sizeof(uint8_t));
     }
+    portEXIT_CRITICAL(&s_tof_read_lock);
     printf("queued new tof data.\n");
     return true;
 }
@@ -129,6 +191,8 @@ void* createVoidPtr(const char* str, size_t len)
     return retPtr;
 }
 
+#ifndef MOCK_PTHREAD_BACKEND
+
 static uint8_t getTaskFromName(const char* name)
 {
     printf("searching for task %s\n", name);
@@ -146,9 +210,13 @@ static uint8_t getTaskFromName(const char* name)
     return MAX_TASK_REGISTRATIONS;
 }
 
+#endif
+
 // mocked functions
 
-QueueHandle_t xQueueCreate(uint8_t queue_length, size_t queue_type)
+#ifndef MOCK_PTHREAD_BACKEND
+
+QueueHandle_t xQueueCreate(uint32_t queue_length, size_t queue_type)
 {
     QueueHandle_t newQueue = malloc(sizeof(QueueType_t));
     newQueue->message_queue_start = NULL;
@@ -165,7 +233,7 @@ void xTaskCreate(void (*func_ptr)(void*), const char* name, size_t stack_depth,
         if(task_array[i].func_ptr == NULL)
         {
             task_array[i].func_ptr = func_ptr;
-            task_array[i].name = malloc(sizeof(name) + 1);
+            task_array[i].name = malloc(strlen(name) + 1);
             strcpy(task_array[i].name, name);
             task_array[i].stack_depth = stack_depth;
             task_array[i].pvParams = pvParams;
@@ -177,6 +245,12 @@ void xTaskCreate(void (*func_ptr)(void*), const char* name, size_t stack_depth,
     }
 }
 
+void xTaskCreatePinnedToCore(void (*func_ptr)(void*), const char* name, size_t stack_depth, void* pvParams, uint8_t priority, void* handle, int32_t core_id)
+{
+    (void) core_id;
+    xTaskCreate(func_ptr, name, stack_depth, pvParams, priority, handle);
+}
+
 bool xQueueSend(QueueHandle_t queue_ptr, void* message_info, TickType_t time_thing)
 {
     if(queue_ptr == NULL)
@@ -184,18 +258,16 @@ bool xQueueSend(QueueHandle_t queue_ptr, void* message_info, TickType_t time_thi
         return false;
     }
     message_node_t* lastNode;
+    if(uxQueueMessagesWaiting(queue_ptr) >= queue_ptr->queue_length)
+    {
+        return false;
+    }
     if(queue_ptr->message_queue_start != NULL)
     {
-        uint8_t queue_length = 0;
         lastNode = queue_ptr->message_queue_start;
         while(lastNode->next_node != NULL)
         {
-            if(queue_length >= queue_ptr->queue_length)
-            {
-                return false;
-            }
             lastNode = lastNode->next_node;
-            queue_length++;
         }
         lastNode->next_node = malloc(sizeof(message_node_t));
         lastNode = lastNode->next_node;
@@ -231,11 +303,107 @@ bool xQueueReceive(QueueHandle_t queue_ptr, void* message_info, TickType_t time_
     return true;
 }
 
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue_ptr)
+{
+    UBaseType_t queue_length = 0;
+    if(queue_ptr == NULL)
+    {
+        return 0;
+    }
+    message_node_t* node = queue_ptr->message_queue_start;
+    while(node != NULL)
+    {
+        queue_length++;
+        node = node->next_node;
+    }
+    return queue_length;
+}
+
+#endif
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((int64_t) now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+uint32_t esp_cpu_get_cycle_count(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t) (((uint64_t) now.tv_sec * 1000000000) + now.tv_nsec);
+}
+
+#ifndef MOCK_PTHREAD_BACKEND
+
 void vTaskDelay(TickType_t time_thing)
 {
     printf("waited %u ms\n", time_thing);
 }
 
+// timers only fire when a test calls spinTimerOnce
+TimerHandle_t xTimerCreate(const char* name, TickType_t period, uint32_t auto_reload, void* timer_id, void (*callback)(TimerHandle_t))
+{
+    if(s_timer_count >= MAX_TIMER_REGISTRATIONS || callback == NULL)
+    {
+        return NULL;
+    }
+    TimerHandle_t timer = &timer_array[s_timer_count];
+    timer->name = name;
+    timer->period = period;
+    timer->auto_reload = auto_reload;
+    timer->timer_id = timer_id;
+    timer->callback = callback;
+    timer->is_active = false;
+    s_timer_count++;
+    printf("created timer %s\n", name);
+    return timer;
+}
+
+bool xTimerStart(TimerHandle_t timer, TickType_t time_thing)
+{
+    (void) time_thing;
+    if(timer == NULL)
+    {
+        return false;
+    }
+    timer->is_active = true;
+    return true;
+}
+
+bool xTimerStop(TimerHandle_t timer, TickType_t time_thing)
+{
+    (void) time_thing;
+    if(timer == NULL)
+    {
+        return false;
+    }
+    timer->is_active = false;
+    return true;
+}
+
+bool xTimerIsTimerActive(TimerHandle_t timer)
+{
+    return timer != NULL && timer->is_active;
+}
+
+void* pvTimerGetTimerID(TimerHandle_t timer)
+{
+    return timer->timer_id;
+}
+
+#endif
+
+bool xQueueSendFromISR(QueueHandle_t queue_ptr, void* message_info, BaseType_t* higher_priority_task_woken)
+{
+    if(higher_priority_task_woken != NULL)
+    {
+        *higher_priority_task_woken = pdFALSE;
+    }
+    return xQueueSend(queue_ptr, message_info, 0);
+}
+
 esp_err_t gpio_isr_handler_add(uint8_t gpio_num, void (*func_ptr)(void*), void* args)
 {
     s_isr_func_ptr = func_ptr;
@@ -246,6 +414,7 @@ esp_err_t gpio_isr_handler_add(uint8_t gpio_num, void (*func_ptr)(void*), void*
 
 esp_err_t mock_tof_read(uint8_t* TOF_OUT, uint8_t dat_size)
 {
+    portENTER_CRITICAL(&s_tof_read_lock);
     if(TOF_read_queue != NULL)
     {
         memcpy(TOF_OUT, TOF_read_queue->ToF_data, dat_size * sizeof(uint8_t));
@@ -253,11 +422,13 @@ esp_err_t mock_tof_read(uint8_t* TOF_OUT, uint8_t dat_size)
         free(TOF_read_queue->ToF_data);
         free(TOF_read_queue);
         TOF_read_queue = temp_queue_node;
-        printf("next queue item is %p", TOF_read_queue);
+        portEXIT_CRITICAL(&s_tof_read_lock);
+        printf("next queue item is %p", temp_queue_node);
         return ESP_OK;
     }
     else
     {
+        portEXIT_CRITICAL(&s_tof_read_lock);
         return ESP_ERROR_GENERIC;
     }
 }
@@ -270,6 +441,7 @@ esp_err_t mock_tof_read_write(uint8_t* TOF_OUT, uint8_t out_dat_size, uint8_t* T
         printf("0x%02x ", TOF_IN[i]);
     }
     printf("\n");
+    portENTER_CRITICAL(&s_tof_read_lock);
     if(TOF_read_queue != NULL)
     {
         memcpy(TOF_OUT, TOF_read_queue->ToF_data, out_dat_size * sizeof(uint8_t));
@@ -277,10 +449,12 @@ esp_err_t mock_tof_read_write(uint8_t* TOF_OUT, uint8_t out_dat_size, uint8_t* T
         free(TOF_read_queue->ToF_data);
         free(TOF_read_queue);
         TOF_read_queue = temp_queue_node;
+        portEXIT_CRITICAL(&s_tof_read_lock);
         return ESP_OK;
     }
     else
     {
+        portEXIT_CRITICAL(&s_tof_read_lock);
         return ESP_ERROR_GENERIC;
     }
     
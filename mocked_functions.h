@@ -7,10 +7,50 @@
 #include <stdio.h>
 #include <string.h>
 
+// MOCK_PTHREAD_BACKEND runs tasks, queues and timers on real threads (see mocked_rtos_pthread.c),
+// otherwise nothing runs until a test spins it.
+#ifdef MOCK_PTHREAD_BACKEND
+
+#define portMAX_DELAY 0xFFFF // waits forever like the real one
+
+#define portMUX_INITIALIZER_UNLOCKED {0, 0}
+
+#define portENTER_CRITICAL(mux) mock_enter_critical(mux)
+
+#define portEXIT_CRITICAL(mux) mock_exit_critical(mux)
+
+#define portENTER_CRITICAL_ISR(mux) mock_enter_critical(mux)
+
+#define portEXIT_CRITICAL_ISR(mux) mock_exit_critical(mux)
+
+#else
+
 #define portMAX_DELAY 10000 // technically infinite but who cares we're unit testing here
 
+#define portMUX_INITIALIZER_UNLOCKED 0
+
+// tests are single threaded so critical sections do nothing, the lock is still used so it isn't flagged
+#define portENTER_CRITICAL(mux) (void) (mux)
+
+#define portEXIT_CRITICAL(mux) (void) (mux)
+
+#define portENTER_CRITICAL_ISR(mux) (void) (mux)
+
+#define portEXIT_CRITICAL_ISR(mux) (void) (mux)
+
+#endif
+
+// interrupts are plain calls from the test thread, so there is nothing to yield to
+#define portYIELD_FROM_ISR(woken) (void) (woken)
+
 #define portTICK_PERIOD_MS 1
 
+#define tskNO_AFFINITY 0x7FFFFFFF
+
+#define pdFALSE 0
+
+#define pdTRUE 1
+
 #define NVS_READONLY 0
 
 #define NVS_READWRITE 1
@@ -47,15 +87,38 @@ typedef struct
 {
     message_node_t* message_queue_start;
     size_t data_type_length;
-    uint8_t queue_length;
+    uint32_t queue_length;
 } QueueType_t;
 
 typedef uint8_t gpio_num_t;
 
+#ifdef MOCK_PTHREAD_BACKEND
+
+// spinlock that the owning thread can take again, like the esp-idf one on the owning core
+typedef struct
+{
+    uint32_t owner;
+    uint32_t count;
+} portMUX_TYPE;
+
+typedef struct mock_queue_t* QueueHandle_t;
+
+#else
+
+typedef uint8_t portMUX_TYPE;
+
 typedef QueueType_t* QueueHandle_t;
 
+#endif
+
+typedef struct mock_timer_t* TimerHandle_t;
+
 typedef uint16_t TickType_t;
 
+typedef uint32_t UBaseType_t;
+
+typedef int32_t BaseType_t;
+
 typedef uint8_t nvs_handle_t;
 
 #define ESP_LOGE(tag, format, ...); \
@@ -72,8 +135,14 @@ printf("\n");
 
 bool spinQueueTaskOnce(const char* name);
 
+// true while spinQueueTaskOnce is running a task, task loops check it to return after one pass
+bool isTaskSpinningOnce(void);
+
 bool spinISROnce(uint8_t gpio_num);
 
+// runs the callback of a started timer once, false if it is not running
+bool spinTimerOnce(const char* name);
+
 bool deleteTask(const char* name);
 
 void deleteQueue(QueueHandle_t handle);
@@ -86,16 +155,45 @@ void* createVoidPtr(const char* str, size_t len);
 
 void app_main(void);
 
-QueueHandle_t xQueueCreate(uint8_t queue_length, size_t queue_type);
+QueueHandle_t xQueueCreate(uint32_t queue_length, size_t queue_type);
 
 void xTaskCreate(void (*func_ptr)(void*), const char* name, size_t stack_depth, void* pvParams, uint8_t priority, void* handle);
 
+void xTaskCreatePinnedToCore(void (*func_ptr)(void*), const char* name, size_t stack_depth, void* pvParams, uint8_t priority, void* handle, int32_t core_id);
+
 bool xQueueSend(QueueHandle_t queue_ptr, void* message_info, TickType_t time_thing);
 
 bool xQueueReceive(QueueHandle_t queue_ptr, void* message_info, TickType_t time_thing);
 
+bool xQueueSendFromISR(QueueHandle_t queue_ptr, void* message_info, BaseType_t* higher_priority_task_woken);
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue_ptr);
+
+int64_t esp_timer_get_time(void);
+
+// counts nanoseconds, so 1000 cycles per microsecond
+uint32_t esp_cpu_get_cycle_count(void);
+
 void vTaskDelay(TickType_t time_thing);
 
+TimerHandle_t xTimerCreate(const char* name, TickType_t period, uint32_t auto_reload, void* timer_id, void (*callback)(TimerHandle_t));
+
+bool xTimerStart(TimerHandle_t timer, TickType_t time_thing);
+
+bool xTimerStop(TimerHandle_t timer, TickType_t time_thing);
+
+bool xTimerIsTimerActive(TimerHandle_t timer);
+
+void* pvTimerGetTimerID(TimerHandle_t timer);
+
+#ifdef MOCK_PTHREAD_BACKEND
+
+void mock_enter_critical(portMUX_TYPE* mux);
+
+void mock_exit_critical(portMUX_TYPE* mux);
+
+#endif
+
 esp_err_t gpio_isr_handler_add(uint8_t gpio_num, void (*func_ptr)(void*), void* args);
 
 esp_err_t mock_tof_read(uint8_t* TOF_OUT, uint8_t dat_size);
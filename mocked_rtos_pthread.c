@@ -0,0 +1,458 @@
+#ifdef MOCK_PTHREAD_BACKEND
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mocked_functions.h"
+
+#define MAX_TASK_REGISTRATIONS 16
+
+#define MAX_TIMER_REGISTRATIONS 8
+
+#define MOCK_THREAD_NAME_MAX 16 //linux limit including the terminator
+
+struct mock_queue_t
+{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    uint8_t* storage;
+    size_t item_size;
+    uint32_t queue_length;
+    uint32_t head;
+    uint32_t count;
+    bool is_closed;
+};
+
+struct mock_timer_t
+{
+    const char* name;
+    TickType_t period;
+    uint32_t auto_reload;
+    void* timer_id;
+    void (*callback)(TimerHandle_t);
+    int64_t expiry_us;
+    bool is_active;
+};
+
+typedef struct
+{
+    void (*func_ptr)(void*);
+    void* pvParams;
+    char name[MOCK_THREAD_NAME_MAX];
+    pthread_t thread;
+} TaskType_t;
+
+static TaskType_t task_array[MAX_TASK_REGISTRATIONS];
+
+static uint8_t s_task_count = 0;
+
+static pthread_mutex_t s_task_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct mock_timer_t timer_array[MAX_TIMER_REGISTRATIONS];
+
+static uint8_t s_timer_count = 0;
+
+//the timer service thread sleeps on this until the next expiry or until a timer changes
+static pthread_mutex_t s_timer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_cond_t s_timer_cond;
+
+static bool s_timer_service_started = false;
+
+static uint32_t s_next_thread_id = 0;
+
+static __thread uint32_t s_thread_id = 0;
+
+//static function defs
+
+static void* run_task(void* args);
+static void* timer_service(void* args);
+static void init_monotonic_cond(pthread_cond_t* cond);
+static void get_deadline(struct timespec* deadline, int64_t time_us);
+static bool wait_on_queue(pthread_cond_t* cond, QueueHandle_t queue_ptr, TickType_t time_thing, int64_t deadline_us);
+static uint32_t get_thread_id(void);
+
+// functions for testing purposes
+
+// tasks already run on their own threads, so there is nothing to spin
+bool spinQueueTaskOnce(const char* name)
+{
+    (void) name;
+    return false;
+}
+
+bool isTaskSpinningOnce(void)
+{
+    return false;
+}
+
+bool spinTimerOnce(const char* name)
+{
+    (void) name;
+    return false;
+}
+
+// threads cannot be stopped from outside, tasks return once whatever they loop on is torn down
+bool deleteTask(const char* name)
+{
+    (void) name;
+    return false;
+}
+
+// the queue task is detached and may still be blocked in xQueueReceive, so the queue is only closed:
+// every waiter wakes up and fails, and the memory is left allocated since there is no telling when the last one lets go
+void deleteQueue(QueueHandle_t handle)
+{
+    if(handle == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&handle->lock);
+    handle->is_closed = true;
+    pthread_cond_broadcast(&handle->not_empty);
+    pthread_cond_broadcast(&handle->not_full);
+    pthread_mutex_unlock(&handle->lock);
+}
+
+void mock_enter_critical(portMUX_TYPE* mux)
+{
+    uint32_t self = get_thread_id();
+    if(__atomic_load_n(&mux->owner, __ATOMIC_ACQUIRE) == self)
+    {
+        mux->count++;
+        return;
+    }
+    uint32_t unlocked = 0;
+    while(!__atomic_compare_exchange_n(&mux->owner, &unlocked, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        //the holder may be descheduled, unlike on the chip where it runs with interrupts off
+        unlocked = 0;
+        sched_yield();
+    }
+    mux->count = 1;
+}
+
+void mock_exit_critical(portMUX_TYPE* mux)
+{
+    mux->count--;
+    if(mux->count == 0)
+    {
+        __atomic_store_n(&mux->owner, 0, __ATOMIC_RELEASE);
+    }
+}
+
+// mocked functions
+
+QueueHandle_t xQueueCreate(uint32_t queue_length, size_t queue_type)
+{
+    QueueHandle_t newQueue = malloc(sizeof(struct mock_queue_t));
+    pthread_mutex_init(&newQueue->lock, NULL);
+    init_monotonic_cond(&newQueue->not_empty);
+    init_monotonic_cond(&newQueue->not_full);
+    newQueue->storage = malloc(queue_length * queue_type);
+    newQueue->item_size = queue_type;
+    newQueue->queue_length = queue_length;
+    newQueue->head = 0;
+    newQueue->count = 0;
+    newQueue->is_closed = false;
+    return newQueue;
+}
+
+// priorities are left to the host scheduler, pinning uses the core id modulo the host cpu count
+void xTaskCreate(void (*func_ptr)(void*), const char* name, size_t stack_depth, void* pvParams, uint8_t priority, void* handle)
+{
+    xTaskCreatePinnedToCore(func_ptr, name, stack_depth, pvParams, priority, handle, tskNO_AFFINITY);
+}
+
+void xTaskCreatePinnedToCore(void (*func_ptr)(void*), const char* name, size_t stack_depth, void* pvParams, uint8_t priority, void* handle, int32_t core_id)
+{
+    (void) stack_depth;
+    (void) priority;
+    (void) handle;
+    pthread_mutex_lock(&s_task_lock);
+    if(s_task_count >= MAX_TASK_REGISTRATIONS)
+    {
+        pthread_mutex_unlock(&s_task_lock);
+        printf("no room for task %s\n", name);
+        return;
+    }
+    TaskType_t* task = &task_array[s_task_count];
+    s_task_count++;
+    pthread_mutex_unlock(&s_task_lock);
+    task->func_ptr = func_ptr;
+    task->pvParams = pvParams;
+    strncpy(task->name, name, MOCK_THREAD_NAME_MAX - 1);
+    task->name[MOCK_THREAD_NAME_MAX - 1] = '\0';
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if(core_id != tskNO_AFFINITY)
+    {
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(core_id % sysconf(_SC_NPROCESSORS_ONLN), &cpu_set);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu_set), &cpu_set);
+    }
+    if(pthread_create(&task->thread, &attr, run_task, task) == 0)
+    {
+        pthread_setname_np(task->thread, task->name);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+bool xQueueSend(QueueHandle_t queue_ptr, void* message_info, TickType_t time_thing)
+{
+    if(queue_ptr == NULL)
+    {
+        return false;
+    }
+    int64_t deadline_us = esp_timer_get_time() + ((int64_t) time_thing * portTICK_PERIOD_MS * 1000);
+    pthread_mutex_lock(&queue_ptr->lock);
+    while(queue_ptr->is_closed || queue_ptr->count >= queue_ptr->queue_length)
+    {
+        if(!wait_on_queue(&queue_ptr->not_full, queue_ptr, time_thing, deadline_us))
+        {
+            pthread_mutex_unlock(&queue_ptr->lock);
+            return false;
+        }
+    }
+    uint32_t tail = (queue_ptr->head + queue_ptr->count) % queue_ptr->queue_length;
+    memcpy(queue_ptr->storage + (tail * queue_ptr->item_size), message_info, queue_ptr->item_size);
+    queue_ptr->count++;
+    pthread_cond_signal(&queue_ptr->not_empty);
+    pthread_mutex_unlock(&queue_ptr->lock);
+    return true;
+}
+
+bool xQueueReceive(QueueHandle_t queue_ptr, void* message_info, TickType_t time_thing)
+{
+    if(queue_ptr == NULL)
+    {
+        return false;
+    }
+    int64_t deadline_us = esp_timer_get_time() + ((int64_t) time_thing * portTICK_PERIOD_MS * 1000);
+    pthread_mutex_lock(&queue_ptr->lock);
+    while(queue_ptr->is_closed || queue_ptr->count == 0)
+    {
+        if(!wait_on_queue(&queue_ptr->not_empty, queue_ptr, time_thing, deadline_us))
+        {
+            pthread_mutex_unlock(&queue_ptr->lock);
+            return false;
+        }
+    }
+    memcpy(message_info, queue_ptr->storage + (queue_ptr->head * queue_ptr->item_size), queue_ptr->item_size);
+    queue_ptr->head = (queue_ptr->head + 1) % queue_ptr->queue_length;
+    queue_ptr->count--;
+    pthread_cond_signal(&queue_ptr->not_full);
+    pthread_mutex_unlock(&queue_ptr->lock);
+    return true;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue_ptr)
+{
+    if(queue_ptr == NULL)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&queue_ptr->lock);
+    UBaseType_t queue_length = queue_ptr->count;
+    pthread_mutex_unlock(&queue_ptr->lock);
+    return queue_length;
+}
+
+void vTaskDelay(TickType_t time_thing)
+{
+    struct timespec delay;
+    delay.tv_sec = (time_thing * portTICK_PERIOD_MS) / 1000;
+    delay.tv_nsec = ((time_thing * portTICK_PERIOD_MS) % 1000) * 1000000L;
+    while(clock_nanosleep(CLOCK_MONOTONIC, 0, &delay, &delay) == EINTR);
+}
+
+// all callbacks run one at a time on a single service thread, like the FreeRTOS timer task
+TimerHandle_t xTimerCreate(const char* name, TickType_t period, uint32_t auto_reload, void* timer_id, void (*callback)(TimerHandle_t))
+{
+    if(callback == NULL || period == 0)
+    {
+        return NULL;
+    }
+    pthread_mutex_lock(&s_timer_lock);
+    if(s_timer_count >= MAX_TIMER_REGISTRATIONS)
+    {
+        pthread_mutex_unlock(&s_timer_lock);
+        return NULL;
+    }
+    if(!s_timer_service_started)
+    {
+        pthread_t service_thread;
+        init_monotonic_cond(&s_timer_cond);
+        pthread_create(&service_thread, NULL, timer_service, NULL);
+        pthread_setname_np(service_thread, "Tmr Svc");
+        pthread_detach(service_thread);
+        s_timer_service_started = true;
+    }
+    TimerHandle_t timer = &timer_array[s_timer_count];
+    timer->name = name;
+    timer->period = period;
+    timer->auto_reload = auto_reload;
+    timer->timer_id = timer_id;
+    timer->callback = callback;
+    timer->is_active = false;
+    s_timer_count++;
+    pthread_mutex_unlock(&s_timer_lock);
+    return timer;
+}
+
+bool xTimerStart(TimerHandle_t timer, TickType_t time_thing)
+{
+    (void) time_thing;
+    if(timer == NULL)
+    {
+        return false;
+    }
+    pthread_mutex_lock(&s_timer_lock);
+    timer->expiry_us = esp_timer_get_time() + ((int64_t) timer->period * portTICK_PERIOD_MS * 1000);
+    timer->is_active = true;
+    pthread_cond_signal(&s_timer_cond);
+    pthread_mutex_unlock(&s_timer_lock);
+    return true;
+}
+
+bool xTimerStop(TimerHandle_t timer, TickType_t time_thing)
+{
+    (void) time_thing;
+    if(timer == NULL)
+    {
+        return false;
+    }
+    pthread_mutex_lock(&s_timer_lock);
+    timer->is_active = false;
+    pthread_mutex_unlock(&s_timer_lock);
+    return true;
+}
+
+bool xTimerIsTimerActive(TimerHandle_t timer)
+{
+    if(timer == NULL)
+    {
+        return false;
+    }
+    pthread_mutex_lock(&s_timer_lock);
+    bool is_active = timer->is_active;
+    pthread_mutex_unlock(&s_timer_lock);
+    return is_active;
+}
+
+void* pvTimerGetTimerID(TimerHandle_t timer)
+{
+    return timer->timer_id;
+}
+
+static void* run_task(void* args)
+{
+    TaskType_t* task = (TaskType_t*) args;
+    (*(task->func_ptr))(task->pvParams);
+    return NULL;
+}
+
+static void* timer_service(void* args)
+{
+    (void) args;
+    pthread_mutex_lock(&s_timer_lock);
+    while(true)
+    {
+        TimerHandle_t next_timer = NULL;
+        for(uint8_t i = 0; i < s_timer_count; i++)
+        {
+            if(timer_array[i].is_active && (next_timer == NULL || timer_array[i].expiry_us < next_timer->expiry_us))
+            {
+                next_timer = &timer_array[i];
+            }
+        }
+        if(next_timer == NULL)
+        {
+            pthread_cond_wait(&s_timer_cond, &s_timer_lock);
+            continue;
+        }
+        int64_t now_us = esp_timer_get_time();
+        if(now_us < next_timer->expiry_us)
+        {
+            struct timespec deadline;
+            get_deadline(&deadline, next_timer->expiry_us);
+            pthread_cond_timedwait(&s_timer_cond, &s_timer_lock, &deadline);
+            continue;
+        }
+        if(next_timer->auto_reload == pdTRUE)
+        {
+            //keep the period from the last expiry, but skip the ones missed while a callback ran long
+            int64_t period_us = (int64_t) next_timer->period * portTICK_PERIOD_MS * 1000;
+            next_timer->expiry_us += period_us;
+            if(next_timer->expiry_us <= now_us)
+            {
+                next_timer->expiry_us = now_us + period_us;
+            }
+        }
+        else
+        {
+            next_timer->is_active = false;
+        }
+        pthread_mutex_unlock(&s_timer_lock);
+        (*(next_timer->callback))(next_timer);
+        pthread_mutex_lock(&s_timer_lock);
+    }
+    return NULL;
+}
+
+static void init_monotonic_cond(pthread_cond_t* cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+//esp_timer_get_time reads CLOCK_MONOTONIC too, so its values convert straight across
+static void get_deadline(struct timespec* deadline, int64_t time_us)
+{
+    deadline->tv_sec = time_us / 1000000;
+    deadline->tv_nsec = (time_us % 1000000) * 1000;
+}
+
+//call with the queue lock held, false once the deadline has passed or the queue is closed
+static bool wait_on_queue(pthread_cond_t* cond, QueueHandle_t queue_ptr, TickType_t time_thing, int64_t deadline_us)
+{
+    if(queue_ptr->is_closed || time_thing == 0)
+    {
+        return false;
+    }
+    if(time_thing == portMAX_DELAY)
+    {
+        pthread_cond_wait(cond, &queue_ptr->lock);
+        return true;
+    }
+    //the caller looks at the queue again after every wakeup, so it only gives up once it has waited long enough
+    if(esp_timer_get_time() >= deadline_us)
+    {
+        return false;
+    }
+    struct timespec deadline;
+    get_deadline(&deadline, deadline_us);
+    pthread_cond_timedwait(cond, &queue_ptr->lock, &deadline);
+    return true;
+}
+
+static uint32_t get_thread_id(void)
+{
+    if(s_thread_id == 0)
+    {
+        s_thread_id = __atomic_add_fetch(&s_next_thread_id, 1, __ATOMIC_RELAXED);
+    }
+    return s_thread_id;
+}
+
+#endif